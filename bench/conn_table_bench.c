@@ -0,0 +1,187 @@
+/**
+ * conn_table_bench.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A microbenchmark comparing the registry of active handlers implemented by
+ * conn_table_t, against a linked_list_t guarded by a global mutex, the way
+ * server_threads used to track its handlers.
+ *
+ * Every thread keeps a window of live entries on descriptors of its own,
+ * removing its oldest entry for each new one, like handlers that come and go.
+ *
+ * Usage: exec_name [-t max_threads] [-n ops_per_thread] [-w window]
+ *  where:
+ *      -max_threads : Threads go 1, 2, 4... up to this (default 8).
+ *      -ops_per_thread : Insertions done by each thread (default 1000000).
+ *      -window : Live entries kept by each thread (default 16).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "conn_table.h"
+#include "linked_list.h"
+
+
+typedef struct {
+    pthread_t tid;
+    int base_fd;  // First descriptor owned by thread.
+    node_t **nodes;  // Nodes of live entries, for the list variant.
+} bench_thread_t;
+
+
+void run(const char *name, void *(*entry)(void *), int threads_num);
+void *run_table(void *args);
+void *run_list(void *args);
+double now(void);
+void usage(const char *exec_name);
+
+
+int ops = 1000000;
+int window = 16;
+
+conn_table_t *table;
+linked_list_t *list;
+pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t list_size_cond = PTHREAD_COND_INITIALIZER;
+pthread_barrier_t start_barrier;
+
+
+int main(int argc, char *argv[])
+{
+    int max_threads = 8;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:n:w:")) != -1) {
+        switch (opt) {
+            case 't':
+                max_threads = atoi(optarg);
+                break;
+            case 'n':
+                ops = atoi(optarg);
+                break;
+            case 'w':
+                window = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (max_threads < 1 || ops < 1 || window < 1) usage(argv[0]);
+
+    printf("%-12s %8s %12s\n", "registry", "threads", "Mops/s");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        table = conn_table_create(threads * window);
+        run("conn_table", run_table, threads);
+        conn_table_destroy(table);
+
+        list = linked_list_create();
+        run("linked_list", run_list, threads);
+        linked_list_destroy(list);
+    }
+
+    return 0;
+}
+
+/**
+ * Prints usage information and terminates process.
+ */
+void usage(const char *exec_name)
+{
+    fprintf(stdout, "Usage: %s [-t max_threads] [-n ops_per_thread] "
+            "[-w window]\n", exec_name);
+    exit(1);
+}
+
+/**
+ * Runs one variant on given number of threads and reports its throughput,
+ * counting an insertion and a removal as one operation each.
+ */
+void run(const char *name, void *(*entry)(void *), int threads_num)
+{
+    bench_thread_t *threads =
+            (bench_thread_t *) malloc(sizeof(bench_thread_t) * threads_num);
+    pthread_barrier_init(&start_barrier, NULL, threads_num + 1);
+
+    for (int i = 0; i < threads_num; i++) {
+        threads[i].base_fd = i * window;
+        threads[i].nodes = (node_t **) calloc(window, sizeof(node_t *));
+        pthread_create(&threads[i].tid, NULL, entry, &threads[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    double start = now();
+    for (int i = 0; i < threads_num; i++) pthread_join(threads[i].tid, NULL);
+    double elapsed = now() - start;
+
+    double total = 2.0 * ops * threads_num;
+    printf("%-12s %8d %12.2f\n", name, threads_num, total / elapsed / 1e6);
+
+    for (int i = 0; i < threads_num; i++) free(threads[i].nodes);
+    pthread_barrier_destroy(&start_barrier);
+    free(threads);
+}
+
+/**
+ * Entry point of threads using conn_table_t.
+ */
+void *run_table(void *args)
+{
+    bench_thread_t *t = (bench_thread_t *) args;
+    pthread_barrier_wait(&start_barrier);
+
+    for (int i = 0; i < ops; i++) {
+        int fd = t->base_fd + i % window;
+        if (i >= window) conn_table_remove(table, fd);
+        conn_table_insert(table, fd, t);
+    }
+    for (int i = 0; i < window; i++) {
+        conn_table_remove(table, t->base_fd + i);
+    }
+
+    return NULL;
+}
+
+/**
+ * Entry point of threads using linked_list_t, doing the same work that
+ * server_threads used to do for each handler.
+ */
+void *run_list(void *args)
+{
+    bench_thread_t *t = (bench_thread_t *) args;
+    pthread_barrier_wait(&start_barrier);
+
+    for (int i = 0; i < ops + window; i++) {
+        int slot = i % window;
+        if (i >= window) {
+            pthread_mutex_lock(&list_mutex);
+            free(linked_list_remove(list, t->nodes[slot]));
+            pthread_cond_signal(&list_size_cond);
+            pthread_mutex_unlock(&list_mutex);
+        }
+        if (i < ops) {
+            int *handler = (int *) malloc(sizeof(int));
+            *handler = t->base_fd + slot;
+            pthread_mutex_lock(&list_mutex);
+            t->nodes[slot] = linked_list_append(list, handler);
+            pthread_mutex_unlock(&list_mutex);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns a monotonic timestamp in seconds.
+ */
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
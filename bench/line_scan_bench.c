@@ -0,0 +1,391 @@
+/**
+ * line_scan_bench.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A microbenchmark of splitting newline delimited messages, as readers in
+ * line mode do, with every kernel of line_scan.h the CPU supports, against
+ * memchr() and the bandwidth of memcpy() over the same data.
+ *
+ * Data gets fed to a reader in reads of 64KB, like a receive buffer at its
+ * default maximum, and every line gets handed to a handler that only counts
+ * it.
+ *
+ * Before timing anything, every kernel gets checked against known answers:
+ * lines must be split where their newlines are, and UTF-8 must be told
+ * valid or not right, for characters at every offset around the 32 bytes
+ * the AVX2 kernel validates at once, and cut by the end of a read. Any wrong
+ * answer fails the benchmark.
+ *
+ * Usage: exec_name [-m megabytes] [-r rounds]
+ *  where:
+ *      -megabytes : Size of data split in each round (default 256).
+ *      -rounds : Rounds of each variant, the best one reported (default 5).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include "frame.h"
+#include "line_scan.h"
+
+#define READ_SIZE (64 * 1024)
+#define CHECK_OFFSETS 72  // Offsets of characters checked, past 2 vectors.
+#define CHECK_LINE_MAX 256
+
+
+typedef struct {
+    const char *bytes;
+    size_t len;
+    int valid;
+} utf8_case_t;
+
+
+int check_kernel(void);
+int check_newlines(void);
+int check_utf8(const utf8_case_t *c, size_t offset, size_t split);
+int feed(const char *data, size_t len, size_t split);
+void fill(char *data, size_t size, size_t line_len, int utf8);
+double run_reader(const char *data, size_t size);
+double run_memchr(const char *data, size_t size);
+double run_memcpy(const char *data, size_t size);
+int count_line(const frame_t *frame, void *arg);
+int record_line(const frame_t *frame, void *arg);
+double now(void);
+void usage(const char *exec_name);
+
+
+int rounds = 5;
+size_t lines = 0;
+size_t line_lens[CHECK_LINE_MAX];  // Of lines split while checking.
+
+#define UTF8_CASE(s, valid) { s, sizeof(s) - 1, valid }
+const utf8_case_t utf8_cases[] = {
+    UTF8_CASE("\xC3\xA9", 1),              // U+00E9
+    UTF8_CASE("\xE0\xA0\x80", 1),          // U+0800, shortest of 3 bytes.
+    UTF8_CASE("\xE2\x82\xAC", 1),          // U+20AC
+    UTF8_CASE("\xED\x9F\xBF", 1),          // U+D7FF, right below surrogates.
+    UTF8_CASE("\xEE\x80\x80", 1),          // U+E000, right above them.
+    UTF8_CASE("\xF0\x90\x80\x80", 1),      // U+10000, shortest of 4 bytes.
+    UTF8_CASE("\xF0\x9F\x98\x80", 1),      // U+1F600
+    UTF8_CASE("\xF4\x8F\xBF\xBF", 1),      // U+10FFFF, the last one.
+    UTF8_CASE("\xC0\xAF", 0),              // Overlong '/'.
+    UTF8_CASE("\xC1\xBF", 0),              // Overlong U+007F.
+    UTF8_CASE("\xE0\x80\xAF", 0),          // Overlong '/'.
+    UTF8_CASE("\xE0\x9F\xBF", 0),          // Overlong U+07FF.
+    UTF8_CASE("\xF0\x80\x80\xAF", 0),      // Overlong '/'.
+    UTF8_CASE("\xF0\x8F\xBF\xBF", 0),      // Overlong U+FFFF.
+    UTF8_CASE("\xED\xA0\x80", 0),          // U+D800, first surrogate.
+    UTF8_CASE("\xED\xBF\xBF", 0),          // U+DFFF, last surrogate.
+    UTF8_CASE("\xF4\x90\x80\x80", 0),      // U+110000
+    UTF8_CASE("\xF5\x80\x80\x80", 0),      // Lead above U+10FFFF.
+    UTF8_CASE("\xFF", 0),
+    UTF8_CASE("\x80", 0),                  // Continuation with no lead.
+    UTF8_CASE("\xC3", 0),                  // Truncated ones.
+    UTF8_CASE("\xE2\x82", 0),
+    UTF8_CASE("\xF0\x9F\x98", 0),
+    UTF8_CASE("\xC3\xA9\xA9", 0),          // One continuation too many.
+};
+
+
+int main(int argc, char *argv[])
+{
+    size_t megabytes = 256;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:r:")) != -1) {
+        switch (opt) {
+            case 'm':
+                megabytes = (size_t) atol(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (megabytes < 1 || rounds < 1) usage(argv[0]);
+
+    const char *kernels[] = { "scalar", "sse2", "avx2" };
+    for (int k = 0; k < 3; k++) {
+        if (line_scan_select(kernels[k]) < 0) continue;
+        if (check_kernel() < 0) {
+            fprintf(stderr, "ERROR: Kernel %s gave wrong answers\n",
+                    kernels[k]);
+            exit(1);
+        }
+        printf("Kernel %s passed known answer checks.\n", kernels[k]);
+    }
+
+    size_t size = megabytes << 20;
+    char *data = (char *) malloc(size);
+    const size_t lens[] = { 64, 1024, 16384 };
+
+    printf("%-8s %-6s %-10s %10s %12s\n", "line", "text", "variant",
+           "GB/s", "Mlines/s");
+    for (int t = 0; t < 2; t++) {
+        for (int l = 0; l < 3; l++) {
+            fill(data, size, lens[l], t);
+            const char *text = t ? "utf8" : "ascii";
+            double mlines = (double) (size / lens[l]) / 1e6;
+
+            for (int k = 0; k < 3; k++) {
+                if (line_scan_select(kernels[k]) < 0) continue;
+                double secs = run_reader(data, size);
+                printf("%-8zu %-6s %-10s %10.2f %12.1f\n", lens[l],
+                       text, kernels[k], size / secs / 1e9, mlines / secs);
+            }
+            double secs = run_memchr(data, size);
+            printf("%-8zu %-6s %-10s %10.2f %12.1f\n", lens[l], text,
+                   "memchr", size / secs / 1e9, mlines / secs);
+        }
+    }
+    double secs = run_memcpy(data, size);
+    printf("%-8s %-6s %-10s %10.2f\n", "-", "-", "memcpy", size / secs / 1e9);
+
+    line_scan_select("auto");
+    free(data);
+    return 0;
+}
+
+/**
+ * Checks the kernel selected against known answers.
+ *
+ * Returns 0 if it gave all of them, -1 otherwise.
+ */
+int check_kernel(void)
+{
+    if (check_newlines() < 0) return -1;
+
+    size_t cases = sizeof(utf8_cases) / sizeof(utf8_cases[0]);
+    for (size_t c = 0; c < cases; c++) {
+        for (size_t off = 0; off < CHECK_OFFSETS; off++) {
+            // Whole, and cut by the end of a read inside the character.
+            if (check_utf8(&utf8_cases[c], off, 0) < 0 ||
+                check_utf8(&utf8_cases[c], off, off + 1) < 0) {
+                fprintf(stderr, "UTF-8 case %zu at offset %zu\n", c, off);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Checks that lines get split right where their newlines are, even next to
+ * bytes that differ from a newline in their lowest bits only, which word at
+ * a time scans may mistake for one.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int check_newlines(void)
+{
+    char data[4 * CHECK_LINE_MAX];
+    const char fillers[] = { 'a', '\x0B', '\x08', '\x0E', '\x09', '\x01' };
+    size_t expected[CHECK_LINE_MAX];
+    size_t count = 0;
+    size_t len = 0;
+
+    // Lines of every length up to 3 words, of every filler.
+    for (size_t n = 1; n <= 24; n++) {
+        for (size_t f = 0; f < sizeof(fillers); f++) {
+            if (len + n > sizeof(data) || count == CHECK_LINE_MAX) break;
+            memset(data + len, fillers[f], n - 1);
+            data[len + n - 1] = '\n';
+            expected[count++] = n;
+            len += n;
+        }
+    }
+
+    lines = 0;
+    if (feed(data, len, 0) < 0 || lines != count) return -1;
+    for (size_t i = 0; i < count; i++) {
+        if (line_lens[i] != expected[i]) {
+            fprintf(stderr, "Line %zu split at %zu instead of %zu\n", i,
+                    line_lens[i], expected[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Checks that a line carrying the bytes of a case at given offset, fed in
+ * two reads cut at split, if not 0, gets accepted only if they are valid.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int check_utf8(const utf8_case_t *c, size_t offset, size_t split)
+{
+    // Followed by ASCII, so truncated characters end before a newline, and
+    // by a long line, so that vector kernels go over the first one whole.
+    char data[CHECK_OFFSETS + 8 + 128];
+    size_t len = 0;
+    memset(data, 'a', offset);
+    len += offset;
+    memcpy(data + len, c->bytes, c->len);
+    len += c->len;
+    memcpy(data + len, "zz\n", 3);
+    len += 3;
+    memset(data + len, 'b', 127);
+    len += 127;
+    data[len - 1] = '\n';
+
+    lines = 0;
+    int rc = feed(data, len, split);
+    if (c->valid) return rc == 0 && lines == 2 ? 0 : -1;
+    return rc < 0 && errno == EILSEQ ? 0 : -1;
+}
+
+/**
+ * Splits data into lines, recording their lengths, in a single read, or in
+ * two cut at split, if not 0.
+ *
+ * Returns what the reader returned.
+ */
+int feed(const char *data, size_t len, size_t split)
+{
+    frame_reader_t reader;
+    frame_reader_init(&reader, FRAME_FORMAT_LINES);
+    int rc = 0;
+    if (split > 0 && split < len) {
+        rc = frame_reader_feed(&reader, data, split, record_line, NULL);
+        data += split;
+        len -= split;
+    }
+    if (rc == 0) {
+        rc = frame_reader_feed(&reader, data, len, record_line, NULL);
+    }
+    int err = errno;
+    frame_reader_free(&reader);
+    errno = err;
+    return rc;
+}
+
+/**
+ * Fills data with lines of given length, newline included. Lines of UTF-8
+ * text carry a two byte character every 16 bytes.
+ */
+void fill(char *data, size_t size, size_t line_len, int utf8)
+{
+    for (size_t i = 0; i < size; i++) {
+        size_t col = i % line_len;
+        if (col == line_len - 1) data[i] = '\n';
+        else if (utf8 && col % 16 == 14 && col + 1 < line_len - 1) {
+            data[i++] = (char) 0xC3;  // U+00E9
+            data[i] = (char) 0xA9;
+        }
+        else data[i] = 'a' + col % 26;
+    }
+    data[size - 1] = '\n';
+}
+
+/**
+ * Returns the best time in seconds of splitting data through a reader.
+ */
+double run_reader(const char *data, size_t size)
+{
+    double best = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        frame_reader_t reader;
+        frame_reader_init(&reader, FRAME_FORMAT_LINES);
+        lines = 0;
+
+        double start = now();
+        for (size_t off = 0; off < size; off += READ_SIZE) {
+            size_t len = size - off < READ_SIZE ? size - off : READ_SIZE;
+            if (frame_reader_feed(&reader, data + off, len, count_line,
+                                  NULL) < 0) {
+                perror("ERROR: Splitting failed");
+                exit(1);
+            }
+        }
+        double secs = now() - start;
+        if (secs < best) best = secs;
+        frame_reader_free(&reader);
+    }
+    return best;
+}
+
+/**
+ * Returns the best time in seconds of finding all newlines with memchr(),
+ * with no validation, nor lines spanning reads.
+ */
+double run_memchr(const char *data, size_t size)
+{
+    double best = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        lines = 0;
+        double start = now();
+        const char *p = data, *end = data + size;
+        while ((p = (const char *) memchr(p, '\n', end - p))) {
+            lines++;
+            p++;
+        }
+        double secs = now() - start;
+        if (secs < best) best = secs;
+    }
+    return best;
+}
+
+/**
+ * Returns the best time in seconds of copying data, in reads of READ_SIZE.
+ */
+double run_memcpy(const char *data, size_t size)
+{
+    char *dst = (char *) malloc(READ_SIZE);
+    double best = 1e9;
+    for (int r = 0; r < rounds; r++) {
+        double start = now();
+        for (size_t off = 0; off < size; off += READ_SIZE) {
+            size_t len = size - off < READ_SIZE ? size - off : READ_SIZE;
+            memcpy(dst, data + off, len);
+            __asm__ volatile("" : : "r"(dst) : "memory");
+        }
+        double secs = now() - start;
+        if (secs < best) best = secs;
+    }
+    free(dst);
+    return best;
+}
+
+int count_line(const frame_t *frame, void *arg)
+{
+    (void) frame;
+    (void) arg;
+    lines++;
+    return 0;
+}
+
+int record_line(const frame_t *frame, void *arg)
+{
+    (void) arg;
+    if (lines < CHECK_LINE_MAX) line_lens[lines] = frame->length;
+    lines++;
+    return 0;
+}
+
+/**
+ * Returns current monotonic time in seconds.
+ */
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Prints usage information and terminates process.
+ */
+void usage(const char *exec_name)
+{
+    fprintf(stderr, "usage %s [-m megabytes] [-r rounds]\n", exec_name);
+    exit(1);
+}
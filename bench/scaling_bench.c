@@ -0,0 +1,535 @@
+/**
+ * scaling_bench.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A benchmark of how the servers scale with connections, run on a single
+ * host over loopback. Every backend gets started afresh for every point of
+ * a sweep, echoing frames back, and gets driven by the client in load mode.
+ *
+ * Settings get swept one at a time, each over its list of values, while the
+ * rest stay at the first value of their lists:
+ *  -idle connections, opened before the test and never used,
+ *  -active connections, each keeping a message in flight,
+ *  -message size,
+ *  -connect churn, connections opened and closed per second.
+ *
+ * For every point, results of the client (throughput, latency percentiles,
+ * churned connections) get reported along with the cost on server side:
+ * memory of its processes (PSS) before and at peak of the test, and so per
+ * connection, its peak tasks, CPU time and context switches, as the server
+ * and the handlers it reaped account them once it exits.
+ *
+ * Results get written as a single JSON document, so that runs on different
+ * commits can be compared.
+ *
+ * Usage: exec_name [-b backends] [-i idle_list] [-c active_list]
+ *                  [-s size_list] [-n churn_list] [-d seconds] [-t threads]
+ *                  [-p port] [-l label] [-o file]
+ *  where:
+ *      -backends : Comma separated servers to run, among threads (a thread
+ *              per client), pool (server_threads -w, growing a worker per
+ *              client, though the last one queued waits for the next one to
+ *              arrive), coroutines (server_threads -g), procs (a process
+ *              per client), prefork (server_procs -k, a worker process per
+ *              CPU), epoll and uring (server_epoll -u) (default all of
+ *              them).
+ *      -idle_list : Idle connections (default 0,1000,5000).
+ *      -active_list : Active connections (default 16,64,256).
+ *      -size_list : Message sizes in bytes (default 64,1024,16384).
+ *      -churn_list : Connections churned per second (default 0,100,1000).
+ *      -seconds : Duration of every point (default 3).
+ *      -threads : Threads of the client (default 2).
+ *      -port : Port servers listen on (default 17000).
+ *      -label : Recorded along with results, e.g. a commit id.
+ *      -file : Where to write results (default stdout).
+ *
+ * Servers and the client are run from the current directory. Every process
+ * holds a descriptor for each connection, so the limit of open files gets
+ * raised to its hard limit. Over a single destination port, the ephemeral
+ * port range of the host (ip_local_port_range) bounds connections too.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_VALUES 16
+#define MAX_TREE 65536        // Server processes tracked at once.
+#define SAMPLE_MS 500         // Interval of sampling server memory.
+#define READY_TIMEOUT_MS 5000 // Max wait for a server to start listening.
+#define EXIT_TIMEOUT_MS 10000 // Max wait for a server to exit.
+#define OUTPUT_MAX 8192       // Bytes of client output kept.
+
+
+typedef struct {
+    const char *name;
+    char *argv[16];  // Command of server, port appended.
+} backend_t;
+
+typedef struct {
+    int values[MAX_VALUES];
+    int count;
+} sweep_t;
+
+typedef struct {
+    long pss_kb;  // Proportional set size of all processes.
+    int tasks;    // Threads of all processes.
+} tree_usage_t;
+
+
+void parse_list(const char *list, sweep_t *sweep, const char *exec_name);
+void run_backend(const backend_t *backend);
+void run_point(const backend_t *backend, int idle, int active, int size,
+               int churn);
+pid_t start_server(const backend_t *backend);
+int wait_ready(void);
+pid_t start_client(int idle, int active, int size, int churn, int *out_fd);
+void sample_tree(pid_t root, tree_usage_t *usage);
+long read_field(const char *path, const char *name);
+int stop_server(pid_t pid, struct rusage *usage);
+double now(void);
+void usage(const char *exec_name);
+
+
+char cpus[16];  // Online CPUs, as an argument of backends.
+backend_t backends[] = {
+    { "threads", { "./server_threads", "-E", "echo", NULL } },
+    { "pool", { "./server_threads", "-w", cpus, "-q", "1", "-o", "grow",
+                "-m", "16384", "-E", "echo", NULL } },
+    { "coroutines", { "./server_threads", "-g", cpus, "-E", "echo", NULL } },
+    { "procs", { "./server_procs", "-E", "echo", NULL } },
+    { "prefork", { "./server_procs", "-k", cpus, "-E", "echo", NULL } },
+    { "epoll", { "./server_epoll", "-E", "echo", NULL } },
+    { "uring", { "./server_epoll", "-u", "-E", "echo", NULL } },
+};
+int backends_num = sizeof(backends) / sizeof(backends[0]);
+
+sweep_t idle_sweep = { { 0, 1000, 5000 }, 3 };
+sweep_t active_sweep = { { 16, 64, 256 }, 3 };
+sweep_t size_sweep = { { 64, 1024, 16384 }, 3 };
+sweep_t churn_sweep = { { 0, 100, 1000 }, 3 };
+double duration = 3;
+int client_threads = 2;
+char port[16] = "17000";
+FILE *out;
+int points = 0;  // Points written so far.
+
+
+int main(int argc, char *argv[])
+{
+    const char *selected = NULL;
+    const char *label = "";
+    const char *path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:i:c:s:n:d:t:p:l:o:")) != -1) {
+        switch (opt) {
+            case 'b': selected = optarg; break;
+            case 'i': parse_list(optarg, &idle_sweep, argv[0]); break;
+            case 'c': parse_list(optarg, &active_sweep, argv[0]); break;
+            case 's': parse_list(optarg, &size_sweep, argv[0]); break;
+            case 'n': parse_list(optarg, &churn_sweep, argv[0]); break;
+            case 'd': duration = atof(optarg); break;
+            case 't': client_threads = atoi(optarg); break;
+            case 'p': snprintf(port, sizeof(port), "%s", optarg); break;
+            case 'l': label = optarg; break;
+            case 'o': path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (duration <= 0 || client_threads < 1 || atoi(port) <= 0) {
+        usage(argv[0]);
+    }
+    for (int i = 0; i < active_sweep.count; i++) {
+        if (active_sweep.values[i] < 1) usage(argv[0]);
+    }
+    for (int i = 0; i < size_sweep.count; i++) {
+        if (size_sweep.values[i] < 1 || size_sweep.values[i] > 65535) {
+            usage(argv[0]);
+        }
+    }
+
+    out = path ? fopen(path, "w") : stdout;
+    if (!out) {
+        perror("ERROR: Failed to open output");
+        exit(1);
+    }
+
+    // Both ends of every connection live on this host.
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    // Worker pools, coroutines and prefork start a thread, a scheduler or
+    // a process for every CPU.
+    snprintf(cpus, sizeof(cpus), "%ld", sysconf(_SC_NPROCESSORS_ONLN));
+
+    struct utsname host;
+    uname(&host);
+    fprintf(out, "{\"label\": \"%s\", \"kernel\": \"%s\", \"cpus\": %ld, "
+            "\"duration\": %.1f, \"results\": [", label, host.release,
+            sysconf(_SC_NPROCESSORS_ONLN), duration);
+
+    for (int b = 0; b < backends_num; b++) {
+        if (selected) {
+            // Match whole names of the comma separated list only.
+            size_t len = strlen(backends[b].name);
+            const char *name = selected;
+            int found = 0;
+            while (!found && name) {
+                found = strncmp(name, backends[b].name, len) == 0 &&
+                        (name[len] == ',' || name[len] == '\0');
+                name = strchr(name, ',');
+                if (name) name++;
+            }
+            if (!found) continue;
+        }
+        run_backend(&backends[b]);
+    }
+
+    fprintf(out, "\n]}\n");
+    if (path) fclose(out);
+    return 0;
+}
+
+/**
+ * Parses a comma separated list of non-negative values into a sweep.
+ */
+void parse_list(const char *list, sweep_t *sweep, const char *exec_name)
+{
+    sweep->count = 0;
+    while (*list) {
+        char *end;
+        long value = strtol(list, &end, 10);
+        if (end == list || value < 0 || sweep->count == MAX_VALUES ||
+            (*end != ',' && *end != '\0')) usage(exec_name);
+        sweep->values[sweep->count++] = (int) value;
+        list = *end ? end + 1 : end;
+    }
+    if (sweep->count == 0) usage(exec_name);
+}
+
+/**
+ * Runs every point of the sweeps against a backend. The base point, with
+ * the first value of every list, gets run only once.
+ */
+void run_backend(const backend_t *backend)
+{
+    int idle = idle_sweep.values[0];
+    int active = active_sweep.values[0];
+    int size = size_sweep.values[0];
+    int churn = churn_sweep.values[0];
+
+    run_point(backend, idle, active, size, churn);
+    for (int i = 1; i < idle_sweep.count; i++) {
+        run_point(backend, idle_sweep.values[i], active, size, churn);
+    }
+    for (int i = 1; i < active_sweep.count; i++) {
+        run_point(backend, idle, active_sweep.values[i], size, churn);
+    }
+    for (int i = 1; i < size_sweep.count; i++) {
+        run_point(backend, idle, active, size_sweep.values[i], churn);
+    }
+    for (int i = 1; i < churn_sweep.count; i++) {
+        run_point(backend, idle, active, size, churn_sweep.values[i]);
+    }
+}
+
+/**
+ * Runs a fresh server and the client against it once, writing out the
+ * results of both.
+ */
+void run_point(const backend_t *backend, int idle, int active, int size,
+               int churn)
+{
+    fprintf(stderr, "%s: idle %d, active %d, size %d, churn %d\n",
+            backend->name, idle, active, size, churn);
+
+    pid_t server = start_server(backend);
+    if (server < 0 || wait_ready() < 0) {
+        fprintf(stderr, "ERROR: Server %s did not start\n", backend->name);
+        if (server > 0) stop_server(server, NULL);
+        return;
+    }
+
+    tree_usage_t base, peak = { 0, 0 };
+    sample_tree(server, &base);
+
+    // Keep the peak usage of server, while collecting client output.
+    int out_fd;
+    pid_t client = start_client(idle, active, size, churn, &out_fd);
+    char output[OUTPUT_MAX];
+    size_t len = 0;
+    double deadline = now() + duration + 120;
+    while (client > 0) {
+        struct pollfd pfd = { out_fd, POLLIN, 0 };
+        int rc = poll(&pfd, 1, SAMPLE_MS);
+        tree_usage_t usage;
+        sample_tree(server, &usage);
+        if (usage.pss_kb > peak.pss_kb) peak.pss_kb = usage.pss_kb;
+        if (usage.tasks > peak.tasks) peak.tasks = usage.tasks;
+
+        if (rc > 0) {
+            ssize_t n = read(out_fd, output + len, sizeof(output) - 1 - len);
+            if (n > 0) len += n;
+            else if (n == 0 || errno != EINTR) break;
+        }
+        if (now() > deadline) {
+            fprintf(stderr, "ERROR: Client got stuck\n");
+            kill(client, SIGKILL);
+            break;
+        }
+    }
+    if (client > 0) {
+        close(out_fd);
+        waitpid(client, NULL, 0);
+    }
+    output[len] = '\0';
+    while (len > 0 && output[len - 1] == '\n') output[--len] = '\0';
+
+    struct rusage usage;
+    int exited = stop_server(server, &usage) == 0;
+
+    fprintf(out, "%s\n  {\"backend\": \"%s\", \"idle\": %d, \"active\": %d, "
+            "\"size\": %d, \"churn\": %d,\n   \"client\": %s,\n",
+            points++ ? "," : "", backend->name, idle, active, size, churn,
+            output[0] == '{' ? output : "null");
+    long conns = (long) idle + active;
+    fprintf(out, "   \"server\": {\"pss_base_kb\": %ld, \"pss_peak_kb\": %ld, "
+            "\"pss_per_conn_bytes\": %ld, \"tasks_peak\": %d, ",
+            base.pss_kb, peak.pss_kb,
+            (peak.pss_kb - base.pss_kb) * 1024 / conns, peak.tasks);
+    if (exited) {
+        fprintf(out, "\"cpu_user_s\": %.3f, \"cpu_sys_s\": %.3f, "
+                "\"ctx_voluntary\": %ld, \"ctx_involuntary\": %ld}}",
+                usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+                usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+                usage.ru_nvcsw, usage.ru_nivcsw);
+    }
+    else {
+        fprintf(out, "\"cpu_user_s\": null, \"cpu_sys_s\": null, "
+                "\"ctx_voluntary\": null, \"ctx_involuntary\": null}}");
+    }
+    fflush(out);
+}
+
+/**
+ * Starts a server of given backend, with its output discarded.
+ *
+ * Returns its pid, or -1 on failure.
+ */
+pid_t start_server(const backend_t *backend)
+{
+    char *argv[18];
+    int argc = 0;
+    while (backend->argv[argc]) {
+        argv[argc] = backend->argv[argc];
+        argc++;
+    }
+    argv[argc++] = port;
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+ * Waits for the server to accept connections.
+ *
+ * Returns 0 once it does, or -1 if it never did.
+ */
+int wait_ready(void)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    double deadline = now() + READY_TIMEOUT_MS / 1e3;
+    while (now() < deadline) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int rc = connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+        close(fd);
+        if (rc == 0) return 0;
+        usleep(10000);
+    }
+    return -1;
+}
+
+/**
+ * Starts the client in load mode, with JSON output on a pipe whose reading
+ * end is returned in out_fd.
+ *
+ * Returns its pid, or -1 on failure.
+ */
+pid_t start_client(int idle, int active, int size, int churn, int *out_fd)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+
+    char args[6][32];
+    snprintf(args[0], sizeof(args[0]), "%d", idle);
+    snprintf(args[1], sizeof(args[1]), "%d", active);
+    snprintf(args[2], sizeof(args[2]), "%d", size);
+    snprintf(args[3], sizeof(args[3]), "%d", churn);
+    snprintf(args[4], sizeof(args[4]), "%g", duration);
+    snprintf(args[5], sizeof(args[5]), "%d", client_threads);
+    char *argv[] = { "./client", "-l", "-j", "-e", "-i", args[0], "-c",
+                     args[1], "-s", args[2], "-n", args[3], "-d", args[4],
+                     "-t", args[5], "127.0.0.1", port, NULL };
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    *out_fd = fds[0];
+    return pid;
+}
+
+/**
+ * Sums the memory and tasks of a process and all of its descendants.
+ */
+void sample_tree(pid_t root, tree_usage_t *usage)
+{
+    static pid_t pids[MAX_TREE];
+    static pid_t parents[MAX_TREE];
+    int count = 0;
+
+    // Record parent of every process, as children lists may be missing.
+    DIR *proc = opendir("/proc");
+    struct dirent *entry;
+    while (proc && (entry = readdir(proc)) && count < MAX_TREE) {
+        pid_t pid = (pid_t) atoi(entry->d_name);
+        if (pid <= 0) continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/status", pid);
+        long ppid = read_field(path, "PPid:");
+        if (ppid < 0) continue;
+        pids[count] = pid;
+        parents[count++] = (pid_t) ppid;
+    }
+    if (proc) closedir(proc);
+
+    usage->pss_kb = 0;
+    usage->tasks = 0;
+    static pid_t tree[MAX_TREE];
+    int tree_num = 1;
+    tree[0] = root;
+    for (int t = 0; t < tree_num; t++) {
+        for (int i = 0; i < count && tree_num < MAX_TREE; i++) {
+            if (parents[i] == tree[t]) tree[tree_num++] = pids[i];
+        }
+
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", tree[t]);
+        long pss = read_field(path, "Pss:");
+        snprintf(path, sizeof(path), "/proc/%d/status", tree[t]);
+        if (pss < 0) pss = read_field(path, "VmRSS:");
+        long tasks = read_field(path, "Threads:");
+        if (pss > 0) usage->pss_kb += pss;
+        if (tasks > 0) usage->tasks += tasks;
+    }
+}
+
+/**
+ * Returns the number following a line starting with name in a proc file,
+ * or -1 if there is none.
+ */
+long read_field(const char *path, const char *name)
+{
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+
+    char line[256];
+    long value = -1;
+    size_t len = strlen(name);
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, name, len) == 0) {
+            value = atol(line + len);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+/**
+ * Asks the server to terminate, killing it if it does not in time, and
+ * reaps it.
+ *
+ * Returns 0 if it exited by itself, with its resource usage, including
+ * that of handlers it reaped, in usage when not NULL. Otherwise, -1.
+ */
+int stop_server(pid_t pid, struct rusage *usage)
+{
+    struct rusage ignored;
+    if (!usage) usage = &ignored;
+
+    kill(pid, SIGINT);
+    double deadline = now() + EXIT_TIMEOUT_MS / 1e3;
+    int status;
+    while (wait4(pid, &status, WNOHANG, usage) == 0) {
+        if (now() > deadline) {
+            kill(pid, SIGKILL);
+            wait4(pid, &status, 0, usage);
+            return -1;
+        }
+        usleep(10000);
+    }
+    return 0;
+}
+
+/**
+ * Returns current monotonic time in seconds.
+ */
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Prints usage information and terminates process.
+ */
+void usage(const char *exec_name)
+{
+    fprintf(stderr, "usage %s [-b backends] [-i idle_list] [-c active_list] "
+            "[-s size_list] [-n churn_list] [-d seconds] [-t threads] "
+            "[-p port] [-l label] [-o file]\n", exec_name);
+    exit(1);
+}
@@ -0,0 +1,175 @@
+/**
+ * admission.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in admission.h.
+ *
+ * Total connections are a single atomic counter. Connections of each source
+ * are the references to its entry in a source table, which may also be
+ * updated from a signal handler, as long as the signal is blocked while the
+ * rest of the process updates it.
+ *
+ * Both the controller and the table live in shared anonymous mappings, so
+ * processes forked after creating the controller all count against the same
+ * limits.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <endian.h>
+#include <errno.h>
+#include "admission.h"
+
+
+#define DEFAULT_ADDRS 65536  // Addresses to make room for, with no limit.
+#define FAMILY_SHIFT 56      // Sources hold their address family above it.
+
+
+/**
+ * Creates an admission controller, shared with processes forked afterwards.
+ * A zero limit disables that limit.
+ *
+ * Returns NULL on failure with errno set.
+ */
+admission_t *admission_create(int max_conns, int max_per_addr)
+{
+    // Anonymous mappings are zero filled, which is how atomics start too.
+    admission_t *adm = (admission_t *) mmap(NULL, sizeof(admission_t),
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_ANONYMOUS,
+                                            -1, 0);
+    if (adm == MAP_FAILED) return NULL;
+
+    adm->size = sizeof(admission_t);
+    adm->max_conns = max_conns;
+    adm->max_per_addr = max_per_addr;
+    adm->sources = NULL;
+
+    // There can be no more addresses than admitted connections.
+    if (max_per_addr > 0) {
+        size_t addrs = max_conns > 0 ? (size_t) max_conns : DEFAULT_ADDRS;
+        adm->sources = source_table_create(addrs, 0);
+        if (!adm->sources) {
+            int err = errno;
+            munmap(adm, adm->size);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    return adm;
+}
+
+void admission_destroy(admission_t *adm)
+{
+    if (adm->sources) source_table_destroy(adm->sources);
+    munmap(adm, adm->size);
+}
+
+/**
+ * Returns the source a client address counts against, when limiting the
+ * connections of each source. Sources carry the address family in their top
+ * byte, so addresses of different families never match. IPv6 clients are
+ * told apart by their /56 prefix, as a single site usually owns all of it,
+ * with IPv4 mapped ones matching plain IPv4 clients. Unix domain socket
+ * clients, and any other of unknown address, are local, so they get
+ * ADMISSION_NO_SOURCE, exempt from limits on sources.
+ */
+uint64_t admission_source(const struct sockaddr *addr)
+{
+    uint32_t v4;
+    if (addr->sa_family == AF_INET) {
+        v4 = ((const struct sockaddr_in *) addr)->sin_addr.s_addr;
+        return (uint64_t) AF_INET << FAMILY_SHIFT | ntohl(v4);
+    }
+    if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *a6 =
+                &((const struct sockaddr_in6 *) addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6)) {
+            memcpy(&v4, &a6->s6_addr[12], sizeof(v4));
+            return (uint64_t) AF_INET << FAMILY_SHIFT | ntohl(v4);
+        }
+        uint64_t prefix;
+        memcpy(&prefix, a6->s6_addr, sizeof(prefix));
+        return (uint64_t) AF_INET6 << FAMILY_SHIFT |
+               be64toh(prefix) >> (64 - FAMILY_SHIFT);
+    }
+    return ADMISSION_NO_SOURCE;
+}
+
+/**
+ * Returns the source of the peer of a connected socket, as of
+ * admission_source(), or the source of unknown addresses if it has none.
+ */
+uint64_t admission_peer_source(int fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_size = sizeof(addr);
+    addr.ss_family = AF_UNSPEC;
+    getpeername(fd, (struct sockaddr *) &addr, &addr_size);
+    return admission_source((struct sockaddr *) &addr);
+}
+
+/**
+ * Admits a new connection from given source, if no limit gets exceeded. The
+ * limit of sources does not apply to ADMISSION_NO_SOURCE.
+ *
+ * Every admitted connection should be released once closed.
+ */
+admission_result_t admission_acquire(admission_t *adm, uint64_t source)
+{
+    int conns = atomic_fetch_add(&adm->conns, 1);
+    if (adm->max_conns > 0 && conns >= adm->max_conns) {
+        atomic_fetch_sub(&adm->conns, 1);
+        return ADMISSION_FULL;
+    }
+    if (!adm->sources || source == ADMISSION_NO_SOURCE) return ADMISSION_OK;
+
+    if (source_table_acquire(adm->sources, source, adm->max_per_addr)) {
+        return ADMISSION_OK;
+    }
+    atomic_fetch_sub(&adm->conns, 1);
+    // No room for a new address counts as a full server.
+    return errno == EBUSY ? ADMISSION_SOURCE : ADMISSION_FULL;
+}
+
+/**
+ * Releases a connection admitted from given source.
+ */
+void admission_release(admission_t *adm, uint64_t source)
+{
+    atomic_fetch_sub(&adm->conns, 1);
+    if (!adm->sources || source == ADMISSION_NO_SOURCE) return;
+    source_table_release(adm->sources, source);
+}
+
+/**
+ * Returns the number of currently admitted connections.
+ */
+int admission_count(admission_t *adm)
+{
+    return atomic_load(&adm->conns);
+}
+
+/**
+ * Closes a connection that is not going to be served, as cheaply as
+ * possible.
+ *
+ * Lingering is disabled, so the connection gets reset at once, instead of
+ * holding a TIME_WAIT entry on the server.
+ */
+void admission_shed(int fd)
+{
+    struct linger lin = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    close(fd);
+}
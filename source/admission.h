@@ -0,0 +1,50 @@
+/**
+ * admission.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to decide which accepted
+ * connections may be served, by limiting both the total connections and the
+ * connections of each source address, over all threads and all processes
+ * forked after setting up the limits.
+ *
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "source_table.h"
+
+#define ADMISSION_NO_SOURCE 0  // Source of clients no source limit applies to.
+
+typedef enum {
+    ADMISSION_OK = 0,
+    ADMISSION_FULL,    // Server holds max connections.
+    ADMISSION_SOURCE   // Source holds max connections.
+} admission_result_t;
+
+typedef struct {
+    _Alignas(64) atomic_int conns;  // Currently admitted connections.
+    int max_conns;     // 0 for no limit.
+    int max_per_addr;  // 0 for no limit.
+    size_t size;       // Bytes mapped.
+    source_table_t *sources;  // Connections of each source, NULL if unlimited.
+} admission_t;
+
+
+admission_t *admission_create(int max_conns, int max_per_addr);
+void admission_destroy(admission_t *adm);
+uint64_t admission_source(const struct sockaddr *addr);
+uint64_t admission_peer_source(int fd);
+admission_result_t admission_acquire(admission_t *adm, uint64_t source);
+void admission_release(admission_t *adm, uint64_t source);
+int admission_count(admission_t *adm);
+void admission_shed(int fd);
+
+#endif
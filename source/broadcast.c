@@ -0,0 +1,557 @@
+/**
+ * broadcast.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in broadcast.h.
+ *
+ * Publishers walk the registry under a read lock, adding a reference to the
+ * message for every subscriber queuing it. Subscribers that had nothing to
+ * send get linked into the ready list of their sender, once per publish.
+ * A sender writes out every ready subscriber with MSG_DONTWAIT, so it never
+ * blocks. Those whose socket buffer is full get armed in the epoll instance
+ * of the sender, till there is room again.
+ *
+ * Connections stay owned by the threads serving them, which close them
+ * after unsubscribing. Unsubscribing waits for the sender to drop the
+ * subscriber, so the sender never touches a closed descriptor, and a sender
+ * handles the events of a wait before its ready list, so no event it got
+ * refers to a subscriber freed meanwhile.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "broadcast.h"
+
+#define MAX_EVENTS 64
+
+
+static int enqueue(broadcast_t *bc, subscriber_t *sub, broadcast_msg_t *msg);
+static void schedule(broadcast_sender_t *sender, subscriber_t *head,
+                     subscriber_t *tail);
+static void *run_sender(void *args);
+static void on_writable(broadcast_sender_t *sender, subscriber_t *sub);
+static void flush_subscriber(broadcast_sender_t *sender, subscriber_t *sub);
+static void consume(broadcast_t *bc, subscriber_t *sub, size_t len);
+static void release_queue(broadcast_t *bc, subscriber_t *sub);
+static void wake_sender(broadcast_sender_t *sender);
+
+
+/**
+ * Creates a broadcast queuing up to depth messages per subscriber, served
+ * by given number of sender threads.
+ *
+ * Returns NULL on failure, with errno set.
+ */
+broadcast_t *broadcast_create(int depth, broadcast_policy_t policy,
+                              int senders_num)
+{
+    if (depth < 1) depth = 1;
+    if (senders_num < 1) senders_num = 1;
+    if (senders_num > BROADCAST_MAX_SENDERS) {
+        senders_num = BROADCAST_MAX_SENDERS;
+    }
+
+    broadcast_t *bc = (broadcast_t *) calloc(1, sizeof(broadcast_t));
+    if (!bc) return NULL;
+    bc->depth = depth;
+    bc->policy = policy;
+    pthread_rwlock_init(&bc->lock, NULL);
+
+    for (int i = 0; i < senders_num; i++) {
+        broadcast_sender_t *sender = &bc->senders[i];
+        sender->bc = bc;
+        pthread_mutex_init(&sender->mutex, NULL);
+        sender->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        sender->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;  // Marks wake_fd.
+        if (sender->epoll_fd < 0 || sender->wake_fd < 0 ||
+            epoll_ctl(sender->epoll_fd, EPOLL_CTL_ADD, sender->wake_fd,
+                      &ev) < 0 ||
+            pthread_create(&sender->thread, NULL, run_sender, sender) != 0) {
+            int err = errno;
+            if (sender->epoll_fd >= 0) close(sender->epoll_fd);
+            if (sender->wake_fd >= 0) close(sender->wake_fd);
+            pthread_mutex_destroy(&sender->mutex);
+            broadcast_destroy(bc);
+            errno = err;
+            return NULL;
+        }
+        bc->senders_num++;
+    }
+
+    return bc;
+}
+
+/**
+ * Stops the senders of a broadcast and frees it. Every subscriber should
+ * have been unsubscribed.
+ */
+void broadcast_destroy(broadcast_t *bc)
+{
+    for (int i = 0; i < bc->senders_num; i++) {
+        broadcast_sender_t *sender = &bc->senders[i];
+        pthread_mutex_lock(&sender->mutex);
+        sender->stopping = 1;
+        pthread_mutex_unlock(&sender->mutex);
+        wake_sender(sender);
+        pthread_join(sender->thread, NULL);
+
+        close(sender->epoll_fd);
+        close(sender->wake_fd);
+        pthread_mutex_destroy(&sender->mutex);
+    }
+
+    pthread_rwlock_destroy(&bc->lock);
+    free(bc->subs);
+    free(bc);
+}
+
+/**
+ * Returns the slow consumer policy matching given name, or -1 if there is
+ * none.
+ */
+int broadcast_parse_policy(const char *name)
+{
+    if (strcmp(name, "drop") == 0) return BROADCAST_DROP;
+    if (strcmp(name, "disconnect") == 0) return BROADCAST_DISCONNECT;
+    return -1;
+}
+
+/**
+ * Makes given connection receive every message published from now on by
+ * other connections.
+ *
+ * Returns the new subscriber, or NULL on failure with errno set.
+ */
+subscriber_t *broadcast_subscribe(broadcast_t *bc, int fd)
+{
+    subscriber_t *sub = (subscriber_t *) calloc(1, sizeof(subscriber_t));
+    if (!sub) return NULL;
+    sub->queue = (broadcast_msg_t **) malloc(
+            sizeof(broadcast_msg_t *) * bc->depth);
+    if (!sub->queue) {
+        free(sub);
+        return NULL;
+    }
+    sub->fd = fd;
+    sub->sender = &bc->senders[fd % bc->senders_num];
+    pthread_mutex_init(&sub->mutex, NULL);
+    pthread_cond_init(&sub->idle, NULL);
+
+    pthread_rwlock_wrlock(&bc->lock);
+    if (bc->subs_num == bc->subs_capacity) {
+        int capacity = bc->subs_capacity ? bc->subs_capacity * 2 : 64;
+        subscriber_t **grown = (subscriber_t **) realloc(
+                bc->subs, sizeof(subscriber_t *) * capacity);
+        if (!grown) {
+            pthread_rwlock_unlock(&bc->lock);
+            pthread_mutex_destroy(&sub->mutex);
+            pthread_cond_destroy(&sub->idle);
+            free(sub->queue);
+            free(sub);
+            errno = ENOMEM;
+            return NULL;
+        }
+        bc->subs = grown;
+        bc->subs_capacity = capacity;
+    }
+    sub->index = bc->subs_num;
+    bc->subs[bc->subs_num++] = sub;
+    pthread_rwlock_unlock(&bc->lock);
+
+    return sub;
+}
+
+/**
+ * Stops a subscriber from receiving messages and frees it, dropping any
+ * message still queued. Once this returns, its connection may get closed.
+ */
+void broadcast_unsubscribe(broadcast_t *bc, subscriber_t *sub)
+{
+    pthread_rwlock_wrlock(&bc->lock);
+    subscriber_t *last = bc->subs[--bc->subs_num];
+    bc->subs[sub->index] = last;
+    last->index = sub->index;
+    pthread_rwlock_unlock(&bc->lock);
+
+    pthread_mutex_lock(&sub->mutex);
+    sub->closed = 1;
+    if (sub->polling && !sub->queued) {
+        // Sender would otherwise wait for room that may never come.
+        sub->queued = 1;
+        schedule(sub->sender, sub, sub);
+    }
+    while (sub->queued || sub->polling) {
+        pthread_cond_wait(&sub->idle, &sub->mutex);
+    }
+    if (sub->registered) {
+        epoll_ctl(sub->sender->epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+    }
+    release_queue(bc, sub);
+    pthread_mutex_unlock(&sub->mutex);
+
+    pthread_mutex_destroy(&sub->mutex);
+    pthread_cond_destroy(&sub->idle);
+    free(sub->queue);
+    free(sub);
+}
+
+/**
+ * Queues a message for every subscriber other than the one it came from,
+ * which may be NULL, and hands it over to their senders. Takes over the
+ * reference of the caller to the message.
+ */
+void broadcast_publish(broadcast_t *bc, subscriber_t *from,
+                       broadcast_msg_t *msg)
+{
+    // Subscribers to schedule, linked per sender.
+    subscriber_t *heads[BROADCAST_MAX_SENDERS] = { NULL };
+    subscriber_t *tails[BROADCAST_MAX_SENDERS];
+
+    pthread_rwlock_rdlock(&bc->lock);
+    for (int i = 0; i < bc->subs_num; i++) {
+        subscriber_t *sub = bc->subs[i];
+        if (sub == from || !enqueue(bc, sub, msg)) continue;
+
+        int s = (int) (sub->sender - bc->senders);
+        sub->next_ready = NULL;
+        if (heads[s]) tails[s]->next_ready = sub;
+        else heads[s] = sub;
+        tails[s] = sub;
+    }
+    pthread_rwlock_unlock(&bc->lock);
+
+    for (int s = 0; s < bc->senders_num; s++) {
+        if (heads[s]) schedule(&bc->senders[s], heads[s], tails[s]);
+    }
+
+    atomic_fetch_add(&bc->published, 1);
+    broadcast_msg_put(msg);
+}
+
+/**
+ * Drops a reference to a message, freeing it along with the last one.
+ */
+void broadcast_msg_put(broadcast_msg_t *msg)
+{
+    if (atomic_fetch_sub(&msg->refs, 1) == 1) free(msg);
+}
+
+void broadcast_batch_init(broadcast_batch_t *batch)
+{
+    memset(batch, 0, sizeof(broadcast_batch_t));
+}
+
+void broadcast_batch_free(broadcast_batch_t *batch)
+{
+    if (batch->msg) broadcast_msg_put(batch->msg);
+    batch->msg = NULL;
+}
+
+/**
+ * Makes batch gather the frames of a connection, passing each one to sink
+ * first, which may be NULL.
+ */
+void broadcast_batch_start(broadcast_batch_t *batch, frame_handler_t sink,
+                           void *sink_arg)
+{
+    batch->sink = sink;
+    batch->sink_arg = sink_arg;
+    if (batch->msg) batch->msg->len = 0;
+}
+
+/**
+ * Hands a frame over to sink and copies it into the message being gathered
+ * by the batch given as arg. Meant to be passed to frame_reader_feed().
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int broadcast_frame(const frame_t *frame, void *arg)
+{
+    broadcast_batch_t *batch = (broadcast_batch_t *) arg;
+    if (batch->sink && batch->sink(frame, batch->sink_arg) != 0) return -1;
+
+    // Lines go out as they came, with no header, ending in a newline.
+    int line = frame->flags & FRAME_LINE;
+    int newline = line && (frame->length == 0 ||
+                           frame->payload[frame->length - 1] != '\n');
+    size_t header = line ? 0 : FRAME_HEADER_SIZE;
+    size_t len = header + frame->length + newline;
+
+    // Message is not shared before being published, so it may move.
+    broadcast_msg_t *msg = batch->msg;
+    if (!msg || msg->len + len > msg->capacity) {
+        size_t capacity = msg ? msg->capacity : BROADCAST_MSG_MIN;
+        size_t used = msg ? msg->len : 0;
+        while (capacity < used + len) capacity *= 2;
+        msg = (broadcast_msg_t *) realloc(
+                msg, sizeof(broadcast_msg_t) + capacity);
+        if (!msg) return -1;
+        if (!batch->msg) {
+            atomic_init(&msg->refs, 1);
+            msg->len = 0;
+        }
+        msg->capacity = capacity;
+        batch->msg = msg;
+    }
+
+    char *dst = msg->data + msg->len;
+    if (header) {
+        dst += frame_pack_header(dst, frame->type, frame->flags,
+                                 frame->length);
+    }
+    if (frame->length > 0) memcpy(dst, frame->payload, frame->length);
+    if (newline) dst[frame->length] = '\n';
+    msg->len += len;
+    return 0;
+}
+
+/**
+ * Publishes the frames gathered by batch since last call, if any.
+ */
+void broadcast_batch_publish(broadcast_batch_t *batch, broadcast_t *bc,
+                             subscriber_t *from)
+{
+    if (!batch->msg || batch->msg->len == 0) return;
+    broadcast_publish(bc, from, batch->msg);
+    batch->msg = NULL;
+}
+
+/**
+ * Adds a message to the queue of a subscriber, applying the slow consumer
+ * policy if it is full.
+ *
+ * Returns 1 if subscriber should be handed over to its sender, 0 otherwise.
+ */
+static int enqueue(broadcast_t *bc, subscriber_t *sub, broadcast_msg_t *msg)
+{
+    int ready = 0;
+
+    pthread_mutex_lock(&sub->mutex);
+    if (sub->closed || sub->dead) ;
+    else if (sub->count == bc->depth) {
+        if (bc->policy == BROADCAST_DROP) atomic_fetch_add(&bc->dropped, 1);
+        else {
+            // Connection is still open, as it is still subscribed. Its
+            // handler sees it shut down and unsubscribes it.
+            sub->dead = 1;
+            shutdown(sub->fd, SHUT_RDWR);
+            atomic_fetch_add(&bc->disconnected, 1);
+        }
+    }
+    else {
+        atomic_fetch_add(&msg->refs, 1);
+        sub->queue[(sub->head + sub->count) % bc->depth] = msg;
+        sub->count++;
+        if (!sub->queued && !sub->polling) {
+            sub->queued = 1;
+            ready = 1;
+        }
+    }
+    pthread_mutex_unlock(&sub->mutex);
+
+    return ready;
+}
+
+/**
+ * Appends a chain of subscribers to the ready list of sender, waking it up
+ * if the list was empty.
+ */
+static void schedule(broadcast_sender_t *sender, subscriber_t *head,
+                     subscriber_t *tail)
+{
+    tail->next_ready = NULL;
+
+    pthread_mutex_lock(&sender->mutex);
+    int wake = sender->ready_head == NULL;
+    if (sender->ready_head) sender->ready_tail->next_ready = head;
+    else sender->ready_head = head;
+    sender->ready_tail = tail;
+    pthread_mutex_unlock(&sender->mutex);
+
+    if (wake) wake_sender(sender);
+}
+
+/**
+ * Entry point of sender threads.
+ */
+static void *run_sender(void *args)
+{
+    broadcast_sender_t *sender = (broadcast_sender_t *) args;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(sender->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR) break;
+
+        for (int i = 0; i < n; i++) {
+            subscriber_t *sub = (subscriber_t *) events[i].data.ptr;
+            if (sub) {
+                on_writable(sender, sub);
+                continue;
+            }
+            uint64_t val;
+            ssize_t rc = read(sender->wake_fd, &val, sizeof(val));
+            (void) rc;
+        }
+
+        pthread_mutex_lock(&sender->mutex);
+        subscriber_t *sub = sender->ready_head;
+        sender->ready_head = sender->ready_tail = NULL;
+        int stopping = sender->stopping;
+        pthread_mutex_unlock(&sender->mutex);
+
+        while (sub) {
+            // Subscriber may be freed once flushed.
+            subscriber_t *next = sub->next_ready;
+            flush_subscriber(sender, sub);
+            sub = next;
+        }
+
+        if (stopping) break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Resumes sending to a subscriber that waited for room in its socket.
+ */
+static void on_writable(broadcast_sender_t *sender, subscriber_t *sub)
+{
+    pthread_mutex_lock(&sub->mutex);
+    sub->polling = 0;
+    if (sub->queued) {
+        // Got unsubscribed, and is in the ready list for that.
+        pthread_mutex_unlock(&sub->mutex);
+        return;
+    }
+    sub->queued = 1;
+    pthread_mutex_unlock(&sub->mutex);
+
+    flush_subscriber(sender, sub);
+}
+
+/**
+ * Writes out as much of the queue of a subscriber as its socket takes,
+ * arming it in the epoll instance of sender if some is left. Subscribers
+ * closed or dead get their queue dropped instead.
+ *
+ * Sender is done with the subscriber once this returns, unless armed.
+ */
+static void flush_subscriber(broadcast_sender_t *sender, subscriber_t *sub)
+{
+    broadcast_t *bc = sender->bc;
+    struct iovec iov[BROADCAST_IOV_MAX];
+    int wait_room = 0;
+
+    pthread_mutex_lock(&sub->mutex);
+    while (sub->count > 0 && !sub->closed && !sub->dead) {
+        // Messages queued meanwhile get appended, so these stay in place.
+        int count = sub->count < BROADCAST_IOV_MAX ?
+                    sub->count : BROADCAST_IOV_MAX;
+        size_t total = 0;
+        for (int i = 0; i < count; i++) {
+            broadcast_msg_t *msg = sub->queue[(sub->head + i) % bc->depth];
+            size_t skip = i == 0 ? sub->offset : 0;
+            iov[i].iov_base = msg->data + skip;
+            iov[i].iov_len = msg->len - skip;
+            total += iov[i].iov_len;
+        }
+        pthread_mutex_unlock(&sub->mutex);
+
+        struct msghdr hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = count;
+        ssize_t n = sendmsg(sub->fd, &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+        int err = errno;
+
+        pthread_mutex_lock(&sub->mutex);
+        if (n < 0) {
+            if (err == EINTR) continue;
+            if (err == EAGAIN || err == EWOULDBLOCK) wait_room = 1;
+            else sub->dead = 1;  // Its handler sees the connection fail.
+            break;
+        }
+        consume(bc, sub, (size_t) n);
+        if ((size_t) n < total) {
+            wait_room = 1;
+            break;
+        }
+    }
+
+    if (!sub->closed && !sub->dead && wait_room) {
+        struct epoll_event ev;
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        ev.data.ptr = sub;
+        int op = sub->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        if (epoll_ctl(sender->epoll_fd, op, sub->fd, &ev) == 0) {
+            sub->registered = 1;
+            sub->polling = 1;
+        }
+        else sub->dead = 1;
+    }
+    if (sub->closed || sub->dead) {
+        release_queue(bc, sub);
+        if (sub->registered) {
+            epoll_ctl(sender->epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+            sub->registered = 0;
+            sub->polling = 0;
+        }
+    }
+
+    sub->queued = 0;
+    if (sub->closed) pthread_cond_broadcast(&sub->idle);
+    pthread_mutex_unlock(&sub->mutex);
+}
+
+/**
+ * Removes len bytes sent from the front of the queue of a subscriber,
+ * dropping messages sent as a whole. Subscriber should be locked.
+ */
+static void consume(broadcast_t *bc, subscriber_t *sub, size_t len)
+{
+    len += sub->offset;
+    while (sub->count > 0 && len >= sub->queue[sub->head]->len) {
+        len -= sub->queue[sub->head]->len;
+        broadcast_msg_put(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % bc->depth;
+        sub->count--;
+    }
+    sub->offset = len;
+}
+
+/**
+ * Drops every message queued for a subscriber. Subscriber should be locked.
+ */
+static void release_queue(broadcast_t *bc, subscriber_t *sub)
+{
+    while (sub->count > 0) {
+        broadcast_msg_put(sub->queue[sub->head]);
+        sub->head = (sub->head + 1) % bc->depth;
+        sub->count--;
+    }
+    sub->offset = 0;
+}
+
+static void wake_sender(broadcast_sender_t *sender)
+{
+    uint64_t val = 1;
+    ssize_t rc = write(sender->wake_fd, &val, sizeof(val));
+    (void) rc;
+}
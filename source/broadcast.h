@@ -0,0 +1,121 @@
+/**
+ * broadcast.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to fan frames received on
+ * one connection out to every other subscribed connection.
+ *
+ * Frames completed by a single read get published together, as a single
+ * reference counted message, which every subscriber queues without copying
+ * it. Sender threads write out the queue of each subscriber with a single
+ * sendmsg(), never blocking on a slow one, whose queue then grows up to its
+ * bound. Further messages get dropped for it, or it gets disconnected.
+ *
+ */
+
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "frame.h"
+
+#define BROADCAST_IOV_MAX 64     // Messages written to a subscriber at once.
+#define BROADCAST_MAX_SENDERS 8
+#define BROADCAST_MSG_MIN 4096   // Initial bytes of a message being built.
+
+typedef enum {
+    BROADCAST_DROP,       // Messages not fitting a subscriber's queue get
+                          // dropped for it.
+    BROADCAST_DISCONNECT  // Subscribers with a full queue get disconnected.
+} broadcast_policy_t;
+
+// Frames published together, shared by every subscriber queuing them. Freed
+// once the last one is done with it.
+typedef struct {
+    atomic_int refs;
+    size_t len;
+    size_t capacity;
+    char data[];
+} broadcast_msg_t;
+
+struct broadcast_sender;
+
+// A connection receiving broadcasts. Its queue is only emptied by its
+// sender, which is responsible for it while queued or polling is set.
+typedef struct subscriber {
+    int fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t idle;       // Signaled once sender is done with it.
+    broadcast_msg_t **queue;   // Ring of messages waiting to be sent.
+    int head;
+    int count;
+    size_t offset;             // Bytes of head message already sent.
+    int index;                 // Position in registry.
+    int queued;                // In a ready list, or being flushed.
+    int polling;               // Waiting for room in socket buffer.
+    int registered;            // Fd is in the epoll instance of sender.
+    int closed;                // Set once unsubscribed.
+    int dead;                  // Connection failed or got disconnected.
+    struct subscriber *next_ready;
+    struct broadcast_sender *sender;
+} subscriber_t;
+
+// Thread writing out the queues of a share of subscribers.
+typedef struct broadcast_sender {
+    struct broadcast *bc;
+    pthread_t thread;
+    int epoll_fd;   // Subscribers waiting for room, along with wake_fd.
+    int wake_fd;    // Turns readable when ready list stops being empty.
+    pthread_mutex_t mutex;
+    subscriber_t *ready_head;  // Subscribers with messages to send.
+    subscriber_t *ready_tail;
+    int stopping;
+} broadcast_sender_t;
+
+typedef struct broadcast {
+    int depth;                  // Max messages queued per subscriber.
+    broadcast_policy_t policy;
+    pthread_rwlock_t lock;      // Guards registry.
+    subscriber_t **subs;        // Registry of subscribers.
+    int subs_num;
+    int subs_capacity;
+    broadcast_sender_t senders[BROADCAST_MAX_SENDERS];
+    int senders_num;
+    atomic_uint_least64_t published;     // Messages published.
+    atomic_uint_least64_t dropped;       // Messages dropped for subscribers.
+    atomic_uint_least64_t disconnected;  // Subscribers disconnected.
+} broadcast_t;
+
+// Gathers the frames of a single read, on behalf of a single thread.
+typedef struct {
+    broadcast_msg_t *msg;  // Frames gathered so far, NULL if none.
+    frame_handler_t sink;  // Gets every frame, before it is gathered.
+    void *sink_arg;
+} broadcast_batch_t;
+
+
+broadcast_t *broadcast_create(int depth, broadcast_policy_t policy,
+                              int senders_num);
+void broadcast_destroy(broadcast_t *bc);
+int broadcast_parse_policy(const char *name);
+subscriber_t *broadcast_subscribe(broadcast_t *bc, int fd);
+void broadcast_unsubscribe(broadcast_t *bc, subscriber_t *sub);
+void broadcast_publish(broadcast_t *bc, subscriber_t *from,
+                       broadcast_msg_t *msg);
+void broadcast_msg_put(broadcast_msg_t *msg);
+
+void broadcast_batch_init(broadcast_batch_t *batch);
+void broadcast_batch_free(broadcast_batch_t *batch);
+void broadcast_batch_start(broadcast_batch_t *batch, frame_handler_t sink,
+                           void *sink_arg);
+int broadcast_frame(const frame_t *frame, void *arg);
+void broadcast_batch_publish(broadcast_batch_t *batch, broadcast_t *bc,
+                             subscriber_t *from);
+
+#endif
@@ -5,25 +5,146 @@
  *  for course "Embedded And Realtime Systems".
  *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
  *
- * A simple TCP client.
+ * A simple TCP client, that may also act as a load generator. Every message
+ * is sent as a frame (see frame.h).
  *
- * Usage: exec_name <host> <port>
+ * Usage: exec_name [-l [load options]] [-b] [-f file] [-P] [-N] [-O options]
+ *                  <host> <port> | <unix:path>
  *   where:
- *      -host : IPv4 address or hostname of server.
+ *      -host : IPv4 or IPv6 address, or hostname of server.
  *      -port : Port number on server.
+ *      -unix:path : Unix domain socket of server ("unix:@name" in the
+ *              abstract namespace), instead of host and port.
+ *      -l : Generate load instead of sending lines typed on stdin.
+ *      -b : Bulk mode. Read stdin in large blocks till EOF, sending many
+ *              lines, each one as a frame, with a single writev().
+ *      -f file : Stream given file with sendfile(). Frames carry as many
+ *              whole lines as fit in one, so the file never gets copied
+ *              through user space.
+ *      -P : Input (stdin or file) already consists of frames, so forward it
+ *              as is, with sendfile() or splice().
+ *      -N : Send lines typed, or messages of load, as newline delimited
+ *              lines with no frame header, for servers run with -N. With -P,
+ *              input may consist of such lines too.
+ *      -O options : Comma separated socket options of connections. TCP
+ *              ones are ignored on Unix domain sockets:
+ *              nodelay : Send small writes at once (TCP_NODELAY).
+ *              quickack : Ack replies at once at the start of connections
+ *                      (TCP_QUICKACK).
+ *              rcvbuf=bytes : Size of receive buffer (SO_RCVBUF).
+ *              sndbuf=bytes : Size of send buffer (SO_SNDBUF).
+ *
+ *   Load options:
+ *      -c connections : Number of connections to open (default 1).
+ *      -t threads : Number of threads driving connections (default 1).
+ *      -s size : Size of each message in bytes, excluding frame header
+ *              (default 64).
+ *      -r rate : Target rate in messages/sec over all connections
+ *              (open loop). When 0 (default), messages are sent as fast as
+ *              possible (closed loop).
+ *      -w window : Messages in flight per connection in closed loop, when
+ *              waiting for replies (default 1).
+ *      -d seconds : Duration of the test (default 10).
+ *      -e : Server echoes messages back (-E echo), so measure their latency.
+ *      -a : Server acks messages (-E ack), so measure their latency.
+ *      -B subscribers : Also open this many connections that only receive
+ *              the messages server broadcasts (-B), and count them.
+ *      -i idle : Also open this many connections that stay idle for the
+ *              whole test, as most connections of a C10K server do.
+ *      -n churn : Also open and close this many connections per second,
+ *              each one sending a single message (and awaiting its reply
+ *              with -e or -a) before closing, and time their lifetime.
+ *      -j : Report results as a single JSON object.
  *
  * Credits:
  *  This file includes public code from Rensselaer Polytechnic Institute (RPI).
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <limits.h>
+#include "histogram.h"
+#include "frame.h"
+#include "endpoint.h"
+
+#define SEND_BUFFER_SIZE 65536  // Bytes of repeated messages to send from.
+#define OPEN_LOOP_BACKLOG 4096  // Messages awaiting reply in open loop.
+#define MAX_EVENTS 64
+#define BULK_BLOCK_SIZE (1 << 20)  // Bytes of stdin read at once in bulk mode.
+#define STREAM_CHUNK (1 << 20)     // Bytes forwarded by a sendfile()/splice().
+#define DRAIN_TIMEOUT_MS 5000      // Max wait for server to close on teardown.
+#define DRAIN_QUIET_MS 100         // Silence of subscribers before closing.
+
+typedef struct {
+    int fd;
+    uint64_t *sent_times;  // Ring of send times of messages awaiting reply.
+    int times_head;
+    int times_count;
+    int times_capacity;
+    uint64_t out_pending;  // Bytes queued but not yet written.
+    uint64_t out_total;    // Bytes written so far.
+    size_t in_partial;     // Bytes received of the reply being read.
+    int subscriber;        // Set if connection only receives broadcasts.
+    int half_closed;       // Set once sending side has been shut down.
+    int finished;          // Set once server has closed its side too.
+} load_conn_t;
+
+typedef struct {
+    load_conn_t *conns;    // Publishing connections, then subscribers.
+    int conns_num;
+    int publishers_num;    // Connections sending messages.
+    histogram_t *latencies;  // Latencies in ns, recorded by this thread.
+    uint64_t msgs_sent;
+    uint64_t msgs_received;
+    uint64_t msgs_missed;    // Open loop sends skipped due to full backlog.
+    uint64_t bytes_delivered;  // Bytes broadcast to subscribers.
+    uint64_t last_delivery;    // Time subscribers last received bytes.
+    int subs_disconnected;     // Subscribers closed by server.
+    uint64_t conns_churned;    // Connections opened and closed.
+    double rate;             // Messages/sec for this thread, 0 if closed loop.
+} load_thread_t;
+
+// Settings of load generation.
+int conns_num = 1;
+int threads_num = 1;
+size_t msg_size = 64;     // Payload bytes of each message.
+size_t frame_size;        // Bytes of each message on the wire.
+double target_rate = 0;
+int window = 1;
+double duration = 10;
+int expect_echo = 0;
+int expect_ack = 0;
+size_t reply_size = 0;   // Bytes of each reply, 0 if server does not reply.
+int subscribers_num = 0;
+int idle_num = 0;
+double churn_rate = 0;   // Connections opened and closed per second.
+int json_output = 0;
+int line_mode = 0;       // Messages go as lines, with no frame header.
+char *send_buffer;       // Repeated frames, to be written from.
+size_t send_buffer_len;  // Multiple of frame_size.
+size_t msgs_in_buffer;   // Messages contained in send buffer.
+uint64_t end_time;       // Time when threads should stop sending.
+
+endpoint_t server;           // Address of server, once resolved.
+int server_resolved = 0;
+socket_options_t sock_opts;  // Options of connections to server.
+
 
 void error(const char *msg)
 {
@@ -31,60 +152,766 @@ void error(const char *msg)
     exit(0);
 }
 
-int main(int argc, char *argv[])
+/**
+ * Prints usage information and terminates process.
+ */
+void usage(const char *exec_name)
+{
+    fprintf(stderr, "usage %s [-l [-c connections] [-t threads] [-s size] "
+            "[-r rate] [-w window] [-d seconds] [-e | -a] [-B subscribers] "
+            "[-i idle] [-n churn] [-j]] [-b] [-f file] "
+            "[-P] [-N] [-O options] hostname port | unix:path\n", exec_name);
+    exit(0);
+}
+
+/**
+ * Returns current monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void)
 {
-    int sockfd, portno, n;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
 
-    char buffer[256];
-    if (argc < 3) {
-       fprintf(stderr,"usage %s hostname port\n", argv[0]);
-       exit(0);
-    }
-    portno = atoi(argv[2]);
+/**
+ * Opens a new connection to given server. Only the first connection
+ * resolves its address, with later ones reusing the address that worked.
+ */
+int connect_to_server(const char *host, const char *port)
+{
+    int sockfd;
 
-    // Open an IPv4 TCP socket.
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0)
-        error("ERROR opening socket");
-    // Get a hostent struct with the server's address.
-    server = gethostbyname(argv[1]);
-    if (server == NULL) {
+    if (server_resolved) sockfd = endpoint_connect(&server, &sock_opts);
+    else sockfd = endpoint_dial(host, port, &sock_opts, &server);
+    if (sockfd < 0 && errno == ENXIO) {
         fprintf(stderr,"ERROR, no such host\n");
         exit(0);
     }
-
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *)server->h_addr,
-         (char *)&serv_addr.sin_addr.s_addr,
-         server->h_length);
-    serv_addr.sin_port = htons(portno);
-    if (connect(sockfd,(struct sockaddr *) &serv_addr,sizeof(serv_addr)) < 0)
+    if (sockfd < 0)
         error("ERROR connecting");
+    server_resolved = 1;
+
+    return sockfd;
+}
+
+/**
+ * Sends lines typed on stdin, until 'quit' is typed.
+ */
+void run_interactive(int sockfd)
+{
+    int n;
+    char buffer[FRAME_HEADER_SIZE + 256];
+    char *line = buffer + FRAME_HEADER_SIZE;
 
     printf("Type 'quit' to terminate.\n");
     printf("Please enter your messages:\n");
 
     // Use 'quit' string as termination indicator.
     while (1) {
-        bzero(buffer, 256);
-        fgets(buffer, 255, stdin);
+        if (!fgets(line, 256, stdin)) break;
 
-        if (strcmp(buffer, "quit\n") == 0) break;
+        if (strcmp(line, "quit\n") == 0) break;
 
-        n = write(sockfd, buffer, strlen(buffer));
+        // Send the line as a single frame, or as is in line mode.
+        size_t len = strlen(line);
+        if (line_mode) n = write(sockfd, line, len);
+        else {
+            frame_pack_header(buffer, FRAME_DATA, 0, len);
+            n = write(sockfd, buffer, FRAME_HEADER_SIZE + len);
+        }
         if (n < 0) error("ERROR: Writing to socket failed");
     }
+}
 
-    // Ask socket for shutdown.
-    shutdown(sockfd, SHUT_RDWR);
-    bzero(buffer, 256);
-    while ((n = write(sockfd, buffer, 1)) > 0);  // Wait until it can be closed.
+/**
+ * Writes all given buffers, resuming after partial writes.
+ */
+void write_all(int sockfd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = writev(sockfd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR: Writing to socket failed");
+        }
 
-    // Finally, close the socket.
+        // Skip buffers fully written, and the written part of the next one.
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+/**
+ * Sends lines read from stdin in large blocks till EOF, each one as a frame.
+ * Frames of a whole block go out together, with as few writev() calls as
+ * IOV_MAX allows.
+ */
+void run_bulk(int sockfd)
+{
+    char *block = (char *) malloc(BULK_BLOCK_SIZE);
+    struct iovec iov[IOV_MAX];
+    char headers[IOV_MAX / 2][FRAME_HEADER_SIZE];
+    size_t kept = 0;  // Bytes of an incomplete line, kept from last block.
+    int eof = 0;
+
+    while (!eof) {
+        ssize_t n = read(STDIN_FILENO, block + kept, BULK_BLOCK_SIZE - kept);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR: Reading stdin failed");
+        }
+        eof = n == 0;
+        size_t len = kept + n;
+
+        // Frame every complete line. A line longer than a frame gets split,
+        // and so does the last one at EOF, even with no newline.
+        size_t start = 0;
+        int iovcnt = 0;
+        while (start < len) {
+            size_t avail = len - start;
+            if (avail > FRAME_MAX_PAYLOAD) avail = FRAME_MAX_PAYLOAD;
+            char *nl = (char *) memchr(block + start, '\n', avail);
+            size_t line;
+            if (nl) line = nl - (block + start) + 1;
+            else if (avail == FRAME_MAX_PAYLOAD || eof) line = avail;
+            else break;  // Rest of the line is in the next block.
+
+            char *header = headers[iovcnt / 2];
+            frame_pack_header(header, FRAME_DATA, 0, line);
+            iov[iovcnt].iov_base = header;
+            iov[iovcnt++].iov_len = FRAME_HEADER_SIZE;
+            iov[iovcnt].iov_base = block + start;
+            iov[iovcnt++].iov_len = line;
+            start += line;
+
+            if (iovcnt == IOV_MAX) {
+                write_all(sockfd, iov, iovcnt);
+                iovcnt = 0;
+            }
+        }
+        write_all(sockfd, iov, iovcnt);
+
+        kept = len - start;
+        memmove(block, block + start, kept);
+    }
+
+    free(block);
+}
+
+/**
+ * Streams a file as frames, each one carrying as many whole lines as fit in
+ * it. Only headers get written from user space, while payloads are sent
+ * straight from the page cache with sendfile().
+ */
+void run_file(int sockfd, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) error("ERROR: Failed to open file");
+    struct stat st;
+    if (fstat(fd, &st) < 0) error("ERROR: Failed to stat file");
+    size_t size = (size_t) st.st_size;
+    if (size == 0) {
+        close(fd);
+        return;
+    }
+
+    // File is only mapped to find line boundaries.
+    char *map = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) error("ERROR: Failed to map file");
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    off_t offset = 0;
+    while ((size_t) offset < size) {
+        size_t len = size - offset;
+        if (len > FRAME_MAX_PAYLOAD) {
+            len = FRAME_MAX_PAYLOAD;
+            char *nl = (char *) memrchr(map + offset, '\n', len);
+            if (nl) len = nl - (map + offset) + 1;
+        }
+
+        // Hold header back until its payload follows.
+        char header[FRAME_HEADER_SIZE];
+        frame_pack_header(header, FRAME_DATA, 0, len);
+        if (send(sockfd, header, FRAME_HEADER_SIZE, MSG_MORE) < 0) {
+            error("ERROR: Writing to socket failed");
+        }
+
+        off_t end = offset + len;
+        while (offset < end) {
+            ssize_t n = sendfile(sockfd, fd, &offset, end - offset);
+            if (n < 0 && errno != EINTR) error("ERROR: Sending file failed");
+            if (n == 0) {
+                // File got truncated, so the frame can never be completed.
+                errno = EIO;
+                error("ERROR: File shrank while sending");
+            }
+        }
+    }
+
+    munmap(map, size);
+    close(fd);
+}
+
+/**
+ * Forwards already framed input as is, till EOF. Regular files go with
+ * sendfile() and pipes with splice(), so data never passes through user
+ * space. Anything else gets copied.
+ */
+void run_raw(int sockfd, int in_fd)
+{
+    ssize_t n;
+    while ((n = sendfile(sockfd, in_fd, NULL, STREAM_CHUNK)) > 0 ||
+           (n < 0 && errno == EINTR));
+    if (n == 0) return;
+    if (errno != EINVAL && errno != ESPIPE) {
+        error("ERROR: Sending input failed");
+    }
+
+    while ((n = splice(in_fd, NULL, sockfd, NULL, STREAM_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 ||
+           (n < 0 && errno == EINTR));
+    if (n == 0) return;
+    if (errno != EINVAL) error("ERROR: Sending input failed");
+
+    char buffer[65536];
+    while ((n = read(in_fd, buffer, sizeof(buffer))) > 0 ||
+           (n < 0 && errno == EINTR)) {
+        if (n < 0) continue;
+        struct iovec iov = { buffer, (size_t) n };
+        write_all(sockfd, &iov, 1);
+    }
+}
+
+/**
+ * Tears a connection down without losing data in flight. Sending side gets
+ * shut down first, so that the server reads everything up to EOF, and then
+ * the connection is only closed once the server has closed its side too.
+ * Anything received meanwhile is discarded.
+ */
+void finish_connection(int sockfd)
+{
+    char buffer[65536];
+
+    shutdown(sockfd, SHUT_WR);
+    while (1) {
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        int rc = poll(&pfd, 1, DRAIN_TIMEOUT_MS);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) break;  // Server never closed.
+
+        ssize_t n = recv(sockfd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n == 0) break;
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR) break;
+    }
     close(sockfd);
+}
+
+/**
+ * Queues a new message on connection, sent at given time.
+ *
+ * Returns 0 on success, or -1 if there is no room to track its reply.
+ */
+int queue_message(load_conn_t *conn, uint64_t sent_time)
+{
+    if (reply_size) {
+        if (conn->times_count == conn->times_capacity) return -1;
+        int tail = (conn->times_head + conn->times_count) % conn->times_capacity;
+        conn->sent_times[tail] = sent_time;
+        conn->times_count++;
+    }
+    conn->out_pending += frame_size;
+    return 0;
+}
+
+/**
+ * Writes as much of the queued bytes as the socket accepts.
+ */
+void flush_connection(load_conn_t *conn)
+{
+    while (conn->out_pending > 0) {
+        size_t offset = conn->out_total % send_buffer_len;
+        size_t len = send_buffer_len - offset;
+        if (len > conn->out_pending) len = conn->out_pending;
+
+        ssize_t n = send(conn->fd, send_buffer + offset, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            error("ERROR: Writing to socket failed");
+        }
+        conn->out_pending -= n;
+        conn->out_total += n;
+    }
+}
+
+/**
+ * Consumes replies, recording the latency of every completed message, or
+ * counting the bytes of broadcasts on subscribers.
+ */
+void read_replies(load_thread_t *thread, load_conn_t *conn)
+{
+    char buffer[65536];
+    ssize_t n;
+
+    if (conn->finished) return;
+    while ((n = recv(conn->fd, buffer, sizeof(buffer), 0)) > 0) {
+        if (conn->subscriber) {
+            thread->bytes_delivered += n;
+            thread->last_delivery = now_ns();
+            continue;
+        }
+        if (!reply_size) continue;
+
+        conn->in_partial += n;
+        uint64_t now = now_ns();
+        while (conn->in_partial >= reply_size && conn->times_count > 0) {
+            conn->in_partial -= reply_size;
+            uint64_t sent = conn->sent_times[conn->times_head];
+            conn->times_head = (conn->times_head + 1) % conn->times_capacity;
+            conn->times_count--;
+            histogram_record(thread->latencies, now - sent);
+            thread->msgs_received++;
+        }
+    }
+    if (n == 0 && conn->half_closed) conn->finished = 1;
+    else if (n == 0 && conn->subscriber) {
+        // Server disconnected a subscriber too slow for it.
+        conn->finished = 1;
+        thread->subs_disconnected++;
+    }
+    else if (n == 0) {
+        fprintf(stderr, "ERROR: Server closed connection\n");
+        exit(0);
+    }
+}
+
+/**
+ * Tears down all connections of a thread, without losing messages counted
+ * as sent. Every connection gets its queued bytes written and then its
+ * sending side shut down, so that the server reads everything up to EOF.
+ * Echoes keep being consumed till the server closes its side too.
+ * Subscribers wait for all publishers of the thread to finish and for
+ * broadcasts to stop arriving first, so that they receive broadcasts of
+ * the last messages.
+ */
+void tear_down_connections(load_thread_t *thread, int epoll_fd)
+{
+    uint64_t deadline = now_ns() + DRAIN_TIMEOUT_MS * 1000000ULL;
+    int finished = 0;
+
+    while (finished < thread->conns_num && now_ns() < deadline) {
+        int quiet = now_ns() - thread->last_delivery >=
+                    DRAIN_QUIET_MS * 1000000ULL;
+        finished = 0;
+        for (int i = 0; i < thread->conns_num; i++) {
+            load_conn_t *conn = &thread->conns[i];
+            if (conn->subscriber &&
+                (finished < thread->publishers_num || !quiet)) {
+                break;
+            }
+            if (!conn->half_closed) {
+                flush_connection(conn);
+                if (conn->out_pending == 0) {
+                    shutdown(conn->fd, SHUT_WR);
+                    conn->half_closed = 1;
+                }
+            }
+            finished += conn->finished;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 10);
+        for (int i = 0; i < n; i++) {
+            load_conn_t *conn = (load_conn_t *) events[i].data.ptr;
+            if (events[i].events & EPOLLIN) read_replies(thread, conn);
+        }
+    }
+}
+
+/**
+ * Entry point of load generating threads.
+ */
+void *run_load_thread(void *args)
+{
+    load_thread_t *thread = (load_thread_t *) args;
+
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) error("ERROR: Failed to create epoll instance");
+    for (int i = 0; i < thread->conns_num; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = &thread->conns[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, thread->conns[i].fd, &ev);
+    }
+
+    uint64_t interval = thread->rate > 0 ? (uint64_t) (1e9 / thread->rate) : 0;
+    uint64_t next_send = now_ns();
+    int next_conn = 0;
+
+    uint64_t now;
+    while ((now = now_ns()) < end_time) {
+        if (interval) {
+            // Open loop: messages are due on schedule, no matter how late
+            // replies arrive, so latency accounts for queueing as well.
+            while (next_send <= now) {
+                load_conn_t *conn = &thread->conns[next_conn];
+                next_conn = (next_conn + 1) % thread->publishers_num;
+                if (queue_message(conn, next_send) < 0) thread->msgs_missed++;
+                else thread->msgs_sent++;
+                flush_connection(conn);
+                next_send += interval;
+            }
+        }
+        else {
+            // Closed loop: keep each connection's window full. Without
+            // replies, just keep its socket buffer full.
+            for (int i = 0; i < thread->publishers_num; i++) {
+                load_conn_t *conn = &thread->conns[i];
+                int room = reply_size ? window - conn->times_count :
+                           (conn->out_pending == 0) * (int) msgs_in_buffer;
+                for (int j = 0; j < room; j++) {
+                    queue_message(conn, now);
+                    thread->msgs_sent++;
+                }
+                flush_connection(conn);
+            }
+        }
+
+        int timeout = 1;
+        if (interval && next_send > now) timeout = (next_send - now) / 1000000;
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            load_conn_t *conn = (load_conn_t *) events[i].data.ptr;
+            if (events[i].events & EPOLLIN) read_replies(thread, conn);
+            if (events[i].events & EPOLLOUT) flush_connection(conn);
+        }
+    }
+
+    tear_down_connections(thread, epoll_fd);
+
+    close(epoll_fd);
+    return NULL;
+}
+
+/**
+ * Reads a single reply, giving up once the server stays silent for too long.
+ */
+void await_reply(int sockfd)
+{
+    char buffer[FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD];
+    size_t received = 0;
+
+    while (received < reply_size) {
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        int rc = poll(&pfd, 1, DRAIN_TIMEOUT_MS);
+        if (rc < 0 && errno == EINTR) continue;
+        if (rc <= 0) return;
+
+        ssize_t n = recv(sockfd, buffer, reply_size - received, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        received += n;
+    }
+}
+
+/**
+ * Entry point of the thread churning connections. At the target rate, each
+ * new connection sends a single message, awaits its reply if any and gets
+ * torn down, recording its whole lifetime, handshake to close.
+ */
+void *run_churn_thread(void *args)
+{
+    load_thread_t *thread = (load_thread_t *) args;
+    uint64_t interval = (uint64_t) (1e9 / churn_rate);
+    uint64_t next_open = now_ns();
+
+    uint64_t now;
+    while ((now = now_ns()) < end_time) {
+        if (next_open > now) {
+            uint64_t delay = next_open - now;
+            struct timespec ts = { (time_t) (delay / 1000000000ULL),
+                                   (long) (delay % 1000000000ULL) };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        next_open += interval;
+
+        int sockfd = connect_to_server(NULL, NULL);
+        struct iovec iov = { send_buffer, frame_size };
+        write_all(sockfd, &iov, 1);
+        thread->msgs_sent++;
+        if (reply_size) await_reply(sockfd);
+        finish_connection(sockfd);
+
+        histogram_record(thread->latencies, now_ns() - now);
+        thread->conns_churned++;
+    }
+
+    return NULL;
+}
+
+/**
+ * Prints percentiles of given latencies in us, as a JSON object.
+ */
+void print_latencies_json(const histogram_t *latencies)
+{
+    printf("{\"min\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+           "\"p99.9\": %.1f, \"max\": %.1f, \"mean\": %.1f}",
+           latencies->total ? latencies->min / 1e3 : 0.0,
+           histogram_percentile(latencies, 50) / 1e3,
+           histogram_percentile(latencies, 90) / 1e3,
+           histogram_percentile(latencies, 99) / 1e3,
+           histogram_percentile(latencies, 99.9) / 1e3,
+           latencies->max / 1e3,
+           histogram_mean(latencies) / 1e3);
+}
+
+/**
+ * Drives the configured load against the server and reports results.
+ */
+void run_load(const char *host, const char *port)
+{
+    if (threads_num > conns_num) threads_num = conns_num;
+
+    // Fill the send buffer with as many whole frames as fit in it. Every
+    // message is a line of letters, with no header in line mode.
+    frame_size = (line_mode ? 0 : FRAME_HEADER_SIZE) + msg_size;
+    if (expect_ack) reply_size = FRAME_HEADER_SIZE;
+    else if (expect_echo) reply_size = frame_size;
+    msgs_in_buffer = SEND_BUFFER_SIZE / frame_size;
+    if (msgs_in_buffer < 1) msgs_in_buffer = 1;
+    send_buffer_len = msgs_in_buffer * frame_size;
+    send_buffer = (char *) malloc(send_buffer_len);
+    for (size_t m = 0; m < msgs_in_buffer; m++) {
+        char *frame = send_buffer + m * frame_size;
+        char *payload = line_mode ? frame :
+                        frame + frame_pack_header(frame, FRAME_DATA, 0,
+                                                  msg_size);
+        for (size_t i = 0; i < msg_size; i++) payload[i] = 'a' + i % 26;
+        payload[msg_size - 1] = '\n';
+    }
+
+    load_thread_t *threads = (load_thread_t *) calloc(
+            threads_num, sizeof(load_thread_t));
+    pthread_t *tids = (pthread_t *) malloc(sizeof(pthread_t) * threads_num);
+
+    // Spread connections and subscribers evenly among threads.
+    for (int t = 0; t < threads_num; t++) {
+        load_thread_t *thread = &threads[t];
+        thread->publishers_num = conns_num / threads_num +
+                                 (t < conns_num % threads_num);
+        thread->conns_num = thread->publishers_num +
+                            subscribers_num / threads_num +
+                            (t < subscribers_num % threads_num);
+        thread->conns = (load_conn_t *) calloc(
+                thread->conns_num, sizeof(load_conn_t));
+        thread->latencies = histogram_create();
+        thread->rate = target_rate / threads_num;
+
+        for (int i = 0; i < thread->conns_num; i++) {
+            load_conn_t *conn = &thread->conns[i];
+            conn->subscriber = i >= thread->publishers_num;
+            conn->fd = connect_to_server(host, port);
+            int flags = fcntl(conn->fd, F_GETFL, 0);
+            if (fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+                error("ERROR: Failed to make socket non-blocking");
+            }
+            conn->times_capacity = target_rate > 0 ? OPEN_LOOP_BACKLOG : window;
+            conn->sent_times = (uint64_t *) malloc(
+                    sizeof(uint64_t) * conn->times_capacity);
+        }
+    }
+
+    // Idle connections never get served anything, nor read from.
+    int *idle_fds = (int *) malloc(sizeof(int) * (idle_num + 1));
+    for (int i = 0; i < idle_num; i++) {
+        idle_fds[i] = connect_to_server(host, port);
+    }
+
+    load_thread_t churner;
+    pthread_t churner_tid;
+    memset(&churner, 0, sizeof(churner));
+    churner.latencies = histogram_create();
+
+    uint64_t start = now_ns();
+    end_time = start + (uint64_t) (duration * 1e9);
+    for (int t = 0; t < threads_num; t++) {
+        pthread_create(&tids[t], NULL, run_load_thread, &threads[t]);
+    }
+    if (churn_rate > 0) {
+        pthread_create(&churner_tid, NULL, run_churn_thread, &churner);
+    }
+
+    // Gather results of all threads.
+    histogram_t *latencies = histogram_create();
+    uint64_t sent = 0, received = 0, missed = 0, delivered = 0;
+    int disconnected = 0;
+    for (int t = 0; t < threads_num; t++) {
+        pthread_join(tids[t], NULL);
+        histogram_merge(latencies, threads[t].latencies);
+        sent += threads[t].msgs_sent;
+        received += threads[t].msgs_received;
+        missed += threads[t].msgs_missed;
+        delivered += threads[t].bytes_delivered;
+        disconnected += threads[t].subs_disconnected;
+    }
+    if (churn_rate > 0) pthread_join(churner_tid, NULL);
+    double elapsed = (double) (now_ns() - start) / 1e9;
+    for (int i = 0; i < idle_num; i++) close(idle_fds[i]);
+    // Every message broadcast has the size of the ones sent.
+    delivered /= frame_size;
+
+    if (json_output) {
+        printf("{\"connections\": %d, \"idle\": %d, \"threads\": %d, "
+               "\"message_size\": %zu, \"duration\": %.3f, ",
+               conns_num, idle_num, threads_num, msg_size, elapsed);
+        printf("\"sent\": %lu, \"sent_rate\": %.0f, \"sent_mbps\": %.2f, "
+               "\"missed\": %lu, ", sent, sent / elapsed,
+               sent * frame_size / elapsed / 1e6, missed);
+        printf("\"received\": %lu, \"received_rate\": %.0f, "
+               "\"latency_us\": ", received, received / elapsed);
+        if (reply_size) print_latencies_json(latencies);
+        else printf("null");
+        printf(", \"churned\": %lu, \"churn_rate\": %.0f, "
+               "\"churn_lifetime_us\": ", churner.conns_churned,
+               churner.conns_churned / elapsed);
+        if (churner.conns_churned) print_latencies_json(churner.latencies);
+        else printf("null");
+        printf(", \"subscribers\": %d, \"delivered\": %lu, "
+               "\"disconnected\": %d}\n", subscribers_num, delivered,
+               disconnected);
+    }
+    else {
+        printf("Connections: %d, threads: %d, message size: %zu bytes, "
+               "duration: %.1f s\n", conns_num, threads_num, msg_size,
+               elapsed);
+        printf("Sent: %lu msgs (%.0f msgs/s, %.2f MB/s)\n", sent,
+               sent / elapsed, sent * frame_size / elapsed / 1e6);
+        if (missed) printf("Missed: %lu msgs (backlog full)\n", missed);
+        if (subscribers_num) {
+            printf("Delivered: %lu msgs to %d subscribers (%.0f msgs/s)\n",
+                   delivered, subscribers_num, delivered / elapsed);
+            if (disconnected) {
+                printf("Disconnected: %d subscribers\n", disconnected);
+            }
+        }
+        if (reply_size) {
+            printf("Received: %lu msgs (%.0f msgs/s)\n", received,
+                   received / elapsed);
+            printf("Latency (us): min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+                   "p99.9 %.1f, max %.1f, mean %.1f\n",
+                   latencies->total ? latencies->min / 1e3 : 0.0,
+                   histogram_percentile(latencies, 50) / 1e3,
+                   histogram_percentile(latencies, 90) / 1e3,
+                   histogram_percentile(latencies, 99) / 1e3,
+                   histogram_percentile(latencies, 99.9) / 1e3,
+                   latencies->max / 1e3,
+                   histogram_mean(latencies) / 1e3);
+        }
+        if (churner.conns_churned) {
+            printf("Churned: %lu conns (%.0f conns/s), lifetime (us): "
+                   "p50 %.1f, p99 %.1f\n", churner.conns_churned,
+                   churner.conns_churned / elapsed,
+                   histogram_percentile(churner.latencies, 50) / 1e3,
+                   histogram_percentile(churner.latencies, 99) / 1e3);
+        }
+    }
+
+    // Clean up resources.
+    for (int t = 0; t < threads_num; t++) {
+        for (int i = 0; i < threads[t].conns_num; i++) {
+            close(threads[t].conns[i].fd);
+            free(threads[t].conns[i].sent_times);
+        }
+        free(threads[t].conns);
+        histogram_destroy(threads[t].latencies);
+    }
+    histogram_destroy(latencies);
+    histogram_destroy(churner.latencies);
+    free(idle_fds);
+    free(threads);
+    free(tids);
+    free(send_buffer);
+}
+
+int main(int argc, char *argv[])
+{
+    int load_mode = 0;
+    int bulk_mode = 0;
+    int framed_input = 0;
+    const char *file = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "lc:t:s:r:w:d:eaB:i:n:jbf:PNO:")) != -1) {
+        switch (opt) {
+            case 'l': load_mode = 1; break;
+            case 'c': conns_num = atoi(optarg); break;
+            case 't': threads_num = atoi(optarg); break;
+            case 's': msg_size = (size_t) atol(optarg); break;
+            case 'r': target_rate = atof(optarg); break;
+            case 'w': window = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'e': expect_echo = 1; break;
+            case 'a': expect_ack = 1; break;
+            case 'B': subscribers_num = atoi(optarg); break;
+            case 'i': idle_num = atoi(optarg); break;
+            case 'n': churn_rate = atof(optarg); break;
+            case 'j': json_output = 1; break;
+            case 'b': bulk_mode = 1; break;
+            case 'f': file = optarg; break;
+            case 'P': framed_input = 1; break;
+            case 'N': line_mode = 1; break;
+            case 'O':
+                if (socket_options_parse(optarg, &sock_opts) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    // Unix domain socket addresses need no port.
+    const char *host = optind < argc ? argv[optind] : NULL;
+    size_t prefix = strlen(ENDPOINT_UNIX_PREFIX);
+    int unix_socket = host && strncmp(host, ENDPOINT_UNIX_PREFIX, prefix) == 0;
+    if (argc - optind < (unix_socket ? 1 : 2)) usage(argv[0]);
+    if (conns_num < 1 || threads_num < 1 || msg_size < 1 ||
+        msg_size > FRAME_MAX_PAYLOAD || window < 1 || subscribers_num < 0 ||
+        idle_num < 0 || churn_rate < 0) {
+        usage(argv[0]);
+    }
+
+    const char *port = unix_socket ? NULL : argv[optind + 1];
+
+    if (load_mode) {
+        run_load(host, port);
+        return 0;
+    }
+
+    int sockfd = connect_to_server(host, port);
+    if (framed_input) {
+        int in_fd = STDIN_FILENO;
+        if (file && (in_fd = open(file, O_RDONLY)) < 0) {
+            error("ERROR: Failed to open file");
+        }
+        run_raw(sockfd, in_fd);
+        if (file) close(in_fd);
+    }
+    else if (file) run_file(sockfd, file);
+    else if (bulk_mode) run_bulk(sockfd);
+    else run_interactive(sockfd);
+
+    // Finally, close the socket.
+    finish_connection(sockfd);
 
     return 0;
 }
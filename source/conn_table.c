@@ -0,0 +1,149 @@
+/**
+ * conn_table.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in conn_table.h.
+ *
+ * The kernel never hands out the same descriptor twice while it is open, so
+ * using it as index leaves no slot to allocate. Inserting and removing are a
+ * single atomic store each, plus an increment of a counter that is sharded
+ * by descriptor, so concurrent handlers rarely touch the same cache line.
+ * No lock and no allocation is involved, which also makes both of them safe
+ * to call from signal handlers.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "conn_table.h"
+
+
+static atomic_int *shard_of(conn_table_t *table, int fd);
+
+
+/**
+ * Creates a table for descriptors in range [0, capacity).
+ *
+ * Slots live in a single zeroed allocation, so pages of descriptors never
+ * used are never touched either.
+ */
+conn_table_t *conn_table_create(int capacity)
+{
+    conn_table_t *table =
+            (conn_table_t *) aligned_alloc(64, sizeof(conn_table_t));
+    if (!table) return NULL;
+
+    table->slots = (_Atomic(void *) *) calloc(capacity, sizeof(void *));
+    if (!table->slots) {
+        free(table);
+        return NULL;
+    }
+    table->capacity = capacity;
+    atomic_init(&table->high, 0);
+    for (int i = 0; i < CONN_TABLE_SHARDS; i++) {
+        atomic_init(&table->shards[i].count, 0);
+    }
+
+    return table;
+}
+
+void conn_table_destroy(conn_table_t *table)
+{
+    free((void *) table->slots);
+    free(table);
+}
+
+/**
+ * Adds an entry for given descriptor, with non-NULL data.
+ *
+ * Returns 0 on success, or -1 with errno set to ERANGE if descriptor is out
+ * of table's range, or to EEXIST if it is already in the table.
+ */
+int conn_table_insert(conn_table_t *table, int fd, void *data)
+{
+    if (fd < 0 || fd >= table->capacity) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    void *expected = NULL;
+    if (!atomic_compare_exchange_strong(&table->slots[fd], &expected, data)) {
+        errno = EEXIST;
+        return -1;
+    }
+    atomic_fetch_add(shard_of(table, fd), 1);
+
+    int high = atomic_load_explicit(&table->high, memory_order_relaxed);
+    while (high <= fd && !atomic_compare_exchange_weak(&table->high,
+                                                       &high, fd + 1));
+
+    return 0;
+}
+
+/**
+ * Removes the entry of given descriptor, returning its data, or NULL if no
+ * such entry exists.
+ */
+void *conn_table_remove(conn_table_t *table, int fd)
+{
+    if (fd < 0 || fd >= table->capacity) return NULL;
+
+    void *data = atomic_exchange(&table->slots[fd], NULL);
+    if (data) atomic_fetch_sub(shard_of(table, fd), 1);
+
+    return data;
+}
+
+/**
+ * Returns data of the entry of given descriptor, or NULL if no such entry
+ * exists.
+ */
+void *conn_table_get(conn_table_t *table, int fd)
+{
+    if (fd < 0 || fd >= table->capacity) return NULL;
+    return atomic_load(&table->slots[fd]);
+}
+
+/**
+ * Returns the lowest descriptor in the table, that is not less than fd, or
+ * -1 if there is none.
+ *
+ * All the entries get visited by:
+ *      int fd = conn_table_next(t, 0);
+ *      for (; fd >= 0; fd = conn_table_next(t, fd + 1)) ...
+ * which only scans slots up to the highest descriptor ever inserted.
+ */
+int conn_table_next(conn_table_t *table, int fd)
+{
+    if (fd < 0) fd = 0;
+    int high = atomic_load(&table->high);
+    for (; fd < high; fd++) {
+        if (atomic_load_explicit(&table->slots[fd], memory_order_relaxed)) {
+            return fd;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns the number of entries in the table.
+ *
+ * Shards are summed one by one, so the result is exact only when no entries
+ * get concurrently inserted.
+ */
+int conn_table_size(conn_table_t *table)
+{
+    int size = 0;
+    for (int i = 0; i < CONN_TABLE_SHARDS; i++) {
+        size += atomic_load(&table->shards[i].count);
+    }
+    return size;
+}
+
+static atomic_int *shard_of(conn_table_t *table, int fd)
+{
+    return &table->shards[fd % CONN_TABLE_SHARDS].count;
+}
@@ -0,0 +1,40 @@
+/**
+ * conn_table.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to create and manage a table
+ * of active connections, indexed by their descriptors.
+ *
+ */
+
+#ifndef CONN_TABLE_H
+#define CONN_TABLE_H
+
+#include <stdatomic.h>
+
+#define CONN_TABLE_SHARDS 16  // Counters of entries, one per cache line.
+
+typedef struct {
+    _Alignas(64) atomic_int count;
+} conn_table_shard_t;
+
+typedef struct {
+    _Atomic(void *) *slots;  // Data of each entry, NULL for free slots.
+    int capacity;            // Descriptors should be below this.
+    atomic_int high;         // Above any descriptor ever inserted.
+    conn_table_shard_t shards[CONN_TABLE_SHARDS];
+} conn_table_t;
+
+
+conn_table_t *conn_table_create(int capacity);
+void conn_table_destroy(conn_table_t *table);
+int conn_table_insert(conn_table_t *table, int fd, void *data);
+void *conn_table_remove(conn_table_t *table, int fd);
+void *conn_table_get(conn_table_t *table, int fd);
+int conn_table_next(conn_table_t *table, int fd);
+int conn_table_size(conn_table_t *table);
+
+#endif
@@ -0,0 +1,694 @@
+/**
+ * coro.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in coro.h.
+ *
+ * On x86-64, switching between coroutines only saves the registers a call
+ * has to preserve, along with the floating point control words, on the
+ * stack being left. Elsewhere, ucontext gets used instead.
+ *
+ * A coroutine about to wait only records what it waits for and switches
+ * back to its scheduler, which then registers it with epoll (oneshot). It
+ * is thus never resumed by another scheduler before it got suspended.
+ * Schedulers that run out of coroutines steal half of the run queue of a
+ * busy one, or else sleep in epoll, where descriptors turning ready wake up
+ * one of them.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include "coro.h"
+#ifdef CORO_TSAN
+#include <sanitizer/tsan_interface.h>
+#endif
+
+#define MAX_EVENTS 64
+
+
+static coro_t *acquire(coro_runtime_t *rt);
+static void release(coro_runtime_t *rt, coro_t *coro);
+static void init_context(coro_runtime_t *rt, coro_t *coro);
+static void switch_context(coro_context_t *from, coro_context_t *to);
+static void coro_main(coro_t *coro) __attribute__((used, noipa, noreturn));
+static void stop_schedulers(coro_runtime_t *rt, int started);
+static void free_runtime(coro_runtime_t *rt);
+static void *run_scheduler(void *args);
+static void run(coro_scheduler_t *sched, coro_t *coro);
+static void arm(coro_scheduler_t *sched, coro_t *coro);
+static void poll_events(coro_scheduler_t *sched, int timeout);
+static void push(coro_scheduler_t *sched, coro_t *first, coro_t *last,
+                 int count);
+static coro_t *pop(coro_scheduler_t *sched);
+static coro_t *steal(coro_scheduler_t *sched);
+static int any_queued(coro_runtime_t *rt);
+static void wake(coro_runtime_t *rt);
+static coro_scheduler_t *current_scheduler(void) __attribute__((noipa));
+static void set_errno(int err) __attribute__((noipa));
+
+static __thread coro_scheduler_t *current = NULL;  // Of scheduler threads.
+
+
+#ifndef CORO_UCONTEXT
+void coro_switch_context(coro_context_t *from, coro_context_t *to);
+void coro_trampoline(void);
+
+// New coroutines start at the trampoline, holding themselves in r12.
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    ".globl coro_switch_context\n"
+    ".hidden coro_switch_context\n"
+    ".type coro_switch_context, @function\n"
+    "coro_switch_context:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size coro_switch_context, .-coro_switch_context\n"
+    ".p2align 4\n"
+    ".globl coro_trampoline\n"
+    ".hidden coro_trampoline\n"
+    ".type coro_trampoline, @function\n"
+    "coro_trampoline:\n"
+    "    movq %r12, %rdi\n"
+    "    call coro_main\n"
+    "    ud2\n"
+    ".size coro_trampoline, .-coro_trampoline\n"
+);
+#else
+static void coro_entry(unsigned int high, unsigned int low);
+#endif
+
+
+/**
+ * Parses the stack size of coroutines, in bytes, from given argument. It
+ * may not be less than a page, nor than CORO_MIN_STACK_SIZE.
+ *
+ * Returns 0 on success, or -1 if argument is not a valid size with errno
+ * set.
+ */
+int coro_parse_stack_size(const char *arg, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno != 0 || !isdigit((unsigned char) *arg) || *end != '\0' ||
+        value > SIZE_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (value < (size_t) sysconf(_SC_PAGESIZE) ||
+        value < CORO_MIN_STACK_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *size = (size_t) value;
+    return 0;
+}
+
+/**
+ * Starts given number of scheduler threads, running coroutines with stacks
+ * of given size, at least CORO_MIN_STACK_SIZE. Init and fini, that may be
+ * NULL, get called by every scheduler thread when it starts and right
+ * before it exits respectively.
+ *
+ * Returns NULL on failure, with errno set.
+ */
+coro_runtime_t *coro_runtime_create(int scheds_num, size_t stack_size,
+                                    coro_hook_t init, coro_hook_t fini)
+{
+    if (scheds_num < 1) scheds_num = 1;
+    if (stack_size < CORO_MIN_STACK_SIZE) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    coro_runtime_t *rt = (coro_runtime_t *) calloc(1, sizeof(coro_runtime_t));
+    if (!rt) return NULL;
+
+    // Stack, rounded to pages, plus a guard page below it.
+    rt->page_size = (size_t) sysconf(_SC_PAGESIZE);
+    rt->mapping_size = (stack_size + rt->page_size - 1) / rt->page_size *
+                       rt->page_size + rt->page_size;
+    rt->stack_size = stack_size;
+    rt->init = init;
+    rt->fini = fini;
+    pthread_mutex_init(&rt->pool_mutex, NULL);
+
+    rt->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    rt->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  // Marks wake_fd.
+    rt->scheds = (coro_scheduler_t *) calloc(scheds_num,
+                                             sizeof(coro_scheduler_t));
+    if (rt->epoll_fd < 0 || rt->wake_fd < 0 || !rt->scheds ||
+        epoll_ctl(rt->epoll_fd, EPOLL_CTL_ADD, rt->wake_fd, &ev) < 0) {
+        int err = errno;
+        if (rt->epoll_fd >= 0) close(rt->epoll_fd);
+        if (rt->wake_fd >= 0) close(rt->wake_fd);
+        free(rt->scheds);
+        free(rt);
+        errno = err;
+        return NULL;
+    }
+
+    rt->scheds_num = scheds_num;
+    for (int i = 0; i < scheds_num; i++) {
+        rt->scheds[i].rt = rt;
+        pthread_mutex_init(&rt->scheds[i].mutex, NULL);
+    }
+    for (int i = 0; i < scheds_num; i++) {
+        coro_scheduler_t *sched = &rt->scheds[i];
+        if (pthread_create(&sched->thread, NULL, run_scheduler, sched) != 0) {
+            stop_schedulers(rt, i);
+            free_runtime(rt);
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+
+    return rt;
+}
+
+/**
+ * Waits for all coroutines to return, stops the schedulers and frees the
+ * runtime.
+ */
+void coro_runtime_destroy(coro_runtime_t *rt)
+{
+    stop_schedulers(rt, rt->scheds_num);
+    free_runtime(rt);
+}
+
+/**
+ * Starts a new coroutine, calling fn with given arg. May be called from any
+ * thread.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int coro_spawn(coro_runtime_t *rt, coro_fn_t fn, void *arg)
+{
+    coro_t *coro = acquire(rt);
+    if (!coro) return -1;
+    coro->fn = fn;
+    coro->arg = arg;
+    coro->state = CORO_READY;
+    init_context(rt, coro);
+#ifdef CORO_TSAN
+    coro->ctx.fiber = __tsan_create_fiber(0);
+#endif
+
+    atomic_fetch_add(&rt->live, 1);
+    unsigned s = atomic_fetch_add(&rt->next_sched, 1) % rt->scheds_num;
+    push(&rt->scheds[s], coro, coro, 1);
+    if (atomic_load(&rt->sleeping) > 0) wake(rt);
+    return 0;
+}
+
+/**
+ * Suspends the calling coroutine till given non-blocking descriptor reports
+ * any of given epoll events, or an error or hang up.
+ *
+ * Returns 0 once it does, or -1 with errno set if it cannot be waited for.
+ */
+int coro_wait_fd(int fd, uint32_t events)
+{
+    coro_scheduler_t *sched = current_scheduler();
+    coro_t *coro = sched->running;
+    coro->wait_fd = fd;
+    coro->wait_events = events;
+    coro->wait_error = 0;
+    coro->state = CORO_WAITING;
+    switch_context(&coro->ctx, &sched->ctx);
+
+    // May be running on another scheduler by now.
+    if (coro->wait_error) {
+        set_errno(coro->wait_error);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Suspends the calling coroutine for given time, letting its scheduler run
+ * others meanwhile. The coroutine waits on a timer descriptor of its own,
+ * only kept while sleeping.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int coro_sleep(uint64_t ns)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t) (ns / 1000000000);
+    its.it_value.tv_nsec = (long) (ns % 1000000000);
+    if (ns == 0) its.it_value.tv_nsec = 1;  // Zero would disarm it.
+
+    int rc = timerfd_settime(fd, 0, &its, NULL);
+    if (rc == 0) rc = coro_wait_fd(fd, EPOLLIN);
+    close(fd);  // Also removes it from the epoll set.
+    return rc < 0 ? -1 : 0;
+}
+
+/**
+ * Lets the scheduler of the calling coroutine run others, before resuming
+ * it.
+ */
+void coro_yield(void)
+{
+    coro_scheduler_t *sched = current_scheduler();
+    coro_t *coro = sched->running;
+    coro->state = CORO_READY;
+    switch_context(&coro->ctx, &sched->ctx);
+}
+
+/**
+ * Returns whether the last call of the calling thread failed only because
+ * its non-blocking descriptor was not ready. Code running on coroutines
+ * should check errno through this, as a coroutine may have moved to another
+ * thread since an inlined access to errno looked its address up.
+ */
+int coro_would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+/**
+ * Returns a coroutine whose stack is not in use, reusing one of the pool,
+ * or NULL on failure with errno set.
+ */
+static coro_t *acquire(coro_runtime_t *rt)
+{
+    pthread_mutex_lock(&rt->pool_mutex);
+    coro_t *coro = rt->pool;
+    if (coro) {
+        rt->pool = coro->next;
+        rt->pool_size--;
+    }
+    pthread_mutex_unlock(&rt->pool_mutex);
+    if (coro) return coro;
+
+    // Pages get backed only once touched.
+    char *mapping = (char *) mmap(NULL, rt->mapping_size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK |
+                                  MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) return NULL;
+    if (mprotect(mapping, rt->page_size, PROT_NONE) < 0) {
+        int err = errno;
+        munmap(mapping, rt->mapping_size);
+        errno = err;
+        return NULL;
+    }
+
+    uintptr_t top = (uintptr_t) (mapping + rt->mapping_size - sizeof(coro_t));
+    coro = (coro_t *) (top & ~(uintptr_t) 63);
+    coro->mapping = mapping;
+    return coro;
+}
+
+/**
+ * Keeps the stack of a coroutine done for reuse, unless the pool is full.
+ */
+static void release(coro_runtime_t *rt, coro_t *coro)
+{
+    pthread_mutex_lock(&rt->pool_mutex);
+    if (rt->pool_size < CORO_POOL_MAX) {
+        coro->next = rt->pool;
+        rt->pool = coro;
+        rt->pool_size++;
+        coro = NULL;
+    }
+    pthread_mutex_unlock(&rt->pool_mutex);
+
+    if (coro) munmap(coro->mapping, rt->mapping_size);
+}
+
+/**
+ * Prepares the context of a coroutine, so that switching to it enters
+ * coro_main() at the top of its stack.
+ */
+static void init_context(coro_runtime_t *rt, coro_t *coro)
+{
+    char *top = (char *) ((uintptr_t) coro & ~(uintptr_t) 15);
+
+#ifndef CORO_UCONTEXT
+    (void) rt;
+
+    // Laid out as coro_switch_context() leaves a suspended stack, returning
+    // to the trampoline with the stack 16 bytes aligned, as calls expect.
+    void **sp = (void **) (top - 16);
+    *--sp = (void *) coro_trampoline;
+    *--sp = NULL;           // rbp
+    *--sp = NULL;           // rbx
+    *--sp = (void *) coro;  // r12
+    *--sp = NULL;           // r13
+    *--sp = NULL;           // r14
+    *--sp = NULL;           // r15
+    // Default MXCSR, followed by default x87 control word.
+    *--sp = (void *) (0x1F80UL | (0x037FUL << 32));
+    coro->ctx.sp = (void *) sp;
+#else
+    char *bottom = coro->mapping + rt->page_size;
+    getcontext(&coro->ctx.uc);
+    coro->ctx.uc.uc_stack.ss_sp = bottom;
+    coro->ctx.uc.uc_stack.ss_size = (size_t) (top - bottom);
+    coro->ctx.uc.uc_link = NULL;
+    uintptr_t ptr = (uintptr_t) coro;
+    makecontext(&coro->ctx.uc, (void (*)(void)) coro_entry, 2,
+                (unsigned int) (ptr >> 32), (unsigned int) ptr);
+#endif
+}
+
+/**
+ * Suspends the running context into from and resumes the one in to.
+ */
+static void switch_context(coro_context_t *from, coro_context_t *to)
+{
+#ifdef CORO_TSAN
+    __tsan_switch_to_fiber(to->fiber, 0);
+#endif
+#ifndef CORO_UCONTEXT
+    coro_switch_context(from, to);
+#else
+    swapcontext(&from->uc, &to->uc);
+#endif
+}
+
+#ifdef CORO_UCONTEXT
+/**
+ * Entry point of coroutines under ucontext, which only passes ints.
+ */
+static void coro_entry(unsigned int high, unsigned int low)
+{
+    coro_main((coro_t *) (((uintptr_t) high << 32) | low));
+}
+#endif
+
+/**
+ * Runs the function of a coroutine, and hands it back to its scheduler for
+ * good once it returns.
+ */
+static void coro_main(coro_t *coro)
+{
+    coro->fn(coro->arg);
+    coro->state = CORO_DONE;
+    switch_context(&coro->ctx, &current_scheduler()->ctx);
+    __builtin_unreachable();
+}
+
+/**
+ * Waits for all coroutines to return and stops the first started scheduler
+ * threads.
+ */
+static void stop_schedulers(coro_runtime_t *rt, int started)
+{
+    atomic_store(&rt->stopping, 1);
+    if (atomic_load(&rt->live) == 0) wake(rt);
+    for (int i = 0; i < started; i++) {
+        pthread_join(rt->scheds[i].thread, NULL);
+    }
+}
+
+static void free_runtime(coro_runtime_t *rt)
+{
+    while (rt->pool) {
+        coro_t *coro = rt->pool;
+        rt->pool = coro->next;
+        munmap(coro->mapping, rt->mapping_size);
+    }
+    for (int i = 0; i < rt->scheds_num; i++) {
+        pthread_mutex_destroy(&rt->scheds[i].mutex);
+    }
+    pthread_mutex_destroy(&rt->pool_mutex);
+    close(rt->epoll_fd);
+    close(rt->wake_fd);
+    free(rt->scheds);
+    free(rt);
+}
+
+/**
+ * Entry point of scheduler threads.
+ */
+static void *run_scheduler(void *args)
+{
+    coro_scheduler_t *sched = (coro_scheduler_t *) args;
+    coro_runtime_t *rt = sched->rt;
+    current = sched;
+#ifdef CORO_TSAN
+    sched->ctx.fiber = __tsan_get_current_fiber();
+#endif
+    if (rt->init) rt->init();
+
+    unsigned runs = 0;
+    while (1) {
+        coro_t *coro = pop(sched);
+        if (!coro) coro = steal(sched);
+        if (coro) {
+            run(sched, coro);
+            // Keep an eye on descriptors turning ready, even while busy.
+            if (++runs % CORO_POLL_INTERVAL == 0) poll_events(sched, 0);
+            continue;
+        }
+        if (atomic_load(&rt->stopping) && atomic_load(&rt->live) == 0) break;
+
+        // Announce sleeping before the last look at run queues, so that
+        // whoever queues a coroutine meanwhile wakes us up.
+        atomic_fetch_add(&rt->sleeping, 1);
+        poll_events(sched, any_queued(rt) ? 0 : -1);
+        atomic_fetch_sub(&rt->sleeping, 1);
+    }
+
+    if (rt->fini) rt->fini();
+    return NULL;
+}
+
+/**
+ * Runs a coroutine till it waits, yields or returns.
+ */
+static void run(coro_scheduler_t *sched, coro_t *coro)
+{
+    coro_runtime_t *rt = sched->rt;
+
+    sched->running = coro;
+    switch_context(&sched->ctx, &coro->ctx);
+    sched->running = NULL;
+
+    switch (coro->state) {
+        case CORO_WAITING:
+            arm(sched, coro);
+            break;
+        case CORO_READY:
+            push(sched, coro, coro, 1);
+            break;
+        case CORO_DONE:
+#ifdef CORO_TSAN
+            __tsan_destroy_fiber(coro->ctx.fiber);
+#endif
+            release(rt, coro);
+            if (atomic_fetch_sub(&rt->live, 1) == 1 &&
+                atomic_load(&rt->stopping)) {
+                wake(rt);
+            }
+            break;
+    }
+}
+
+/**
+ * Registers a suspended coroutine for the descriptor it waits for, or
+ * resumes it with an error if that fails.
+ */
+static void arm(coro_scheduler_t *sched, coro_t *coro)
+{
+    int epoll_fd = sched->rt->epoll_fd;
+    int fd = coro->wait_fd;
+    struct epoll_event ev;
+    ev.events = coro->wait_events | EPOLLONESHOT;
+    ev.data.ptr = coro;
+#ifdef CORO_TSAN
+    // Handing it over through epoll orders it, unknown to ThreadSanitizer.
+    __tsan_release(coro);
+#endif
+
+    // Descriptors stay registered, disarmed, between waits.
+    int rc = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+    if (rc < 0 && errno == ENOENT) {
+        rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    if (rc < 0) {
+        coro->wait_error = errno;
+        coro->state = CORO_READY;
+        push(sched, coro, coro, 1);
+    }
+}
+
+/**
+ * Waits up to timeout ms (-1 for ever) for descriptors to turn ready,
+ * queuing the coroutines waiting for them.
+ */
+static void poll_events(coro_scheduler_t *sched, int timeout)
+{
+    coro_runtime_t *rt = sched->rt;
+    struct epoll_event events[MAX_EVENTS];
+
+    int n = epoll_wait(rt->epoll_fd, events, MAX_EVENTS, timeout);
+    int ready = 0;
+    for (int i = 0; i < n; i++) {
+        coro_t *coro = (coro_t *) events[i].data.ptr;
+        if (coro) {
+#ifdef CORO_TSAN
+            __tsan_acquire(coro);
+#endif
+            push(sched, coro, coro, 1);
+            ready++;
+            continue;
+        }
+
+        // Once stopping for good, leave it signaled for every scheduler.
+        if (!atomic_load(&rt->stopping) || atomic_load(&rt->live) > 0) {
+            uint64_t val;
+            ssize_t rc = read(rt->wake_fd, &val, sizeof(val));
+            (void) rc;
+        }
+    }
+
+    // Let schedulers sleeping meanwhile share the work.
+    if (ready > 1 && atomic_load(&rt->sleeping) > 0) wake(rt);
+}
+
+/**
+ * Appends a chain of count coroutines to the run queue of a scheduler.
+ */
+static void push(coro_scheduler_t *sched, coro_t *first, coro_t *last,
+                 int count)
+{
+    last->next = NULL;
+    pthread_mutex_lock(&sched->mutex);
+    if (sched->tail) sched->tail->next = first;
+    else sched->head = first;
+    sched->tail = last;
+    atomic_fetch_add(&sched->queued, count);
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+/**
+ * Removes the first coroutine of the run queue of a scheduler.
+ *
+ * Returns it, or NULL if the queue is empty.
+ */
+static coro_t *pop(coro_scheduler_t *sched)
+{
+    if (atomic_load(&sched->queued) == 0) return NULL;
+
+    pthread_mutex_lock(&sched->mutex);
+    coro_t *coro = sched->head;
+    if (coro) {
+        sched->head = coro->next;
+        if (!sched->head) sched->tail = NULL;
+        atomic_fetch_sub(&sched->queued, 1);
+    }
+    pthread_mutex_unlock(&sched->mutex);
+
+    return coro;
+}
+
+/**
+ * Takes half of the run queue of the first other scheduler found with a
+ * non-empty one, queuing all but the first coroutine taken on sched.
+ *
+ * Returns the first coroutine taken, or NULL if there was none.
+ */
+static coro_t *steal(coro_scheduler_t *sched)
+{
+    coro_runtime_t *rt = sched->rt;
+    int self = (int) (sched - rt->scheds);
+
+    for (int i = 1; i < rt->scheds_num; i++) {
+        coro_scheduler_t *victim = &rt->scheds[(self + i) % rt->scheds_num];
+        if (atomic_load(&victim->queued) == 0) continue;
+
+        pthread_mutex_lock(&victim->mutex);
+        int take = (atomic_load(&victim->queued) + 1) / 2;
+        coro_t *first = victim->head;
+        coro_t *last = first;
+        if (first) {
+            for (int t = 1; t < take; t++) last = last->next;
+            victim->head = last->next;
+            if (!victim->head) victim->tail = NULL;
+            atomic_fetch_sub(&victim->queued, take);
+        }
+        pthread_mutex_unlock(&victim->mutex);
+        if (!first) continue;
+
+        if (first != last) push(sched, first->next, last, take - 1);
+        return first;
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns whether any scheduler has coroutines ready to run.
+ */
+static int any_queued(coro_runtime_t *rt)
+{
+    for (int i = 0; i < rt->scheds_num; i++) {
+        if (atomic_load(&rt->scheds[i].queued) > 0) return 1;
+    }
+    return 0;
+}
+
+static void wake(coro_runtime_t *rt)
+{
+    uint64_t val = 1;
+    ssize_t rc = write(rt->wake_fd, &val, sizeof(val));
+    (void) rc;
+}
+
+/**
+ * Returns the scheduler of the calling thread. Never inlined, so that it
+ * gets looked up again after a coroutine got resumed, maybe elsewhere.
+ */
+static coro_scheduler_t *current_scheduler(void)
+{
+    return current;
+}
+
+static void set_errno(int err)
+{
+    errno = err;
+}
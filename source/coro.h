@@ -0,0 +1,122 @@
+/**
+ * coro.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to run many coroutines over
+ * a few scheduler threads. Coroutines are written in blocking style, but
+ * wait for their non-blocking descriptors through coro_wait_fd(), letting
+ * their scheduler run others meanwhile. Idle schedulers steal coroutines
+ * ready to run from busy ones.
+ *
+ * A coroutine may resume on another thread than the one it waited on, so
+ * code running on coroutines should not keep pointers to thread locals, nor
+ * read errno, across waits. Thread locals got through a function that is
+ * not inlined are fine, as is coro_would_block().
+ *
+ */
+
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#if !defined(__x86_64__) && !defined(CORO_UCONTEXT)
+#define CORO_UCONTEXT  // Fall back to ucontext on other architectures.
+#endif
+#ifdef CORO_UCONTEXT
+#include <ucontext.h>
+#endif
+#ifdef __SANITIZE_THREAD__
+#define CORO_TSAN  // Tell ThreadSanitizer about every switch of stacks.
+#endif
+
+#define CORO_STACK_SIZE (64 * 1024)  // Default stack size of coroutines.
+#define CORO_MIN_STACK_SIZE (16 * 1024)
+#define CORO_POOL_MAX 1024    // Stacks kept for reuse, beyond that unmapped.
+#define CORO_POLL_INTERVAL 64 // Coroutines run between polls for events.
+
+typedef void (*coro_fn_t)(void *arg);
+typedef void (*coro_hook_t)(void);
+
+// Saved registers of a suspended coroutine or scheduler.
+typedef struct {
+#ifdef CORO_UCONTEXT
+    ucontext_t uc;
+#else
+    void *sp;  // Stack pointer, with the rest pushed on the stack.
+#endif
+#ifdef CORO_TSAN
+    void *fiber;
+#endif
+} coro_context_t;
+
+typedef enum {
+    CORO_READY,    // Runnable, in a run queue.
+    CORO_WAITING,  // Waiting for a descriptor.
+    CORO_DONE      // Returned, its stack may be reused.
+} coro_state_t;
+
+struct coro_runtime;
+
+// A coroutine along with its stack, which is a single mapping, with the
+// coroutine at its top and a guard page at its bottom.
+typedef struct coro {
+    coro_context_t ctx;
+    coro_fn_t fn;
+    void *arg;
+    coro_state_t state;
+    int wait_fd;           // Descriptor waited for.
+    uint32_t wait_events;  // Epoll events waited for.
+    int wait_error;        // Errno of a failed wait, 0 if none.
+    char *mapping;
+    struct coro *next;     // Next one in a run queue or in the pool.
+} coro_t;
+
+typedef struct {
+    struct coro_runtime *rt;
+    pthread_t thread;
+    coro_context_t ctx;    // Context of the loop, coroutines return to.
+    coro_t *running;       // Coroutine being run, NULL if none.
+    pthread_mutex_t mutex; // Guards run queue.
+    coro_t *head;          // Run queue.
+    coro_t *tail;
+    atomic_int queued;     // Length of run queue.
+} coro_scheduler_t;
+
+typedef struct coro_runtime {
+    coro_scheduler_t *scheds;
+    int scheds_num;
+    int epoll_fd;          // Descriptors waited for, shared by schedulers.
+    int wake_fd;           // Wakes up sleeping schedulers.
+    size_t stack_size;
+    size_t page_size;
+    size_t mapping_size;   // Bytes of the mapping of every coroutine.
+    coro_hook_t init;      // Called by every scheduler thread on start.
+    coro_hook_t fini;      // Called by every scheduler thread on exit.
+    pthread_mutex_t pool_mutex;
+    coro_t *pool;          // Coroutines done, whose stacks get reused.
+    int pool_size;
+    atomic_uint next_sched;  // Scheduler the next coroutine goes to.
+    atomic_int sleeping;     // Schedulers waiting for events.
+    atomic_int live;         // Coroutines not done yet.
+    atomic_int stopping;
+} coro_runtime_t;
+
+
+int coro_parse_stack_size(const char *arg, size_t *size);
+coro_runtime_t *coro_runtime_create(int scheds_num, size_t stack_size,
+                                    coro_hook_t init, coro_hook_t fini);
+void coro_runtime_destroy(coro_runtime_t *rt);
+int coro_spawn(coro_runtime_t *rt, coro_fn_t fn, void *arg);
+int coro_wait_fd(int fd, uint32_t events);
+int coro_sleep(uint64_t ns);
+void coro_yield(void);
+int coro_would_block(void);
+
+#endif
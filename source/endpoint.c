@@ -0,0 +1,325 @@
+/**
+ * endpoint.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in endpoint.h.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "endpoint.h"
+
+
+static int unix_endpoint(const char *path, endpoint_t *ep);
+static struct addrinfo *resolve(const char *host, const char *port,
+                                int passive);
+static void copy_address(endpoint_t *ep, const struct addrinfo *ai);
+
+
+/**
+ * Parses the address a server should listen on. It may be given as a bare
+ * port, for all IPv4 interfaces, as "host:port", with IPv6 hosts in brackets
+ * (e.g. "[::]:port" for all interfaces, over both IPv4 and IPv6), or as a
+ * Unix domain socket address.
+ *
+ * Returns 0 on success, or -1 with errno set to EINVAL if spec is malformed,
+ * or to ENXIO if its host cannot be resolved.
+ */
+int endpoint_parse(const char *spec, endpoint_t *ep)
+{
+    size_t prefix = strlen(ENDPOINT_UNIX_PREFIX);
+    if (strncmp(spec, ENDPOINT_UNIX_PREFIX, prefix) == 0) {
+        return unix_endpoint(spec + prefix, ep);
+    }
+
+    char host[256];
+    const char *port = spec;
+    const char *colon = strrchr(spec, ':');
+    if (!colon) strcpy(host, "0.0.0.0");
+    else {
+        const char *start = spec;
+        const char *end = colon;
+        if (spec[0] == '[') {
+            start++;
+            end--;
+            if (end < start || *end != ']') {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        else if (strchr(spec, ':') != colon) {
+            errno = EINVAL;  // IPv6 hosts need brackets.
+            return -1;
+        }
+
+        size_t len = (size_t) (end - start);
+        if (len == 0 || len >= sizeof(host)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(host, start, len);
+        host[len] = '\0';
+        port = colon + 1;
+    }
+
+    return endpoint_resolve(host, port, 1, ep);
+}
+
+/**
+ * Resolves given host and port into the first address found for them. Host
+ * may also be a Unix domain socket address, in which case port is ignored.
+ * Passive addresses are meant to be listened on.
+ *
+ * Returns 0 on success, or -1 with errno set to EINVAL if port is invalid,
+ * or to ENXIO if host cannot be resolved.
+ */
+int endpoint_resolve(const char *host, const char *port, int passive,
+                     endpoint_t *ep)
+{
+    size_t prefix = strlen(ENDPOINT_UNIX_PREFIX);
+    if (strncmp(host, ENDPOINT_UNIX_PREFIX, prefix) == 0) {
+        return unix_endpoint(host + prefix, ep);
+    }
+
+    struct addrinfo *res = resolve(host, port, passive);
+    if (!res) return -1;
+    copy_address(ep, res);
+    freeaddrinfo(res);
+    return 0;
+}
+
+/**
+ * Opens a new connection to given endpoint, tuned by given options, that
+ * may be NULL.
+ *
+ * Returns the descriptor of the connection, or -1 with errno set.
+ */
+int endpoint_connect(const endpoint_t *ep, const socket_options_t *opts)
+{
+    int fd = socket(ep->family, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    // Buffer sizes have to be set before connecting, so that TCP window
+    // scaling gets negotiated for them.
+    if ((opts && socket_options_apply(fd, ep->family, opts) < 0) ||
+        connect(fd, (const struct sockaddr *) &ep->addr, ep->addr_len) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Opens a new connection to given host and port, trying every address they
+ * resolve to, till one accepts it. The address connected to gets stored
+ * into ep, so that more connections may be opened to it.
+ *
+ * Returns the descriptor of the connection, or -1 with errno set.
+ */
+int endpoint_dial(const char *host, const char *port,
+                  const socket_options_t *opts, endpoint_t *ep)
+{
+    size_t prefix = strlen(ENDPOINT_UNIX_PREFIX);
+    if (strncmp(host, ENDPOINT_UNIX_PREFIX, prefix) == 0) {
+        if (unix_endpoint(host + prefix, ep) < 0) return -1;
+        return endpoint_connect(ep, opts);
+    }
+
+    struct addrinfo *res = resolve(host, port, 0);
+    if (!res) return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        copy_address(ep, ai);
+        fd = endpoint_connect(ep, opts);
+    }
+
+    int err = errno;
+    freeaddrinfo(res);
+    errno = err;
+    return fd;
+}
+
+/**
+ * Parses a comma separated list of socket options into opts. Accepted ones
+ * are "nodelay", "quickack", "defer=seconds", "rcvbuf=bytes" and
+ * "sndbuf=bytes". Spec gets modified while parsing.
+ *
+ * Returns 0 on success, or -1 with errno set to EINVAL if an option is
+ * unknown or lacks a valid value.
+ */
+int socket_options_parse(char *spec, socket_options_t *opts)
+{
+    enum { NODELAY, QUICKACK, DEFER, RCVBUF, SNDBUF };
+    char *const names[] = {
+        "nodelay", "quickack", "defer", "rcvbuf", "sndbuf", NULL
+    };
+
+    while (*spec != '\0') {
+        char *value;
+        int opt = getsubopt(&spec, names, &value);
+        if (opt < 0 || (opt >= DEFER) != (value != NULL)) {
+            errno = EINVAL;
+            return -1;
+        }
+        int n = value ? atoi(value) : 1;
+        if (n <= 0) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        switch (opt) {
+            case NODELAY: opts->nodelay = 1; break;
+            case QUICKACK: opts->quickack = 1; break;
+            case DEFER: opts->defer_accept = n; break;
+            case RCVBUF: opts->rcvbuf = n; break;
+            case SNDBUF: opts->sndbuf = n; break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Sets the options of a socket of given family, other than the ones
+ * specific to listeners. TCP options get skipped on Unix domain sockets.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int socket_options_apply(int fd, int family, const socket_options_t *opts)
+{
+    int on = 1;
+
+    if (opts->rcvbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+                                       &opts->rcvbuf, sizeof(int)) < 0) {
+        return -1;
+    }
+    if (opts->sndbuf > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+                                       &opts->sndbuf, sizeof(int)) < 0) {
+        return -1;
+    }
+    if (family == AF_UNIX) return 0;
+
+    if (opts->nodelay &&
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        return -1;
+    }
+    if (opts->quickack &&
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on)) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Sets the options of a TCP connection that it did not inherit from its
+ * listener. Opts may be NULL. Failures are ignored, as connections work
+ * without them.
+ */
+void socket_options_accepted(int fd, const socket_options_t *opts)
+{
+    int on = 1;
+    if (opts && opts->quickack) {
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+}
+
+/**
+ * Fills ep with a Unix domain socket address. Paths starting with '@' name
+ * sockets in the abstract namespace.
+ *
+ * Returns 0 on success, or -1 with errno set to EINVAL if path is empty or
+ * to ENAMETOOLONG if it does not fit.
+ */
+static int unix_endpoint(const char *path, endpoint_t *ep)
+{
+    struct sockaddr_un *addr = (struct sockaddr_un *) &ep->addr;
+    size_t len = strlen(path);
+
+    if (len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(ep, 0, sizeof(endpoint_t));
+    ep->family = AF_UNIX;
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, len);
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        ep->addr_len = (socklen_t) (offsetof(struct sockaddr_un, sun_path) +
+                                    len);
+    }
+    else {
+        ep->addr_len = (socklen_t) sizeof(struct sockaddr_un);
+    }
+
+    return 0;
+}
+
+/**
+ * Looks up the addresses of given TCP host and port.
+ *
+ * Returns a list to be freed through freeaddrinfo(), or NULL with errno set
+ * to EINVAL if port is invalid, or to ENXIO if host cannot be resolved.
+ */
+static struct addrinfo *resolve(const char *host, const char *port,
+                                int passive)
+{
+    // Numeric ports would otherwise get truncated silently.
+    char *end;
+    long num = strtol(port, &end, 10);
+    if (*port == '\0' ||
+        (isdigit((unsigned char) *port) && (*end != '\0' || num > 65535))) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    struct addrinfo *res;
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc == 0) return res;
+
+    if (rc == EAI_SERVICE) errno = EINVAL;
+    else if (rc != EAI_SYSTEM) errno = ENXIO;
+    return NULL;
+}
+
+/**
+ * Copies a resolved address into ep.
+ */
+static void copy_address(endpoint_t *ep, const struct addrinfo *ai)
+{
+    memset(ep, 0, sizeof(endpoint_t));
+    ep->family = ai->ai_family;
+    memcpy(&ep->addr, ai->ai_addr, ai->ai_addrlen);
+    ep->addr_len = ai->ai_addrlen;
+}
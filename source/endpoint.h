@@ -0,0 +1,52 @@
+/**
+ * endpoint.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines shared by client and servers in order
+ * to parse the addresses they talk over, either TCP ones (IPv4 or IPv6) or
+ * Unix domain socket ones, and to tune their sockets.
+ *
+ * Unix domain socket addresses are written as "unix:path", or as
+ * "unix:@name" for the abstract namespace.
+ *
+ */
+
+#ifndef ENDPOINT_H
+#define ENDPOINT_H
+
+#include <sys/socket.h>
+
+#define ENDPOINT_UNIX_PREFIX "unix:"
+
+typedef struct {
+    int family;  // AF_INET, AF_INET6 or AF_UNIX.
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} endpoint_t;
+
+// Options of TCP sockets. Only the buffer sizes apply to Unix domain ones.
+typedef struct {
+    int nodelay;       // Send small writes at once (TCP_NODELAY).
+    int quickack;      // Ack data at once (TCP_QUICKACK). The kernel may
+                       // return to delayed acks later on.
+    int defer_accept;  // Seconds a listener waits for data of a new
+                       // connection before reporting it (TCP_DEFER_ACCEPT).
+    int rcvbuf;        // Bytes of receive buffer (SO_RCVBUF), 0 for default.
+    int sndbuf;        // Bytes of send buffer (SO_SNDBUF), 0 for default.
+} socket_options_t;
+
+
+int endpoint_parse(const char *spec, endpoint_t *ep);
+int endpoint_resolve(const char *host, const char *port, int passive,
+                     endpoint_t *ep);
+int endpoint_connect(const endpoint_t *ep, const socket_options_t *opts);
+int endpoint_dial(const char *host, const char *port,
+                  const socket_options_t *opts, endpoint_t *ep);
+int socket_options_parse(char *spec, socket_options_t *opts);
+int socket_options_apply(int fd, int family, const socket_options_t *opts);
+void socket_options_accepted(int fd, const socket_options_t *opts);
+
+#endif
@@ -0,0 +1,534 @@
+/**
+ * event_loop.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in event_loop.h.
+ *
+ * Every loop owns an epoll instance. Client sockets are non-blocking and
+ * registered edge-triggered, so they are drained until EAGAIN on every
+ * notification. The listener may be shared by many loops. It is registered
+ * level-triggered with EPOLLEXCLUSIVE, so a new connection wakes up only one
+ * of them. Connections may also be delivered by another process over a
+ * Unix domain socket channel, using SCM_RIGHTS.
+ *
+ * When replying to frames, connections are only watched for writing while
+ * some replies wait for the socket to take them. Once too many of them wait,
+ * the connection stops being read, until the peer reads its replies.
+ *
+ * When timing connections out, epoll_wait() returns once per tick of the
+ * wheel at least, while there are connections. Their timers are not moved
+ * on reads, but once they expire, the way the reaper of timeouts.h does.
+ *
+ * When admitting connections, the ones exceeding admission limits get shed
+ * as soon as the loop takes them over, whether accepted by the loop itself
+ * or received over its channel.
+ *
+ * When limiting rates, a connection exceeding its limits stops being read
+ * until a timer of its own fires on a finer wheel, without being left out
+ * of epoll. As it is edge-triggered, the events it gets meanwhile are
+ * ignored, and it gets drained once resumed.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "event_loop.h"
+#include "fd_passing.h"
+#include "listener.h"
+#include "admission.h"
+
+
+#define MAX_EVENTS 256    // Events fetched by a single epoll_wait().
+#define ACCEPT_BATCH 64   // Connections accepted per listener wake-up.
+
+
+static void accept_connections(event_loop_t *loop);
+static void receive_connections(event_loop_t *loop);
+static void register_connection(event_loop_t *loop, int fd);
+static int read_connection(event_loop_t *loop, connection_t *conn);
+static int throttle(event_loop_t *loop, connection_t *conn, size_t bytes,
+                    uint64_t msgs);
+static int write_connection(event_loop_t *loop, connection_t *conn);
+static void watch_writes(event_loop_t *loop, connection_t *conn, int on);
+static void close_connection(event_loop_t *loop, connection_t *conn);
+static void expire_connection(wheel_timer_t *timer, void *arg);
+static void resume_connection(wheel_timer_t *timer, void *arg);
+static int next_timeout(event_loop_t *loop, int timing);
+static void begin_termination(event_loop_t *loop);
+
+
+event_loop_t *event_loop_create(int listener_fd, int term_fd,
+                                output_t *output, size_t recv_max)
+{
+    event_loop_t *loop = (event_loop_t *) malloc(sizeof(event_loop_t));
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        free(loop);
+        return NULL;
+    }
+    loop->listener_fd = listener_fd;
+    loop->term_fd = term_fd;
+    loop->channel_fd = -1;
+    loop->terminating = 0;
+    loop->conns = linked_list_create();
+    loop->output = output;
+    recv_buffer_init(&loop->buffer, RECV_BUFFER_MIN, recv_max);
+    loop->metrics = NULL;
+    loop->log_writer = NULL;
+    reply_batch_init(&loop->replies, REPLY_NONE);
+    loop->format = FRAME_FORMAT_FRAMES;
+    loop->sock_opts = NULL;
+    loop->timeouts = (conn_timeouts_t) { 0, 0, 0 };
+    timer_wheel_init(&loop->wheel, TIMEOUT_TICK_MS, timer_wheel_now_ms());
+    for (int k = 0; k < TIMEOUT_KINDS; k++) loop->timed_out[k] = 0;
+    loop->limiter = NULL;
+    timer_wheel_init(&loop->rate_wheel, 1, timer_wheel_now_ms());
+    loop->admission = NULL;
+
+    struct epoll_event ev;
+
+    // Termination descriptor is never consumed, so every loop sees it.
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->term_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, term_fd, &ev) < 0) {
+        event_loop_destroy(loop);
+        return NULL;
+    }
+
+    if (listener_fd >= 0) {
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &loop->listener_fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listener_fd, &ev) < 0) {
+            event_loop_destroy(loop);
+            return NULL;
+        }
+    }
+
+    return loop;
+}
+
+void event_loop_destroy(event_loop_t *loop)
+{
+    // Close any connection still owned by the loop.
+    while (linked_list_size(loop->conns) > 0) {
+        close_connection(loop, (connection_t *) loop->conns->root->next->data);
+    }
+    linked_list_destroy(loop->conns);
+    recv_buffer_free(&loop->buffer);
+    reply_batch_free(&loop->replies);
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+/**
+ * Runs the loop on current thread until termination has been requested and
+ * every owned connection has been closed.
+ */
+void event_loop_run(event_loop_t *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int timing = conn_timeouts_enabled(&loop->timeouts);
+
+    while (!loop->terminating || linked_list_size(loop->conns) > 0) {
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS,
+                           next_timeout(loop, timing));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("ERROR: Waiting for events failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &loop->term_fd) begin_termination(loop);
+            else if (ptr == &loop->listener_fd) {
+                if (!loop->terminating) accept_connections(loop);
+            }
+            else if (ptr == &loop->channel_fd) {
+                if (!loop->terminating) receive_connections(loop);
+            }
+            else {
+                connection_t *conn = (connection_t *) ptr;
+                uint32_t ev = events[i].events;
+                if ((ev & EPOLLOUT) && write_connection(loop, conn) < 0) {
+                    continue;  // Connection is gone.
+                }
+                if ((ev & ~EPOLLOUT) && !conn->read_paused &&
+                    !conn->read_done && !conn->throttled) {
+                    read_connection(loop, conn);
+                }
+            }
+        }
+
+        // Only once events are done with, as it may close connections.
+        if (timing) {
+            timer_wheel_advance(&loop->wheel, timer_wheel_now_ms(),
+                                expire_connection, loop);
+        }
+        if (loop->limiter) {
+            timer_wheel_advance(&loop->rate_wheel, timer_wheel_now_ms(),
+                                resume_connection, loop);
+        }
+    }
+}
+
+/**
+ * Makes the loop serve connections received over given channel.
+ *
+ * Channel should be a Unix domain socket, over which another process sends
+ * descriptors of already accepted non-blocking connections. The loop starts
+ * terminating when the other end of the channel gets closed.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int event_loop_add_channel(event_loop_t *loop, int channel_fd)
+{
+    if (set_nonblocking(channel_fd) < 0) return -1;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &loop->channel_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, channel_fd, &ev) < 0) {
+        return -1;
+    }
+    loop->channel_fd = channel_fd;
+
+    return 0;
+}
+
+/**
+ * Accepts pending connections on the listener and registers them to the loop.
+ */
+static void accept_connections(event_loop_t *loop)
+{
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        int in_fd = accept4(loop->listener_fd, NULL, NULL,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (in_fd < 0) {
+            // Aborted connections should not stop draining the backlog.
+            if (errno == ECONNABORTED || errno == EINTR) continue;
+            return;  // Either drained (EAGAIN) or out of resources.
+        }
+        if (loop->metrics) metrics_accepted(loop->metrics);
+        socket_options_accepted(in_fd, loop->sock_opts);
+        register_connection(loop, in_fd);
+    }
+}
+
+/**
+ * Registers to the loop all connections pending on its channel.
+ */
+static void receive_connections(event_loop_t *loop)
+{
+    int in_fd;
+    while ((in_fd = recv_fd(loop->channel_fd)) >= 0) {
+        register_connection(loop, in_fd);
+    }
+
+    // Sender has gone away, so there is no reason to keep running.
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        begin_termination(loop);
+    }
+}
+
+/**
+ * Makes the loop the owner of a non-blocking client connection, unless it
+ * does not get admitted.
+ */
+static void register_connection(event_loop_t *loop, int fd)
+{
+    uint64_t source = 0;
+    if (loop->admission || loop->limiter) source = admission_peer_source(fd);
+    if (loop->admission &&
+        admission_acquire(loop->admission, source) != ADMISSION_OK) {
+        admission_shed(fd);  // Shed before paying for any state.
+        return;
+    }
+
+    connection_t *conn = (connection_t *) malloc(sizeof(connection_t));
+    conn->fd = fd;
+    conn->source = source;
+    conn->list_entry = linked_list_append(loop->conns, (void *) conn);
+    output_stream_init(&conn->stream, loop->output);
+    frame_reader_init(&conn->reader, loop->format);
+    conn->accepted_at = 0;
+    reply_backlog_init(&conn->replies);
+    conn->writing = 0;
+    conn->read_paused = 0;
+    conn->read_done = 0;
+    conn->log.writer = loop->log_writer;
+    if (loop->log_writer) {
+        conn->log.conn_id = message_log_connection_id(loop->log_writer->log);
+    }
+    if (loop->metrics) {
+        conn->accepted_at = metrics_now();
+        metrics_started(loop->metrics);
+    }
+    timer_init(&conn->timer);
+    if (conn_timeouts_enabled(&loop->timeouts)) {
+        conn_activity_init(&conn->activity, timer_wheel_now_ms());
+        timeout_kind_t kind;
+        uint64_t deadline = conn_timeouts_deadline(&loop->timeouts,
+                                                   &conn->activity, &kind);
+        timer_wheel_add(&loop->wheel, &conn->timer,
+                        conn_timeouts_recheck(&loop->timeouts, deadline,
+                                              conn->activity.active_ms));
+    }
+    conn->throttled = 0;
+    timer_init(&conn->resume);
+    if (loop->limiter) rate_conn_init(loop->limiter, &conn->rate, source);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close_connection(loop, conn);
+    }
+}
+
+/**
+ * Drains all data currently available on a connection, replying to its
+ * frames if the loop does so, unless it exceeds its rate limits first.
+ *
+ * Returns 0, or -1 if connection got closed.
+ */
+static int read_connection(event_loop_t *loop, connection_t *conn)
+{
+    ssize_t n;
+    frame_handler_t handler = loop->log_writer ? log_stream_write_frame
+                                               : output_stream_write_frame;
+    void *handler_arg = loop->log_writer ? (void *) &conn->log
+                                         : (void *) &conn->stream;
+    int replying = loop->replies.mode != REPLY_NONE;
+    if (replying) {
+        reply_batch_start(&loop->replies, conn->fd, &conn->replies, handler,
+                          handler_arg);
+    }
+
+    // Edge-triggered, so keep reading till there is nothing left. Frames
+    // are parsed in place, before the buffer gets reused.
+    while ((n = recv_buffer_read(&loop->buffer, conn->fd)) > 0) {
+        if (loop->metrics) {
+            if (conn->accepted_at) {
+                metrics_first_byte(loop->metrics, conn->accepted_at);
+                conn->accepted_at = 0;
+            }
+            metrics_read(loop->metrics, n);
+        }
+        uint64_t messages = conn->reader.messages;
+        int rc = replying ?
+                reply_batch_feed(&loop->replies, &conn->reader,
+                                 loop->buffer.data, n) :
+                frame_reader_feed(&conn->reader, loop->buffer.data, n,
+                                  handler, handler_arg);
+        if (rc < 0) {
+            close_connection(loop, conn);  // Bad frame, or sink failed.
+            return -1;
+        }
+        if (loop->limiter && !loop->terminating &&
+            throttle(loop, conn, (size_t) n,
+                     conn->reader.messages - messages)) break;
+        if (reply_backlog_size(&conn->replies) > REPLY_BACKLOG_MAX) break;
+    }
+    output_stream_flush(&conn->stream);  // Submit messages of all reads.
+    if (loop->log_writer) log_writer_flush(loop->log_writer);
+    if (timer_pending(&conn->timer)) {
+        conn_activity_read(&conn->activity, timer_wheel_now_ms(),
+                           frame_reader_pending(&conn->reader));
+    }
+
+    if (n > 0) {
+        // Resumed once replies drain. Throttled ones also wait for their
+        // timer.
+        if (reply_backlog_size(&conn->replies) > REPLY_BACKLOG_MAX) {
+            conn->read_paused = 1;
+        }
+    }
+    // Close on shutdown (n == 0) or on any error other than a drained
+    // socket. Replies still waiting get sent first, on shutdown.
+    else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK &&
+                        errno != EINTR)) {
+        if (n < 0 || reply_backlog_size(&conn->replies) == 0) {
+            close_connection(loop, conn);
+            return -1;
+        }
+        conn->read_done = 1;
+    }
+
+    if (reply_backlog_size(&conn->replies) > 0) watch_writes(loop, conn, 1);
+    return 0;
+}
+
+/**
+ * Writes as many waiting replies as the socket of a connection takes,
+ * resuming reading from it once all of them are gone.
+ *
+ * Returns 0, or -1 if connection got closed.
+ */
+static int write_connection(event_loop_t *loop, connection_t *conn)
+{
+    int rc = reply_backlog_flush(&conn->replies, conn->fd);
+    if (rc < 0 || (rc == 0 && conn->read_done)) {
+        close_connection(loop, conn);
+        return -1;
+    }
+    if (rc > 0) return 0;  // Wait till socket takes more.
+
+    watch_writes(loop, conn, 0);
+    if (conn->read_paused) {
+        conn->read_paused = 0;
+        if (!conn->throttled) return read_connection(loop, conn);
+    }
+    return 0;
+}
+
+/**
+ * Starts or stops watching a connection for its socket becoming writable.
+ */
+static void watch_writes(event_loop_t *loop, connection_t *conn, int on)
+{
+    if (conn->writing == on) return;
+    conn->writing = on;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (on ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/**
+ * Unregisters a connection from the loop and closes it.
+ */
+static void close_connection(event_loop_t *loop, connection_t *conn)
+{
+    linked_list_remove(loop->conns, conn->list_entry);
+    timer_wheel_remove(&loop->wheel, &conn->timer);
+    timer_wheel_remove(&loop->rate_wheel, &conn->resume);
+    if (loop->limiter) rate_conn_free(loop->limiter, &conn->rate);
+    if (loop->admission) admission_release(loop->admission, conn->source);
+    output_stream_close(&conn->stream);
+    frame_reader_free(&conn->reader);
+    reply_backlog_free(&conn->replies);
+    close(conn->fd);  // Also removes it from the epoll set.
+    if (loop->metrics) metrics_closed(loop->metrics);
+    free(conn);
+}
+
+/**
+ * Closes a connection of the loop given as arg if it is past its deadline,
+ * or else moves its timer on.
+ */
+static void expire_connection(wheel_timer_t *timer, void *arg)
+{
+    event_loop_t *loop = (event_loop_t *) arg;
+    connection_t *conn = (connection_t *) ((char *) timer -
+                                           offsetof(connection_t, timer));
+
+    timeout_kind_t kind;
+    uint64_t deadline = conn_timeouts_deadline(&loop->timeouts,
+                                               &conn->activity, &kind);
+    uint64_t now = timer_wheel_now_ms();
+    if (deadline > now) {
+        timer_wheel_add(&loop->wheel, timer,
+                        conn_timeouts_recheck(&loop->timeouts, deadline,
+                                              now));
+        return;
+    }
+
+    loop->timed_out[kind]++;
+    if (loop->metrics) metrics_timed_out(loop->metrics, kind);
+    close_connection(loop, conn);
+}
+
+/**
+ * Charges a connection for a read of given bytes and messages, pausing
+ * reading from it if it exceeds its rate limits.
+ *
+ * Returns non-zero if the connection got paused.
+ */
+static int throttle(event_loop_t *loop, connection_t *conn, size_t bytes,
+                    uint64_t msgs)
+{
+    uint64_t pause = rate_conn_charge(loop->limiter, &conn->rate, bytes,
+                                      (size_t) msgs);
+    if (pause == 0) return 0;
+    if (loop->metrics) metrics_throttled(loop->metrics, pause);
+
+    uint64_t now = timer_wheel_now_ms();
+    uint64_t pause_ms = (pause + 999999) / 1000000;
+    if (timer_pending(&conn->timer)) {
+        conn_activity_pause(&conn->activity, now, pause_ms);
+    }
+    conn->throttled = 1;
+    timer_wheel_add(&loop->rate_wheel, &conn->resume, now + pause_ms);
+    return 1;
+}
+
+/**
+ * Resumes reading from a throttled connection of the loop given as arg,
+ * unless it waits for something else.
+ */
+static void resume_connection(wheel_timer_t *timer, void *arg)
+{
+    event_loop_t *loop = (event_loop_t *) arg;
+    connection_t *conn = (connection_t *) ((char *) timer -
+                                           offsetof(connection_t, resume));
+
+    conn->throttled = 0;
+    if (!conn->read_paused && !conn->read_done) read_connection(loop, conn);
+}
+
+/**
+ * Returns the time in ms until the first timer of the loop may expire, fit
+ * for epoll_wait(), or -1 if there is none.
+ */
+static int next_timeout(event_loop_t *loop, int timing)
+{
+    uint64_t now = timer_wheel_now_ms();
+    int timeout = timing ? timer_wheel_timeout(&loop->wheel, now) : -1;
+    int resume = timer_wheel_timeout(&loop->rate_wheel, now);
+    if (resume >= 0 && (timeout < 0 || resume < timeout)) timeout = resume;
+    return timeout;
+}
+
+/**
+ * Stops accepting new connections and asks owned ones to terminate.
+ *
+ * Connections are only shut down here, so any data still queued on them
+ * gets consumed before they are closed by read_connection().
+ */
+static void begin_termination(event_loop_t *loop)
+{
+    if (loop->terminating) return;
+    loop->terminating = 1;
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->term_fd, NULL);
+    if (loop->listener_fd >= 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listener_fd, NULL);
+    }
+    if (loop->channel_fd >= 0) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->channel_fd, NULL);
+    }
+
+    // Throttled connections get drained on the next tick.
+    iterator_t *iter = linked_list_iterator(loop->conns);
+    while (iterator_has_next(iter)) {
+        connection_t *conn = (connection_t *) iterator_next(iter);
+        shutdown(conn->fd, SHUT_RDWR);
+        if (conn->throttled) {
+            timer_wheel_add(&loop->rate_wheel, &conn->resume, 0);
+        }
+    }
+    iterator_destroy(iter);
+}
@@ -0,0 +1,88 @@
+/**
+ * event_loop.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to create and run an
+ * edge-triggered epoll event loop, able to multiplex many client connections
+ * on a single thread, timing them out on a timing wheel of the loop,
+ * pausing the ones exceeding their rate limits on another one, and shedding
+ * the ones exceeding admission limits.
+ *
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "linked_list.h"
+#include "output.h"
+#include "recv_buffer.h"
+#include "frame.h"
+#include "metrics.h"
+#include "message_log.h"
+#include "reply.h"
+#include "endpoint.h"
+#include "timeouts.h"
+#include "rate_limit.h"
+#include "admission.h"
+
+typedef struct {
+    int fd;
+    node_t *list_entry;  // Entry of connection in its loop's list.
+    output_stream_t stream;  // Where received messages get staged.
+    frame_reader_t reader;   // Parser of frames received.
+    uint64_t accepted_at;    // Accept time, 0 once data has been received.
+    log_stream_t log;        // Where received messages get appended, when
+                             // loop has a log writer.
+    reply_backlog_t replies; // Replies the socket did not take yet.
+    int writing;      // Set while waiting for the socket to take replies.
+    int read_paused;  // Set while data is left unread, as peer does not
+                      // read its replies.
+    int read_done;    // Set once peer closed its side, while replies wait.
+    int receiving;    // Set while a receive is armed, on io_uring loops.
+    wheel_timer_t timer;        // Times connection out, if loop does so.
+    conn_activity_t activity;
+    int throttled;          // Set while not read, for exceeding rate limits.
+    wheel_timer_t resume;   // Resumes reading once throttled.
+    rate_conn_t rate;       // Rates of connection, if loop limits them.
+    uint64_t source;        // As of admission_source(), if loop admits
+                            // connections.
+} connection_t;
+
+typedef struct {
+    int epoll_fd;
+    int listener_fd;       // Listener shared among loops, -1 if none.
+    int term_fd;           // Descriptor that becomes readable on termination.
+    int channel_fd;        // Socket delivering connections, -1 if none.
+    int terminating;       // Set once termination has been requested.
+    linked_list_t *conns;  // Connections owned by this loop.
+    output_t *output;      // Pipeline received data is written to.
+    recv_buffer_t buffer;  // Shared by all connections, as reads never
+                           // overlap. Idle connections hold no buffer.
+    metrics_slot_t *metrics;  // Where loop records its metrics, NULL if none.
+    log_writer_t *log_writer; // Sink of messages, NULL for the pipeline.
+    reply_batch_t replies;    // Replies to frames read. Set up by servers
+                              // through reply_batch_init(), none by default.
+    frame_format_t format;    // Of data received, frames by default.
+    const socket_options_t *sock_opts;  // Of accepted connections, NULL if
+                                        // none.
+    conn_timeouts_t timeouts;  // Of connections, none by default.
+    timer_wheel_t wheel;       // Connections, when timing them out.
+    unsigned long timed_out[TIMEOUT_KINDS];  // Connections closed on timeout.
+    rate_limiter_t *limiter;  // Rate limits, possibly shared with other
+                              // loops and processes, none by default.
+    timer_wheel_t rate_wheel; // Throttled connections, at a tick of 1ms.
+    admission_t *admission;   // Limits of connections, possibly shared with
+                              // other loops and processes, none by default.
+} event_loop_t;
+
+
+event_loop_t *event_loop_create(int listener_fd, int term_fd,
+                                output_t *output, size_t recv_max);
+void event_loop_destroy(event_loop_t *loop);
+void event_loop_run(event_loop_t *loop);
+int event_loop_add_channel(event_loop_t *loop, int channel_fd);
+
+#endif
@@ -0,0 +1,128 @@
+/**
+ * fd_passing.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in fd_passing.h.
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "fd_passing.h"
+
+
+/**
+ * Sends a duplicate of fd over the given Unix domain socket.
+ *
+ * Returns 0 on success, -1 on failure with errno set. Never raises SIGPIPE.
+ */
+int send_fd(int sock, int fd)
+{
+    char dummy = 0;  // At least one byte of real data has to be sent.
+    return send_fd_with(sock, fd, &dummy, 1);
+}
+
+/**
+ * Receives a file descriptor sent by send_fd() over given socket.
+ *
+ * Returns the new descriptor, or -1 on failure with errno set. When the peer
+ * has closed its end, errno is set to ECONNRESET.
+ */
+int recv_fd(int sock)
+{
+    char dummy;
+    int fd;
+    ssize_t n = recv_fd_with(sock, &fd, &dummy, 1);
+    if (n < 0) return -1;
+    if (n == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if (fd < 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sends len bytes of data over the given Unix domain socket, together with a
+ * duplicate of fd, unless fd is negative. Data should not be empty.
+ *
+ * Returns 0 on success, -1 on failure with errno set. Never raises SIGPIPE.
+ */
+int send_fd_with(int sock, int fd, const void *data, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = (void *) data;
+    iov.iov_len = len;
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) return -1;
+    return 0;
+}
+
+/**
+ * Receives up to len bytes of data sent by send_fd_with() over given socket,
+ * storing the descriptor that came with them in fd, or -1 if there was none.
+ *
+ * Returns the bytes received, 0 when the peer has closed its end, or -1 on
+ * failure with errno set.
+ */
+ssize_t recv_fd_with(int sock, int *fd, void *data, size_t len)
+{
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = len;
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    *fd = -1;
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) return n;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            errno = EBADMSG;
+            return -1;
+        }
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return n;
+}
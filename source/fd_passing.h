@@ -0,0 +1,24 @@
+/**
+ * fd_passing.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to pass open file descriptors
+ * between processes over Unix domain sockets (SCM_RIGHTS).
+ *
+ */
+
+#ifndef FD_PASSING_H
+#define FD_PASSING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+int send_fd(int sock, int fd);
+int recv_fd(int sock);
+int send_fd_with(int sock, int fd, const void *data, size_t len);
+ssize_t recv_fd_with(int sock, int *fd, void *data, size_t len);
+
+#endif
@@ -0,0 +1,311 @@
+/**
+ * frame.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in frame.h.
+ *
+ * Frames that are whole in the data fed to a reader are handed over in
+ * place. Only a frame cut at the end of the data gets copied aside, and only
+ * until it is completed by the next data fed.
+ *
+ * Lines are handled the same way, found by line_scan(). Lines of plain
+ * ASCII, as the scan tells, are valid as they are, so only the rest get
+ * validated as UTF-8, while still in cache.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "frame.h"
+#include "line_scan.h"
+
+
+static int parse_header(const char *src, frame_t *frame);
+static int feed_partial(frame_reader_t *reader, const char **data,
+                        size_t *len, frame_handler_t handler, void *arg);
+static int feed_lines(frame_reader_t *reader, const char *data, size_t len,
+                      frame_handler_t handler, void *arg);
+static int hand_line(frame_reader_t *reader, const char *line, size_t len,
+                     int unchecked, frame_handler_t handler, void *arg);
+static int keep_line(frame_reader_t *reader, const char *data, size_t len,
+                     int unchecked);
+static void reset(frame_reader_t *reader);
+
+
+/**
+ * Writes a frame header for a payload of given length into dst.
+ *
+ * Returns the size of the header.
+ */
+size_t frame_pack_header(char *dst, uint8_t type, uint8_t flags,
+                         size_t length)
+{
+    dst[0] = (char) (length >> 8);
+    dst[1] = (char) length;
+    dst[2] = (char) type;
+    dst[3] = (char) flags;
+    return FRAME_HEADER_SIZE;
+}
+
+void frame_reader_init(frame_reader_t *reader, frame_format_t format)
+{
+    reader->format = format;
+    reader->failed = 0;
+    reader->messages = 0;
+    reset(reader);
+}
+
+void frame_reader_free(frame_reader_t *reader)
+{
+    free(reader->payload);
+    reader->payload = NULL;
+}
+
+/**
+ * Parses given data, calling handler for every frame completed by it.
+ *
+ * Data need not start or end on frame boundaries, as long as data of the
+ * same stream gets fed in order.
+ *
+ * Returns 0 on success, or -1 with errno set to EPROTO if an invalid frame
+ * or a line longer than FRAME_MAX_PAYLOAD was met, to EILSEQ if a line was
+ * not valid UTF-8, or to ECANCELED if handler stopped parsing. A reader
+ * stays failed after invalid data.
+ */
+int frame_reader_feed(frame_reader_t *reader, const char *data, size_t len,
+                      frame_handler_t handler, void *arg)
+{
+    if (reader->failed) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (reader->format == FRAME_FORMAT_LINES) {
+        return feed_lines(reader, data, len, handler, arg);
+    }
+
+    // Complete any frame left over by the previous data.
+    if (reader->header_len > 0) {
+        int rc = feed_partial(reader, &data, &len, handler, arg);
+        if (rc != 0) return rc;
+        if (reader->header_len > 0) return 0;  // Still incomplete.
+    }
+
+    frame_t frame;
+    while (len >= FRAME_HEADER_SIZE) {
+        if (parse_header(data, &frame) < 0) {
+            reader->failed = 1;
+            errno = EPROTO;
+            return -1;
+        }
+        if (len - FRAME_HEADER_SIZE < frame.length) break;
+
+        frame.payload = data + FRAME_HEADER_SIZE;
+        reader->messages++;
+        if (handler(&frame, arg) != 0) {
+            errno = ECANCELED;
+            return -1;
+        }
+        data += FRAME_HEADER_SIZE + frame.length;
+        len -= FRAME_HEADER_SIZE + frame.length;
+    }
+
+    // Keep the start of the frame cut at the end.
+    if (len > 0) return feed_partial(reader, &data, &len, handler, arg);
+
+    return 0;
+}
+
+/**
+ * Returns non-zero if reader holds the start of a frame, or line, still
+ * incomplete.
+ */
+int frame_reader_pending(const frame_reader_t *reader)
+{
+    return reader->header_len > 0 || reader->payload_len > 0;
+}
+
+/**
+ * Decodes a header, returning -1 if it does not belong to a valid frame.
+ */
+static int parse_header(const char *src, frame_t *frame)
+{
+    const unsigned char *h = (const unsigned char *) src;
+    frame->length = (uint16_t) (h[0] << 8 | h[1]);
+    frame->type = h[2];
+    frame->flags = h[3];
+    return frame->type == FRAME_DATA ? 0 : -1;
+}
+
+/**
+ * Moves data into the frame being assembled by reader, calling handler once
+ * it gets complete. Consumed data is skipped.
+ */
+static int feed_partial(frame_reader_t *reader, const char **data,
+                        size_t *len, frame_handler_t handler, void *arg)
+{
+    frame_t frame;
+
+    if (reader->header_len < FRAME_HEADER_SIZE) {
+        size_t n = FRAME_HEADER_SIZE - reader->header_len;
+        if (n > *len) n = *len;
+        memcpy(reader->header + reader->header_len, *data, n);
+        reader->header_len += n;
+        *data += n;
+        *len -= n;
+        if (reader->header_len < FRAME_HEADER_SIZE) return 0;
+    }
+
+    if (parse_header(reader->header, &frame) < 0) {
+        reader->failed = 1;
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (frame.length > 0) {
+        if (!reader->payload) {
+            reader->payload = (char *) malloc(frame.length);
+            if (!reader->payload) return -1;
+        }
+        size_t n = frame.length - reader->payload_len;
+        if (n > *len) n = *len;
+        memcpy(reader->payload + reader->payload_len, *data, n);
+        reader->payload_len += n;
+        *data += n;
+        *len -= n;
+        if (reader->payload_len < frame.length) return 0;
+    }
+
+    frame.payload = reader->payload;
+    reader->messages++;
+    int rc = handler(&frame, arg);
+
+    // Partial frames are rare, so do not hold their memory.
+    free(reader->payload);
+    reset(reader);
+
+    if (rc != 0) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Parses lines the way frame_reader_feed() does frames.
+ */
+static int feed_lines(frame_reader_t *reader, const char *data, size_t len,
+                      frame_handler_t handler, void *arg)
+{
+    // Complete any line left over by the previous data.
+    if (reader->payload_len > 0) {
+        int unchecked = 0;
+        size_t end = line_scan(data, len, &unchecked);
+        size_t n = end < len ? end + 1 : len;
+        if (keep_line(reader, data, n, unchecked) < 0) return -1;
+        if (end == len) return 0;  // Still incomplete.
+        data += n;
+        len -= n;
+
+        int rc = hand_line(reader, reader->payload, reader->payload_len,
+                           reader->unchecked, handler, arg);
+        free(reader->payload);
+        reset(reader);
+        if (rc < 0) return -1;
+    }
+
+    while (len > 0) {
+        int unchecked = 0;
+        size_t end = line_scan(data, len, &unchecked);
+        if (end == len) return keep_line(reader, data, len, unchecked);
+
+        size_t n = end + 1;
+        if (hand_line(reader, data, n, unchecked, handler, arg) < 0) return -1;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Hands a complete line over as a data frame, validating it first unless
+ * it is plain ASCII.
+ *
+ * Returns 0 on success, or -1 with errno set.
+ */
+static int hand_line(frame_reader_t *reader, const char *line, size_t len,
+                     int unchecked, frame_handler_t handler, void *arg)
+{
+    if (len > FRAME_MAX_PAYLOAD) {
+        reader->failed = 1;
+        errno = EPROTO;
+        return -1;
+    }
+    if (unchecked && !utf8_validate(line, len)) {
+        reader->failed = 1;
+        errno = EILSEQ;
+        return -1;
+    }
+
+    frame_t frame;
+    frame.type = FRAME_DATA;
+    frame.flags = FRAME_LINE;
+    frame.length = (uint16_t) len;
+    frame.payload = line;
+    reader->messages++;
+    if (handler(&frame, arg) != 0) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Appends the start of a line cut at the end of the data to the one being
+ * assembled by reader.
+ *
+ * Returns 0 on success, or -1 with errno set.
+ */
+static int keep_line(frame_reader_t *reader, const char *data, size_t len,
+                     int unchecked)
+{
+    size_t needed = reader->payload_len + len;
+    if (needed > FRAME_MAX_PAYLOAD) {
+        free(reader->payload);
+        reset(reader);
+        reader->failed = 1;
+        errno = EPROTO;
+        return -1;
+    }
+    if (needed > reader->payload_capacity) {
+        size_t capacity = reader->payload_capacity ?
+                          reader->payload_capacity : 256;
+        while (capacity < needed) capacity *= 2;
+        if (capacity > FRAME_MAX_PAYLOAD) capacity = FRAME_MAX_PAYLOAD;
+        char *payload = (char *) realloc(reader->payload, capacity);
+        if (!payload) return -1;
+        reader->payload = payload;
+        reader->payload_capacity = capacity;
+    }
+
+    memcpy(reader->payload + reader->payload_len, data, len);
+    reader->payload_len += len;
+    reader->unchecked |= unchecked;
+    return 0;
+}
+
+/**
+ * Forgets any frame or line spanning reads, whose memory has been freed.
+ */
+static void reset(frame_reader_t *reader)
+{
+    reader->header_len = 0;
+    reader->payload = NULL;
+    reader->payload_len = 0;
+    reader->payload_capacity = 0;
+    reader->unchecked = 0;
+}
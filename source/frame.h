@@ -0,0 +1,72 @@
+/**
+ * frame.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to pack and parse the frames
+ * exchanged between client and server.
+ *
+ * Every frame consists of a 4 bytes header followed by its payload:
+ *      | length (16 bits, big endian) | type (8 bits) | flags (8 bits) |
+ * where length counts payload bytes only.
+ *
+ * Readers may instead take a stream of newline delimited UTF-8 lines, each
+ * one handed over as a data frame of its own, newline included.
+ *
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_HEADER_SIZE 4
+#define FRAME_MAX_PAYLOAD 65535
+#define FRAME_LINE 0x01  // Flag of messages received as lines, no header.
+
+typedef enum {
+    FRAME_DATA = 1,  // A message to be written out by the server.
+    FRAME_ACK        // Acknowledges a data frame, with no payload.
+} frame_type_t;
+
+typedef enum {
+    FRAME_FORMAT_FRAMES,  // Frames as above.
+    FRAME_FORMAT_LINES    // Newline delimited lines.
+} frame_format_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t length;
+    const char *payload;  // Points into the buffer frame was parsed from.
+} frame_t;
+
+// Called for every complete frame. Non-zero return stops parsing.
+typedef int (*frame_handler_t)(const frame_t *frame, void *arg);
+
+typedef struct {
+    frame_format_t format;
+    char header[FRAME_HEADER_SIZE];  // Header of frame spanning reads.
+    size_t header_len;
+    char *payload;       // Payload of frame, or line, spanning reads, NULL
+                         // if none.
+    size_t payload_len;  // Bytes of it received so far.
+    size_t payload_capacity;  // Bytes allocated for a line spanning reads.
+    int unchecked;       // Set if line spanning reads needs validation.
+    int failed;          // Set once an invalid frame has been met.
+    uint64_t messages;   // Frames, or lines, handed over so far.
+} frame_reader_t;
+
+
+size_t frame_pack_header(char *dst, uint8_t type, uint8_t flags,
+                         size_t length);
+void frame_reader_init(frame_reader_t *reader, frame_format_t format);
+void frame_reader_free(frame_reader_t *reader);
+int frame_reader_feed(frame_reader_t *reader, const char *data, size_t len,
+                      frame_handler_t handler, void *arg);
+int frame_reader_pending(const frame_reader_t *reader);
+
+#endif
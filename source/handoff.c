@@ -0,0 +1,204 @@
+/**
+ * handoff.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in handoff.h.
+ *
+ * Messages travel over a SOCK_SEQPACKET socket, so each one of them arrives
+ * whole, along with the descriptor it carries, if any.
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "fd_passing.h"
+#include "listener.h"
+#include "handoff.h"
+
+
+static int init_address(struct sockaddr_un *addr, const char *path);
+
+static struct stat bound_stat;  // Tells whether bound path is still ours.
+
+
+/**
+ * Creates a socket listening for handoff requests on given path, replacing
+ * a socket left there by an instance that is gone, or by the one handed over
+ * to current one, if took_over is set. A live socket of any other instance,
+ * or anything else than a socket, fails with EADDRINUSE.
+ *
+ * Returns the socket, or -1 on failure with errno set.
+ */
+int handoff_listen(const char *path, int took_over)
+{
+    struct sockaddr_un addr;
+    if (init_address(&addr, path) < 0) return -1;
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+
+    if ((bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+         (errno != EADDRINUSE ||
+          !unix_path_reclaimable(path, SOCK_SEQPACKET, took_over) ||
+          unlink(path) < 0 ||
+          bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)) ||
+        listen(sock, 1) < 0 || stat(path, &bound_stat) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * Closes a socket created by handoff_listen(), removing its path, unless a
+ * newer instance has bound the path over in the meantime.
+ */
+void handoff_close(int sock, const char *path)
+{
+    close(sock);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && st.st_dev == bound_stat.st_dev &&
+        st.st_ino == bound_stat.st_ino) {
+        unlink(path);
+    }
+}
+
+/**
+ * Requests a handoff from the instance listening on given path.
+ *
+ * Returns the channel to that instance, or -1 on failure with errno set.
+ * ENOENT and ECONNREFUSED mean that no instance is listening there.
+ */
+int handoff_connect(const char *path, uint32_t flags)
+{
+    struct sockaddr_un addr;
+    if (init_address(&addr, path) < 0) return -1;
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) return -1;
+
+    handoff_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.flags = flags;
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        handoff_send(sock, HANDOFF_REQUEST, &msg, -1) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * Sends a message of given type, carrying a duplicate of fd, unless fd is
+ * negative. Any field msg carries besides its type is sent as is, and msg
+ * may be NULL for messages of no fields.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int handoff_send(int sock, handoff_type_t type, const handoff_msg_t *msg,
+                 int fd)
+{
+    handoff_msg_t out;
+    if (msg) out = *msg;
+    else memset(&out, 0, sizeof(out));
+    out.type = type;
+
+    return send_fd_with(sock, fd, &out, sizeof(out));
+}
+
+/**
+ * Receives the next message, storing the descriptor it carries into fd, or
+ * -1 if none. Waiting stops after HANDOFF_TIMEOUT_MS, or as soon as
+ * cancel_fd, unless negative, becomes readable.
+ *
+ * Returns 0 on success, -1 on failure with errno set. When the peer has
+ * closed the channel, errno is set to ECONNRESET.
+ */
+int handoff_recv(int sock, handoff_msg_t *msg, int *fd, int cancel_fd)
+{
+    struct pollfd fds[2];
+    fds[0].fd = sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = cancel_fd;  // Ignored by poll() when negative.
+    fds[1].events = POLLIN;
+
+    *fd = -1;
+    int rc;
+    while ((rc = poll(fds, 2, HANDOFF_TIMEOUT_MS)) < 0 && errno == EINTR);
+    if (rc < 0) return -1;
+    if (rc == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (fds[1].revents) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    ssize_t n = recv_fd_with(sock, fd, msg, sizeof(handoff_msg_t));
+    if (n < 0) return -1;
+    if (n == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    if ((size_t) n != sizeof(handoff_msg_t)) {
+        if (*fd >= 0) close(*fd);
+        *fd = -1;
+        errno = EBADMSG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Receives the next message, like handoff_recv(), failing with EBADMSG if it
+ * is not of given type or carries a descriptor.
+ */
+int handoff_expect(int sock, handoff_type_t type, handoff_msg_t *msg,
+                   int cancel_fd)
+{
+    int fd;
+    if (handoff_recv(sock, msg, &fd, cancel_fd) < 0) return -1;
+    if (fd >= 0) close(fd);
+    if (msg->type != type || fd >= 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Fills in the address of a Unix domain socket at given path.
+ *
+ * Returns 0 on success, -1 if path does not fit, with errno set.
+ */
+static int init_address(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
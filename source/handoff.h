@@ -0,0 +1,59 @@
+/**
+ * handoff.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to hand the listeners of a
+ * running server, along with connections still waiting to be served, over to
+ * a new instance of it, through a Unix domain socket.
+ *
+ * A handoff goes like:
+ *      new -> old : REQUEST, with flags
+ *      old -> new : LISTENER for every listener, LOG if logging, END
+ *      new -> old : READY, once accepting on the listeners is possible
+ *      old -> new : CONNECTION for every waiting connection, if requested
+ * after which old instance closes the channel. Old instance keeps accepting
+ * until it gets READY, so a new instance failing on its way up costs
+ * nothing.
+ *
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+#define HANDOFF_MAX_LISTENERS 1024  // One per CPU, at most.
+#define HANDOFF_TIMEOUT_MS 30000    // Max wait for the peer to respond.
+
+#define HANDOFF_CONNECTIONS 0x1  // Request flag, to take waiting connections.
+
+typedef enum {
+    HANDOFF_REQUEST = 1,  // Asks for a handoff.
+    HANDOFF_LISTENER,     // Carries a listener.
+    HANDOFF_LOG,          // Carries the state of the message log.
+    HANDOFF_END,          // No more listeners follow.
+    HANDOFF_READY,        // New instance is ready to accept.
+    HANDOFF_CONNECTION    // Carries a connection waiting to be served.
+} handoff_type_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t flags;        // Of a request.
+    uint64_t source;       // Client source of a connection, for admission.
+    uint64_t accepted_at;  // Accept time of a connection, in ns.
+} handoff_msg_t;
+
+
+int handoff_listen(const char *path, int took_over);
+void handoff_close(int sock, const char *path);
+int handoff_connect(const char *path, uint32_t flags);
+int handoff_send(int sock, handoff_type_t type, const handoff_msg_t *msg,
+                 int fd);
+int handoff_recv(int sock, handoff_msg_t *msg, int *fd, int cancel_fd);
+int handoff_expect(int sock, handoff_type_t type, handoff_msg_t *msg,
+                   int cancel_fd);
+
+#endif
@@ -0,0 +1,108 @@
+/**
+ * histogram.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in histogram.h.
+ *
+ */
+
+#include <stdlib.h>
+#include "histogram.h"
+
+
+static int bucket_of(uint64_t value);
+static uint64_t value_of(int bucket);
+
+
+histogram_t *histogram_create(void)
+{
+    histogram_t *hist = (histogram_t *) calloc(1, sizeof(histogram_t));
+    hist->min = UINT64_MAX;
+    return hist;
+}
+
+void histogram_destroy(histogram_t *hist)
+{
+    free(hist);
+}
+
+void histogram_record(histogram_t *hist, uint64_t value)
+{
+    hist->counts[bucket_of(value)]++;
+    hist->total++;
+    hist->sum += (double) value;
+    if (value < hist->min) hist->min = value;
+    if (value > hist->max) hist->max = value;
+}
+
+/**
+ * Adds all values recorded in src to dst.
+ */
+void histogram_merge(histogram_t *dst, const histogram_t *src)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+/**
+ * Returns the value below which given percentage (0-100) of the recorded
+ * values lie, or 0 if nothing has been recorded.
+ */
+uint64_t histogram_percentile(const histogram_t *hist, double percentile)
+{
+    if (hist->total == 0) return 0;
+    if (percentile >= 100.0) return hist->max;
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) hist->total);
+    if (rank < 1) rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = value_of(i);
+            if (value < hist->min) return hist->min;
+            if (value > hist->max) return hist->max;
+            return value;
+        }
+    }
+    return hist->max;
+}
+
+double histogram_mean(const histogram_t *hist)
+{
+    return hist->total ? hist->sum / (double) hist->total : 0.0;
+}
+
+/**
+ * Values below HISTOGRAM_SUB_COUNT are kept exactly. Above that, every power
+ * of two range maps to HISTOGRAM_SUB_COUNT buckets of equal width.
+ */
+static int bucket_of(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_COUNT) return (int) value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_COUNT +
+           (int) (value >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+/**
+ * Returns the middle of the range of values that fall into bucket.
+ */
+static uint64_t value_of(int bucket)
+{
+    if (bucket < 2 * HISTOGRAM_SUB_COUNT) return (uint64_t) bucket;
+
+    int shift = bucket / HISTOGRAM_SUB_COUNT - 1;
+    uint64_t low = (uint64_t) (bucket % HISTOGRAM_SUB_COUNT +
+                               HISTOGRAM_SUB_COUNT) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
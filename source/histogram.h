@@ -0,0 +1,40 @@
+/**
+ * histogram.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to create and manage a
+ * histogram of values in the style of HDR histograms. Values are counted in
+ * logarithmic ranges, each one split into linear sub-buckets, so any value
+ * gets recorded with a bounded relative error (< 1%) in O(1) time.
+ *
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 7  // 128 sub-buckets in each range.
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;  // Number of recorded values.
+    uint64_t min;
+    uint64_t max;
+    double sum;      // Sum of recorded values, for computing the mean.
+} histogram_t;
+
+
+histogram_t *histogram_create(void);
+void histogram_destroy(histogram_t *hist);
+void histogram_record(histogram_t *hist, uint64_t value);
+void histogram_merge(histogram_t *dst, const histogram_t *src);
+uint64_t histogram_percentile(const histogram_t *hist, double percentile);
+double histogram_mean(const histogram_t *hist);
+
+#endif
@@ -0,0 +1,452 @@
+/**
+ * line_scan.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in line_scan.h.
+ *
+ * Vector kernels compare a whole vector of bytes against the newline at
+ * once, only turning the result into a bit mask when something matched,
+ * while high bits of the bytes gone over keep being or-ed into a vector
+ * that gets looked at once in the end. The scalar kernel does the same on
+ * 64 bit words, finding newlines through the classic zero byte test.
+ *
+ * The AVX2 kernel also validates UTF-8 on the way, with the lookup
+ * algorithm of Keiser and Lemire ("Validating UTF-8 In Less Than One
+ * Instruction Per Byte", 2021): three table lookups over nibbles of each
+ * byte and the one before it catch every error of two byte sequences,
+ * while bytes expected to be the third or fourth of a sequence get checked
+ * apart. Every line gets validated on its own, so the state of a scan is
+ * reset at its start, and errors past the newline are ignored. Lines
+ * spanning reads get scanned in pieces, whose ends may look invalid, so
+ * such lines may be left unchecked.
+ *
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include "line_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINE_SCAN_X86
+#endif
+
+// Errors of UTF-8 that a byte and the one before it may reveal.
+#define TOO_SHORT (1 << 0)   // 11______ followed by 0_______ or 11______.
+#define TOO_LONG (1 << 1)    // 0_______ followed by 10______.
+#define OVERLONG_3 (1 << 2)  // 11100000 100_____
+#define TOO_LARGE (1 << 3)   // 11110100 1001____, or anything larger.
+#define SURROGATE (1 << 4)   // 11101101 101_____
+#define OVERLONG_2 (1 << 5)  // 1100000_ 10______
+#define TOO_LARGE_1000 (1 << 6)  // 11110101 1000____, or anything larger.
+#define OVERLONG_4 (1 << 6)  // 11110000 1000____
+#define TWO_CONTS (1 << 7)   // 10______ 10______
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+
+static size_t scan_scalar(const char *data, size_t len, int *unchecked);
+#ifdef LINE_SCAN_X86
+static size_t scan_sse2(const char *data, size_t len, int *unchecked)
+        __attribute__((target("sse2")));
+static size_t scan_avx2(const char *data, size_t len, int *unchecked)
+        __attribute__((target("avx2")));
+static __m256i check_utf8(__m256i input, __m256i prev)
+        __attribute__((target("avx2")));
+static __m256i incomplete_utf8(__m256i input)
+        __attribute__((target("avx2")));
+static uint32_t nonzero_bytes(__m256i v) __attribute__((target("avx2")));
+#endif
+static void select_default(void) __attribute__((constructor));
+
+typedef struct {
+    const char *name;
+    size_t (*scan)(const char *data, size_t len, int *unchecked);
+} kernel_t;
+
+static const kernel_t kernels[] = {
+#ifdef LINE_SCAN_X86
+    { "avx2", scan_avx2 },
+    { "sse2", scan_sse2 },
+#endif
+    { "scalar", scan_scalar },
+};
+static const kernel_t *kernel = &kernels[sizeof(kernels) /
+                                         sizeof(kernels[0]) - 1];
+
+
+/**
+ * Returns the offset of the first newline in data, or len if there is none.
+ * Sets *unchecked if the bytes before it are not known to be valid UTF-8,
+ * leaving it as is otherwise. Only plain ASCII is known to be valid to
+ * every kernel.
+ */
+size_t line_scan(const char *data, size_t len, int *unchecked)
+{
+    return kernel->scan(data, len, unchecked);
+}
+
+/**
+ * Makes line_scan() use the kernel of given name ("avx2", "sse2", "scalar"),
+ * or the best one the CPU supports for "auto". Meant to be called before
+ * any scanning starts.
+ *
+ * Returns 0 on success, or -1 with errno set to EINVAL if there is no such
+ * kernel, or to ENOTSUP if the CPU does not support it.
+ */
+int line_scan_select(const char *name)
+{
+    if (strcmp(name, "auto") == 0) {
+        select_default();
+        return 0;
+    }
+
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (strcmp(name, kernels[i].name) != 0) continue;
+#ifdef LINE_SCAN_X86
+        __builtin_cpu_init();
+        int avx2 = __builtin_cpu_supports("avx2");
+        int sse2 = __builtin_cpu_supports("sse2");
+        if ((kernels[i].scan == scan_avx2 && !avx2) ||
+            (kernels[i].scan == scan_sse2 && !sse2)) {
+            errno = ENOTSUP;
+            return -1;
+        }
+#endif
+        kernel = &kernels[i];
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+/**
+ * Returns the name of the kernel in use.
+ */
+const char *line_scan_name(void)
+{
+    return kernel->name;
+}
+
+/**
+ * Returns whether data is valid UTF-8, with no overlong encodings,
+ * surrogates or code points above U+10FFFF.
+ */
+int utf8_validate(const char *data, size_t len)
+{
+    const unsigned char *s = (const unsigned char *) data;
+    size_t i = 0;
+
+    while (i < len) {
+        // Skip runs of ASCII a word at a time.
+        if (i + 8 <= len) {
+            uint64_t word;
+            memcpy(&word, s + i, sizeof(word));
+            if ((word & 0x8080808080808080ULL) == 0) {
+                i += 8;
+                continue;
+            }
+        }
+
+        unsigned char c = s[i];
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+
+        // Bounds of the byte following the lead, the rest being 0x80-0xBF.
+        size_t follow;
+        unsigned char lo = 0x80, hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) follow = 1;
+        else if (c >= 0xE0 && c <= 0xEF) {
+            follow = 2;
+            if (c == 0xE0) lo = 0xA0;       // Overlong.
+            else if (c == 0xED) hi = 0x9F;  // Surrogates.
+        }
+        else if (c >= 0xF0 && c <= 0xF4) {
+            follow = 3;
+            if (c == 0xF0) lo = 0x90;       // Overlong.
+            else if (c == 0xF4) hi = 0x8F;  // Above U+10FFFF.
+        }
+        else return 0;
+
+        if (len - i - 1 < follow) return 0;
+        if (s[i + 1] < lo || s[i + 1] > hi) return 0;
+        for (size_t k = 2; k <= follow; k++) {
+            if ((s[i + k] & 0xC0) != 0x80) return 0;
+        }
+        i += follow + 1;
+    }
+
+    return 1;
+}
+
+/**
+ * Scans a word at a time, for CPUs with no vector kernel.
+ */
+static size_t scan_scalar(const char *data, size_t len, int *unchecked)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    const uint64_t newlines = ones * '\n';
+    uint64_t seen = 0;  // High bits of bytes gone over.
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+
+        // Marks exactly the bytes equal to newline. Adding to the low bits
+        // of every byte carries into its high bit unless they are zero,
+        // never into the next byte, so the first one found is right on
+        // either byte order.
+        uint64_t x = word ^ newlines;
+        uint64_t found = ~(((x & ~highs) + ~highs) | x | ~highs);
+        if (found) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            size_t pos = (size_t) __builtin_clzll(found) / 8;
+            uint64_t before = pos ? ~0ULL << (64 - 8 * pos) : 0;
+#else
+            size_t pos = (size_t) __builtin_ctzll(found) / 8;
+            uint64_t before = pos ? ~0ULL >> (64 - 8 * pos) : 0;
+#endif
+            if (seen | (word & before & highs)) *unchecked = 1;
+            return i + pos;
+        }
+        seen |= word & highs;
+    }
+
+    for (; i < len && data[i] != '\n'; i++) {
+        seen |= (unsigned char) data[i] & 0x80;
+    }
+    if (seen) *unchecked = 1;
+    return i;
+}
+
+#ifdef LINE_SCAN_X86
+/**
+ * Scans 16 bytes at a time.
+ */
+static size_t scan_sse2(const char *data, size_t len, int *unchecked)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    __m128i seen = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+        unsigned found = (unsigned) _mm_movemask_epi8(
+                _mm_cmpeq_epi8(v, newline));
+        if (found) {
+            unsigned before = (found & -found) - 1;
+            if (_mm_movemask_epi8(seen) |
+                (_mm_movemask_epi8(v) & before)) *unchecked = 1;
+            return i + __builtin_ctz(found);
+        }
+        seen = _mm_or_si128(seen, v);
+    }
+
+    if (_mm_movemask_epi8(seen)) *unchecked = 1;
+    return i + scan_scalar(data + i, len - i, unchecked);
+}
+
+/**
+ * Returns the error flags of the bytes of input, given the 32 bytes before
+ * them in prev.
+ */
+static __m256i check_utf8(__m256i input, __m256i prev)
+{
+    // Indexed by the high nibble of the byte before.
+    const __m256i byte_1_high_table = _mm256_setr_epi8(
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+            TOO_SHORT | OVERLONG_2,
+            TOO_SHORT,
+            TOO_SHORT | OVERLONG_3 | SURROGATE,
+            (char) (TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4),
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+            TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+            TOO_SHORT | OVERLONG_2,
+            TOO_SHORT,
+            TOO_SHORT | OVERLONG_3 | SURROGATE,
+            (char) (TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4));
+    // Indexed by the low nibble of the byte before.
+    const __m256i byte_1_low_table = _mm256_setr_epi8(
+            (char) (CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4),
+            (char) (CARRY | OVERLONG_2),
+            (char) CARRY,
+            (char) CARRY,
+            (char) (CARRY | TOO_LARGE),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4),
+            (char) (CARRY | OVERLONG_2),
+            (char) CARRY,
+            (char) CARRY,
+            (char) (CARRY | TOO_LARGE),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000),
+            (char) (CARRY | TOO_LARGE | TOO_LARGE_1000));
+    // Indexed by the high nibble of the byte itself.
+    const char cont_8 = (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS |
+                                OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4);
+    const char cont_9 = (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS |
+                                OVERLONG_3 | TOO_LARGE);
+    const char cont_ab = (char) (TOO_LONG | OVERLONG_2 | TWO_CONTS |
+                                 SURROGATE | TOO_LARGE);
+    const __m256i byte_2_high_table = _mm256_setr_epi8(
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            cont_8, cont_9, cont_ab, cont_ab,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+            cont_8, cont_9, cont_ab, cont_ab,
+            TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    __m256i shifted = _mm256_permute2x128_si256(prev, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table,
+            _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table,
+            _mm256_and_si256(prev1, nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table,
+            _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble));
+    __m256i special = _mm256_and_si256(
+            _mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // Continuations after continuations are only fine as third or fourth
+    // bytes, that follow a lead of 111_____ or 1111____ respectively.
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8(0xF0 - 0x80));
+    __m256i must_continue = _mm256_and_si256(
+            _mm256_or_si256(third, fourth), _mm256_set1_epi8((char) 0x80));
+    return _mm256_xor_si256(must_continue, special);
+}
+
+/**
+ * Returns non-zero bytes where the last bytes of input start a sequence
+ * that they do not complete.
+ */
+static __m256i incomplete_utf8(__m256i input)
+{
+    const __m256i max = _mm256_setr_epi8(
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+            (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1));
+    return _mm256_subs_epu8(input, max);
+}
+
+/**
+ * Returns a mask of the bytes of v that are not zero.
+ */
+static uint32_t nonzero_bytes(__m256i v)
+{
+    return ~(uint32_t) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+}
+
+/**
+ * Scans 64 bytes at a time, as two vectors of 32 bytes each, validating
+ * UTF-8 as well.
+ */
+static size_t scan_avx2(const char *data, size_t len, int *unchecked)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    __m256i prev = _mm256_setzero_si256();        // Last non-ASCII vector.
+    __m256i incomplete = _mm256_setzero_si256();  // Whether it ended mid
+                                                  // sequence.
+    __m256i error = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (data + i + 32));
+        __m256i ea = _mm256_cmpeq_epi8(a, newline);
+        __m256i eb = _mm256_cmpeq_epi8(b, newline);
+        __m256i any = _mm256_or_si256(ea, eb);
+        uint64_t bytes = (uint32_t) _mm256_movemask_epi8(a) |
+                         (uint64_t) (uint32_t) _mm256_movemask_epi8(b) << 32;
+
+        if (!_mm256_testz_si256(any, any)) {
+            uint64_t found = (uint32_t) _mm256_movemask_epi8(ea) |
+                             (uint64_t) (uint32_t) _mm256_movemask_epi8(eb)
+                             << 32;
+            size_t pos = (size_t) __builtin_ctzll(found);
+            uint64_t upto = pos == 63 ? ~0ULL : (2ULL << pos) - 1;
+
+            // Errors past the newline belong to the next line.
+            uint64_t bad = 0;
+            if (bytes & upto) {
+                bad = nonzero_bytes(check_utf8(a, prev));
+                if (pos >= 32) {
+                    bad |= (uint64_t) nonzero_bytes(check_utf8(b, a)) << 32;
+                }
+                bad &= upto;
+            }
+            else error = _mm256_or_si256(error, incomplete);
+            if (bad || !_mm256_testz_si256(error, error)) *unchecked = 1;
+            return i + pos;
+        }
+
+        // ASCII is only fine if the vector before completed its sequences.
+        if (!bytes) error = _mm256_or_si256(error, incomplete);
+        else {
+            error = _mm256_or_si256(error, check_utf8(a, prev));
+            error = _mm256_or_si256(error, check_utf8(b, a));
+            incomplete = incomplete_utf8(b);
+            prev = b;
+        }
+    }
+
+    // A sequence left incomplete may be completed, or not, by the rest.
+    if (!_mm256_testz_si256(error, error) ||
+        !_mm256_testz_si256(incomplete, incomplete)) *unchecked = 1;
+    return i + scan_sse2(data + i, len - i, unchecked);
+}
+#endif
+
+/**
+ * Picks the widest kernel the CPU supports.
+ */
+static void select_default(void)
+{
+#ifdef LINE_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = &kernels[0];
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        kernel = &kernels[1];
+        return;
+    }
+#endif
+    kernel = &kernels[sizeof(kernels) / sizeof(kernels[0]) - 1];
+}
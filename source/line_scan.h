@@ -0,0 +1,31 @@
+/**
+ * line_scan.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to find the ends of
+ * newline delimited messages, and to validate them as UTF-8.
+ *
+ * Scanning uses the widest vector kernel the CPU supports (AVX2, SSE2), or
+ * else a word at a time scalar one, chosen once at startup. Kernels also
+ * tell whether the bytes they went over are left unchecked: the scalar and
+ * SSE2 ones only pass plain ASCII, which is valid UTF-8 as is, while the
+ * AVX2 one validates UTF-8 on its own, so only messages it found invalid,
+ * or cut in the middle of a character, need to be validated apart.
+ *
+ */
+
+#ifndef LINE_SCAN_H
+#define LINE_SCAN_H
+
+#include <stddef.h>
+
+
+size_t line_scan(const char *data, size_t len, int *unchecked);
+int line_scan_select(const char *name);
+const char *line_scan_name(void);
+int utf8_validate(const char *data, size_t len);
+
+#endif
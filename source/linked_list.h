@@ -10,6 +10,9 @@
  *
  */
 
+#ifndef LINKED_LIST_H
+#define LINKED_LIST_H
+
 typedef struct Node node_t;
 
 struct Node {
@@ -39,3 +42,5 @@ iterator_t *linked_list_iterator(linked_list_t *list);
 int iterator_has_next(iterator_t *iter);
 void *iterator_next(iterator_t *iter);
 void iterator_destroy(iterator_t *iter);
+
+#endif
@@ -0,0 +1,200 @@
+/**
+ * listener.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in listener.h.
+ *
+ * A Unix domain socket listener leaves its path behind when closed. So the
+ * path gets unlinked once the server is done with it, unless another socket
+ * has been bound to it since, which is told by its inode.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "listener.h"
+
+
+/**
+ * Prints a message about currently set errno and terminates process.
+ */
+static void error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+static int create_listener(const endpoint_t *ep,
+                           const socket_options_t *opts, int reuseport);
+static const char *unix_path(const endpoint_t *ep);
+
+static struct stat unix_path_stat;  // Of the path listened on, if any.
+static int unix_path_bound = 0;
+
+
+/**
+ * Initialize a listener on the given endpoint, tuned by given options.
+ */
+int init_listener(const endpoint_t *ep, const socket_options_t *opts)
+{
+    return create_listener(ep, opts, 0);
+}
+
+/**
+ * Initialize a TCP listener on the given endpoint, that may be bound many
+ * times.
+ *
+ * Each listener created this way gets its own accept queue, with the kernel
+ * load balancing new connections among all of them.
+ */
+int init_reuseport_listener(const endpoint_t *ep,
+                            const socket_options_t *opts)
+{
+    return create_listener(ep, opts, 1);
+}
+
+/**
+ * Takes over the path of a Unix domain socket listener bound by another
+ * process, so that it gets released by the current one.
+ */
+void adopt_listener(const endpoint_t *ep)
+{
+    const char *path = unix_path(ep);
+    if (path && stat(path, &unix_path_stat) == 0) unix_path_bound = 1;
+}
+
+/**
+ * Unlinks the path of a Unix domain socket listener on given endpoint, if
+ * it is still the one bound or adopted by the current process.
+ */
+void release_listener(const endpoint_t *ep)
+{
+    const char *path = unix_path(ep);
+    struct stat st;
+    if (path && unix_path_bound && stat(path, &st) == 0 &&
+        st.st_dev == unix_path_stat.st_dev &&
+        st.st_ino == unix_path_stat.st_ino) {
+        unlink(path);
+    }
+    unix_path_bound = 0;
+}
+
+/**
+ * Switches given descriptor to non-blocking mode.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Creates a stream socket bound to given endpoint.
+ *
+ * TCP options inherited by accepted connections get set on the listener,
+ * before binding, so that window scaling accounts for buffer sizes. Unix
+ * domain sockets inherit none, so they get no options.
+ */
+static int create_listener(const endpoint_t *ep,
+                           const socket_options_t *opts, int reuseport)
+{
+    int socket_fd;  // Listener's file descriptor.
+
+    socket_fd = socket(ep->family, SOCK_STREAM, 0);
+    if (socket_fd < 0) error("ERROR: Opening of socket failed");
+
+    int on = 1;
+    int off = 0;
+    if (reuseport &&
+        setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        error("ERROR: Failed to enable port reuse");
+    }
+    // IPv6 listeners accept IPv4 connections too.
+    if (ep->family == AF_INET6 &&
+        setsockopt(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, &off,
+                   sizeof(off)) < 0) {
+        error("ERROR: Failed to accept IPv4 on IPv6 listener");
+    }
+    if (opts && ep->family != AF_UNIX) {
+        if (socket_options_apply(socket_fd, ep->family, opts) < 0) {
+            error("ERROR: Failed to set socket options");
+        }
+        if (opts->defer_accept > 0 &&
+            setsockopt(socket_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                       &opts->defer_accept, sizeof(int)) < 0) {
+            error("ERROR: Failed to defer accepting");
+        }
+    }
+
+    // Bind to the listening address, replacing any Unix domain socket left
+    // behind by a server that is gone.
+    const struct sockaddr *addr = (const struct sockaddr *) &ep->addr;
+    const char *path = unix_path(ep);
+    if (bind(socket_fd, addr, ep->addr_len) < 0 &&
+        (errno != EADDRINUSE || !path ||
+         !unix_path_reclaimable(path, SOCK_STREAM, 0) || unlink(path) < 0 ||
+         bind(socket_fd, addr, ep->addr_len) < 0)) {
+        error("ERROR: Binding failed");
+    }
+    if (path && stat(path, &unix_path_stat) == 0) unix_path_bound = 1;
+
+    return socket_fd;
+}
+
+/**
+ * Returns the file system path of a Unix domain socket endpoint, or NULL if
+ * it has none.
+ */
+static const char *unix_path(const endpoint_t *ep)
+{
+    const struct sockaddr_un *addr = (const struct sockaddr_un *) &ep->addr;
+    if (ep->family != AF_UNIX || addr->sun_path[0] == '\0') return NULL;
+    return addr->sun_path;
+}
+
+/**
+ * Tells whether path may be unlinked, to bind a Unix domain socket of given
+ * type over it. It may only hold a socket nobody listens on any more, or any
+ * socket at all if replace_live is set. Anything else, like a regular file,
+ * is never replaced.
+ *
+ * Leaves errno set to EADDRINUSE, for the failed bind() to report.
+ */
+int unix_path_reclaimable(const char *path, int type, int replace_live)
+{
+    struct stat st;
+    if (lstat(path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        errno = EADDRINUSE;
+        return 0;
+    }
+    if (replace_live) return 1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, type, 0);
+    if (fd < 0) return 0;
+    int stale = connect(fd, (const struct sockaddr *) &addr,
+                        sizeof(addr)) < 0 && errno == ECONNREFUSED;
+    close(fd);
+    errno = EADDRINUSE;
+    return stale;
+}
@@ -0,0 +1,26 @@
+/**
+ * listener.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines shared by all server implementations
+ * for setting up listening sockets.
+ *
+ */
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include "endpoint.h"
+
+int init_listener(const endpoint_t *ep, const socket_options_t *opts);
+int init_reuseport_listener(const endpoint_t *ep,
+                            const socket_options_t *opts);
+void adopt_listener(const endpoint_t *ep);
+void release_listener(const endpoint_t *ep);
+int set_nonblocking(int fd);
+int unix_path_reclaimable(const char *path, int type, int replace_live);
+
+#endif
@@ -0,0 +1,75 @@
+/**
+ * log_replay.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * Replays a message log written by the servers, printing every message as a
+ * line of its own, prefixed by its connection id and reception time.
+ *
+ * Usage: exec_name [-r] <log_dir>
+ *  where:
+ *      -log_dir : Directory of the log, as given to the server.
+ *      -r : Print bare messages, without any prefix.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "message_log.h"
+
+
+int print_record(const log_record_t *record, const char *payload, void *arg);
+void usage(const char *exec_name);
+
+
+int main(int argc, char *argv[])
+{
+    int raw = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r")) != -1) {
+        switch (opt) {
+            case 'r':
+                raw = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind >= argc) usage(argv[0]);
+
+    if (message_log_replay(argv[optind], print_record, &raw) < 0) {
+        perror("ERROR: Failed to replay log");
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Prints usage information and terminates process.
+ */
+void usage(const char *exec_name)
+{
+    fprintf(stdout, "Usage: %s [-r] <log_dir>\n", exec_name);
+    exit(1);
+}
+
+/**
+ * Prints a logged message as a line of its own.
+ */
+int print_record(const log_record_t *record, const char *payload, void *arg)
+{
+    if (!*(int *) arg) {
+        printf("%llu %llu.%09llu ", (unsigned long long) record->conn_id,
+               (unsigned long long) record->timestamp / 1000000000ULL,
+               (unsigned long long) record->timestamp % 1000000000ULL);
+    }
+    fwrite(payload, 1, record->length, stdout);
+    if (record->length == 0 || payload[record->length - 1] != '\n') {
+        putchar('\n');
+    }
+    return 0;
+}
@@ -0,0 +1,657 @@
+/**
+ * message_log.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in message_log.h.
+ *
+ * The log is a single sequence of bytes, split into fixed size segment
+ * files named after their index. Writers reserve room for a record by
+ * advancing the shared end of the log with a compare and swap, and then
+ * copy the record into their own mapping of its segment, with no lock
+ * involved. Records never span segments. A record that does not fit moves
+ * the end of the log to the start of the next segment, leaving a padding
+ * record behind, which is how segments rotate.
+ *
+ * Segment files get fully allocated before being mapped, so writers never
+ * fault on a hole of the file. Every process maps a segment once, for all of
+ * its writers, so that short lived ones, like the handlers of single
+ * connections, do not allocate and map it over and over. Mappings nobody
+ * uses get dropped once a later segment gets mapped.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "message_log.h"
+
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t) 7)
+#define SEGMENT_SUFFIX ".log"
+#define SEGMENT_NAME_LEN 24  // 20 digits of index and suffix.
+
+
+static int scan_segments(const char *dir, uint64_t **indexes);
+static int compare_indexes(const void *a, const void *b);
+static int segment_path(const char *dir, uint64_t index, char *path);
+static int map_segment(log_writer_t *writer, uint64_t index);
+static void unmap_segment(log_writer_t *writer);
+static log_mapping_t *create_mapping(message_log_t *log, uint64_t index);
+static void drop_mappings(message_log_t *log, uint64_t before);
+static int write_record(log_writer_t *writer, uint64_t pos,
+                        log_record_type_t type, uint64_t conn_id,
+                        const char *data, size_t len);
+static void stamp_pad(message_log_t *log, uint64_t pos, size_t len);
+static uint32_t record_checksum(uint32_t type, const log_record_t *record,
+                                const char *payload);
+static int record_valid(const log_record_t *record, size_t room);
+static int replay_segment(const char *path, log_record_handler_t handler,
+                          void *arg);
+
+static int state_fd = -1;  // Backs the shared state of the log in process.
+static log_mapping_t *mappings = NULL;  // Segments mapped in process.
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Opens the log kept in given directory, creating the directory if needed.
+ * Appending starts on a new segment, after any existing one.
+ *
+ * Returns NULL on failure with errno set.
+ */
+message_log_t *message_log_open(const char *dir, size_t segment_size,
+                                log_sync_t sync)
+{
+    message_log_t *log;
+    if (strlen(dir) + SEGMENT_NAME_LEN + 2 > sizeof(log->dir)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return NULL;
+
+    uint64_t *indexes;
+    int segments = scan_segments(dir, &indexes);
+    if (segments < 0) return NULL;
+
+    // Backed by a memfd, so that unrelated processes may attach to it too.
+    int fd = memfd_create("message_log", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, sizeof(message_log_t)) < 0) goto fail;
+    log = (message_log_t *) mmap(NULL, sizeof(message_log_t),
+                                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (log == MAP_FAILED) goto fail;
+    state_fd = fd;
+
+    // Segments are mapped as a whole, so keep them page aligned.
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    if (segment_size < LOG_MIN_SEGMENT_SIZE) {
+        segment_size = LOG_MIN_SEGMENT_SIZE;
+    }
+    segment_size = (segment_size + page - 1) / page * page;
+
+    log->segment_size = segment_size;
+    log->sync = sync;
+    strcpy(log->dir, dir);
+    atomic_init(&log->next_conn_id, 1);
+    uint64_t start = segments > 0 ? indexes[segments - 1] + 1 : 0;
+    atomic_init(&log->position, start * segment_size);
+
+    free(indexes);
+    return log;
+
+fail:
+    free(indexes);
+    if (fd >= 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+    }
+    return NULL;
+}
+
+/**
+ * Attaches to a log opened by another process, given the descriptor that
+ * message_log_fd() returned there. Appending continues from wherever that
+ * process is, with the directory, segment size and sync policy it opened
+ * the log with. Descriptor is owned by the log from now on.
+ *
+ * Returns NULL on failure with errno set.
+ */
+message_log_t *message_log_attach(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) return NULL;
+    if ((size_t) st.st_size != sizeof(message_log_t)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    message_log_t *log = (message_log_t *) mmap(
+            NULL, sizeof(message_log_t), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (log == MAP_FAILED) return NULL;
+    state_fd = fd;
+
+    return log;
+}
+
+/**
+ * Returns the descriptor backing the state of the log opened or attached in
+ * this process, to be passed to processes that should append to it too.
+ */
+int message_log_fd(void)
+{
+    return state_fd;
+}
+
+void message_log_close(message_log_t *log)
+{
+    pthread_mutex_lock(&mappings_lock);
+    drop_mappings(log, UINT64_MAX);
+    pthread_mutex_unlock(&mappings_lock);
+    munmap(log, sizeof(message_log_t));
+    if (state_fd >= 0) close(state_fd);
+    state_fd = -1;
+}
+
+/**
+ * Returns a new identifier for a connection, unique among all processes
+ * appending to the log.
+ */
+uint64_t message_log_connection_id(message_log_t *log)
+{
+    return atomic_fetch_add_explicit(&log->next_conn_id, 1,
+                                     memory_order_relaxed);
+}
+
+/**
+ * Returns the sync policy matching given name, or -1 if there is none.
+ */
+int message_log_parse_sync(const char *name)
+{
+    if (strcmp(name, "none") == 0) return LOG_SYNC_NONE;
+    if (strcmp(name, "async") == 0) return LOG_SYNC_ASYNC;
+    if (strcmp(name, "sync") == 0) return LOG_SYNC_FULL;
+    return -1;
+}
+
+/**
+ * Calls handler on every record of the log kept in given directory, in the
+ * order they were reserved. Records that were never completed, as after a
+ * crash, get skipped, and so does padding.
+ *
+ * Returns 0 on success, or -1 on failure with errno set. A negative value
+ * returned by handler stops the replay with errno set to ECANCELED.
+ */
+int message_log_replay(const char *dir, log_record_handler_t handler,
+                       void *arg)
+{
+    uint64_t *indexes;
+    int segments = scan_segments(dir, &indexes);
+    if (segments < 0) return -1;
+
+    int rc = 0;
+    char path[PATH_MAX];
+    for (int i = 0; i < segments && rc == 0; i++) {
+        rc = segment_path(dir, indexes[i], path);
+        if (rc == 0) rc = replay_segment(path, handler, arg);
+    }
+
+    free(indexes);
+    return rc;
+}
+
+void log_writer_init(log_writer_t *writer, message_log_t *log)
+{
+    writer->log = log;
+    writer->mapping = NULL;
+    writer->dirty_start = writer->dirty_end = 0;
+}
+
+/**
+ * Flushes according to sync policy and releases current segment.
+ */
+void log_writer_free(log_writer_t *writer)
+{
+    unmap_segment(writer);
+}
+
+/**
+ * Appends a message received on given connection.
+ *
+ * Returns 0 on success, -1 on failure with errno set. Messages that could
+ * never fit in a segment fail with EMSGSIZE.
+ */
+int log_writer_append(log_writer_t *writer, uint64_t conn_id,
+                      const char *data, size_t len)
+{
+    message_log_t *log = writer->log;
+    size_t seg = log->segment_size;
+    size_t size = sizeof(log_record_t) + ALIGN8(len);
+    if (size > seg || len > UINT32_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint64_t pos = atomic_load_explicit(&log->position, memory_order_relaxed);
+    while (1) {
+        size_t off = pos % seg;
+        if (off + size <= seg) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &log->position, &pos, pos + size,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+            continue;
+        }
+
+        // Rotate. Only the writer that moves the end pads the segment.
+        uint64_t next = pos - off + seg;
+        if (atomic_compare_exchange_weak_explicit(
+                &log->position, &pos, next,
+                memory_order_relaxed, memory_order_relaxed)) {
+            if (off + sizeof(log_record_t) <= seg &&
+                write_record(writer, pos, LOG_RECORD_PAD, 0, NULL,
+                             seg - off - sizeof(log_record_t)) < 0) {
+                return -1;
+            }
+            pos = next;
+        }
+    }
+
+    return write_record(writer, pos, LOG_RECORD_DATA, conn_id, data, len);
+}
+
+/**
+ * Ends a batch of appended records, syncing them according to the policy
+ * of the log.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int log_writer_flush(log_writer_t *writer)
+{
+    if (writer->dirty_end <= writer->dirty_start) return 0;
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = writer->dirty_start / page * page;
+    size_t len = writer->dirty_end - start;
+    writer->dirty_start = writer->dirty_end = 0;
+
+    switch (writer->log->sync) {
+        case LOG_SYNC_ASYNC:
+            return sync_file_range(writer->mapping->fd, start, len,
+                                   SYNC_FILE_RANGE_WRITE);
+        case LOG_SYNC_FULL:
+            return msync(writer->mapping->map + start, len, MS_SYNC);
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Appends a received frame to the message log, through the log stream given
+ * as arg.
+ */
+int log_stream_write_frame(const frame_t *frame, void *arg)
+{
+    log_stream_t *stream = (log_stream_t *) arg;
+    if (log_writer_append(stream->writer, stream->conn_id, frame->payload,
+                          frame->length) < 0) {
+        perror("ERROR: Failed to append to message log");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Finds the indexes of all segments in given directory, sorted.
+ *
+ * Returns their number, or -1 on failure with errno set.
+ */
+static int scan_segments(const char *dir, uint64_t **indexes)
+{
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+
+    int num = 0;
+    int capacity = 16;
+    *indexes = (uint64_t *) malloc(sizeof(uint64_t) * capacity);
+
+    struct dirent *entry;
+    while ((entry = readdir(d))) {
+        const char *name = entry->d_name;
+        char *end;
+        if (strlen(name) != SEGMENT_NAME_LEN) continue;
+        uint64_t index = strtoull(name, &end, 10);
+        if (end != name + 20 || strcmp(end, SEGMENT_SUFFIX) != 0) continue;
+
+        if (num == capacity) {
+            capacity *= 2;
+            *indexes = (uint64_t *) realloc(*indexes,
+                                            sizeof(uint64_t) * capacity);
+        }
+        (*indexes)[num++] = index;
+    }
+    closedir(d);
+
+    qsort(*indexes, num, sizeof(uint64_t), compare_indexes);
+    return num;
+}
+
+static int compare_indexes(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Writes the path of a segment into a buffer of PATH_MAX bytes.
+ *
+ * Returns 0 on success, -1 if path is too long with errno set.
+ */
+static int segment_path(const char *dir, uint64_t index, char *path)
+{
+    int n = snprintf(path, PATH_MAX, "%s/%020llu" SEGMENT_SUFFIX, dir,
+                     (unsigned long long) index);
+    if (n >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Replaces the segment used by writer with the one of given index, mapping
+ * it, and creating it, unless another writer of the process already did.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+static int map_segment(log_writer_t *writer, uint64_t index)
+{
+    unmap_segment(writer);
+
+    pthread_mutex_lock(&mappings_lock);
+    log_mapping_t *mapping = mappings;
+    while (mapping && mapping->segment != index) mapping = mapping->next;
+    if (!mapping) {
+        drop_mappings(writer->log, index);
+        mapping = create_mapping(writer->log, index);
+    }
+    if (mapping) mapping->refs++;
+    pthread_mutex_unlock(&mappings_lock);
+    if (!mapping) return -1;
+
+    writer->mapping = mapping;
+    return 0;
+}
+
+/**
+ * Flushes the segment used by writer and stops using it. It stays mapped
+ * for other writers, and for the ones to come.
+ */
+static void unmap_segment(log_writer_t *writer)
+{
+    if (!writer->mapping) return;
+
+    log_writer_flush(writer);
+    pthread_mutex_lock(&mappings_lock);
+    writer->mapping->refs--;
+    pthread_mutex_unlock(&mappings_lock);
+    writer->mapping = NULL;
+}
+
+/**
+ * Maps the segment of given index, creating it if it does not exist yet,
+ * and adds it to the mappings of the process. Called with mappings locked.
+ *
+ * Returns the mapping, or NULL on failure with errno set.
+ */
+static log_mapping_t *create_mapping(message_log_t *log, uint64_t index)
+{
+    char path[PATH_MAX];
+    if (segment_path(log->dir, index, path) < 0) return NULL;
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return NULL;
+
+    // Every process allocates the segment, as it cannot tell whether the one
+    // that created it has already done so. Allocating again is a no-op.
+    int rc = posix_fallocate(fd, 0, log->segment_size);
+    if (rc != 0) {
+        close(fd);
+        errno = rc;
+        return NULL;
+    }
+
+    log_mapping_t *mapping = (log_mapping_t *) malloc(sizeof(log_mapping_t));
+    void *map = mapping ? mmap(NULL, log->segment_size,
+                               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                        : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        rc = errno;
+        free(mapping);
+        close(fd);
+        errno = rc;
+        return NULL;
+    }
+    madvise(map, log->segment_size, MADV_SEQUENTIAL);
+
+    mapping->segment = index;
+    mapping->fd = fd;
+    mapping->map = (char *) map;
+    mapping->refs = 0;
+    mapping->next = mappings;
+    mappings = mapping;
+    return mapping;
+}
+
+/**
+ * Unmaps all segments before given index that no writer uses. Called with
+ * mappings locked.
+ */
+static void drop_mappings(message_log_t *log, uint64_t before)
+{
+    log_mapping_t **link = &mappings;
+    while (*link) {
+        log_mapping_t *mapping = *link;
+        if (mapping->refs > 0 || mapping->segment >= before) {
+            link = &mapping->next;
+            continue;
+        }
+        *link = mapping->next;
+        munmap(mapping->map, log->segment_size);
+        close(mapping->fd);
+        free(mapping);
+    }
+}
+
+/**
+ * Writes a record at given reserved position of the log, publishing it by
+ * setting its type last.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+static int write_record(log_writer_t *writer, uint64_t pos,
+                        log_record_type_t type, uint64_t conn_id,
+                        const char *data, size_t len)
+{
+    size_t seg = writer->log->segment_size;
+    uint64_t index = pos / seg;
+    size_t off = pos % seg;
+    if ((!writer->mapping || writer->mapping->segment != index) &&
+        map_segment(writer, index) < 0) {
+        int err = errno;
+        stamp_pad(writer->log, pos, ALIGN8(len));
+        errno = err;
+        return -1;
+    }
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    log_record_t *record = (log_record_t *) (writer->mapping->map + off);
+    record->length = (uint32_t) len;
+    record->conn_id = conn_id;
+    record->timestamp = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (data) memcpy(record + 1, data, len);
+    record->magic = LOG_RECORD_MAGIC;
+    record->checksum = record_checksum(type, record, data);
+    atomic_store_explicit(&record->type, type, memory_order_release);
+
+    size_t end = off + sizeof(log_record_t) + (data ? len : 0);
+    if (writer->dirty_end <= writer->dirty_start) {
+        writer->dirty_start = off;
+        writer->dirty_end = end;
+    }
+    else {
+        if (off < writer->dirty_start) writer->dirty_start = off;
+        if (end > writer->dirty_end) writer->dirty_end = end;
+    }
+
+    return 0;
+}
+
+/**
+ * Marks a reserved record that could not be written as padding of given
+ * length, writing its header through the file, since the segment could not
+ * be mapped. Replay would otherwise take the record for the end of the
+ * segment. Best effort, as the file is probably failing anyway.
+ */
+static void stamp_pad(message_log_t *log, uint64_t pos, size_t len)
+{
+    char path[PATH_MAX];
+    if (segment_path(log->dir, pos / log->segment_size, path) < 0) return;
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+
+    log_record_t record = { .length = (uint32_t) len,
+                            .magic = LOG_RECORD_MAGIC };
+    record.checksum = record_checksum(LOG_RECORD_PAD, &record, NULL);
+    atomic_init(&record.type, LOG_RECORD_PAD);
+    ssize_t rc = pwrite(fd, &record, sizeof(record), pos % log->segment_size);
+    (void) rc;
+    close(fd);
+}
+
+/**
+ * Returns a checksum of a record of given type, covering its header and,
+ * for messages, the payload too. Words are mixed as they get multiplied, so
+ * that every bit of them reaches the lower half kept.
+ */
+static uint32_t record_checksum(uint32_t type, const log_record_t *record,
+                                const char *payload)
+{
+    const uint64_t K = 0x9E3779B97F4A7C15ULL;
+    uint64_t words[3] = {
+        (uint64_t) type << 32 | record->length, record->conn_id,
+        record->timestamp
+    };
+    uint64_t h = record->magic;
+    for (int i = 0; i < 3; i++) {
+        h = (h ^ words[i]) * K;
+        h ^= h >> 32;
+    }
+
+    if (payload && type == LOG_RECORD_DATA) {
+        size_t len = record->length;
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            uint64_t w;
+            memcpy(&w, payload + i, 8);
+            h = (h ^ w) * K;
+            h ^= h >> 32;
+        }
+        if (i < len) {
+            uint64_t w = 0;
+            memcpy(&w, payload + i, len - i);
+            h = (h ^ w) * K;
+            h ^= h >> 32;
+        }
+    }
+
+    return (uint32_t) h;
+}
+
+/**
+ * Returns non-zero if a completed record starts at given header, with
+ * room bytes left in its segment.
+ */
+static int record_valid(const log_record_t *record, size_t room)
+{
+    uint32_t type = atomic_load_explicit(&record->type, memory_order_acquire);
+    if ((type != LOG_RECORD_DATA && type != LOG_RECORD_PAD) ||
+        record->magic != LOG_RECORD_MAGIC) return 0;
+    if (sizeof(log_record_t) + ALIGN8((size_t) record->length) > room) {
+        return 0;
+    }
+    return record->checksum ==
+           record_checksum(type, record, (const char *) (record + 1));
+}
+
+/**
+ * Calls handler on every completed record of a single segment file.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+static int replay_segment(const char *path, log_record_handler_t handler,
+                          void *arg)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t) st.st_size;
+    if (size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    char *map = (char *) mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    int rc = 0;
+    size_t off = 0;
+    while (off + sizeof(log_record_t) <= size) {
+        const log_record_t *record = (const log_record_t *) (map + off);
+
+        // Unused space, the remains of a writer that never completed its
+        // record, and the end of the segment all look the same, so look
+        // for any later record past them.
+        if (!record_valid(record, size - off)) {
+            off += 8;
+            continue;
+        }
+
+        size_t next = off + sizeof(log_record_t) + ALIGN8(record->length);
+        if (atomic_load_explicit(&record->type, memory_order_relaxed) !=
+            LOG_RECORD_DATA) {
+            off = next;
+            continue;
+        }
+
+        if (handler(record, (const char *) (record + 1), arg) < 0) {
+            errno = ECANCELED;
+            rc = -1;
+            break;
+        }
+        off = next;
+    }
+
+    munmap(map, size);
+    return rc;
+}
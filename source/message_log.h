@@ -0,0 +1,112 @@
+/**
+ * message_log.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to append received messages
+ * to a persistent log, made of preallocated memory mapped segment files, and
+ * to replay them later.
+ *
+ * Every segment is a sequence of 8 bytes aligned records:
+ *      | type (32 bits) | length (32 bits) | connection id (64 bits) |
+ *      | timestamp (64 bits) | magic (32 bits) | checksum (32 bits) |
+ *      | payload, padded to 8 bytes |
+ * in host byte order. Type is written last, and the checksum covers the
+ * rest of the header, along with the payload of messages. Records describe
+ * themselves, so replay resumes past a record that was never completed, by
+ * looking for the next valid header on 8 bytes alignment. Writers that fail
+ * after reserving a record stamp it as padding.
+ *
+ */
+
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include "frame.h"
+
+#define LOG_SEGMENT_SIZE (64UL << 20)  // Default size of segments.
+#define LOG_MIN_SEGMENT_SIZE (1UL << 20)
+#define LOG_RECORD_MAGIC 0x474F4C4DU  // "MLOG", read in little endian.
+
+typedef enum {
+    LOG_RECORD_DATA = 1,  // A received message.
+    LOG_RECORD_PAD        // Length bytes after header are unused.
+} log_record_type_t;
+
+typedef struct {
+    _Atomic uint32_t type;  // Published last, 0 while being written.
+    uint32_t length;        // Bytes of payload.
+    uint64_t conn_id;       // Connection message was received on.
+    uint64_t timestamp;     // Wall clock time of reception, in ns.
+    uint32_t magic;         // LOG_RECORD_MAGIC.
+    uint32_t checksum;      // Of type, rest of header and any message.
+} log_record_t;
+
+typedef enum {
+    LOG_SYNC_NONE,   // Leave write back to the kernel.
+    LOG_SYNC_ASYNC,  // Start writing back every batch, without waiting.
+    LOG_SYNC_FULL    // Wait for every batch to reach the disk.
+} log_sync_t;
+
+// Lives in a shared mapping, so processes forked after its creation append
+// to the same log, as well as any process attaching to it later.
+typedef struct {
+    _Alignas(64) atomic_uint_least64_t position;  // End of reserved space,
+                                                  // counting all segments.
+    _Alignas(64) atomic_uint_least64_t next_conn_id;
+    size_t segment_size;
+    log_sync_t sync;
+    char dir[PATH_MAX];
+} message_log_t;
+
+// A segment mapped in this process, shared by all writers appending to it.
+typedef struct log_mapping {
+    struct log_mapping *next;
+    uint64_t segment;  // Index of segment.
+    int fd;
+    char *map;
+    int refs;          // Writers using it.
+} log_mapping_t;
+
+// Appends to a log on behalf of a single thread, one segment at a time.
+typedef struct {
+    message_log_t *log;
+    log_mapping_t *mapping;  // Of current segment, NULL if none.
+    size_t dirty_start;      // Range written since last batch.
+    size_t dirty_end;
+} log_writer_t;
+
+// Messages of a single connection, appended through a writer.
+typedef struct {
+    log_writer_t *writer;
+    uint64_t conn_id;
+} log_stream_t;
+
+typedef int (*log_record_handler_t)(const log_record_t *record,
+                                    const char *payload, void *arg);
+
+
+message_log_t *message_log_open(const char *dir, size_t segment_size,
+                                log_sync_t sync);
+message_log_t *message_log_attach(int fd);
+int message_log_fd(void);
+void message_log_close(message_log_t *log);
+uint64_t message_log_connection_id(message_log_t *log);
+int message_log_replay(const char *dir, log_record_handler_t handler,
+                       void *arg);
+int message_log_parse_sync(const char *name);
+
+void log_writer_init(log_writer_t *writer, message_log_t *log);
+void log_writer_free(log_writer_t *writer);
+int log_writer_append(log_writer_t *writer, uint64_t conn_id,
+                      const char *data, size_t len);
+int log_writer_flush(log_writer_t *writer);
+int log_stream_write_frame(const frame_t *frame, void *arg);
+
+#endif
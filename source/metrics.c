@@ -0,0 +1,674 @@
+/**
+ * metrics.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in metrics.h.
+ *
+ * Every writer only ever adds to its own slot with relaxed atomics, so
+ * recording takes no locks and touches no line written by other threads.
+ * Totals are summed over all slots when reported, which makes them slightly
+ * skewed under load, but never torn.
+ *
+ * Reports are produced either on SIGUSR2, written to stderr, or for every
+ * connection to an admin Unix domain socket. Requests of the form "GET ..."
+ * get an HTTP response, so that the socket can be scraped directly,
+ * everything else gets the bare report. Both the signal and the socket wake
+ * up a single epoll descriptor, watched either by a reporter thread, or by
+ * the loop of a process that forks and so has to stay single threaded.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "listener.h"
+#include "metrics.h"
+
+
+#define DUMP_SIGNAL SIGUSR2
+#define REPORT_SIZE 16384   // Enough for every metric in text format.
+#define REQUEST_WAIT_MS 100 // Time given to admin clients to send a request.
+
+typedef struct {
+    uint64_t accepted;
+    uint64_t started;
+    uint64_t closed;
+    uint64_t timed_out[METRICS_TIMEOUTS];
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t read_sizes[METRICS_BUCKETS];
+    uint64_t latencies[METRICS_BUCKETS];
+    uint64_t latency_sum;
+    uint64_t throttled;
+    uint64_t throttled_ns;
+} metrics_totals_t;
+
+
+static void sum_slots(metrics_t *metrics, metrics_totals_t *totals);
+static int bucket_of(uint64_t value, uint64_t base);
+static void append(char *buf, size_t size, size_t *len, const char *fmt, ...);
+static void append_counter(char *buf, size_t size, size_t *len,
+                           const char *name, const char *help,
+                           const char *type, uint64_t value);
+static void append_histogram(char *buf, size_t size, size_t *len,
+                             const char *name, const char *help,
+                             const uint64_t *buckets, uint64_t base,
+                             double scale, double sum);
+static void *run_reporter(void *args);
+static int respond(void);
+static void serve_admin_client(int fd);
+static int write_all(int fd, const char *data, size_t len);
+static int send_all(int fd, const char *data, size_t len);
+static void request_dump(int signum);
+
+
+// State of the single reporter of the process.
+static metrics_t *reported;
+static pthread_t reporter;
+static int reporter_running = 0;
+static int wake_fds[2] = { -1, -1 };  // Wakes up reporter, from signals too.
+static int admin_fd = -1;
+static int report_fd = -1;  // Epoll instance watching both of the above.
+static char *admin_socket_path;
+static struct stat admin_socket_stat;  // Tells whether path is still ours.
+
+
+/**
+ * Creates the metrics of a server, with given number of slots.
+ *
+ * Returns NULL on failure with errno set.
+ */
+metrics_t *metrics_create(int slots_num)
+{
+    if (slots_num < 1) slots_num = 1;
+    size_t size = sizeof(metrics_t) + sizeof(metrics_slot_t) * slots_num;
+
+    // Anonymous mappings are zero filled, which is how atomics start too.
+    metrics_t *metrics = (metrics_t *) mmap(NULL, size,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_ANONYMOUS,
+                                            -1, 0);
+    if (metrics == MAP_FAILED) return NULL;
+
+    metrics->slots_num = slots_num;
+    return metrics;
+}
+
+void metrics_destroy(metrics_t *metrics)
+{
+    munmap(metrics,
+           sizeof(metrics_t) + sizeof(metrics_slot_t) * metrics->slots_num);
+}
+
+/**
+ * Reports the reuse counters of a pool along with the metrics. Pools should
+ * be added before the reporter starts.
+ */
+void metrics_add_pool(metrics_t *metrics, const char *name,
+                      const pool_stats_t *stats)
+{
+    if (metrics->pools_num >= METRICS_POOLS) return;
+    metrics->pools[metrics->pools_num].name = name;
+    metrics->pools[metrics->pools_num].stats = stats;
+    metrics->pools_num++;
+}
+
+/**
+ * Hands out a slot to a new writer, in round robin.
+ */
+metrics_slot_t *metrics_claim(metrics_t *metrics)
+{
+    int i = atomic_fetch_add_explicit(&metrics->claimed, 1,
+                                      memory_order_relaxed);
+    return &metrics->slots[(unsigned) i % metrics->slots_num];
+}
+
+/**
+ * Returns a monotonic timestamp in ns, to be used as accept time.
+ */
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_accepted(metrics_slot_t *slot)
+{
+    atomic_fetch_add_explicit(&slot->accepted, 1, memory_order_relaxed);
+}
+
+void metrics_started(metrics_slot_t *slot)
+{
+    atomic_fetch_add_explicit(&slot->started, 1, memory_order_relaxed);
+}
+
+void metrics_closed(metrics_slot_t *slot)
+{
+    atomic_fetch_add_explicit(&slot->closed, 1, memory_order_relaxed);
+}
+
+/**
+ * Records a connection getting closed for exceeding a timeout of given
+ * kind. It still gets recorded as closed, once its handler closes it.
+ */
+void metrics_timed_out(metrics_slot_t *slot, int kind)
+{
+    atomic_fetch_add_explicit(&slot->timed_out[kind], 1,
+                              memory_order_relaxed);
+}
+
+/**
+ * Records a read that returned given number of bytes.
+ */
+void metrics_read(metrics_slot_t *slot, size_t bytes)
+{
+    atomic_fetch_add_explicit(&slot->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->reads, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(
+            &slot->read_sizes[bucket_of(bytes, METRICS_SIZE_BASE)], 1,
+            memory_order_relaxed);
+}
+
+/**
+ * Records the arrival of the first data of a connection accepted at given
+ * timestamp of metrics_now().
+ */
+void metrics_first_byte(metrics_slot_t *slot, uint64_t accepted_at)
+{
+    uint64_t now = metrics_now();
+    uint64_t latency = now > accepted_at ? now - accepted_at : 0;
+    atomic_fetch_add_explicit(
+            &slot->latencies[bucket_of(latency, METRICS_LATENCY_BASE)], 1,
+            memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->latency_sum, latency,
+                              memory_order_relaxed);
+}
+
+/**
+ * Records reading from a connection getting paused for given ns, for
+ * exceeding its rate limits.
+ */
+void metrics_throttled(metrics_slot_t *slot, uint64_t ns)
+{
+    atomic_fetch_add_explicit(&slot->throttled, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&slot->throttled_ns, ns, memory_order_relaxed);
+}
+
+/**
+ * Writes a report of current totals in Prometheus text format into given
+ * buffer, truncating it if it does not fit.
+ *
+ * Returns the length of the report.
+ */
+size_t metrics_format(metrics_t *metrics, char *buf, size_t size)
+{
+    metrics_totals_t t;
+    sum_slots(metrics, &t);
+
+    size_t len = 0;
+    buf[0] = '\0';
+    append_counter(buf, size, &len, "server_connections_accepted_total",
+                   "Connections accepted.", "counter", t.accepted);
+    append_counter(buf, size, &len, "server_connections_closed_total",
+                   "Connections closed after being served.", "counter",
+                   t.closed);
+    const char *timeouts[METRICS_TIMEOUTS] = { "idle", "read", "lifetime" };
+    append(buf, size, &len, "# HELP %s %s\n# TYPE %s counter\n",
+           "server_connections_timed_out_total",
+           "Connections closed for exceeding a timeout.",
+           "server_connections_timed_out_total");
+    for (int k = 0; k < METRICS_TIMEOUTS; k++) {
+        append(buf, size, &len, "%s{timeout=\"%s\"} %llu\n",
+               "server_connections_timed_out_total", timeouts[k],
+               (unsigned long long) t.timed_out[k]);
+    }
+    append_counter(buf, size, &len, "server_active_handlers",
+                   "Connections currently being served.", "gauge",
+                   t.started > t.closed ? t.started - t.closed : 0);
+    append_counter(buf, size, &len, "server_received_bytes_total",
+                   "Bytes received from clients.", "counter", t.bytes);
+    append_counter(buf, size, &len, "server_reads_total",
+                   "Reads that returned data.", "counter", t.reads);
+    append_counter(buf, size, &len, "server_throttled_reads_total",
+                   "Times reading paused by rate limits.", "counter",
+                   t.throttled);
+    append(buf, size, &len, "# HELP %s %s\n# TYPE %s counter\n%s %.3f\n",
+           "server_throttled_seconds_total",
+           "Time reading spent paused by rate limits.",
+           "server_throttled_seconds_total", "server_throttled_seconds_total",
+           t.throttled_ns * 1e-9);
+    if (metrics->pools_num > 0) {
+        append(buf, size, &len, "# HELP %s %s\n# TYPE %s counter\n",
+               "server_pool_allocations_total",
+               "Objects handed out by pools, fresh from the heap or reused.",
+               "server_pool_allocations_total");
+    }
+    for (int p = 0; p < metrics->pools_num; p++) {
+        const metrics_pool_t *pool = &metrics->pools[p];
+        append(buf, size, &len, "%s{pool=\"%s\",source=\"heap\"} %lu\n",
+               "server_pool_allocations_total", pool->name,
+               atomic_load_explicit(&pool->stats->fresh,
+                                    memory_order_relaxed));
+        append(buf, size, &len, "%s{pool=\"%s\",source=\"reused\"} %lu\n",
+               "server_pool_allocations_total", pool->name,
+               atomic_load_explicit(&pool->stats->reused,
+                                    memory_order_relaxed));
+    }
+    append_histogram(buf, size, &len, "server_read_size_bytes",
+                     "Bytes returned by each read.", t.read_sizes,
+                     METRICS_SIZE_BASE, 1.0, (double) t.bytes);
+    append_histogram(buf, size, &len, "server_first_byte_latency_seconds",
+                     "Time from accepting a connection to its first data.",
+                     t.latencies, METRICS_LATENCY_BASE, 1e-9,
+                     t.latency_sum * 1e-9);
+
+    return len;
+}
+
+/**
+ * Sets up reporting of metrics by the process, dumping a report to stderr on
+ * every SIGUSR2 and, if admin_path is not NULL, serving a report to every
+ * connection to a Unix domain socket bound on that path. A socket left there
+ * by a previous run gets replaced, while a live one, or any other file,
+ * fails with EADDRINUSE.
+ *
+ * No thread gets started. Reports only get produced once the caller sees
+ * metrics_fd() readable and calls metrics_respond(). There may only be one
+ * reporter per process.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int metrics_listen(metrics_t *metrics, const char *admin_path)
+{
+    if (pipe2(wake_fds, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+
+    if (admin_path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(admin_path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            goto fail;
+        }
+        strcpy(addr.sun_path, admin_path);
+
+        admin_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+        if (admin_fd < 0) goto fail;
+        // Only a socket left behind by a previous run gets replaced.
+        if ((bind(admin_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+             (errno != EADDRINUSE ||
+              !unix_path_reclaimable(admin_path, SOCK_STREAM, 0) ||
+              unlink(admin_path) < 0 ||
+              bind(admin_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)) ||
+            listen(admin_fd, 16) < 0) goto fail;
+        admin_socket_path = strdup(admin_path);
+        stat(admin_path, &admin_socket_stat);
+    }
+
+    report_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (report_fd < 0) goto fail;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = wake_fds[0];
+    if (epoll_ctl(report_fd, EPOLL_CTL_ADD, wake_fds[0], &ev) < 0) goto fail;
+    ev.data.fd = admin_fd;
+    if (admin_fd >= 0 &&
+        epoll_ctl(report_fd, EPOLL_CTL_ADD, admin_fd, &ev) < 0) goto fail;
+
+    reported = metrics;
+
+    // Restart interrupted calls, as accepting loops stop on EINTR.
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = request_dump;
+    act.sa_flags = SA_RESTART;
+    sigaction(DUMP_SIGNAL, &act, NULL);
+
+    return 0;
+
+fail:;
+    int err = errno;
+    if (report_fd >= 0) close(report_fd);
+    if (admin_fd >= 0) close(admin_fd);
+    if (admin_socket_path) {
+        unlink(admin_socket_path);
+        free(admin_socket_path);
+        admin_socket_path = NULL;
+    }
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+    report_fd = admin_fd = wake_fds[0] = wake_fds[1] = -1;
+    errno = err;
+    return -1;
+}
+
+/**
+ * Sets up reporting of metrics the way metrics_listen() does, along with a
+ * reporter thread producing the reports.
+ *
+ * Reporter runs with all signals blocked, so they keep being delivered to the
+ * threads that expect them. Processes that fork afterwards should use
+ * metrics_listen() instead, since their children could only make async
+ * signal safe calls then.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+int metrics_serve(metrics_t *metrics, const char *admin_path)
+{
+    if (metrics_listen(metrics, admin_path) < 0) return -1;
+
+    sigset_t all, orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &orig);
+    int rc = pthread_create(&reporter, NULL, run_reporter, NULL);
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+    if (rc != 0) {
+        metrics_stop();
+        errno = rc;
+        return -1;
+    }
+
+    reporter_running = 1;
+    return 0;
+}
+
+/**
+ * Returns a descriptor that becomes readable once reports are due, or -1 if
+ * reporting has not been set up.
+ */
+int metrics_fd(void)
+{
+    return report_fd;
+}
+
+/**
+ * Produces every report due, without waiting for any more. Admin clients
+ * are given a little time to send their request, though.
+ */
+void metrics_respond(void)
+{
+    respond();
+}
+
+/**
+ * Stops the reporter of the process, if any, and removes its admin socket.
+ */
+void metrics_stop(void)
+{
+    if (wake_fds[1] < 0) return;
+
+    signal(DUMP_SIGNAL, SIG_IGN);
+    if (reporter_running) {
+        char c = 'q';
+        ssize_t rc = write(wake_fds[1], &c, 1);
+        (void) rc;
+        pthread_join(reporter, NULL);
+        reporter_running = 0;
+    }
+
+    close(report_fd);
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+    report_fd = wake_fds[0] = wake_fds[1] = -1;
+    if (admin_fd >= 0) {
+        close(admin_fd);
+        // A newer instance may have bound the path over in the meantime.
+        struct stat st;
+        if (stat(admin_socket_path, &st) == 0 &&
+            st.st_dev == admin_socket_stat.st_dev &&
+            st.st_ino == admin_socket_stat.st_ino) {
+            unlink(admin_socket_path);
+        }
+        free(admin_socket_path);
+        admin_socket_path = NULL;
+        admin_fd = -1;
+    }
+}
+
+/**
+ * Sums the counters of all slots.
+ */
+static void sum_slots(metrics_t *metrics, metrics_totals_t *totals)
+{
+    memset(totals, 0, sizeof(metrics_totals_t));
+
+    for (int i = 0; i < metrics->slots_num; i++) {
+        metrics_slot_t *s = &metrics->slots[i];
+        totals->accepted += atomic_load_explicit(&s->accepted,
+                                                 memory_order_relaxed);
+        totals->started += atomic_load_explicit(&s->started,
+                                                memory_order_relaxed);
+        totals->closed += atomic_load_explicit(&s->closed,
+                                               memory_order_relaxed);
+        for (int k = 0; k < METRICS_TIMEOUTS; k++) {
+            totals->timed_out[k] += atomic_load_explicit(
+                    &s->timed_out[k], memory_order_relaxed);
+        }
+        totals->bytes += atomic_load_explicit(&s->bytes,
+                                              memory_order_relaxed);
+        totals->reads += atomic_load_explicit(&s->reads,
+                                              memory_order_relaxed);
+        totals->latency_sum += atomic_load_explicit(&s->latency_sum,
+                                                    memory_order_relaxed);
+        totals->throttled += atomic_load_explicit(&s->throttled,
+                                                  memory_order_relaxed);
+        totals->throttled_ns += atomic_load_explicit(&s->throttled_ns,
+                                                     memory_order_relaxed);
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            totals->read_sizes[b] += atomic_load_explicit(
+                    &s->read_sizes[b], memory_order_relaxed);
+            totals->latencies[b] += atomic_load_explicit(
+                    &s->latencies[b], memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * Returns the histogram bucket of a value, where bucket i holds values up to
+ * base * 2^i and the last bucket everything above.
+ */
+static int bucket_of(uint64_t value, uint64_t base)
+{
+    if (value <= base) return 0;
+    int b = 64 - __builtin_clzll((value - 1) / base);
+    return b < METRICS_BUCKETS - 1 ? b : METRICS_BUCKETS - 1;
+}
+
+/**
+ * Appends formatted text to a report, keeping it null terminated.
+ */
+static void append(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+    if (*len + 1 >= size) return;
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + *len, size - *len, fmt, args);
+    va_end(args);
+
+    if (n > 0) *len += (size_t) n < size - *len ? (size_t) n : size - *len - 1;
+}
+
+static void append_counter(char *buf, size_t size, size_t *len,
+                           const char *name, const char *help,
+                           const char *type, uint64_t value)
+{
+    append(buf, size, len, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+           name, help, name, type, name, (unsigned long long) value);
+}
+
+/**
+ * Appends a histogram, converting bucket bounds to its unit with scale.
+ */
+static void append_histogram(char *buf, size_t size, size_t *len,
+                             const char *name, const char *help,
+                             const uint64_t *buckets, uint64_t base,
+                             double scale, double sum)
+{
+    append(buf, size, len, "# HELP %s %s\n# TYPE %s histogram\n",
+           name, help, name);
+
+    // Prometheus buckets are cumulative.
+    uint64_t count = 0;
+    for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+        count += buckets[b];
+        append(buf, size, len, "%s_bucket{le=\"%g\"} %llu\n", name,
+               (double) (base << b) * scale, (unsigned long long) count);
+    }
+    count += buckets[METRICS_BUCKETS - 1];
+    append(buf, size, len, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+           (unsigned long long) count);
+    append(buf, size, len, "%s_sum %.9g\n%s_count %llu\n", name, sum,
+           name, (unsigned long long) count);
+}
+
+/**
+ * Entry point of the reporter thread.
+ */
+static void *run_reporter(void *args)
+{
+    (void) args;
+
+    struct pollfd pfd = { report_fd, POLLIN, 0 };
+    while (1) {
+        if (poll(&pfd, 1, -1) <= 0) continue;
+        if (respond()) return NULL;
+    }
+}
+
+/**
+ * Dumps a report if the dump signal has arrived, and serves every admin
+ * client waiting, unless the reporter thread has been asked to quit.
+ *
+ * Returns non-zero if the reporter thread should quit.
+ */
+static int respond(void)
+{
+    char wakes[64];
+    ssize_t n;
+    int dump = 0;
+    while ((n = read(wake_fds[0], wakes, sizeof(wakes))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            if (wakes[i] == 'q') return 1;
+        }
+        dump = 1;
+    }
+    if (dump) {
+        char report[REPORT_SIZE];
+        size_t len = metrics_format(reported, report, sizeof(report));
+        write_all(STDERR_FILENO, report, len);
+    }
+
+    int fd;
+    while (admin_fd >= 0 &&
+           (fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
+        serve_admin_client(fd);
+        close(fd);
+    }
+    return 0;
+}
+
+/**
+ * Writes a report to an admin client, wrapped in an HTTP response if the
+ * client asked for one.
+ */
+static void serve_admin_client(int fd)
+{
+    // Slow clients should not stall the reporter for long.
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[512];
+    ssize_t n = 0;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, REQUEST_WAIT_MS) > 0) {
+        n = recv(fd, request, sizeof(request), MSG_DONTWAIT);
+    }
+
+    char report[REPORT_SIZE];
+    size_t len = metrics_format(reported, report, sizeof(report));
+
+    if (n >= 4 && strncmp(request, "GET ", 4) == 0) {
+        char header[128];
+        int hlen = snprintf(header, sizeof(header),
+                            "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n\r\n", len);
+        if (send_all(fd, header, hlen) < 0) return;
+    }
+    send_all(fd, report, len);
+}
+
+/**
+ * Writes all given data, unless an error occurs.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Sends all given data to a socket, unless an error occurs. Clients that
+ * hang up early, like servers probing whether the path is still in use, do
+ * not raise SIGPIPE.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Asks the reporter for a dump.
+ *
+ * This is a signal handler, that should be connected to the dump signal.
+ */
+static void request_dump(int signum)
+{
+    if (signum == DUMP_SIGNAL) {
+        int saved = errno;
+        char c = 'd';
+        ssize_t rc = write(wake_fds[1], &c, 1);
+        (void) rc;
+        errno = saved;
+    }
+}
@@ -0,0 +1,82 @@
+/**
+ * metrics.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to record runtime metrics of
+ * a server into per-thread or per-process slots, and to report their totals
+ * in Prometheus text format.
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "pool.h"
+
+#define METRICS_BUCKETS 16      // Buckets of each histogram, last one is +Inf.
+#define METRICS_SIZE_BASE 64    // Upper bound of first read size bucket.
+#define METRICS_LATENCY_BASE 16000  // Upper bound of first latency bucket, ns.
+#define METRICS_TIMEOUTS 3      // Kinds of timeouts, as in timeouts.h.
+#define METRICS_POOLS 4         // Pools that may be reported.
+
+// Counters of a single writer. Slots are only shared when there are more
+// writers than slots, which costs contention but never accuracy.
+typedef struct {
+    _Alignas(64) atomic_ulong accepted;  // Connections accepted.
+    atomic_ulong started;  // Connections handed to a handler.
+    atomic_ulong closed;   // Connections closed after being served.
+    atomic_ulong timed_out[METRICS_TIMEOUTS];  // Of them, closed on timeout.
+    atomic_ulong bytes;    // Bytes received.
+    atomic_ulong reads;    // Reads that returned data.
+    atomic_ulong read_sizes[METRICS_BUCKETS];
+    atomic_ulong latencies[METRICS_BUCKETS];  // Accept to first byte.
+    atomic_ulong latency_sum;  // In ns.
+    atomic_ulong throttled;     // Times reading paused by rate limits.
+    atomic_ulong throttled_ns;  // Time spent paused.
+} metrics_slot_t;
+
+// Reuse counters of a pool, only reported by the process that added it.
+typedef struct {
+    const char *name;
+    const pool_stats_t *stats;
+} metrics_pool_t;
+
+// Lives in an anonymous shared mapping, so processes forked after its
+// creation record into the same slots.
+typedef struct {
+    int slots_num;
+    atomic_int claimed;  // Slots handed out so far.
+    int pools_num;
+    metrics_pool_t pools[METRICS_POOLS];
+    metrics_slot_t slots[];
+} metrics_t;
+
+
+metrics_t *metrics_create(int slots_num);
+void metrics_destroy(metrics_t *metrics);
+metrics_slot_t *metrics_claim(metrics_t *metrics);
+void metrics_add_pool(metrics_t *metrics, const char *name,
+                      const pool_stats_t *stats);
+uint64_t metrics_now(void);
+void metrics_accepted(metrics_slot_t *slot);
+void metrics_started(metrics_slot_t *slot);
+void metrics_closed(metrics_slot_t *slot);
+void metrics_timed_out(metrics_slot_t *slot, int kind);
+void metrics_read(metrics_slot_t *slot, size_t bytes);
+void metrics_first_byte(metrics_slot_t *slot, uint64_t accepted_at);
+void metrics_throttled(metrics_slot_t *slot, uint64_t ns);
+size_t metrics_format(metrics_t *metrics, char *buf, size_t size);
+int metrics_listen(metrics_t *metrics, const char *admin_path);
+int metrics_serve(metrics_t *metrics, const char *admin_path);
+int metrics_fd(void);
+void metrics_respond(void);
+void metrics_stop(void);
+
+#endif
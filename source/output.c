@@ -0,0 +1,388 @@
+/**
+ * output.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in output.h.
+ *
+ * Handlers never block on each other. They only contend on the atomic
+ * positions of the rings. The writer gathers submitted chunks and writes
+ * them out with a single writev(), as soon as either flush_size bytes are
+ * pending or the oldest pending chunk has waited for flush_delay. When
+ * there is nothing to write, it sleeps until a handler submits a chunk.
+ *
+ * Chunks come from the heap until enough of them get recycled. Data that
+ * finds no chunk to hold it gets dropped and counted, instead of stalling
+ * handlers, and the pipeline warns about it on stderr.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "output.h"
+
+
+#define QUEUE_CAPACITY 4096  // Chunks that may wait for the writer.
+#define WRITE_BATCH 512      // Max chunks gathered by a single writev().
+
+
+static void *run_writer(void *args);
+static void write_batch(output_t *out, output_chunk_t **batch, int count);
+static output_chunk_t *acquire_chunk(output_t *out);
+static void release_chunk(output_t *out, output_chunk_t *chunk);
+static void submit_chunk(output_t *out, output_chunk_t *chunk);
+static void wake_writer(output_t *out);
+static void drop_data(output_t *out, size_t len);
+static uint64_t now_ns(void);
+
+
+/**
+ * Creates a pipeline writing to fd and starts its writer thread.
+ *
+ * Returns the pipeline, or NULL on failure with errno set.
+ */
+output_t *output_create(int fd, size_t flush_size, unsigned flush_delay_us)
+{
+    output_t *out = (output_t *) malloc(sizeof(output_t));
+    if (!out) return NULL;
+    out->fd = fd;
+    out->flush_size = flush_size;
+    out->flush_delay = (uint64_t) flush_delay_us * 1000;
+    out->queue = ring_create(QUEUE_CAPACITY);
+    out->free_chunks = ring_create(QUEUE_CAPACITY);
+    if (!out->queue || !out->free_chunks) goto fail;
+    atomic_init(&out->stop, 0);
+    atomic_init(&out->idle, 0);
+    atomic_init(&out->dropped, 0);
+    pthread_mutex_init(&out->idle_mutex, NULL);
+    pthread_cond_init(&out->idle_cond, NULL);
+
+    int rc = pthread_create(&out->writer, NULL, run_writer, (void *) out);
+    if (rc != 0) {
+        pthread_mutex_destroy(&out->idle_mutex);
+        pthread_cond_destroy(&out->idle_cond);
+        errno = rc;
+        goto fail;
+    }
+
+    return out;
+
+fail:;
+    int err = errno;
+    if (out->queue) ring_destroy(out->queue);
+    if (out->free_chunks) ring_destroy(out->free_chunks);
+    free(out);
+    errno = err;
+    return NULL;
+}
+
+/**
+ * Writes out everything submitted so far and destroys the pipeline.
+ *
+ * No stream should be written to after calling it.
+ */
+void output_destroy(output_t *out)
+{
+    atomic_store(&out->stop, 1);
+    wake_writer(out);
+    pthread_join(out->writer, NULL);
+
+    unsigned long dropped = atomic_load(&out->dropped);
+    if (dropped > 0) {
+        fprintf(stderr, "WARNING: Output dropped %lu bytes, for lack of "
+                "memory.\n", dropped);
+    }
+
+    output_chunk_t *chunk;
+    while ((chunk = (output_chunk_t *) ring_pop(out->free_chunks))) free(chunk);
+    ring_destroy(out->free_chunks);
+    ring_destroy(out->queue);
+    pthread_mutex_destroy(&out->idle_mutex);
+    pthread_cond_destroy(&out->idle_cond);
+    free(out);
+}
+
+void output_stream_init(output_stream_t *stream, output_t *out)
+{
+    stream->out = out;
+    stream->chunk = NULL;
+}
+
+/**
+ * Stages data of a connection, submitting every complete line of it.
+ *
+ * A partial line is kept staged, until either its end arrives, the chunk
+ * gets full or the stream gets closed.
+ */
+void output_stream_write(output_stream_t *stream, const char *data, size_t len)
+{
+    output_t *out = stream->out;
+
+    while (len > 0) {
+        if (!stream->chunk) stream->chunk = acquire_chunk(out);
+        output_chunk_t *chunk = stream->chunk;
+        if (!chunk) {
+            drop_data(out, len);
+            return;
+        }
+
+        size_t n = OUTPUT_CHUNK_SIZE - chunk->len;
+        if (n > len) n = len;
+        memcpy(chunk->data + chunk->len, data, n);
+        chunk->len += n;
+        data += n;
+        len -= n;
+
+        if (chunk->len == OUTPUT_CHUNK_SIZE) {
+            submit_chunk(out, chunk);
+            stream->chunk = NULL;
+        }
+    }
+
+    output_chunk_t *chunk = stream->chunk;
+    if (!chunk) return;
+    char *last = (char *) memrchr(chunk->data, '\n', chunk->len);
+    if (!last) return;
+
+    // Move the trailing partial line, if any, to a new chunk.
+    size_t complete = last - chunk->data + 1;
+    stream->chunk = NULL;
+    if (complete < chunk->len) {
+        stream->chunk = acquire_chunk(out);
+        if (stream->chunk) {
+            stream->chunk->len = chunk->len - complete;
+            memcpy(stream->chunk->data, chunk->data + complete,
+                   stream->chunk->len);
+        }
+        else drop_data(out, chunk->len - complete);
+        chunk->len = complete;
+    }
+    submit_chunk(out, chunk);
+}
+
+/**
+ * Stages a whole message as a line of its own, adding a line end if it has
+ * none.
+ *
+ * Messages are not submitted one by one, but once output_stream_flush() gets
+ * called, or the chunk gets full. A message never gets split among chunks,
+ * unless it does not fit in one.
+ */
+void output_stream_write_message(output_stream_t *stream, const char *data,
+                                 size_t len)
+{
+    int add_newline = len == 0 || data[len - 1] != '\n';
+    size_t total = len + add_newline;
+
+    output_chunk_t *chunk = stream->chunk;
+    if (chunk && OUTPUT_CHUNK_SIZE - chunk->len < total) {
+        output_stream_flush(stream);
+        chunk = NULL;
+    }
+    if (!chunk) chunk = stream->chunk = acquire_chunk(stream->out);
+    if (!chunk) {
+        drop_data(stream->out, total);
+        return;
+    }
+
+    if (total <= OUTPUT_CHUNK_SIZE) {
+        memcpy(chunk->data + chunk->len, data, len);
+        chunk->len += len;
+        if (add_newline) chunk->data[chunk->len++] = '\n';
+        return;
+    }
+
+    output_stream_write(stream, data, len);
+    if (add_newline) output_stream_write(stream, "\n", 1);
+}
+
+/**
+ * Stages the payload of a received frame as a message, on the output stream
+ * given as arg. It is a frame_handler_t, for feeding frame readers.
+ *
+ * Returns 0, as staging never fails.
+ */
+int output_stream_write_frame(const frame_t *frame, void *arg)
+{
+    output_stream_write_message((output_stream_t *) arg, frame->payload,
+                                frame->length);
+    return 0;
+}
+
+/**
+ * Submits anything staged on the stream.
+ */
+void output_stream_flush(output_stream_t *stream)
+{
+    if (!stream->chunk) return;
+    if (stream->chunk->len > 0) submit_chunk(stream->out, stream->chunk);
+    else release_chunk(stream->out, stream->chunk);
+    stream->chunk = NULL;
+}
+
+/**
+ * Submits anything still staged on the stream.
+ */
+void output_stream_close(output_stream_t *stream)
+{
+    output_stream_flush(stream);
+}
+
+/**
+ * Entry point of the writer thread.
+ */
+static void *run_writer(void *args)
+{
+    output_t *out = (output_t *) args;
+    output_chunk_t *batch[WRITE_BATCH];
+    int count = 0;
+    size_t bytes = 0;
+
+    while (1) {
+        output_chunk_t *chunk;
+        while (count < WRITE_BATCH &&
+               (chunk = (output_chunk_t *) ring_pop(out->queue))) {
+            batch[count++] = chunk;
+            bytes += chunk->len;
+        }
+        int stop = atomic_load(&out->stop);
+
+        if (count > 0) {
+            uint64_t waited = now_ns() - batch[0]->submit_time;
+            if (bytes >= out->flush_size || count == WRITE_BATCH ||
+                waited >= out->flush_delay || stop) {
+                write_batch(out, batch, count);
+                count = 0;
+                bytes = 0;
+            }
+            else {
+                // Give more data the chance to arrive, until oldest is due.
+                uint64_t left = out->flush_delay - waited;
+                struct timespec ts = { left / 1000000000ULL,
+                                       left % 1000000000ULL };
+                nanosleep(&ts, NULL);
+            }
+            continue;
+        }
+        if (stop) break;
+
+        // Nothing to write, so sleep until a chunk gets submitted. Ring is
+        // checked again after announcing the sleep, so no wake-up is lost.
+        pthread_mutex_lock(&out->idle_mutex);
+        atomic_store(&out->idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        chunk = (output_chunk_t *) ring_pop(out->queue);
+        if (!chunk && !atomic_load(&out->stop)) {
+            pthread_cond_wait(&out->idle_cond, &out->idle_mutex);
+        }
+        atomic_store(&out->idle, 0);
+        pthread_mutex_unlock(&out->idle_mutex);
+
+        if (chunk) {
+            batch[count++] = chunk;
+            bytes += chunk->len;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Writes out a batch of chunks with as few writev() calls as possible, then
+ * makes them available for reuse.
+ */
+static void write_batch(output_t *out, output_chunk_t **batch, int count)
+{
+    struct iovec iov[WRITE_BATCH];
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = batch[i]->data;
+        iov[i].iov_len = batch[i]->len;
+    }
+
+    int first = 0;
+    while (first < count) {
+        ssize_t n = writev(out->fd, iov + first, count - first);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;  // Output is gone, so there is no point in retrying.
+        }
+
+        // Skip what has been completely written and resume the rest.
+        while (first < count && (size_t) n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (first < count) {
+            iov[first].iov_base = (char *) iov[first].iov_base + n;
+            iov[first].iov_len -= n;
+        }
+    }
+
+    for (int i = 0; i < count; i++) release_chunk(out, batch[i]);
+}
+
+/**
+ * Returns an empty chunk, or NULL if none could be allocated.
+ */
+static output_chunk_t *acquire_chunk(output_t *out)
+{
+    output_chunk_t *chunk = (output_chunk_t *) ring_pop(out->free_chunks);
+    if (!chunk) chunk = (output_chunk_t *) malloc(sizeof(output_chunk_t));
+    if (chunk) chunk->len = 0;
+    return chunk;
+}
+
+/**
+ * Counts data dropped for lack of a chunk, warning about the first drop.
+ */
+static void drop_data(output_t *out, size_t len)
+{
+    if (atomic_fetch_add_explicit(&out->dropped, len,
+                                  memory_order_relaxed) == 0) {
+        perror("WARNING: Output is dropping data");
+    }
+}
+
+static void release_chunk(output_t *out, output_chunk_t *chunk)
+{
+    if (ring_push(out->free_chunks, chunk) < 0) free(chunk);
+}
+
+/**
+ * Hands a chunk to the writer. When the writer falls behind, handlers wait
+ * here, so that memory stays bounded.
+ */
+static void submit_chunk(output_t *out, output_chunk_t *chunk)
+{
+    chunk->submit_time = now_ns();
+    while (ring_push(out->queue, chunk) < 0) {
+        wake_writer(out);
+        sched_yield();
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&out->idle)) wake_writer(out);
+}
+
+static void wake_writer(output_t *out)
+{
+    pthread_mutex_lock(&out->idle_mutex);
+    pthread_cond_signal(&out->idle_cond);
+    pthread_mutex_unlock(&out->idle_mutex);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
@@ -0,0 +1,65 @@
+/**
+ * output.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to create and manage a
+ * batched output pipeline. Handlers stage received data into chunks, which
+ * get handed over a lock-free ring to a dedicated writer thread, that
+ * writes them out with large writev() calls.
+ *
+ */
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ring.h"
+#include "frame.h"
+
+#define OUTPUT_CHUNK_SIZE 16384  // Capacity of each chunk.
+
+typedef struct {
+    size_t len;
+    uint64_t submit_time;  // When it was handed to the writer, in ns.
+    char data[OUTPUT_CHUNK_SIZE];
+} output_chunk_t;
+
+typedef struct {
+    int fd;                // Descriptor written to.
+    size_t flush_size;     // Bytes that trigger a write at once.
+    uint64_t flush_delay;  // Max time in ns that a chunk waits to be written.
+    ring_t *queue;         // Chunks waiting to be written.
+    ring_t *free_chunks;   // Chunks ready to be reused.
+    pthread_t writer;
+    atomic_int stop;       // Set when the writer should drain and exit.
+    atomic_int idle;       // Set while the writer sleeps on idle_cond.
+    atomic_ulong dropped;  // Bytes staged with no chunk to hold them.
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+} output_t;
+
+// Per connection staging area. Complete lines are submitted at once, so the
+// data of a connection never interleaves with others in the middle of lines.
+typedef struct {
+    output_t *out;
+    output_chunk_t *chunk;  // Chunk being filled, NULL if none.
+} output_stream_t;
+
+
+output_t *output_create(int fd, size_t flush_size, unsigned flush_delay_us);
+void output_destroy(output_t *out);
+void output_stream_init(output_stream_t *stream, output_t *out);
+void output_stream_write(output_stream_t *stream, const char *data, size_t len);
+void output_stream_write_message(output_stream_t *stream, const char *data,
+                                 size_t len);
+int output_stream_write_frame(const frame_t *frame, void *arg);
+void output_stream_flush(output_stream_t *stream);
+void output_stream_close(output_stream_t *stream);
+
+#endif
@@ -0,0 +1,194 @@
+/**
+ * pool.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in pool.h.
+ *
+ * Every thread keeps a small cache of objects of each pool, in static thread
+ * local storage, so most objects get recycled by the thread that freed them
+ * with no atomic operation at all. Caches overflow into the depot of their
+ * pool, a lock-free ring, which also feeds threads that allocate more than
+ * they free, like acceptors. Only when the depot is empty, or full, objects
+ * come from, or go back to, the heap. Threads should flush their caches
+ * before they exit, or else the objects in them are lost.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include "pool.h"
+
+
+typedef struct {
+    int count;
+    void *objs[POOL_CACHE_SIZE];
+} pool_cache_t;
+
+
+static int class_of(const buf_pool_t *pool, size_t size);
+
+static obj_pool_t *pools[POOL_MAX];  // Created so far, by id.
+static atomic_int pools_num = 0;
+static __thread pool_cache_t caches[POOL_MAX];  // Of current thread.
+
+
+/**
+ * Creates a pool of objects of given size, keeping up to depot_size of them
+ * besides the ones cached by threads.
+ *
+ * Returns the pool, or NULL on failure with errno set.
+ */
+obj_pool_t *obj_pool_create(size_t size, size_t depot_size)
+{
+    int id = atomic_fetch_add(&pools_num, 1);
+    if (id >= POOL_MAX) {
+        atomic_fetch_sub(&pools_num, 1);
+        errno = ENOSPC;
+        return NULL;
+    }
+
+    obj_pool_t *pool = (obj_pool_t *) aligned_alloc(64, sizeof(obj_pool_t));
+    if (!pool) return NULL;
+    pool->id = id;
+    pool->size = size;
+    pool->depot = ring_create(depot_size);
+    if (!pool->depot) {
+        free(pool);
+        return NULL;
+    }
+    pool->stats = &pool->own_stats;
+    atomic_init(&pool->own_stats.fresh, 0);
+    atomic_init(&pool->own_stats.reused, 0);
+    pools[id] = pool;
+
+    return pool;
+}
+
+/**
+ * Returns an object of the pool, or NULL if none could be allocated.
+ */
+void *obj_pool_get(obj_pool_t *pool)
+{
+    pool_cache_t *cache = &caches[pool->id];
+    void *obj = cache->count > 0 ? cache->objs[--cache->count]
+                                 : ring_pop(pool->depot);
+    if (obj) {
+        atomic_fetch_add_explicit(&pool->stats->reused, 1,
+                                  memory_order_relaxed);
+        return obj;
+    }
+
+    obj = malloc(pool->size);
+    if (obj) {
+        atomic_fetch_add_explicit(&pool->stats->fresh, 1,
+                                  memory_order_relaxed);
+    }
+    return obj;
+}
+
+/**
+ * Returns an object to the pool it was taken from.
+ */
+void obj_pool_put(obj_pool_t *pool, void *obj)
+{
+    if (!obj) return;
+    pool_cache_t *cache = &caches[pool->id];
+    if (cache->count < POOL_CACHE_SIZE) cache->objs[cache->count++] = obj;
+    else if (ring_push(pool->depot, obj) < 0) free(obj);
+}
+
+/**
+ * Creates a pool of buffers of min_size, doubling up to max_size, the way
+ * recv_buffer_t grows. The depot of every class holds up to
+ * BUF_POOL_DEPOT_BYTES.
+ *
+ * Returns the pool, or NULL on failure with errno set.
+ */
+buf_pool_t *buf_pool_create(size_t min_size, size_t max_size)
+{
+    if (min_size == 0) min_size = 1;
+    if (max_size < min_size) max_size = min_size;
+
+    buf_pool_t *pool = (buf_pool_t *) aligned_alloc(64, sizeof(buf_pool_t));
+    if (!pool) return NULL;
+    pool->min_size = min_size;
+    pool->max_size = max_size;
+    pool->classes = 0;
+    atomic_init(&pool->stats.fresh, 0);
+    atomic_init(&pool->stats.reused, 0);
+
+    size_t size = min_size;
+    while (pool->classes < BUF_POOL_CLASSES) {
+        if (size > max_size) size = max_size;
+        size_t depot_size = BUF_POOL_DEPOT_BYTES / size;
+        if (depot_size < POOL_CACHE_SIZE) depot_size = POOL_CACHE_SIZE;
+        if (depot_size > POOL_DEPOT_SIZE) depot_size = POOL_DEPOT_SIZE;
+
+        obj_pool_t *class = obj_pool_create(size, depot_size);
+        if (!class) return NULL;  // Pools are never freed.
+        class->stats = &pool->stats;
+        pool->pools[pool->classes++] = class;
+        if (size == max_size) break;
+        size *= 2;
+    }
+
+    return pool;
+}
+
+/**
+ * Returns a buffer of at least given size, or NULL if none could be
+ * allocated. It should be put back with the same size.
+ */
+void *buf_pool_get(buf_pool_t *pool, size_t size)
+{
+    int class = class_of(pool, size);
+    if (class >= 0) return obj_pool_get(pool->pools[class]);
+
+    void *buf = malloc(size);
+    if (buf) {
+        atomic_fetch_add_explicit(&pool->stats.fresh, 1,
+                                  memory_order_relaxed);
+    }
+    return buf;
+}
+
+/**
+ * Returns a buffer taken from the pool with given size.
+ */
+void buf_pool_put(buf_pool_t *pool, void *buf, size_t size)
+{
+    int class = class_of(pool, size);
+    if (class >= 0) obj_pool_put(pool->pools[class], buf);
+    else free(buf);
+}
+
+/**
+ * Moves the objects cached by the calling thread to the depots of their
+ * pools. Should be called by threads before they exit.
+ */
+void pool_thread_flush(void)
+{
+    int num = atomic_load(&pools_num);
+    if (num > POOL_MAX) num = POOL_MAX;
+
+    for (int id = 0; id < num; id++) {
+        pool_cache_t *cache = &caches[id];
+        while (cache->count > 0) {
+            void *obj = cache->objs[--cache->count];
+            if (ring_push(pools[id]->depot, obj) < 0) free(obj);
+        }
+    }
+}
+
+/**
+ * Returns the class of buffers of given size, or -1 if they are too large.
+ */
+static int class_of(const buf_pool_t *pool, size_t size)
+{
+    int class = 0;
+    while (class < pool->classes && pool->pools[class]->size < size) class++;
+    return class < pool->classes ? class : -1;
+}
@@ -0,0 +1,62 @@
+/**
+ * pool.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to recycle objects of fixed
+ * size, and buffers of a few size classes, instead of going to the heap for
+ * every one of them.
+ *
+ * Pools live as long as the process does, so threads may return objects to
+ * them at any time, even while the process exits.
+ *
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+#define POOL_MAX 32          // Pools a process may create.
+#define POOL_CACHE_SIZE 8    // Objects every thread keeps of each pool.
+#define POOL_DEPOT_SIZE 1024 // Objects shared by all threads, by default.
+#define BUF_POOL_CLASSES 16  // Size classes of buffer pools, at most.
+#define BUF_POOL_DEPOT_BYTES (4 * 1024 * 1024)  // Kept of every class.
+
+typedef struct {
+    _Alignas(64) atomic_ulong fresh;  // Objects allocated from the heap.
+    atomic_ulong reused;              // Objects handed out again.
+} pool_stats_t;
+
+typedef struct {
+    int id;               // Index of the caches of the pool in every thread.
+    size_t size;          // Bytes of every object.
+    ring_t *depot;        // Objects left over by thread caches.
+    pool_stats_t *stats;  // Where reuse gets counted.
+    pool_stats_t own_stats;
+} obj_pool_t;
+
+// Buffers of min_size, doubling up to max_size, each size in a pool of its
+// own. Larger ones come from the heap.
+typedef struct {
+    size_t min_size;
+    size_t max_size;
+    int classes;
+    obj_pool_t *pools[BUF_POOL_CLASSES];
+    pool_stats_t stats;  // Of all classes.
+} buf_pool_t;
+
+
+obj_pool_t *obj_pool_create(size_t size, size_t depot_size);
+void *obj_pool_get(obj_pool_t *pool);
+void obj_pool_put(obj_pool_t *pool, void *obj);
+buf_pool_t *buf_pool_create(size_t min_size, size_t max_size);
+void *buf_pool_get(buf_pool_t *pool, size_t size);
+void buf_pool_put(buf_pool_t *pool, void *buf, size_t size);
+void pool_thread_flush(void);
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ * rate_limit.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in rate_limit.h.
+ *
+ * Every bucket is a single timestamp, the theoretical arrival time of the
+ * generic cell rate algorithm: charging moves it later by the time the
+ * tokens taken are worth, starting from now if it lies in the past, and the
+ * bucket is in debt by however much it ends up more than a burst away. So
+ * charging is a compare and swap, with no lock, even for buckets shared by
+ * every connection of a source. Buckets of sources are kept in a source
+ * table, the way admission counts connections, which is only locked when
+ * connections start and end. Its entries never move while referenced, so
+ * connections keep pointing to theirs, and it is shared with processes
+ * forked after creating the limiter.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "admission.h"
+#include "rate_limit.h"
+
+
+#define NS_PER_SEC 1000000000ULL
+#define DEFAULT_BURST_NS (NS_PER_SEC / 10)
+
+
+static int parse_rate(const char *value, uint64_t *rate);
+static uint64_t charge(atomic_uint_least64_t *tat, uint64_t rate,
+                       size_t units, uint64_t burst_ns, uint64_t now);
+static void charge_bucket(rate_bucket_t *bucket, const rate_t *rate,
+                          size_t bytes, size_t msgs, uint64_t burst_ns,
+                          uint64_t now, uint64_t *pause);
+
+
+/**
+ * Parses a comma separated list of limits into limits. Rates of each
+ * connection are given as "bytes=rate" and "msgs=rate", and of each source
+ * as "addr_bytes=rate" and "addr_msgs=rate", optionally suffixed by k, m or
+ * g. Buckets hold "burst=seconds" worth of their rate, 0.1 by default.
+ *
+ * Returns 0 on success, -1 with errno set to EINVAL on invalid list.
+ */
+int rate_limits_parse(char *spec, rate_limits_t *limits)
+{
+    enum { BYTES, MSGS, ADDR_BYTES, ADDR_MSGS, BURST };
+    char *const names[] = {
+        "bytes", "msgs", "addr_bytes", "addr_msgs", "burst", NULL
+    };
+
+    if (limits->burst_ns == 0) limits->burst_ns = DEFAULT_BURST_NS;
+
+    while (*spec != '\0') {
+        char *value, *end;
+        int opt = getsubopt(&spec, names, &value);
+        if (opt < 0 || !value) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        int rc = 0;
+        switch (opt) {
+            case BYTES: rc = parse_rate(value, &limits->conn.bytes); break;
+            case MSGS: rc = parse_rate(value, &limits->conn.msgs); break;
+            case ADDR_BYTES: rc = parse_rate(value, &limits->addr.bytes);
+                             break;
+            case ADDR_MSGS: rc = parse_rate(value, &limits->addr.msgs); break;
+            case BURST: {
+                double seconds = strtod(value, &end);
+                if (end == value || *end != '\0' || !(seconds > 0)) rc = -1;
+                else limits->burst_ns = (uint64_t) (seconds * NS_PER_SEC);
+                break;
+            }
+        }
+        if (rc < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Returns non-zero if any rate is limited at all.
+ */
+int rate_limits_enabled(const rate_limits_t *limits)
+{
+    return limits->conn.bytes > 0 || limits->conn.msgs > 0 ||
+           limits->addr.bytes > 0 || limits->addr.msgs > 0;
+}
+
+/**
+ * Creates a rate limiter enforcing given limits.
+ *
+ * Returns the limiter, or NULL on failure with errno set.
+ */
+rate_limiter_t *rate_limiter_create(const rate_limits_t *limits)
+{
+    rate_limiter_t *limiter =
+            (rate_limiter_t *) aligned_alloc(64, sizeof(rate_limiter_t));
+    if (!limiter) return NULL;
+
+    limiter->limits = *limits;
+    if (limiter->limits.burst_ns == 0) {
+        limiter->limits.burst_ns = DEFAULT_BURST_NS;
+    }
+    limiter->sources = NULL;
+
+    if (limits->addr.bytes > 0 || limits->addr.msgs > 0) {
+        limiter->sources = source_table_create(RATE_SOURCES,
+                                               sizeof(rate_bucket_t));
+        if (!limiter->sources) {
+            free(limiter);
+            return NULL;
+        }
+    }
+
+    return limiter;
+}
+
+/**
+ * Destroys a rate limiter, along with the buckets of all sources.
+ */
+void rate_limiter_destroy(rate_limiter_t *limiter)
+{
+    if (limiter->sources) source_table_destroy(limiter->sources);
+    free(limiter);
+}
+
+/**
+ * Starts limiting a connection from given source, as of admission_source().
+ * Should be freed once closed. If the table of sources is full, or the
+ * source is ADMISSION_NO_SOURCE, only the limits of the connection itself
+ * apply to it.
+ */
+void rate_conn_init(rate_limiter_t *limiter, rate_conn_t *conn,
+                    uint64_t source)
+{
+    atomic_init(&conn->bucket.bytes_tat, 0);
+    atomic_init(&conn->bucket.msgs_tat, 0);
+    conn->source_bucket = NULL;
+    conn->source = source;
+    if (!limiter->sources || source == ADMISSION_NO_SOURCE) return;
+
+    conn->source_bucket = (rate_bucket_t *) source_table_acquire(
+            limiter->sources, source, 0);
+}
+
+/**
+ * Stops limiting a connection, dropping its source once it has no other
+ * connection.
+ */
+void rate_conn_free(rate_limiter_t *limiter, rate_conn_t *conn)
+{
+    if (!conn->source_bucket) return;
+    conn->source_bucket = NULL;
+    source_table_release(limiter->sources, conn->source);
+}
+
+/**
+ * Charges a connection for having read given bytes and messages.
+ *
+ * Returns the time in ns the connection should stop reading for, so that
+ * it pays back its debt, or 0 if it may go on.
+ */
+uint64_t rate_conn_charge(rate_limiter_t *limiter, rate_conn_t *conn,
+                          size_t bytes, size_t msgs)
+{
+    const rate_limits_t *limits = &limiter->limits;
+    uint64_t now = rate_now_ns();
+    uint64_t pause = 0;
+
+    charge_bucket(&conn->bucket, &limits->conn, bytes, msgs,
+                  limits->burst_ns, now, &pause);
+    if (conn->source_bucket) {
+        charge_bucket(conn->source_bucket, &limits->addr, bytes, msgs,
+                      limits->burst_ns, now, &pause);
+    }
+
+    return pause;
+}
+
+/**
+ * Returns a monotonic timestamp in ns.
+ */
+uint64_t rate_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * Parses a positive rate, optionally suffixed by k, m or g.
+ */
+static int parse_rate(const char *value, uint64_t *rate)
+{
+    char *end;
+    double r = strtod(value, &end);
+    switch (*end) {
+        case 'k': case 'K': r *= 1e3; end++; break;
+        case 'm': case 'M': r *= 1e6; end++; break;
+        case 'g': case 'G': r *= 1e9; end++; break;
+    }
+    if (end == value || *end != '\0' || !(r >= 1) || r > 1e15) return -1;
+    *rate = (uint64_t) r;
+    return 0;
+}
+
+/**
+ * Takes the tokens of given units out of a bucket filling at rate per
+ * second, holding burst_ns worth of them.
+ *
+ * Returns the debt of the bucket in ns, 0 if none.
+ */
+static uint64_t charge(atomic_uint_least64_t *tat, uint64_t rate,
+                       size_t units, uint64_t burst_ns, uint64_t now)
+{
+    uint64_t cost = (uint64_t) units * NS_PER_SEC / rate;
+    uint64_t old = atomic_load_explicit(tat, memory_order_relaxed);
+    uint64_t new;
+    do {
+        new = (old > now ? old : now) + cost;
+    } while (!atomic_compare_exchange_weak_explicit(
+            tat, &old, new, memory_order_relaxed, memory_order_relaxed));
+
+    return new - now > burst_ns ? new - now - burst_ns : 0;
+}
+
+/**
+ * Charges both rates of a bucket, raising pause to the longest debt.
+ */
+static void charge_bucket(rate_bucket_t *bucket, const rate_t *rate,
+                          size_t bytes, size_t msgs, uint64_t burst_ns,
+                          uint64_t now, uint64_t *pause)
+{
+    uint64_t debt;
+    if (rate->bytes > 0 && bytes > 0) {
+        debt = charge(&bucket->bytes_tat, rate->bytes, bytes, burst_ns, now);
+        if (debt > *pause) *pause = debt;
+    }
+    if (rate->msgs > 0 && msgs > 0) {
+        debt = charge(&bucket->msgs_tat, rate->msgs, msgs, burst_ns, now);
+        if (debt > *pause) *pause = debt;
+    }
+}
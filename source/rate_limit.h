@@ -0,0 +1,71 @@
+/**
+ * rate_limit.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to limit the bytes and the
+ * messages each connection, and each source address, may send per second.
+ *
+ * Limits are token buckets, kept as the time they get full again. Reads are
+ * charged after they happen, so a connection may run into debt, and it then
+ * has to stop reading until its debt is paid back. As long as it does not
+ * read, TCP flow control throttles its client, instead of dropping it.
+ *
+ */
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "source_table.h"
+
+#define RATE_SOURCES 65536  // Sources limited at once, at most.
+#define RATE_PAUSE_SLICE_NS 100000000ULL  // Longest sleep of a paused reader.
+
+// Rates per second, 0 for no limit.
+typedef struct {
+    uint64_t bytes;
+    uint64_t msgs;
+} rate_t;
+
+typedef struct {
+    rate_t conn;        // Of every connection.
+    rate_t addr;        // Of every source, over all its connections.
+    uint64_t burst_ns;  // Time worth of tokens a bucket holds.
+} rate_limits_t;
+
+// Times in ns each bucket gets full again, updated with compare and swap.
+typedef struct {
+    atomic_uint_least64_t bytes_tat;
+    atomic_uint_least64_t msgs_tat;
+} rate_bucket_t;
+
+typedef struct {
+    rate_limits_t limits;
+    source_table_t *sources;  // Buckets of each source, NULL if unlimited.
+} rate_limiter_t;
+
+// Limits of a single connection, only touched by its handler.
+typedef struct {
+    rate_bucket_t bucket;
+    rate_bucket_t *source_bucket;  // NULL if its source is not limited.
+    uint64_t source;               // As of admission_source().
+} rate_conn_t;
+
+
+int rate_limits_parse(char *spec, rate_limits_t *limits);
+int rate_limits_enabled(const rate_limits_t *limits);
+rate_limiter_t *rate_limiter_create(const rate_limits_t *limits);
+void rate_limiter_destroy(rate_limiter_t *limiter);
+void rate_conn_init(rate_limiter_t *limiter, rate_conn_t *conn,
+                    uint64_t source);
+void rate_conn_free(rate_limiter_t *limiter, rate_conn_t *conn);
+uint64_t rate_conn_charge(rate_limiter_t *limiter, rate_conn_t *conn,
+                          size_t bytes, size_t msgs);
+uint64_t rate_now_ns(void);
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * recv_buffer.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in recv_buffer.h.
+ *
+ * A read that fills the whole buffer means that more data is most probably
+ * waiting, so capacity doubles at once, up to max_capacity. Capacity halves
+ * only after SHRINK_AFTER consecutive reads using less than a quarter of it,
+ * so bursty streams do not keep reallocating.
+ *
+ * Pooled buffers take every capacity from the size class matching it, so
+ * they never go to the heap, once their pool has warmed up.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "recv_buffer.h"
+
+
+#define SHRINK_AFTER 8
+
+
+static void resize(recv_buffer_t *buf, size_t capacity);
+
+
+void recv_buffer_init(recv_buffer_t *buf, size_t min_capacity,
+                      size_t max_capacity)
+{
+    if (max_capacity < min_capacity) max_capacity = min_capacity;
+    buf->min_capacity = min_capacity;
+    buf->max_capacity = max_capacity;
+    buf->capacity = min_capacity;
+    buf->data = (char *) malloc(min_capacity);
+    buf->small_reads = 0;
+    buf->pool = NULL;
+}
+
+/**
+ * Initializes a buffer taking its data from given pool, with the smallest
+ * and the largest size of the pool as its capacity limits.
+ *
+ * Returns 0 on success, -1 with errno set if no data could be allocated,
+ * leaving a buffer that may only be freed, or initialized again.
+ */
+int recv_buffer_init_pooled(recv_buffer_t *buf, buf_pool_t *pool)
+{
+    buf->min_capacity = pool->min_size;
+    buf->max_capacity = pool->max_size;
+    buf->capacity = pool->min_size;
+    buf->data = (char *) buf_pool_get(pool, pool->min_size);
+    buf->small_reads = 0;
+    buf->pool = pool;
+    return buf->data ? 0 : -1;
+}
+
+void recv_buffer_free(recv_buffer_t *buf)
+{
+    if (buf->pool) buf_pool_put(buf->pool, buf->data, buf->capacity);
+    else free(buf->data);
+    buf->data = NULL;
+}
+
+/**
+ * Reads from fd into the buffer, the same way read() does.
+ *
+ * Received data always starts at buf->data. The buffer is resized after the
+ * read, so its contents are only valid until the next call.
+ */
+ssize_t recv_buffer_read(recv_buffer_t *buf, int fd)
+{
+    ssize_t n = read(fd, buf->data, buf->capacity);
+    if (n <= 0) return n;
+
+    if ((size_t) n == buf->capacity) {
+        buf->small_reads = 0;
+        if (buf->capacity < buf->max_capacity) {
+            size_t capacity = buf->capacity * 2;
+            if (capacity > buf->max_capacity) capacity = buf->max_capacity;
+            // Data read is handed to caller before next read, so a fresh
+            // allocation would lose it. realloc() keeps it.
+            resize(buf, capacity);
+        }
+    }
+    else if ((size_t) n < buf->capacity / 4) {
+        if (++buf->small_reads >= SHRINK_AFTER &&
+            buf->capacity > buf->min_capacity) {
+            size_t capacity = buf->capacity / 2;
+            if (capacity < buf->min_capacity) capacity = buf->min_capacity;
+            if ((size_t) n <= capacity) resize(buf, capacity);
+            buf->small_reads = 0;
+        }
+    }
+    else buf->small_reads = 0;
+
+    return n;
+}
+
+/**
+ * Drops the buffer back to its minimum capacity, e.g. when its connection
+ * is gone or idle.
+ */
+void recv_buffer_reset(recv_buffer_t *buf)
+{
+    if (buf->capacity > buf->min_capacity) resize(buf, buf->min_capacity);
+    buf->small_reads = 0;
+}
+
+static void resize(recv_buffer_t *buf, size_t capacity)
+{
+    if (buf->pool) {
+        char *data = (char *) buf_pool_get(buf->pool, capacity);
+        if (!data) return;
+        memcpy(data, buf->data,
+               capacity < buf->capacity ? capacity : buf->capacity);
+        buf_pool_put(buf->pool, buf->data, buf->capacity);
+        buf->data = data;
+        buf->capacity = capacity;
+        return;
+    }
+
+    char *data = (char *) realloc(buf->data, capacity);
+    if (!data) return;  // Keep using the old one.
+    buf->data = data;
+    buf->capacity = capacity;
+}
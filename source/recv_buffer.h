@@ -0,0 +1,40 @@
+/**
+ * recv_buffer.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to create and manage a
+ * length-tracked receive buffer, that adapts its size to the observed reads.
+ *
+ */
+
+#ifndef RECV_BUFFER_H
+#define RECV_BUFFER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "pool.h"
+
+#define RECV_BUFFER_MIN 512          // Initial capacity of buffers.
+#define RECV_BUFFER_MAX (64 * 1024)  // Default upper limit of capacity.
+
+typedef struct {
+    char *data;
+    size_t capacity;
+    size_t min_capacity;
+    size_t max_capacity;
+    int small_reads;  // Consecutive reads that used little of the buffer.
+    buf_pool_t *pool; // Where data comes from, NULL for the heap.
+} recv_buffer_t;
+
+
+void recv_buffer_init(recv_buffer_t *buf, size_t min_capacity,
+                      size_t max_capacity);
+int recv_buffer_init_pooled(recv_buffer_t *buf, buf_pool_t *pool);
+void recv_buffer_free(recv_buffer_t *buf);
+ssize_t recv_buffer_read(recv_buffer_t *buf, int fd);
+void recv_buffer_reset(recv_buffer_t *buf);
+
+#endif
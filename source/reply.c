@@ -0,0 +1,355 @@
+/**
+ * reply.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in reply.h.
+ *
+ * Acks are all alike, so they point into a static array of ack frames, with
+ * consecutive ones sharing a piece. Echoes of frames parsed in place point
+ * into the data read, right from their header, which is still there. Only a
+ * frame that spanned reads has been assembled aside, so its echo gets copied,
+ * and there is at most one such frame per read.
+ *
+ * Without a backlog, a batch gets written as a whole. With one, sends never
+ * block, even on blocking sockets, and whatever the socket does not take at
+ * once moves to the backlog of the connection, which must drain before any
+ * newer reply gets written.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include "reply.h"
+
+
+static int reply_frame(const frame_t *frame, void *arg);
+static int add_piece(reply_batch_t *batch, const char *data, size_t len);
+static int flush_batch(reply_batch_t *batch);
+static int write_all(reply_batch_t *batch);
+static ssize_t send_pieces(int fd, struct iovec *iov, int count, int flags);
+static int backlog_append(reply_backlog_t *backlog, const char *data,
+                          size_t len);
+
+static char acks[REPLY_ACKS_MAX * FRAME_HEADER_SIZE];
+static _Atomic int acks_packed = 0;  // Set once acks hold ack headers.
+
+
+/**
+ * Returns the reply mode matching given name, or -1 if there is none.
+ */
+int reply_parse_mode(const char *name)
+{
+    if (strcmp(name, "none") == 0) return REPLY_NONE;
+    if (strcmp(name, "echo") == 0) return REPLY_ECHO;
+    if (strcmp(name, "ack") == 0) return REPLY_ACK;
+    return -1;
+}
+
+void reply_batch_init(reply_batch_t *batch, reply_mode_t mode)
+{
+    memset(batch, 0, sizeof(reply_batch_t));
+    batch->mode = mode;
+    batch->fd = -1;
+
+    // Threads starting together may all pack acks, writing the same bytes.
+    // The flag publishes them, so that threads seeing it set, which send
+    // acks without packing them, see them packed too.
+    if (mode == REPLY_ACK &&
+        !atomic_load_explicit(&acks_packed, memory_order_acquire)) {
+        for (int i = 0; i < REPLY_ACKS_MAX; i++) {
+            frame_pack_header(acks + i * FRAME_HEADER_SIZE, FRAME_ACK, 0, 0);
+        }
+        atomic_store_explicit(&acks_packed, 1, memory_order_release);
+    }
+}
+
+void reply_batch_free(reply_batch_t *batch)
+{
+    free(batch->spill);
+    batch->spill = NULL;
+}
+
+/**
+ * Makes batch reply to the frames of a connection, passing each one to sink
+ * first. Replies get written to fd, keeping what it does not take at once
+ * into backlog, or waiting for all of them to be written if it is NULL.
+ */
+void reply_batch_start(reply_batch_t *batch, int fd, reply_backlog_t *backlog,
+                       frame_handler_t sink, void *sink_arg)
+{
+    batch->fd = fd;
+    batch->backlog = backlog;
+    batch->sink = sink;
+    batch->sink_arg = sink_arg;
+    batch->iov_count = 0;
+    batch->spilled = 0;
+}
+
+/**
+ * Feeds data read from the connection to reader, replying to every frame
+ * completed by it, the same way frame_reader_feed() does. Replies get
+ * written before returning, as data is only valid until the next read.
+ *
+ * Returns 0 on success, or -1 with errno set if reader or sink failed, or if
+ * writing replies failed.
+ */
+int reply_batch_feed(reply_batch_t *batch, frame_reader_t *reader,
+                     const char *data, size_t len)
+{
+    batch->data = data;
+    batch->len = len;
+
+    int rc = frame_reader_feed(reader, data, len, reply_frame, batch);
+    if (flush_batch(batch) < 0) return -1;
+    return rc;
+}
+
+void reply_backlog_init(reply_backlog_t *backlog)
+{
+    backlog->data = NULL;
+    backlog->start = backlog->end = backlog->capacity = 0;
+}
+
+void reply_backlog_free(reply_backlog_t *backlog)
+{
+    free(backlog->data);
+    reply_backlog_init(backlog);
+}
+
+/**
+ * Returns the bytes of replies waiting in backlog.
+ */
+size_t reply_backlog_size(const reply_backlog_t *backlog)
+{
+    return backlog->end - backlog->start;
+}
+
+/**
+ * Writes as much of backlog as fd takes without blocking.
+ *
+ * Returns 0 once backlog is empty, 1 if some of it is left, or -1 on failure
+ * with errno set. An emptied backlog holds no memory.
+ */
+int reply_backlog_flush(reply_backlog_t *backlog, int fd)
+{
+    while (backlog->start < backlog->end) {
+        ssize_t n = send(fd, backlog->data + backlog->start,
+                         backlog->end - backlog->start,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+        backlog->start += n;
+    }
+
+    reply_backlog_free(backlog);
+    return 0;
+}
+
+/**
+ * Hands a frame over to sink and adds its reply to the batch given as arg.
+ */
+static int reply_frame(const frame_t *frame, void *arg)
+{
+    reply_batch_t *batch = (reply_batch_t *) arg;
+    if (batch->sink && batch->sink(frame, batch->sink_arg) != 0) return -1;
+
+    if (batch->mode == REPLY_ACK) {
+        return add_piece(batch, acks, FRAME_HEADER_SIZE);
+    }
+
+    // Frame parsed in place, so its header is right before its payload.
+    // Lines get echoed as they came, with no header.
+    size_t header = frame->flags & FRAME_LINE ? 0 : FRAME_HEADER_SIZE;
+    size_t len = header + frame->length;
+    uintptr_t payload = (uintptr_t) frame->payload;
+    uintptr_t data = (uintptr_t) batch->data;
+    if (frame->payload && payload >= data + header &&
+        payload + frame->length <= data + batch->len) {
+        return add_piece(batch, frame->payload - header, len);
+    }
+
+    if (batch->spilled && flush_batch(batch) < 0) return -1;
+    if (!batch->spill) {
+        batch->spill = (char *) malloc(FRAME_HEADER_SIZE + FRAME_MAX_PAYLOAD);
+        if (!batch->spill) return -1;
+    }
+    if (header) {
+        frame_pack_header(batch->spill, frame->type, frame->flags,
+                          frame->length);
+    }
+    if (frame->length > 0) {
+        memcpy(batch->spill + header, frame->payload, frame->length);
+    }
+    batch->spilled = 1;
+    return add_piece(batch, batch->spill, len);
+}
+
+/**
+ * Appends a piece of reply to the batch, merging it into the last piece when
+ * adjacent to it, and flushing the batch first if it is full.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+static int add_piece(reply_batch_t *batch, const char *data, size_t len)
+{
+    if (batch->iov_count > 0) {
+        struct iovec *last = &batch->iov[batch->iov_count - 1];
+        char *end = (char *) last->iov_base + last->iov_len;
+        int ack = batch->mode == REPLY_ACK;
+        if (ack && last->iov_len < sizeof(acks)) {
+            last->iov_len += len;
+            return 0;
+        }
+        if (!ack && end == data) {
+            last->iov_len += len;
+            return 0;
+        }
+    }
+
+    if (batch->iov_count == REPLY_IOV_MAX && flush_batch(batch) < 0) {
+        return -1;
+    }
+    batch->iov[batch->iov_count].iov_base = (void *) data;
+    batch->iov[batch->iov_count].iov_len = len;
+    batch->iov_count++;
+    return 0;
+}
+
+/**
+ * Writes out all replies of the batch, emptying it.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+static int flush_batch(reply_batch_t *batch)
+{
+    if (batch->iov_count == 0) return 0;
+
+    int rc;
+    if (!batch->backlog) rc = write_all(batch);
+    else if (reply_backlog_size(batch->backlog) > 0) {
+        // Keep replies in order behind the ones already waiting.
+        rc = 0;
+        for (int i = 0; i < batch->iov_count && rc == 0; i++) {
+            rc = backlog_append(batch->backlog, batch->iov[i].iov_base,
+                                batch->iov[i].iov_len);
+        }
+        if (rc == 0 && reply_backlog_flush(batch->backlog, batch->fd) < 0) {
+            rc = -1;
+        }
+    }
+    else {
+        ssize_t n;
+        while ((n = send_pieces(batch->fd, batch->iov, batch->iov_count,
+                                MSG_DONTWAIT)) < 0 && errno == EINTR);
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) rc = -1;
+        else {
+            // Keep whatever the socket did not take.
+            size_t written = n < 0 ? 0 : (size_t) n;
+            rc = 0;
+            for (int i = 0; i < batch->iov_count && rc == 0; i++) {
+                size_t piece = batch->iov[i].iov_len;
+                if (written >= piece) {
+                    written -= piece;
+                    continue;
+                }
+                rc = backlog_append(batch->backlog,
+                                    (char *) batch->iov[i].iov_base + written,
+                                    piece - written);
+                written = 0;
+            }
+        }
+    }
+
+    batch->iov_count = 0;
+    batch->spilled = 0;
+    return rc;
+}
+
+/**
+ * Writes all pieces of the batch to its blocking connection.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+static int write_all(reply_batch_t *batch)
+{
+    struct iovec *iov = batch->iov;
+    int count = batch->iov_count;
+
+    while (count > 0) {
+        ssize_t n = send_pieces(batch->fd, iov, count, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        // Skip pieces written, and the written part of the next one.
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Writes given pieces to a socket, the same way writev() does, with given
+ * flags of send(), without ever raising SIGPIPE, as connections may get shut
+ * down while being replied to.
+ */
+static ssize_t send_pieces(int fd, struct iovec *iov, int count, int flags)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+}
+
+/**
+ * Copies data at the end of backlog, growing it as needed.
+ *
+ * Returns 0 on success, -1 on failure with errno set.
+ */
+static int backlog_append(reply_backlog_t *backlog, const char *data,
+                          size_t len)
+{
+    if (backlog->end + len > backlog->capacity) {
+        // Reclaim the space of bytes already sent, before growing.
+        size_t size = reply_backlog_size(backlog);
+        if (backlog->start > 0) {
+            memmove(backlog->data, backlog->data + backlog->start, size);
+        }
+        backlog->start = 0;
+        backlog->end = size;
+
+        if (size + len > backlog->capacity) {
+            size_t capacity = backlog->capacity ? backlog->capacity : 4096;
+            while (capacity < size + len) capacity *= 2;
+            char *grown = (char *) realloc(backlog->data, capacity);
+            if (!grown) return -1;
+            backlog->data = grown;
+            backlog->capacity = capacity;
+        }
+    }
+
+    memcpy(backlog->data + backlog->end, data, len);
+    backlog->end += len;
+    return 0;
+}
@@ -0,0 +1,71 @@
+/**
+ * reply.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to reply to every frame a
+ * server receives, either by echoing it back as is, or by acknowledging it
+ * with an empty ack frame. Replies to all frames completed by a single read
+ * get written together, with a single writev().
+ *
+ */
+
+#ifndef REPLY_H
+#define REPLY_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "frame.h"
+
+#define REPLY_IOV_MAX 64        // Pieces of replies written at once.
+#define REPLY_ACKS_MAX 256      // Acks covered by a single piece.
+#define REPLY_BACKLOG_MAX (1 << 20)  // Unsent bytes to stop reading at.
+
+typedef enum {
+    REPLY_NONE,  // Frames are never replied to.
+    REPLY_ECHO,  // Every frame gets sent back as is.
+    REPLY_ACK    // Every frame gets an ack frame back.
+} reply_mode_t;
+
+// Replies a connection could not take yet without blocking, in order.
+typedef struct {
+    char *data;
+    size_t start;     // First byte not sent yet.
+    size_t end;
+    size_t capacity;
+} reply_backlog_t;
+
+// Replies to the frames of a single read, built by a single thread. Echoes
+// of frames whole in the data read point right into it, so adjacent ones
+// make up a single piece.
+typedef struct {
+    reply_mode_t mode;
+    struct iovec iov[REPLY_IOV_MAX];
+    int iov_count;
+    const char *data;  // Data of the read being replied to.
+    size_t len;
+    char *spill;       // Copy of an echoed frame that spanned reads.
+    int spilled;       // Set while spill is part of the batch.
+    int fd;            // Connection replies go to.
+    reply_backlog_t *backlog;  // NULL if sends may block.
+    frame_handler_t sink;      // Gets every frame, before it is replied to.
+    void *sink_arg;
+} reply_batch_t;
+
+
+int reply_parse_mode(const char *name);
+void reply_batch_init(reply_batch_t *batch, reply_mode_t mode);
+void reply_batch_free(reply_batch_t *batch);
+void reply_batch_start(reply_batch_t *batch, int fd, reply_backlog_t *backlog,
+                       frame_handler_t sink, void *sink_arg);
+int reply_batch_feed(reply_batch_t *batch, frame_reader_t *reader,
+                     const char *data, size_t len);
+
+void reply_backlog_init(reply_backlog_t *backlog);
+void reply_backlog_free(reply_backlog_t *backlog);
+size_t reply_backlog_size(const reply_backlog_t *backlog);
+int reply_backlog_flush(reply_backlog_t *backlog, int fd);
+
+#endif
@@ -0,0 +1,101 @@
+/**
+ * ring.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in ring.h.
+ *
+ * Every cell carries a sequence number, telling whether it is ready to be
+ * written or read at a given position, so producers and consumers only race
+ * with their own kind, on a single compare-and-swap (D. Vyukov's design).
+ *
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "ring.h"
+
+
+/**
+ * Creates a ring able to hold capacity pointers, rounded up to a power of 2.
+ *
+ * Returns the ring, or NULL on failure with errno set.
+ */
+ring_t *ring_create(size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity) size <<= 1;
+
+    ring_t *ring = (ring_t *) aligned_alloc(64, sizeof(ring_t));
+    if (!ring) return NULL;
+    ring->cells = (ring_cell_t *) malloc(sizeof(ring_cell_t) * size);
+    if (!ring->cells) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = size - 1;
+    for (size_t i = 0; i < size; i++) atomic_init(&ring->cells[i].seq, i);
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+
+    return ring;
+}
+
+void ring_destroy(ring_t *ring)
+{
+    free(ring->cells);
+    free(ring);
+}
+
+/**
+ * Pushes a pointer. Returns 0 on success, or -1 if the ring is full.
+ */
+int ring_push(ring_t *ring, void *data)
+{
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    while (1) {
+        ring_cell_t *cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring->enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                cell->data = data;
+                atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+                return 0;
+            }
+        }
+        else if (dif < 0) return -1;
+        else pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    }
+}
+
+/**
+ * Pops the oldest pointer. Returns NULL if the ring is empty.
+ */
+void *ring_pop(ring_t *ring)
+{
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    while (1) {
+        ring_cell_t *cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t) seq - (intptr_t) (pos + 1);
+
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring->dequeue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                void *data = cell->data;
+                atomic_store_explicit(&cell->seq, pos + ring->mask + 1,
+                                      memory_order_release);
+                return data;
+            }
+        }
+        else if (dif < 0) return NULL;
+        else pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    }
+}
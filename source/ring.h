@@ -0,0 +1,38 @@
+/**
+ * ring.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to create and manage a
+ * bounded lock-free multi-producer multi-consumer ring of pointers.
+ *
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+typedef struct {
+    atomic_size_t seq;  // Position this cell is ready for.
+    void *data;
+} ring_cell_t;
+
+typedef struct {
+    ring_cell_t *cells;
+    size_t mask;
+    // Producers and consumers touch different cache lines.
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+} ring_t;
+
+
+ring_t *ring_create(size_t capacity);
+void ring_destroy(ring_t *ring);
+int ring_push(ring_t *ring, void *data);
+void *ring_pop(ring_t *ring);
+
+#endif
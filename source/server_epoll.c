@@ -0,0 +1,390 @@
+/**
+ * server_epoll.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A TCP server able to handle multiple connections in an event based model.
+ * All connections are multiplexed on a small number of epoll loops, each one
+ * running on its own thread. Optionally, loops may be backed by io_uring
+ * instead of epoll.
+ *
+ * Usage: exec_name [-l loops] [-u] [-b backlog] [-C max_conns]
+ *                  [-I max_per_addr] [-F flush_bytes] [-L flush_usec]
+ *                  [-R recv_max] [-E none|echo|ack] [-N] [-t timeouts]
+ *                  [-r limits] [-O options] <address>
+ *  where:
+ *      -address : Where to listen. Either a port, for all IPv4 interfaces,
+ *              or "host:port", with IPv6 hosts in brackets (e.g. "[::]:port"
+ *              for all interfaces, over both IPv4 and IPv6), or "unix:path"
+ *              for a Unix domain socket ("unix:@name" in the abstract
+ *              namespace).
+ *      -loops : Number of event loops. Defaults to the number of online CPUs.
+ *      -u : Use io_uring loops, falling back to epoll ones when the running
+ *              kernel does not support them.
+ *      -backlog : Length of accept queue of listener (default SOMAXCONN).
+ *      -max_conns : Max connections served at once, by all loops. Further
+ *              connections get reset. When 0 (default), there is no limit.
+ *      -max_per_addr : Max connections of a single source address served at
+ *              once. Further connections get reset. When 0 (default), there
+ *              is no limit.
+ *      -flush_bytes : Received bytes that get written to stdout at once
+ *              (default 65536).
+ *      -flush_usec : Max time received data may wait before being written
+ *              to stdout (default 1000).
+ *      -recv_max : Max size the receive buffer of each epoll loop may grow
+ *              to (default 65536).
+ *      -E : How every frame received gets replied to, for measuring round
+ *              trip latency. Replies to all frames of a read get written
+ *              together, so clients may keep many frames in flight.
+ *              none : Never (default).
+ *              echo : Frame gets sent back as is.
+ *              ack : An empty ack frame gets sent back.
+ *      -N : Messages are newline delimited UTF-8 lines, instead of frames.
+ *              Connections sending invalid UTF-8, or lines longer than 65535
+ *              bytes, get closed. Echoes are the lines themselves, while
+ *              acks stay frames.
+ *      -timeouts : Comma separated timeouts of connections, in seconds, after
+ *              which they get closed (none by default). Only epoll loops
+ *              time connections out, so -u gets ignored then.
+ *              idle=seconds : Nothing has been received for that long.
+ *              read=seconds : A frame, or line, started being received that
+ *                      long ago and is still incomplete.
+ *              lifetime=seconds : Connection was accepted that long ago.
+ *      -limits : Comma separated rates, per second, over which reading from
+ *              connections pauses until they are back under them (none by
+ *              default). Rates of each source address are shared by all
+ *              loops. Only epoll loops limit rates, so -u gets ignored then.
+ *              Rates may be suffixed by k, m or g:
+ *              bytes=rate : Bytes received from each connection.
+ *              msgs=rate : Frames, or lines, received from each connection.
+ *              addr_bytes=rate : Bytes received from each source address,
+ *                      over all its connections.
+ *              addr_msgs=rate : Frames, or lines, received from each source
+ *                      address.
+ *              burst=seconds : Worth of every rate that may be received at
+ *                      once (default 0.1).
+ *      -options : Comma separated options of TCP connections, ignored on
+ *              Unix domain sockets:
+ *              nodelay : Send small replies at once (TCP_NODELAY).
+ *              quickack : Ack at once at the start of connections
+ *                      (TCP_QUICKACK).
+ *              defer=seconds : Only accept connections once they carry data,
+ *                      waiting up to seconds for it (TCP_DEFER_ACCEPT).
+ *              rcvbuf=bytes : Size of receive buffers (SO_RCVBUF).
+ *              sndbuf=bytes : Size of send buffers (SO_SNDBUF).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include "listener.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "output.h"
+#include "recv_buffer.h"
+#include "reply.h"
+
+
+void start_listener(int socket_fd);
+void destroy_listener(int socket_fd);
+void *start_loop(void *args);
+void *start_uring_loop(void *args);
+void raise_fd_limit(void);
+void usage(const char *exec_name);
+void error(const char *msg);
+void terminate_server(int signum);
+
+
+const int TERM_SIGNAL = SIGINT;  // Signal for requesting server termination.
+
+int listener_fd;  // Socket descriptor of listener.
+int term_fd;      // Event descriptor that wakes up loops on termination.
+output_t *output; // Pipeline writing received data to stdout.
+int backlog = SOMAXCONN;  // Accept queue length of listener.
+endpoint_t endpoint;         // Address listened on.
+socket_options_t sock_opts;  // Options of listener and connections.
+
+
+int main(int argc, char *argv[])
+{
+    int loops_num = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int use_uring = 0;
+    size_t flush_bytes = 65536;
+    unsigned flush_usec = 1000;
+    size_t recv_max = RECV_BUFFER_MAX;
+    reply_mode_t reply_mode = REPLY_NONE;
+    frame_format_t frame_format = FRAME_FORMAT_FRAMES;
+    conn_timeouts_t timeouts = { 0, 0, 0 };
+    rate_limits_t limits = { { 0, 0 }, { 0, 0 }, 0 };
+    rate_limiter_t *limiter = NULL;
+    int max_conns = 0;
+    int max_per_addr = 0;
+    admission_t *admission = NULL;
+
+    int opt, rc;
+    while ((opt = getopt(argc, argv, "l:ub:C:I:F:L:R:E:Nt:r:O:")) != -1) {
+        switch (opt) {
+            case 'l':
+                loops_num = atoi(optarg);
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'C':
+                max_conns = atoi(optarg);
+                break;
+            case 'I':
+                max_per_addr = atoi(optarg);
+                break;
+            case 'F':
+                flush_bytes = (size_t) atol(optarg);
+                break;
+            case 'L':
+                flush_usec = (unsigned) atoi(optarg);
+                break;
+            case 'R':
+                recv_max = (size_t) atol(optarg);
+                break;
+            case 'E':
+                if ((rc = reply_parse_mode(optarg)) < 0) usage(argv[0]);
+                reply_mode = (reply_mode_t) rc;
+                break;
+            case 'N':
+                frame_format = FRAME_FORMAT_LINES;
+                break;
+            case 't':
+                if (conn_timeouts_parse(optarg, &timeouts) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                if (rate_limits_parse(optarg, &limits) < 0) usage(argv[0]);
+                break;
+            case 'O':
+                if (socket_options_parse(optarg, &sock_opts) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    // Listening address should be provided by caller.
+    if (optind >= argc) {
+        fprintf(stderr, "ERROR: No listening address provided.\n");
+        usage(argv[0]);
+    }
+    if (endpoint_parse(argv[optind], &endpoint) < 0) {
+        error("ERROR: Invalid listening address");
+    }
+    if (loops_num < 1) loops_num = 1;
+    if (use_uring && conn_timeouts_enabled(&timeouts)) {
+        fprintf(stderr, "io_uring loops do not time connections out, "
+                "using epoll.\n");
+        use_uring = 0;
+    }
+    if (rate_limits_enabled(&limits)) {
+        if (use_uring) {
+            fprintf(stderr, "io_uring loops do not limit rates, "
+                    "using epoll.\n");
+            use_uring = 0;
+        }
+        limiter = rate_limiter_create(&limits);
+        if (!limiter) error("ERROR: Failed to set up rate limits");
+    }
+    if (max_conns > 0 || max_per_addr > 0) {
+        admission = admission_create(max_conns, max_per_addr);
+        if (!admission) error("ERROR: Failed to set up admission control");
+    }
+
+    raise_fd_limit();
+
+    listener_fd = init_listener(&endpoint, &sock_opts);
+    start_listener(listener_fd);
+
+    term_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (term_fd < 0) error("ERROR: Failed to create termination event");
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = terminate_server;
+    sigaction(TERM_SIGNAL, &act, NULL);
+    printf("Use CTRL+C to terminate.\n");
+    fflush(stdout);  // Pipeline writes to stdout bypassing stdio.
+
+    output = output_create(STDOUT_FILENO, flush_bytes, flush_usec);
+    if (!output) error("ERROR: Failed to create output pipeline");
+
+    // Launch all the loops, each one on its own thread. The first io_uring
+    // loop to be created tells whether the kernel supports them.
+    void **loops = (void **) malloc(sizeof(void *) * loops_num);
+    pthread_t *tids = (pthread_t *) malloc(sizeof(pthread_t) * loops_num);
+    for (int i = 0; i < loops_num; i++) {
+        if (use_uring) {
+            loops[i] = uring_loop_create(listener_fd, term_fd, output);
+            if (!loops[i] && i == 0) {
+                fprintf(stderr, "io_uring is not supported (%s), "
+                        "falling back to epoll.\n", strerror(errno));
+                use_uring = 0;
+            }
+            else if (!loops[i]) error("ERROR: Failed to create io_uring loop");
+            else {
+                ((uring_loop_t *) loops[i])->sock_opts = &sock_opts;
+                ((uring_loop_t *) loops[i])->format = frame_format;
+                reply_batch_init(&((uring_loop_t *) loops[i])->replies,
+                                 reply_mode);
+                ((uring_loop_t *) loops[i])->admission = admission;
+                pthread_create(&tids[i], NULL, start_uring_loop, loops[i]);
+                continue;
+            }
+        }
+
+        // Only epoll loops need a non-blocking listener.
+        if (i == 0 && set_nonblocking(listener_fd) < 0) {
+            error("ERROR: Failed to make listener non-blocking");
+        }
+        loops[i] = event_loop_create(listener_fd, term_fd, output, recv_max);
+        if (!loops[i]) error("ERROR: Failed to create event loop");
+        reply_batch_init(&((event_loop_t *) loops[i])->replies, reply_mode);
+        ((event_loop_t *) loops[i])->sock_opts = &sock_opts;
+        ((event_loop_t *) loops[i])->format = frame_format;
+        ((event_loop_t *) loops[i])->timeouts = timeouts;
+        ((event_loop_t *) loops[i])->limiter = limiter;
+        ((event_loop_t *) loops[i])->admission = admission;
+        pthread_create(&tids[i], NULL, start_loop, loops[i]);
+    }
+
+    // Loops return only after all their connections have been closed.
+    unsigned long timed_out[TIMEOUT_KINDS] = { 0 };
+    for (int i = 0; i < loops_num; i++) {
+        pthread_join(tids[i], NULL);
+        if (use_uring) uring_loop_destroy((uring_loop_t *) loops[i]);
+        else {
+            for (int k = 0; k < TIMEOUT_KINDS; k++) {
+                timed_out[k] += ((event_loop_t *) loops[i])->timed_out[k];
+            }
+            event_loop_destroy((event_loop_t *) loops[i]);
+        }
+    }
+
+    output_destroy(output);  // Write out anything still pending.
+    if (limiter) rate_limiter_destroy(limiter);
+    if (admission) admission_destroy(admission);
+
+    printf("\nServer terminating...\n");
+    if (conn_timeouts_enabled(&timeouts)) {
+        printf("Timed out %lu idle, %lu read and %lu lifetime "
+               "connections.\n", timed_out[TIMEOUT_IDLE],
+               timed_out[TIMEOUT_READ], timed_out[TIMEOUT_LIFETIME]);
+    }
+
+    // Clean up resources.
+    destroy_listener(listener_fd);
+    release_listener(&endpoint);
+    close(term_fd);
+    free(tids);
+    free(loops);
+
+    return 0;
+}
+
+/**
+ * Prints a message about currently set errno and terminates process.
+ */
+void error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/**
+ * Prints usage information and terminates process.
+ */
+void usage(const char *exec_name)
+{
+    fprintf(stdout, "Usage: %s [-l loops] [-u] [-b backlog] "
+            "[-C max_conns] [-I max_per_addr] [-F flush_bytes] "
+            "[-L flush_usec] [-R recv_max] [-E none|echo|ack] [-N] "
+            "[-t timeouts] [-r limits] [-O options] <address>\n", exec_name);
+    exit(1);
+}
+
+/**
+ * Ask server to terminate normally completing any critical unhandled task.
+ *
+ * This is a signal handler, that should be connected to a terminating signal.
+ * It only wakes up the loops, which stop accepting and shut down their
+ * connections by themselves.
+ */
+void terminate_server(int signum)
+{
+    if (signum == TERM_SIGNAL) {
+        uint64_t val = 1;
+        ssize_t rc = write(term_fd, &val, sizeof(val));
+        (void) rc;
+    }
+}
+
+/**
+ * Marks given socket as a listener, to be shared by all loops.
+ */
+void start_listener(int socket_fd)
+{
+    // Backlog should be able to absorb bursts of many idle clients.
+    int rc = listen(socket_fd, backlog);  // Mark socket as listener.
+    if (rc < 0) error("ERROR: Failed to listen on given socket");
+}
+
+/**
+ * Properly terminates a listener on the given socket.
+ */
+void destroy_listener(int socket_fd)
+{
+    close(socket_fd);
+}
+
+/**
+ * Entry point for each loop's thread.
+ */
+void *start_loop(void *args)
+{
+    event_loop_run((event_loop_t *) args);
+    return NULL;
+}
+
+/**
+ * Entry point for each io_uring loop's thread.
+ */
+void *start_uring_loop(void *args)
+{
+    uring_loop_run((uring_loop_t *) args);
+    return NULL;
+}
+
+/**
+ * Raises the soft limit of open descriptors up to the hard one, since every
+ * connection consumes a descriptor.
+ */
+void raise_fd_limit(void)
+{
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) < 0) return;
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+}
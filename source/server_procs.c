@@ -7,103 +7,363 @@
  *
  * A TCP server able to handle multiple connections in a process based model.
  *
- * Usage: exec_name <port>
+ * Usage: exec_name [-k workers] [-d reuseport|pass] [-b backlog]
+ *                  [-C max_conns] [-I max_per_addr] [-R recv_max]
+ *                  [-M admin_path] [-S log_dir] [-G segment_size]
+ *                  [-Y none|async|sync] [-E none|echo|ack] [-N]
+ *                  [-t timeouts] [-r limits] [-O options] <address>
  *  where:
- *      -port : Port number on which to start the server.
+ *      -address : Where to listen. Either a port, for all IPv4 interfaces,
+ *              or "host:port", with IPv6 hosts in brackets (e.g. "[::]:port"
+ *              for all interfaces, over both IPv4 and IPv6), or "unix:path"
+ *              for a Unix domain socket ("unix:@name" in the abstract
+ *              namespace).
+ *      -workers : Number of worker processes to pre-fork. Each one of them
+ *              serves many connections on an epoll loop. When 0 (default),
+ *              a new process is forked for each client.
+ *      -d : How connections reach pre-forked workers:
+ *              reuseport : Every worker accepts on its own SO_REUSEPORT
+ *                      listener (default). Unix domain sockets cannot be
+ *                      shared so, so they fall back to pass.
+ *              pass : Master accepts and passes connections to workers
+ *                      over SCM_RIGHTS.
+ *      -backlog : Length of accept queue of each listener (default
+ *              SOMAXCONN).
+ *      -max_conns : Max connections served at once, by all handler processes
+ *              or workers. Further connections get reset. When 0 (default),
+ *              there is no limit.
+ *      -max_per_addr : Max connections of a single source address served at
+ *              once. Further connections get reset. When 0 (default), there
+ *              is no limit.
+ *      -recv_max : Max size receive buffers may grow to (default 65536).
+ *      -admin_path : Path of a Unix domain socket reporting metrics of all
+ *              processes in Prometheus text format to anyone connecting to
+ *              it. Metrics are also written to stderr on SIGUSR2.
+ *      -log_dir : Append received messages of all processes to a persistent
+ *              log in this directory, instead of writing them to stdout. Use
+ *              log_replay to read it.
+ *      -segment_size : Bytes of each segment file of the log, after which a
+ *              new one gets started (default 64MB).
+ *      -Y : When appended messages get synced to disk, after every read:
+ *              none : Never, left to the kernel (default).
+ *              async : Write back starts, without waiting for it.
+ *              sync : Wait for messages to reach the disk.
+ *      -E : How every frame received gets replied to, for measuring round
+ *              trip latency. Replies to all frames of a read get written
+ *              together, so clients may keep many frames in flight.
+ *              none : Never (default).
+ *              echo : Frame gets sent back as is.
+ *              ack : An empty ack frame gets sent back.
+ *      -N : Messages are newline delimited UTF-8 lines, instead of frames.
+ *              Connections sending invalid UTF-8, or lines longer than 65535
+ *              bytes, get closed. Echoes are the lines themselves, while
+ *              acks stay frames.
+ *      -timeouts : Comma separated timeouts of connections, in seconds, after
+ *              which they get closed, freeing their handler process (none
+ *              by default):
+ *              idle=seconds : Nothing has been received for that long.
+ *              read=seconds : A frame, or line, started being received that
+ *                      long ago and is still incomplete.
+ *              lifetime=seconds : Connection was accepted that long ago.
+ *      -limits : Comma separated rates, per second, over which reading from
+ *              connections pauses until they are back under them (none by
+ *              default). Rates of each source address are shared by all
+ *              processes. Rates may be suffixed by k, m or g:
+ *              bytes=rate : Bytes received from each connection.
+ *              msgs=rate : Frames, or lines, received from each connection.
+ *              addr_bytes=rate : Bytes received from each source address,
+ *                      over all its connections.
+ *              addr_msgs=rate : Frames, or lines, received from each source
+ *                      address.
+ *              burst=seconds : Worth of every rate that may be received at
+ *                      once (default 0.1).
+ *      -options : Comma separated options of TCP connections, ignored on
+ *              Unix domain sockets:
+ *              nodelay : Send small replies at once (TCP_NODELAY).
+ *              quickack : Ack at once at the start of connections
+ *                      (TCP_QUICKACK).
+ *              defer=seconds : Only accept connections once they carry data,
+ *                      waiting up to seconds for it (TCP_DEFER_ACCEPT).
+ *              rcvbuf=bytes : Size of receive buffers (SO_RCVBUF).
+ *              sndbuf=bytes : Size of send buffers (SO_SNDBUF).
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <poll.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <netinet/in.h>
-#include "linked_list.h"
+#include "conn_table.h"
+#include "admission.h"
+#include "listener.h"
+#include "event_loop.h"
+#include "fd_passing.h"
+#include "output.h"
+#include "recv_buffer.h"
+#include "frame.h"
+#include "metrics.h"
+#include "message_log.h"
+#include "reply.h"
+#include "timeouts.h"
+#include "rate_limit.h"
 
 
 typedef struct {
-    int fd;
-} handler_t;
+    pid_t pid;       // Pid of worker, -1 when not running.
+    int channel_fd;  // Master's end of worker's channel, -1 if not used.
+} worker_t;
+
+typedef enum {
+    DISPATCH_REUSEPORT,  // Each worker accepts on its own listener.
+    DISPATCH_PASS        // Master accepts and passes connections to workers.
+} dispatch_mode_t;
 
 
-int init_listener(int port);
 void start_listener(int socket_fd);
 void destroy_listener(int socket_fd);
-void handle_client(int client_fd, struct sockaddr_in client_addr, node_t *node);
+void handle_client(int client_fd, uint64_t source, uint64_t accepted_at);
+int wait_client(int client_fd, const conn_activity_t *activity);
+int throttle_client(int client_fd, rate_conn_t *rate, size_t bytes,
+                    uint64_t msgs, conn_activity_t *activity);
+int print_frame(const frame_t *frame, void *arg);
 void error(const char *msg);
 void terminate_server(int signum);
-void remove_handler(int signum, siginfo_t *info, void *cont);
+void accept_clients(int socket_fd);
+void spawn_handler(int socket_fd, int client_fd, uint64_t source,
+                   uint64_t accepted_at);
+void abandon_handler(int client_fd, uint64_t source, int pidfd,
+                     const char *msg);
+void read_signals(void);
+void remove_handler(int pidfd);
+void begin_termination(int socket_fd);
+void start_prefork(void);
+void spawn_worker(int slot);
+void start_worker(int channel_fd);
+void dispatch_connections(void);
+void supervise_workers(void);
+void note_child_exit(int signum);
+void terminate_worker(int signum);
+void usage(const char *exec_name);
 
 
 const int TERM_SIGNAL = SIGINT;  // Signal for requesting server termination.
-const int MAN_SIGNAL = SIGUSR1;  // Signal used for manipulating handler_fds.
+const int METRICS_SLOTS = 256;   // Processes beyond that share metrics slots.
+const int ACCEPT_BATCH = 64;     // Connections accepted per listener wake-up.
+const int MAX_EVENTS = 256;      // Events fetched by a single epoll_wait().
 
-struct sigaction man_act;
 struct sigaction act;
+size_t recv_max = RECV_BUFFER_MAX;  // Max capacity of receive buffers.
+int backlog = SOMAXCONN;  // Accept queue length of each listener.
+endpoint_t endpoint;         // Address listened on.
+socket_options_t sock_opts;  // Options of listeners and connections.
+metrics_t *metrics;       // Counters of all processes, in shared memory.
+metrics_slot_t *metrics_slot;  // Counters of current process.
+message_log_t *message_log = NULL;  // Sink of messages, NULL for stdout.
+reply_mode_t reply_mode = REPLY_NONE;  // How received frames get replied to.
+frame_format_t frame_format = FRAME_FORMAT_FRAMES;  // Of received data.
+conn_timeouts_t timeouts;  // Of connections, none by default.
+
+admission_t *admission = NULL;  // Limits of connections, in shared memory,
+                                // NULL if none.
+rate_limiter_t *limiter = NULL;  // Limits rates of connections, with sources
+                                 // in shared memory, NULL if none.
 
 // Globals valid to listener process only.
-linked_list_t *handler_fds;   // Storage for info of active handlers.
+conn_table_t *handler_fds;  // Pids of active handlers, by client fd.
+uint64_t *handler_sources;  // Client sources of active handlers, by fd.
+int *handler_clients;       // Client fds of active handlers, by pidfd.
 int listener_fd; // Handler of the listener connection.
-sigset_t *blocked_signals;  // Signals to block when manipulating handler_fds.
+int epoll_fd;    // Multiplexes listener, signals and handler exits.
+int signal_fd;   // Delivers termination signal and SIGCHLD.
 
 // Globals valid to handlers processes only.
 int handler_fd;  // Handler of the connection to client.
 
+// Globals valid to pre-fork mode only.
+worker_t *workers;        // Slots of pre-forked workers (master only).
+int workers_num = 0;      // Number of pre-forked workers.
+dispatch_mode_t dispatch_mode = DISPATCH_REUSEPORT;
+volatile sig_atomic_t term_requested = 0;  // Set by terminating signal.
+volatile sig_atomic_t child_exited = 0;    // Set by SIGCHLD on master.
+int term_fd = -1;         // Wakes up worker's loop on termination.
+
 
 int main(int argc, char *argv[])
 {
-    // Listening port should be provided by caller.
-    if (argc < 2) {
-        fprintf(stderr, "ERROR: No listening port provided.\n");
-        fprintf(stdout, "Usage: %s <port>\n", argv[0]);
-        exit(1);
+    int max_conns = 0;
+    int max_per_addr = 0;
+    const char *admin_path = NULL;
+    const char *log_dir = NULL;
+    size_t segment_size = LOG_SEGMENT_SIZE;
+    log_sync_t log_sync = LOG_SYNC_NONE;
+    rate_limits_t limits = { { 0, 0 }, { 0, 0 }, 0 };
+
+    int opt, rc;
+    while ((opt = getopt(argc, argv, "k:d:b:C:I:R:M:S:G:Y:E:N"
+                         "t:r:O:")) != -1) {
+        switch (opt) {
+            case 'k':
+                workers_num = atoi(optarg);
+                break;
+            case 'd':
+                if (strcmp(optarg, "reuseport") == 0) {
+                    dispatch_mode = DISPATCH_REUSEPORT;
+                }
+                else if (strcmp(optarg, "pass") == 0) {
+                    dispatch_mode = DISPATCH_PASS;
+                }
+                else usage(argv[0]);
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'C':
+                max_conns = atoi(optarg);
+                break;
+            case 'I':
+                max_per_addr = atoi(optarg);
+                break;
+            case 'R':
+                recv_max = (size_t) atol(optarg);
+                break;
+            case 'M':
+                admin_path = optarg;
+                break;
+            case 'S':
+                log_dir = optarg;
+                break;
+            case 'G':
+                segment_size = (size_t) atol(optarg);
+                break;
+            case 'Y':
+                if ((rc = message_log_parse_sync(optarg)) < 0) usage(argv[0]);
+                log_sync = (log_sync_t) rc;
+                break;
+            case 'E':
+                if ((rc = reply_parse_mode(optarg)) < 0) usage(argv[0]);
+                reply_mode = (reply_mode_t) rc;
+                break;
+            case 'N':
+                frame_format = FRAME_FORMAT_LINES;
+                break;
+            case 't':
+                if (conn_timeouts_parse(optarg, &timeouts) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                if (rate_limits_parse(optarg, &limits) < 0) usage(argv[0]);
+                break;
+            case 'O':
+                if (socket_options_parse(optarg, &sock_opts) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
 
-    // Initialize globals.
-    handler_fds = linked_list_create();
-    blocked_signals = (sigset_t *) malloc(sizeof(sigset_t));
-    sigemptyset(blocked_signals);
-    sigaddset(blocked_signals, MAN_SIGNAL);
+    // Listening address should be provided by caller.
+    if (optind >= argc) {
+        fprintf(stderr, "ERROR: No listening address provided.\n");
+        usage(argv[0]);
+    }
+    if (endpoint_parse(argv[optind], &endpoint) < 0) {
+        error("ERROR: Invalid listening address");
+    }
+    if (workers_num > 0 && dispatch_mode == DISPATCH_REUSEPORT &&
+        endpoint.family == AF_UNIX) {
+        fprintf(stderr, "Unix domain sockets cannot be shared through "
+                "SO_REUSEPORT, passing connections instead.\n");
+        dispatch_mode = DISPATCH_PASS;
+    }
+
+    // Metrics, log, admission and rate limits must be mapped before forking
+    // anyone using them.
+    // Reports get produced by the loop of the master, since it cannot
+    // start threads while forking.
+    metrics = metrics_create(METRICS_SLOTS);
+    if (!metrics) error("ERROR: Failed to create metrics");
+    if (metrics_listen(metrics, admin_path) < 0) {
+        error("ERROR: Failed to start metrics reporter");
+    }
+    if (log_dir) {
+        message_log = message_log_open(log_dir, segment_size, log_sync);
+        if (!message_log) error("ERROR: Failed to open message log");
+    }
+    if (max_conns > 0 || max_per_addr > 0) {
+        admission = admission_create(max_conns, max_per_addr);
+        if (!admission) error("ERROR: Failed to set up admission control");
+    }
+    if (rate_limits_enabled(&limits)) {
+        limiter = rate_limiter_create(&limits);
+        if (!limiter) error("ERROR: Failed to set up rate limits");
+    }
 
-    int port = atoi(argv[1]); // Listening port.
-    listener_fd = init_listener(port);
+    if (workers_num > 0) {
+        start_prefork();
+        release_listener(&endpoint);
+        if (admission) admission_destroy(admission);
+        if (limiter) rate_limiter_destroy(limiter);
+        metrics_stop();
+        metrics_destroy(metrics);
+        if (message_log) message_log_close(message_log);
+        return 0;
+    }
 
-    // Install signal handler for list manipilation signal.
-    memset(&man_act, 0, sizeof(struct sigaction));
-    man_act.sa_sigaction = remove_handler;
-    man_act.sa_flags = SA_SIGINFO | SA_RESTART;
-    sigaction(MAN_SIGNAL, &man_act, NULL);
+    // Initialize globals.
+    int open_max = (int) sysconf(_SC_OPEN_MAX);
+    handler_fds = conn_table_create(open_max);
+    handler_sources = (uint64_t *) malloc(sizeof(uint64_t) * open_max);
+    handler_clients = (int *) malloc(sizeof(int) * open_max);
 
-    // Install signal handler for terminating signal.
-    memset(&act, 0, sizeof(struct sigaction));
-    act.sa_handler = terminate_server;
-    sigaction(TERM_SIGNAL, &act, NULL);
+    listener_fd = init_listener(&endpoint, &sock_opts);
+
+    // Signals get read from a descriptor, so they have to stay blocked.
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, TERM_SIGNAL);
+    sigaddset(&sigs, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigs, NULL);
+    signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) error("ERROR: Failed to create signal descriptor");
     printf("Use CTRL+C to terminate.\n");
+    fflush(stdout);  // Do not let handlers inherit pending output.
 
     // Use current process for the listener.
     start_listener(listener_fd);
 
     printf("\nServer terminating...\n");
 
-    sigprocmask(SIG_BLOCK, blocked_signals, NULL);
-    iterator_t * iter = linked_list_iterator(handler_fds);
-    while(iterator_has_next(iter)) {
-        handler_t *handler = (handler_t *) iterator_next(iter);
-        shutdown(handler->fd, SHUT_RDWR);
-    }
-    iterator_destroy(iter);
-    sigprocmask(SIG_UNBLOCK, blocked_signals, NULL);
-
-    // Wait for all handler processes to complete.
+    // Reap any handler that exited after the last SIGCHLD got read.
     int pid;
     while((pid = wait(NULL)) > 0);
 
     // Cleanup resources.
-    free(blocked_signals);
-    linked_list_destroy(handler_fds);
+    close(signal_fd);
+    conn_table_destroy(handler_fds);
+    release_listener(&endpoint);
+    free(handler_sources);
+    free(handler_clients);
+    if (admission) admission_destroy(admission);
+    if (limiter) rate_limiter_destroy(limiter);
+    metrics_stop();
+    metrics_destroy(metrics);
+    if (message_log) message_log_close(message_log);
 
     return 0;
 }
@@ -117,94 +377,252 @@ void error(const char *msg)
     exit(1);
 }
 
+/**
+ * Prints usage information and terminates process.
+ */
+void usage(const char *exec_name)
+{
+    fprintf(stdout, "Usage: %s [-k workers] [-d reuseport|pass] "
+            "[-b backlog] [-C max_conns] [-I max_per_addr] [-R recv_max] "
+            "[-M admin_path] [-S log_dir] [-G segment_size] "
+            "[-Y none|async|sync] [-E none|echo|ack] [-N] [-t timeouts] "
+            "[-r limits] [-O options] <address>\n", exec_name);
+    exit(1);
+}
+
 /**
  * Ask server to terminate normally completing any critical unhandled task.
  *
  * This is a signal handler, that should be connected to a terminating signal
- * in the listener process.
+ * in the master of pre-forked workers.
  */
 void terminate_server(int signum)
 {
     // Stop accepting new connections.
-    if (signum == TERM_SIGNAL) destroy_listener(listener_fd);
+    if (signum == TERM_SIGNAL) {
+        term_requested = 1;
+        if (listener_fd >= 0) destroy_listener(listener_fd);
+    }
 }
 
 /**
- * Remove a handler from the list of active handlers.
+ * Converts current process into a listener on given socket, forking a new
+ * handler process for each client.
  *
- * This is a signal handler for a signal that should be sent from each handler
- * process just before it terminatess.
+ * Listener, signals and handler exits are all multiplexed on an epoll
+ * instance. Each handler is watched through a pidfd, which tells at once
+ * which connection it was serving when it exits, while reaping is left to
+ * SIGCHLD, collecting all exited handlers together. Returns once termination
+ * has been requested and every handler has exited.
  */
-void remove_handler(int signum, siginfo_t *info, void *cont)
+void start_listener(int socket_fd)
 {
-    if (signum == MAN_SIGNAL) {
-        printf("Removing handler...\n");
-        handler_t * handler = linked_list_remove(
-                handler_fds, info->si_value.sival_ptr);
-        close(handler->fd);  // Listener no more needs an open fd to client.
-        free(handler);
+    int rc = listen(socket_fd, backlog);  // Mark socket as listener.
+    if (rc < 0) error("ERROR: Failed to listen on given socket");
+    if (set_nonblocking(socket_fd) < 0) {
+        error("ERROR: Failed to make listener non-blocking");
     }
+    metrics_slot = metrics_claim(metrics);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) error("ERROR: Failed to create epoll instance");
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = socket_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &ev) < 0) {
+        error("ERROR: Failed to watch listener");
+    }
+    ev.data.fd = signal_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) < 0) {
+        error("ERROR: Failed to watch signals");
+    }
+    ev.data.fd = metrics_fd();
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_fd(), &ev) < 0) {
+        error("ERROR: Failed to watch metrics requests");
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!term_requested || conn_table_size(handler_fds) > 0) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR: Waiting for events failed");
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == socket_fd) {
+                if (!term_requested) accept_clients(socket_fd);
+            }
+            else if (fd == signal_fd) {
+                read_signals();
+                if (term_requested) begin_termination(socket_fd);
+            }
+            else if (fd == metrics_fd()) metrics_respond();
+            else remove_handler(fd);
+        }
+    }
+
+    close(epoll_fd);
 }
 
 /**
- * Initialize a listener on the given port.
+ * Accepts pending connections on the listener, forking a handler for each
+ * one that gets admitted.
  */
-int init_listener(int port)
+void accept_clients(int socket_fd)
 {
-    int socket_fd;                 // Listener's file descriptor.
-    struct sockaddr_in serv_addr;  // Server's local address.
+    struct sockaddr_storage client_addr;  // Address object of the client.
 
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0);  // IPv4 TCP socket.
-    if (socket_fd < 0) error("ERROR: Opening of socket failed");
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        // Handlers read in blocking mode, so only close on exec.
+        socklen_t sock_size = sizeof(client_addr);
+        int in_fd = accept4(socket_fd, (struct sockaddr *) &client_addr,
+                            &sock_size, SOCK_CLOEXEC);
+        if (in_fd < 0) {
+            // Aborted connections should not stop draining the backlog.
+            if (errno == ECONNABORTED || errno == EINTR) continue;
+            return;  // Either drained (EAGAIN) or out of resources.
+        }
+        uint64_t accepted_at = metrics_now();
+        metrics_accepted(metrics_slot);
 
-    // Create a sockaddr object with local IP and listening port.
-    memset((void *) &serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
+        uint64_t source = admission_source((struct sockaddr *) &client_addr);
+        if (admission &&
+            admission_acquire(admission, source) != ADMISSION_OK) {
+            admission_shed(in_fd);  // Shed before paying for a fork.
+            continue;
+        }
+        handler_sources[in_fd] = source;
+        socket_options_accepted(in_fd, &sock_opts);
 
-    // Bind to the listening port at localhost.
-    if (bind(socket_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        error("ERROR: Binding failed");
+        spawn_handler(socket_fd, in_fd, source, accepted_at);
+    }
+}
+
+/**
+ * Forks a handler process for a new client and starts watching it.
+ */
+void spawn_handler(int socket_fd, int client_fd, uint64_t source,
+                   uint64_t accepted_at)
+{
+    int pid;
+    if ((pid = fork()) == 0) {
+        close(socket_fd);
+        close(epoll_fd);
+        close(signal_fd);
+        sigset_t sigs;  // Blocked only to be read by the listener.
+        sigemptyset(&sigs);
+        sigprocmask(SIG_SETMASK, &sigs, NULL);
+        // Handle the new client by a new process.
+        handle_client(client_fd, source, accepted_at);
+    }
+    else if (pid == -1)  {
+        abandon_handler(client_fd, source, -1,
+                        "ERROR: Failed to launch handler");
+        return;
     }
+    // Else: Do not close client_fd in parent process, Otherwise it will be
+    // impossible to shutdown() the connection.
 
-    return socket_fd;
+    // Handler cannot have been reaped yet, so its pid is still valid, even
+    // if it has already exited.
+    int pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0) {
+        abandon_handler(client_fd, source, -1,
+                        "ERROR: Failed to watch handler");
+        return;
+    }
+    handler_clients[pidfd] = client_fd;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = pidfd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &ev) < 0) {
+        abandon_handler(client_fd, source, pidfd,
+                        "ERROR: Failed to watch handler");
+        return;
+    }
+
+    // Add a new entry to handlers table.
+    if (conn_table_insert(handler_fds, client_fd,
+                          (void *) (intptr_t) pid) < 0) {
+        abandon_handler(client_fd, source, pidfd,
+                        "ERROR: Failed to register handler");
+        return;
+    }
+    metrics_started(metrics_slot);
 }
 
 /**
- * Converts current process into a listener on given socket.
+ * Gives up on a client whose handler could not be launched or watched,
+ * printing given message about currently set errno, while the listener
+ * keeps serving everyone else.
+ *
+ * Any handler already forked gets its connection shut down, so it exits on
+ * its own, to be reaped on SIGCHLD. It is not killed, since it could be
+ * holding a lock of limits shared with everyone else.
  */
-void start_listener(int socket_fd)
+void abandon_handler(int client_fd, uint64_t source, int pidfd,
+                     const char *msg)
 {
-    int rc = listen(socket_fd, 8);  // Mark socket as listener.
-    if (rc < 0) error("ERROR: Failed to listen on given socket");
+    perror(msg);
+    if (pidfd >= 0) close(pidfd);  // Also removes it from the epoll set.
+    shutdown(client_fd, SHUT_RDWR);
+    if (admission) admission_release(admission, source);
+    admission_shed(client_fd);
+}
 
-    int in_fd;  // File descriptor for incoming connection.
-    struct sockaddr_in client_addr;  // Address object of the client.
-    socklen_t sock_size = sizeof(client_addr);
-
-    while ((in_fd = accept(socket_fd,
-                           (struct sockaddr *) &client_addr,
-                           &sock_size)) > -1)
-    {
-        // Add a new entry to handlers list.
-        handler_t *handler = malloc(sizeof(handler_t));
-        handler->fd = in_fd;
-        sigprocmask(SIG_BLOCK, blocked_signals, NULL);
-    	node_t *node = linked_list_append(handler_fds, (void *) handler);
-        sigprocmask(SIG_UNBLOCK, blocked_signals, NULL);
-
-        int pid;
-        if ((pid = fork()) == 0) {
-            close(socket_fd);
-            // Handle the new client by a new process.
-            handle_client(in_fd, client_addr, node);
-        }
-        else if (pid == -1)  {
-            error("ERROR: Failed to launch handler");
+/**
+ * Consumes pending signals, reaping all exited handlers on SIGCHLD and
+ * noting termination requests.
+ */
+void read_signals(void)
+{
+    struct signalfd_siginfo info[16];
+    ssize_t n;
+    while ((n = read(signal_fd, info, sizeof(info))) > 0) {
+        for (size_t i = 0; i < n / sizeof(info[0]); i++) {
+            if ((int) info[i].ssi_signo == TERM_SIGNAL) term_requested = 1;
+            else if (info[i].ssi_signo == SIGCHLD) {
+                // Pending SIGCHLDs coalesce, so reap everyone exited.
+                while (waitpid(-1, NULL, WNOHANG) > 0);
+            }
         }
-        // Else: Do not close in_fd in parent process, Otherwise it will be
-        // impossible to shutdown() the connection.
+    }
+}
+
+/**
+ * Removes the handler watched by given pidfd, which has exited, from the
+ * table of active handlers.
+ */
+void remove_handler(int pidfd)
+{
+    int fd = handler_clients[pidfd];
+    close(pidfd);  // Also removes it from the epoll set.
+
+    // Listener no more needs an open fd to client.
+    if (conn_table_remove(handler_fds, fd)) {
+        if (admission) admission_release(admission, handler_sources[fd]);
+        close(fd);
+        metrics_closed(metrics_slot);
+    }
+}
+
+/**
+ * Stops accepting new connections and asks active handlers to terminate,
+ * by shutting their connections down.
+ */
+void begin_termination(int socket_fd)
+{
+    static int terminating = 0;
+    if (terminating) return;
+    terminating = 1;
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket_fd, NULL);
+    int fd = conn_table_next(handler_fds, 0);
+    for (; fd >= 0; fd = conn_table_next(handler_fds, fd + 1)) {
+        shutdown(fd, SHUT_RDWR);
     }
 }
 
@@ -217,11 +635,11 @@ void destroy_listener(int socket_fd)
 }
 
 /**
- * Start the handler.
+ * Start the handler of a client from given source, as of admission_source().
  */
-void handle_client(int client_fd, struct sockaddr_in client_addr, node_t *node)
+void handle_client(int client_fd, uint64_t source, uint64_t accepted_at)
 {
-    // printf("New connection accepted. FD: %d\n", h_args->socket_fd);
+    metrics_slot = metrics_claim(metrics);
 
     // Disable termination signal.
     sigset_t sigs;
@@ -232,28 +650,411 @@ void handle_client(int client_fd, struct sockaddr_in client_addr, node_t *node)
     handler_fd = client_fd;
 
     // Initialize incoming message buffer.
-    char *buffer = (char *) malloc(sizeof(char) * 256);
-    memset(buffer, 0, 256);
-    int n;
+    recv_buffer_t buffer;
+    recv_buffer_init(&buffer, RECV_BUFFER_MIN, recv_max);
+    frame_reader_t reader;
+    frame_reader_init(&reader, frame_format);
+    ssize_t n;
+    int first = 1;  // Whether no data has been received yet.
 
-    // Keep reading till an error or shutdown (n == 0).
-    while((n = read(client_fd, buffer, 255)) > 0) {
-        printf("%s", buffer);
-        memset(buffer, 0, 256);  // Clear the buffer for next incoming.
+    // Messages go to the log, if any, or else get printed.
+    frame_handler_t handler = print_frame;
+    log_writer_t writer;
+    log_stream_t log_stream;
+    if (message_log) {
+        log_writer_init(&writer, message_log);
+        log_stream.writer = &writer;
+        log_stream.conn_id = message_log_connection_id(message_log);
+        handler = log_stream_write_frame;
     }
+    reply_batch_t replies;
+    reply_batch_init(&replies, reply_mode);
+    reply_batch_start(&replies, client_fd, NULL, handler, &log_stream);
+    int timing = conn_timeouts_enabled(&timeouts);
+    conn_activity_t activity;
+    conn_activity_init(&activity, accepted_at / 1000000);
+    rate_conn_t rate;
+    if (limiter) rate_conn_init(limiter, &rate, source);
 
-    // Signal parent process to treat this handler as dead.
-    union sigval val;
-    val.sival_ptr = (void *) node;
-    sigqueue(getppid(), MAN_SIGNAL, val);
-    // kill(getppid(), MAN_SIGNAL);
+    // Keep reading till an error, shutdown (n == 0), an invalid frame or a
+    // timeout.
+    while (1) {
+        int kind = timing ? wait_client(client_fd, &activity) : -1;
+        if (kind >= 0) {
+            metrics_timed_out(metrics_slot, kind);
+            break;
+        }
+        if ((n = recv_buffer_read(&buffer, client_fd)) <= 0) break;
+
+        if (first) metrics_first_byte(metrics_slot, accepted_at);
+        first = 0;
+        metrics_read(metrics_slot, n);
+        uint64_t messages = reader.messages;
+        int rc = reply_mode != REPLY_NONE ?
+                reply_batch_feed(&replies, &reader, buffer.data, n) :
+                frame_reader_feed(&reader, buffer.data, n, handler,
+                                  &log_stream);
+        if (rc < 0) break;
+        if (message_log) log_writer_flush(&writer);
+        if (timing) {
+            conn_activity_read(&activity, timer_wheel_now_ms(),
+                               frame_reader_pending(&reader));
+        }
+        if (limiter && throttle_client(client_fd, &rate, (size_t) n,
+                                       reader.messages - messages,
+                                       &activity) < 0) break;
+    }
+    if (limiter) rate_conn_free(limiter, &rate);
 
     // Close the connection to the client.
     close(client_fd);
 
     // Free local resources.
-    free(buffer);
+    recv_buffer_free(&buffer);
+    frame_reader_free(&reader);
+    reply_batch_free(&replies);
+    if (message_log) log_writer_free(&writer);
 
-    printf("Connection closed.\n");
+    // Printed along with messages, which the log replaces.
+    if (!message_log) printf("Connection closed.\n");
     exit(0);
 }
+
+/**
+ * Waits for data of a client with given activity to arrive, up to its
+ * deadline. Being the only connection of its process, it waits on poll()
+ * alone, instead of a timing wheel.
+ *
+ * Returns -1 once there is data, or an error, to be seen by the next read,
+ * or else the kind of the timeout exceeded.
+ */
+int wait_client(int client_fd, const conn_activity_t *activity)
+{
+    struct pollfd pfd;
+    pfd.fd = client_fd;
+    pfd.events = POLLIN;
+
+    while (1) {
+        timeout_kind_t kind;
+        uint64_t deadline = conn_timeouts_deadline(&timeouts, activity,
+                                                   &kind);
+        uint64_t now = timer_wheel_now_ms();
+        if (deadline <= now) return kind;
+
+        int wait = deadline - now > INT_MAX ? -1 : (int) (deadline - now);
+        int rc = poll(&pfd, 1, wait);
+        if (rc > 0 || (rc < 0 && errno != EINTR)) return -1;
+    }
+}
+
+/**
+ * Charges a client for a read of given bytes and messages, pausing reading
+ * from it for as long as it exceeds its rate limits. Timeouts of given
+ * activity get pushed back by the pause.
+ *
+ * Pauses get waited out on poll(), for no event at all, so that a shutdown
+ * of the connection on termination still cuts them short.
+ *
+ * Returns 0 once the pause is over, -1 if the connection got shut down.
+ */
+int throttle_client(int client_fd, rate_conn_t *rate, size_t bytes,
+                    uint64_t msgs, conn_activity_t *activity)
+{
+    uint64_t pause = rate_conn_charge(limiter, rate, bytes, (size_t) msgs);
+    if (pause == 0) return 0;
+    metrics_throttled(metrics_slot, pause);
+    uint64_t pause_ms = (pause + 999999) / 1000000;
+    if (conn_timeouts_enabled(&timeouts)) {
+        conn_activity_pause(activity, timer_wheel_now_ms(), pause_ms);
+    }
+
+    struct pollfd pfd;
+    pfd.fd = client_fd;
+    pfd.events = 0;  // Hang ups get reported anyway.
+
+    uint64_t until = rate_now_ns() + pause;
+    uint64_t now;
+    while ((now = rate_now_ns()) < until) {
+        uint64_t wait_ms = (until - now + 999999) / 1000000;
+        int wait = wait_ms > INT_MAX ? INT_MAX : (int) wait_ms;
+        int rc = poll(&pfd, 1, wait);
+        if (rc > 0 || (rc < 0 && errno != EINTR)) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Prints the message of a received frame as a line of its own.
+ */
+int print_frame(const frame_t *frame, void *arg)
+{
+    (void) arg;
+    fwrite(frame->payload, 1, frame->length, stdout);
+    if (frame->length == 0 || frame->payload[frame->length - 1] != '\n') {
+        putchar('\n');
+    }
+    return 0;
+}
+
+/**
+ * Runs the server in pre-fork mode, with current process becoming the
+ * master of a fixed number of worker processes.
+ *
+ * Master respawns any worker that exits before termination is requested.
+ * On termination, it forwards the request to all workers and waits for them
+ * to drain their connections.
+ */
+void start_prefork(void)
+{
+    workers = (worker_t *) malloc(sizeof(worker_t) * workers_num);
+    for (int i = 0; i < workers_num; i++) {
+        workers[i].pid = -1;
+        workers[i].channel_fd = -1;
+    }
+
+    if (dispatch_mode == DISPATCH_PASS) {
+        listener_fd = init_listener(&endpoint, &sock_opts);
+        if (listen(listener_fd, backlog) < 0) {
+            error("ERROR: Failed to listen on given socket");
+        }
+        if (set_nonblocking(listener_fd) < 0) {
+            error("ERROR: Failed to make listener non-blocking");
+        }
+        metrics_slot = metrics_claim(metrics);
+    }
+    else {
+        // Probe the port once, so workers do not fail one after the other.
+        destroy_listener(init_reuseport_listener(&endpoint, &sock_opts));
+        listener_fd = -1;
+    }
+
+    // Install signal handlers, without SA_RESTART, so that blocking calls
+    // of master get interrupted.
+    memset(&act, 0, sizeof(struct sigaction));
+    act.sa_handler = terminate_server;
+    sigaction(TERM_SIGNAL, &act, NULL);
+    struct sigaction chld_act;
+    memset(&chld_act, 0, sizeof(struct sigaction));
+    chld_act.sa_handler = note_child_exit;
+    sigaction(SIGCHLD, &chld_act, NULL);
+    printf("Use CTRL+C to terminate.\n");
+    fflush(stdout);  // Do not let workers inherit pending output.
+
+    for (int i = 0; i < workers_num; i++) spawn_worker(i);
+
+    // Sleep until a worker exits, termination is requested, a report is
+    // due, or a connection is to be passed. Signals only get delivered
+    // while sleeping, so none of them gets missed.
+    sigset_t sigs, orig_sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, TERM_SIGNAL);
+    sigaddset(&sigs, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigs, &orig_sigs);
+    struct pollfd fds[2];
+    fds[0].fd = metrics_fd();
+    fds[0].events = POLLIN;
+    fds[1].fd = listener_fd;  // Ignored by poll() when negative.
+    fds[1].events = POLLIN;
+    while (!term_requested) {
+        if (child_exited) {
+            supervise_workers();
+            continue;
+        }
+        if (ppoll(fds, 2, NULL, &orig_sigs) < 0) continue;
+        if (fds[0].revents & POLLIN) metrics_respond();
+        if (fds[1].revents & POLLIN) dispatch_connections();
+    }
+    sigprocmask(SIG_SETMASK, &orig_sigs, NULL);
+
+    printf("\nServer terminating...\n");
+
+    // Forward termination to workers.
+    for (int i = 0; i < workers_num; i++) {
+        if (workers[i].pid > 0) kill(workers[i].pid, TERM_SIGNAL);
+        if (workers[i].channel_fd >= 0) close(workers[i].channel_fd);
+    }
+
+    // Wait for all worker processes to complete.
+    int pid;
+    while((pid = wait(NULL)) > 0);
+
+    free(workers);
+}
+
+/**
+ * Forks a new worker process for the given slot.
+ */
+void spawn_worker(int slot)
+{
+    int fds[2] = { -1, -1 };  // Master's and worker's ends of channel.
+    if (dispatch_mode == DISPATCH_PASS &&
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        error("ERROR: Failed to create worker channel");
+    }
+
+    int pid;
+    if ((pid = fork()) == 0) {
+        if (fds[0] >= 0) close(fds[0]);
+        start_worker(fds[1]);
+    }
+    else if (pid == -1) {
+        error("ERROR: Failed to launch worker");
+    }
+
+    if (fds[1] >= 0) close(fds[1]);
+    workers[slot].pid = pid;
+    workers[slot].channel_fd = fds[0];
+}
+
+/**
+ * Entry point of worker processes.
+ *
+ * Serves connections on an epoll loop, accepting them either on a listener
+ * of its own, or receiving them over given channel from the master.
+ */
+void start_worker(int channel_fd)
+{
+    // Drop everything that belongs to the master.
+    for (int i = 0; i < workers_num; i++) {
+        if (workers[i].channel_fd >= 0) close(workers[i].channel_fd);
+    }
+    if (listener_fd >= 0) close(listener_fd);
+    signal(SIGCHLD, SIG_DFL);
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigprocmask(SIG_SETMASK, &sigs, NULL);
+
+    term_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (term_fd < 0) error("ERROR: Failed to create termination event");
+
+    memset(&act, 0, sizeof(struct sigaction));
+    act.sa_handler = terminate_worker;
+    sigaction(TERM_SIGNAL, &act, NULL);
+
+    int worker_listener = -1;
+    if (dispatch_mode == DISPATCH_REUSEPORT) {
+        worker_listener = init_reuseport_listener(&endpoint, &sock_opts);
+        if (listen(worker_listener, backlog) < 0) {
+            error("ERROR: Failed to listen on given socket");
+        }
+        if (set_nonblocking(worker_listener) < 0) {
+            error("ERROR: Failed to make listener non-blocking");
+        }
+    }
+
+    // Each worker gets its own pipeline, writing to the shared stdout.
+    output_t *output = output_create(STDOUT_FILENO, 65536, 1000);
+    if (!output) error("ERROR: Failed to create output pipeline");
+
+    event_loop_t *loop = event_loop_create(worker_listener, term_fd, output,
+                                           recv_max);
+    if (!loop) error("ERROR: Failed to create event loop");
+    loop->metrics = metrics_claim(metrics);
+    loop->sock_opts = &sock_opts;
+    log_writer_t writer;
+    if (message_log) {
+        log_writer_init(&writer, message_log);
+        loop->log_writer = &writer;
+    }
+    reply_batch_init(&loop->replies, reply_mode);
+    loop->format = frame_format;
+    loop->timeouts = timeouts;
+    loop->admission = admission;
+    loop->limiter = limiter;
+    if (channel_fd >= 0 && event_loop_add_channel(loop, channel_fd) < 0) {
+        error("ERROR: Failed to watch worker channel");
+    }
+
+    event_loop_run(loop);
+
+    // Free local resources.
+    event_loop_destroy(loop);
+    if (message_log) log_writer_free(&writer);
+    output_destroy(output);
+    if (worker_listener >= 0) destroy_listener(worker_listener);
+    if (channel_fd >= 0) close(channel_fd);
+    close(term_fd);
+
+    exit(0);
+}
+
+/**
+ * Accepts pending connections on master and hands them to workers in round
+ * robin.
+ */
+void dispatch_connections(void)
+{
+    static int next = 0;  // Worker to receive next connection.
+    int in_fd;            // File descriptor for incoming connection.
+
+    for (int i = 0; i < ACCEPT_BATCH; i++) {
+        in_fd = accept4(listener_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (in_fd < 0) {
+            // Aborted connections should not stop draining the backlog.
+            if (errno == ECONNABORTED || errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            error("ERROR: Failed to accept connection");
+        }
+        metrics_accepted(metrics_slot);
+        socket_options_accepted(in_fd, &sock_opts);
+
+        // Skip workers that have gone away, trying each one at most once.
+        for (int tries = 0; tries < workers_num; tries++) {
+            worker_t *worker = &workers[next];
+            next = (next + 1) % workers_num;
+            if (worker->channel_fd >= 0 &&
+                send_fd(worker->channel_fd, in_fd) == 0) break;
+        }
+
+        close(in_fd);  // Worker holds its own copy from now on.
+    }
+}
+
+/**
+ * Reaps exited workers and respawns them, unless server is terminating.
+ */
+void supervise_workers(void)
+{
+    child_exited = 0;
+
+    int pid;
+    int status;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < workers_num; i++) {
+            if (workers[i].pid != pid) continue;
+
+            workers[i].pid = -1;
+            if (workers[i].channel_fd >= 0) {
+                close(workers[i].channel_fd);
+                workers[i].channel_fd = -1;
+            }
+            if (!term_requested) {
+                fprintf(stderr, "Worker %d exited, respawning...\n", pid);
+                spawn_worker(i);
+            }
+        }
+    }
+}
+
+/**
+ * Notes that a child has exited, to be reaped out of signal context.
+ */
+void note_child_exit(int signum)
+{
+    if (signum == SIGCHLD) child_exited = 1;
+}
+
+/**
+ * Asks a worker's loop to stop accepting and drain its connections.
+ *
+ * This is a signal handler, that should be connected to a terminating signal
+ * in worker processes.
+ */
+void terminate_worker(int signum)
+{
+    if (signum == TERM_SIGNAL) {
+        uint64_t val = 1;
+        ssize_t rc = write(term_fd, &val, sizeof(val));
+        (void) rc;
+    }
+}
@@ -7,105 +7,653 @@
  *
  * A TCP server able to handle multiple connections in a thread based model.
  *
- * Usage: exec_name <port>
+ * Usage: exec_name [-w workers] [-q queue_size] [-o policy] [-m max_workers]
+ *                  [-a] [-b backlog] [-C max_conns] [-I max_per_addr]
+ *                  [-P park_size] [-F flush_bytes] [-L flush_usec]
+ *                  [-R recv_max] [-M admin_path] [-S log_dir]
+ *                  [-G segment_size] [-Y none|async|sync]
+ *                  [-U upgrade_path] [-T] [-E none|echo|ack] [-N]
+ *                  [-B queue_depth] [-D drop|disconnect] [-g schedulers]
+ *                  [-k stack_size] [-t timeouts] [-r limits] [-O options]
+ *                  <address>
  *  where:
- *      -port : Port number on which to start the server.
+ *      -address : Where to listen. Either a port, for all IPv4 interfaces,
+ *              or "host:port", with IPv6 hosts in brackets (e.g. "[::]:port"
+ *              for all interfaces, over both IPv4 and IPv6), or "unix:path"
+ *              for a Unix domain socket ("unix:@name" in the abstract
+ *              namespace).
+ *      -workers : Number of pre-spawned worker threads. When 0 (default), a
+ *              new thread is spawned for each client.
+ *      -queue_size : Capacity of the queue of accepted connections waiting
+ *              for a worker. Defaults to 64.
+ *      -policy : What to do when the queue is full. One of:
+ *              block : Stop accepting until a slot gets free (default).
+ *              reject : Close the new connection at once.
+ *              grow : Spawn another worker, up to max_workers.
+ *      -max_workers : Upper limit of workers for grow policy. Defaults to
+ *              four times the initial workers.
+ *      -a : Accept on every CPU, with a SO_REUSEPORT listener and an accept
+ *              thread per CPU. Connections get served on the CPU that
+ *              accepted them, so workers, queue_size and max_workers then
+ *              apply to each CPU.
+ *      -backlog : Length of accept queue of each listener (default
+ *              SOMAXCONN).
+ *      -max_conns : Max connections served or queued at once. Further ones
+ *              get parked or reset. When 0 (default), there is no limit.
+ *      -max_per_addr : Max connections from a single source address.
+ *              Further ones get reset. When 0 (default), there is no limit.
+ *      -park_size : Connections above max_conns to keep waiting for a free
+ *              slot, instead of resetting them (default 0).
+ *      -flush_bytes : Received bytes that get written to stdout at once
+ *              (default 65536).
+ *      -flush_usec : Max time received data may wait before being written
+ *              to stdout (default 1000).
+ *      -recv_max : Max size receive buffers may grow to (default 65536).
+ *      -admin_path : Path of a Unix domain socket reporting metrics in
+ *              Prometheus text format to anyone connecting to it. Metrics
+ *              are also written to stderr on SIGUSR2.
+ *      -log_dir : Append received messages to a persistent log in this
+ *              directory, instead of writing them to stdout. Use log_replay
+ *              to read it.
+ *      -segment_size : Bytes of each segment file of the log, after which a
+ *              new one gets started (default 64MB).
+ *      -Y : When appended messages get synced to disk, after every read:
+ *              none : Never, left to the kernel (default).
+ *              async : Write back starts, without waiting for it.
+ *              sync : Wait for messages to reach the disk.
+ *      -upgrade_path : Path of a Unix domain socket, through which a new
+ *              instance started with the same path takes the listeners over,
+ *              for restarting without refusing any connection. The old
+ *              instance then stops accepting, serves the connections it
+ *              already has and exits. A new instance finding nobody on the
+ *              path starts afresh. Both should run in the same mode (-a or
+ *              not), and the new one appends to the message log of the old
+ *              one, if both of them log.
+ *      -T : When taking over, also take the connections still waiting for a
+ *              worker or parked in the old instance, instead of leaving them
+ *              to be served there.
+ *      -E : How every frame received gets replied to, for measuring round
+ *              trip latency. Replies to all frames of a read get written
+ *              together, so clients may keep many frames in flight.
+ *              none : Never (default).
+ *              echo : Frame gets sent back as is.
+ *              ack : An empty ack frame gets sent back.
+ *      -N : Messages are newline delimited UTF-8 lines, instead of frames.
+ *              Connections sending invalid UTF-8, or lines longer than 65535
+ *              bytes, get closed. Echoes are the lines themselves, while
+ *              acks stay frames.
+ *      -queue_depth : Broadcast frames received on every connection to all
+ *              other connections. Frames of a single read get broadcast
+ *              together, and up to queue_depth such broadcasts may wait to
+ *              be sent to a connection. Cannot be combined with -E.
+ *      -D : What to do with connections whose broadcast queue is full:
+ *              drop : Drop further broadcasts for them (default).
+ *              disconnect : Shut them down.
+ *      -schedulers : Serve every connection on a coroutine, instead of a
+ *              thread of its own, with this many threads running all
+ *              coroutines. Replaces the worker pool.
+ *      -stack_size : Bytes of stack of every coroutine (default 65536), at
+ *              least 16384 and a page.
+ *      -timeouts : Comma separated timeouts of connections, in seconds, after
+ *              which they get closed, freeing their handler (none by
+ *              default):
+ *              idle=seconds : Nothing has been received for that long.
+ *              read=seconds : A frame, or line, started being received that
+ *                      long ago and is still incomplete.
+ *              lifetime=seconds : Connection was accepted that long ago.
+ *      -limits : Comma separated rates, per second, over which reading from
+ *              connections pauses until they are back under them, so that
+ *              TCP flow control slows their clients down (none by default).
+ *              Rates may be suffixed by k, m or g:
+ *              bytes=rate : Bytes received from each connection.
+ *              msgs=rate : Frames, or lines, received from each connection.
+ *              addr_bytes=rate : Bytes received from each source address,
+ *                      over all its connections.
+ *              addr_msgs=rate : Frames, or lines, received from each source
+ *                      address.
+ *              burst=seconds : Worth of every rate that may be received at
+ *                      once (default 0.1).
+ *      -options : Comma separated options of TCP connections, ignored on
+ *              Unix domain sockets:
+ *              nodelay : Send small replies at once (TCP_NODELAY).
+ *              quickack : Ack at once at the start of connections
+ *                      (TCP_QUICKACK).
+ *              defer=seconds : Only accept connections once they carry data,
+ *                      waiting up to seconds for it (TCP_DEFER_ACCEPT).
+ *              rcvbuf=bytes : Size of receive buffers (SO_RCVBUF).
+ *              sndbuf=bytes : Size of send buffers (SO_SNDBUF).
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <pthread.h>
-#include "linked_list.h"
+#include <sched.h>
+#include "conn_table.h"
+#include "admission.h"
+#include "listener.h"
+#include "work_queue.h"
+#include "output.h"
+#include "recv_buffer.h"
+#include "frame.h"
+#include "metrics.h"
+#include "message_log.h"
+#include "handoff.h"
+#include "reply.h"
+#include "broadcast.h"
+#include "coro.h"
+#include "timeouts.h"
+#include "rate_limit.h"
+#include "pool.h"
 
 
 typedef struct {
-    int socket_fd;
-    struct sockaddr_in addr;
-	node_t *list_entry;
+    work_item_t items[2];  // Connection being served and the next one.
 } handler_args_t;
 
+typedef enum {
+    POLICY_BLOCK,   // Stop accepting until there is room in the queue.
+    POLICY_REJECT,  // Close connections that do not fit in the queue.
+    POLICY_GROW     // Spawn more workers, up to max_workers.
+} overflow_policy_t;
+
+// State of a connection being served, kept across reads.
 typedef struct {
-    pthread_t tid;
-    int fd;
-} handler_t;
+    work_item_t *item;
+    output_stream_t stream;
+    frame_reader_t reader;
+    uint64_t log_conn_id;      // Id of connection in message log.
+    subscriber_t *subscriber;  // NULL if not receiving broadcasts.
+    reply_backlog_t backlog;   // Replies waiting for room, on coroutines.
+    reaper_watch_t watch;      // Times connection out, if reaper is set.
+    rate_conn_t rate;          // Rates of connection, if limiter is set.
+} connection_t;
+
+// Listener together with the threads serving the connections it accepts.
+typedef struct {
+    int cpu;            // CPU all threads of shard run on, -1 for any.
+    int listener_fd;    // Socket descriptor of listener.
+    pthread_t acceptor; // Thread accepting on listener, in per-CPU mode.
+    // Worker pool of shard. Pool is disabled when work_queue is NULL.
+    work_queue_t *work_queue;  // Accepted connections waiting for a worker.
+    pthread_t *workers;  // Spawned workers.
+    int workers_num;     // Number of currently spawned workers.
+    pthread_mutex_t spawn_lock;  // Held while spawning, by the acceptor, or
+                                 // the thread completing a handoff.
+} shard_t;
 
 
-int init_listener(int port);
-void start_listener(int socket_fd);
+void init_shards(int per_cpu, const int *inherited, int inherited_num);
+void start_listener(shard_t *shard);
+void *start_acceptor(void *args);
 void destroy_listener(int socket_fd);
-void handle_client(int client_fd, struct sockaddr_in client_addr);
+int request_handoff(int take_conns, int *listeners, int *listeners_num,
+                    int *log_fd);
+void complete_handoff(int channel);
+void *start_finisher(void *args);
+void *start_upgrader(void *args);
+int hand_off(int channel);
+void hand_off_clients(int channel);
+int hand_off_client(int channel, work_item_t *item);
+void shed_parked(void);
+void wait_handlers(void);
+void stop_handlers(void);
+void admit_client(shard_t *shard, work_item_t item);
+int unpark_client(work_item_t *item);
+void handle_client(shard_t *shard, work_item_t item);
 void *start_handler(void *args);
+void start_coroutine(void *args);
+void start_scheduler(void);
+void stop_scheduler(void);
+void enqueue_client(shard_t *shard, work_item_t item);
+void register_handler(work_item_t *item);
+void unregister_handler(int client_fd);
+void abandon_client(work_item_t *item, const char *msg);
+void serve_clients(work_item_t *item, work_item_t *next,
+                   recv_buffer_t *buffer);
+int finish_client(work_item_t *done, work_item_t *next);
+void spawn_worker(shard_t *shard);
+void *start_worker(void *args);
+void init_thread_attr(pthread_attr_t *attr, shard_t *shard);
+void serve_client(work_item_t *item, recv_buffer_t *buffer);
+ssize_t read_client(int fd, recv_buffer_t *buffer);
+int serve_read(connection_t *conn, const char *data, size_t len, int first);
+int drain_replies(connection_t *conn);
+int throttle(connection_t *conn, size_t bytes, uint64_t msgs);
+int parse_policy(const char *name);
+void usage(const char *exec_name);
 void error(const char *msg);
 void terminate_server(int signum);
 
 
 const int TERM_SIGNAL = SIGINT;  // Signal for requesting server termination.
+const int METRICS_SLOTS = 256;   // Threads beyond that share metrics slots.
 
-linked_list_t *handler_fds;   // Storage for info of active handlers.
-int listener_fd;              // Socket descriptor of listener.
-pthread_mutex_t *list_mutex;  // A mutex used for list operations.
+conn_table_t *handler_fds;    // Client sources of active handlers, by fd.
+shard_t *shards;              // One per CPU, or a single one.
+int shards_num;
+int backlog = SOMAXCONN;      // Accept queue length of each listener.
+endpoint_t endpoint;          // Address listened on.
+socket_options_t sock_opts;   // Options of listeners and connections.
+pthread_mutex_t *list_mutex;  // Only used for waiting handlers on termination.
 pthread_cond_t *list_size_cond;  // Condition to be used for tracking handlers num.
+atomic_int terminating = 0;  // Set once handlers are asked to stop.
+atomic_int draining = 0;     // Set once main thread waits for handlers.
+atomic_int active_handlers = 0;  // Registered handlers, counted exactly,
+                                 // unlike the size of handler_fds.
+volatile sig_atomic_t term_requested = 0;  // Set by terminating signal.
+int wake_fd;  // Turns readable once acceptors should stop.
+
+// Hot restart related globals.
+const char *upgrade_path = NULL;  // Where new instances ask for handoff.
+int upgrade_fd = -1;     // Listens for handoff requests, -1 if none.
+pthread_t upgrader;      // Thread serving handoff requests.
+pthread_t finisher;      // Thread taking connections from an old instance.
+atomic_int handed_off = 0;  // Set once a new instance took listeners over.
+
+// Admission control related globals.
+admission_t *admission = NULL;  // Limits of connections, NULL if none.
+work_queue_t *parking = NULL;   // Connections waiting for admission.
+
+// Worker pool related globals, applying to each shard.
+overflow_policy_t policy = POLICY_BLOCK;
+int max_workers = 0;     // Upper limit of workers for POLICY_GROW.
+
+output_t *output;  // Pipeline writing received data to stdout.
+size_t recv_max = RECV_BUFFER_MAX;  // Max capacity of receive buffers.
+
+// Recycled state of handlers, so serving a connection needs no allocation.
+obj_pool_t *args_pool;     // Of handler_args_t.
+buf_pool_t *buffer_pool;   // Of receive buffers.
+
+metrics_t *metrics;  // Counters of all threads.
+__thread metrics_slot_t *metrics_slot;  // Counters of current thread.
+
+message_log_t *message_log = NULL;  // Sink of messages, NULL for stdout.
+__thread log_writer_t log_writer;   // Appends to log for current thread.
+
+reply_mode_t reply_mode = REPLY_NONE;  // How received frames get replied to.
+frame_format_t frame_format = FRAME_FORMAT_FRAMES;  // Of received data.
+__thread reply_batch_t replies;        // Replies of current thread.
+
+broadcast_t *broadcast = NULL;         // Fan-out of frames, NULL if none.
+__thread broadcast_batch_t broadcasts; // Frames of current read to publish.
+
+coro_runtime_t *coroutines = NULL;  // Runs handlers, NULL if threads do.
+
+reaper_t *reaper = NULL;  // Closes connections timing out, NULL if none.
+
+rate_limiter_t *limiter = NULL;  // Limits rates of connections, NULL if none.
 
 
 int main(int argc, char *argv[])
 {
-    // Listening port should be provided by caller.
-    if (argc < 2) {
-        fprintf(stderr, "ERROR: No listening port provided.\n");
-        fprintf(stdout, "Usage: %s <port>\n", argv[0]);
-        exit(1);
+    int init_workers = 0;
+    int queue_size = 64;
+    int per_cpu = 0;
+    int max_conns = 0;
+    int max_per_addr = 0;
+    int park_size = 0;
+    size_t flush_bytes = 65536;
+    unsigned flush_usec = 1000;
+    const char *admin_path = NULL;
+    const char *log_dir = NULL;
+    size_t segment_size = LOG_SEGMENT_SIZE;
+    log_sync_t log_sync = LOG_SYNC_NONE;
+    int take_conns = 0;
+    int broadcast_depth = 0;
+    broadcast_policy_t broadcast_policy = BROADCAST_DROP;
+    int schedulers = 0;
+    size_t stack_size = CORO_STACK_SIZE;
+    conn_timeouts_t timeouts = { 0, 0, 0 };
+    rate_limits_t limits = { { 0, 0 }, { 0, 0 }, 0 };
+
+    int opt, rc;
+    while ((opt = getopt(argc, argv, "w:q:o:m:ab:C:I:P:F:L:R:M:S:G:Y:U:T"
+                         "E:NB:D:g:k:t:r:O:")) != -1) {
+        switch (opt) {
+            case 'w':
+                init_workers = atoi(optarg);
+                break;
+            case 'q':
+                queue_size = atoi(optarg);
+                break;
+            case 'o':
+                if ((rc = parse_policy(optarg)) < 0) usage(argv[0]);
+                policy = (overflow_policy_t) rc;
+                break;
+            case 'm':
+                max_workers = atoi(optarg);
+                break;
+            case 'a':
+                per_cpu = 1;
+                break;
+            case 'b':
+                backlog = atoi(optarg);
+                break;
+            case 'C':
+                max_conns = atoi(optarg);
+                break;
+            case 'I':
+                max_per_addr = atoi(optarg);
+                break;
+            case 'P':
+                park_size = atoi(optarg);
+                break;
+            case 'F':
+                flush_bytes = (size_t) atol(optarg);
+                break;
+            case 'L':
+                flush_usec = (unsigned) atoi(optarg);
+                break;
+            case 'R':
+                recv_max = (size_t) atol(optarg);
+                break;
+            case 'M':
+                admin_path = optarg;
+                break;
+            case 'S':
+                log_dir = optarg;
+                break;
+            case 'G':
+                segment_size = (size_t) atol(optarg);
+                break;
+            case 'Y':
+                if ((rc = message_log_parse_sync(optarg)) < 0) usage(argv[0]);
+                log_sync = (log_sync_t) rc;
+                break;
+            case 'U':
+                upgrade_path = optarg;
+                break;
+            case 'T':
+                take_conns = 1;
+                break;
+            case 'E':
+                if ((rc = reply_parse_mode(optarg)) < 0) usage(argv[0]);
+                reply_mode = (reply_mode_t) rc;
+                break;
+            case 'N':
+                frame_format = FRAME_FORMAT_LINES;
+                break;
+            case 'B':
+                broadcast_depth = atoi(optarg);
+                break;
+            case 'D':
+                if ((rc = broadcast_parse_policy(optarg)) < 0) usage(argv[0]);
+                broadcast_policy = (broadcast_policy_t) rc;
+                break;
+            case 'g':
+                schedulers = atoi(optarg);
+                break;
+            case 'k':
+                if (coro_parse_stack_size(optarg, &stack_size) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                if (conn_timeouts_parse(optarg, &timeouts) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                if (rate_limits_parse(optarg, &limits) < 0) usage(argv[0]);
+                break;
+            case 'O':
+                if (socket_options_parse(optarg, &sock_opts) < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    // Listening address should be provided by caller.
+    if (optind >= argc) {
+        fprintf(stderr, "ERROR: No listening address provided.\n");
+        usage(argv[0]);
+    }
+    if (endpoint_parse(argv[optind], &endpoint) < 0) {
+        error("ERROR: Invalid listening address");
+    }
+    if (broadcast_depth > 0 && reply_mode != REPLY_NONE) {
+        // Both would write to connections at once, interleaving frames.
+        fprintf(stderr, "ERROR: Replies cannot be combined with "
+                "broadcasts.\n");
+        usage(argv[0]);
+    }
+    if (schedulers > 0 && init_workers > 0) {
+        fprintf(stderr, "Coroutines replace the worker pool, "
+                "ignoring -w.\n");
+        init_workers = 0;
+    }
+    if (per_cpu && endpoint.family == AF_UNIX) {
+        fprintf(stderr, "Unix domain sockets cannot be shared through "
+                "SO_REUSEPORT, using a single listener.\n");
+        per_cpu = 0;
+    }
+
+    // Take listeners over from a running instance, if there is one.
+    int inherited[HANDOFF_MAX_LISTENERS];
+    int inherited_num = 0;
+    int log_fd = -1;
+    int channel = -1;
+    if (upgrade_path) {
+        channel = request_handoff(take_conns, inherited, &inherited_num,
+                                  &log_fd);
     }
 
     // Initialize globals.
-    handler_fds = linked_list_create();
+    handler_fds = conn_table_create((int) sysconf(_SC_OPEN_MAX));
     list_mutex = (pthread_mutex_t *) malloc(sizeof(pthread_mutex_t));
     pthread_mutex_init(list_mutex, NULL);
 	list_size_cond = (pthread_cond_t *) malloc(sizeof(pthread_cond_t));
 	pthread_cond_init(list_size_cond, NULL);
+    output = output_create(STDOUT_FILENO, flush_bytes, flush_usec);
+    if (!output) error("ERROR: Failed to create output pipeline");
+    args_pool = obj_pool_create(sizeof(handler_args_t), POOL_DEPOT_SIZE);
+    buffer_pool = buf_pool_create(RECV_BUFFER_MIN, recv_max);
+    if (!args_pool || !buffer_pool) error("ERROR: Failed to create pools");
+    metrics = metrics_create(METRICS_SLOTS);
+    if (!metrics) error("ERROR: Failed to create metrics");
+    metrics_add_pool(metrics, "handler", args_pool->stats);
+    metrics_add_pool(metrics, "buffer", &buffer_pool->stats);
+    if (metrics_serve(metrics, admin_path) < 0) {
+        error("ERROR: Failed to start metrics reporter");
+    }
+    if (log_dir && log_fd >= 0) {
+        message_log = message_log_attach(log_fd);
+        if (!message_log) error("ERROR: Failed to attach to message log");
+    }
+    else if (log_dir) {
+        message_log = message_log_open(log_dir, segment_size, log_sync);
+        if (!message_log) error("ERROR: Failed to open message log");
+    }
+    else if (log_fd >= 0) close(log_fd);
 
-    int port = atoi(argv[1]); // Listening port.
-    listener_fd = init_listener(port);
+    if (max_conns > 0 || max_per_addr > 0) {
+        admission = admission_create(max_conns, max_per_addr);
+        if (!admission) error("ERROR: Failed to set up admission control");
+        if (max_conns > 0 && park_size > 0) {
+            parking = work_queue_create(park_size);
+        }
+    }
+
+    if (broadcast_depth > 0) {
+        broadcast = broadcast_create(broadcast_depth, broadcast_policy,
+                                     (int) sysconf(_SC_NPROCESSORS_ONLN));
+        if (!broadcast) error("ERROR: Failed to set up broadcasts");
+    }
+    if (conn_timeouts_enabled(&timeouts)) {
+        reaper = reaper_create(&timeouts, metrics_claim(metrics));
+        if (!reaper) error("ERROR: Failed to start reaper");
+    }
+    if (rate_limits_enabled(&limits)) {
+        limiter = rate_limiter_create(&limits);
+        if (!limiter) error("ERROR: Failed to set up rate limits");
+    }
+    if (schedulers > 0) {
+        coroutines = coro_runtime_create(schedulers, stack_size,
+                                         start_scheduler, stop_scheduler);
+        if (!coroutines) error("ERROR: Failed to start schedulers");
+    }
+
+    init_shards(per_cpu, inherited, inherited_num);
+
+    // Pre-spawn the workers of the pools, if requested.
+    if (init_workers > 0) {
+        if (queue_size < 1) queue_size = 1;
+        if (max_workers < init_workers) max_workers = 4 * init_workers;
+        for (int s = 0; s < shards_num; s++) {
+            shard_t *shard = &shards[s];
+            shard->work_queue = work_queue_create(queue_size);
+            shard->workers =
+                    (pthread_t *) malloc(sizeof(pthread_t) * max_workers);
+            for (int i = 0; i < init_workers; i++) spawn_worker(shard);
+        }
+    }
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) error("ERROR: Failed to create wake up event");
 
     struct sigaction act;
     memset(&act, 0, sizeof(act));
     act.sa_handler = terminate_server;
     sigaction(TERM_SIGNAL, &act, NULL);
     printf("Use CTRL+C to terminate.\n");
+    fflush(stdout);  // Pipeline writes to stdout bypassing stdio.
 
-    // Use current thread for the listener.
-    start_listener(listener_fd);
+    if (upgrade_path) {
+        // The instance taken over from, if any, may still be listening.
+        upgrade_fd = handoff_listen(upgrade_path, channel >= 0);
+        if (upgrade_fd < 0) error("ERROR: Failed to listen for upgrades");
 
-    printf("\nServer terminating...\n");
+        // Keep signals off upgrader and finisher, which may block for long.
+        // Acceptors start on the inherited listeners at once, while the old
+        // instance passes its waiting connections over to the finisher.
+        sigset_t all, orig;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &orig);
+        rc = pthread_create(&upgrader, NULL, start_upgrader, NULL);
+        if (rc == 0 && channel >= 0) {
+            rc = pthread_create(&finisher, NULL, start_finisher,
+                                (void *) (intptr_t) channel);
+        }
+        pthread_sigmask(SIG_SETMASK, &orig, NULL);
+        if (rc != 0) error("ERROR: Failed to launch upgrader");
+    }
 
-    // Ask active handlers to terminate.
-    pthread_mutex_lock(list_mutex);
-    iterator_t * iter = linked_list_iterator(handler_fds);
-    while(iterator_has_next(iter)) {
-        handler_t *handler = (handler_t *) iterator_next(iter);
-        shutdown(handler->fd, SHUT_RDWR);
+    // Use current thread for a single listener, or a pinned thread for
+    // each one of per-CPU listeners.
+    if (per_cpu) {
+        for (int s = 0; s < shards_num; s++) {
+            pthread_attr_t attr;
+            init_thread_attr(&attr, &shards[s]);
+            if (pthread_create(&shards[s].acceptor, &attr, start_acceptor,
+                               &shards[s]) != 0) {
+                error("ERROR: Failed to launch acceptor");
+            }
+            pthread_attr_destroy(&attr);
+        }
+        for (int s = 0; s < shards_num; s++) {
+            pthread_join(shards[s].acceptor, NULL);
+        }
     }
-    iterator_destroy(iter);
-    pthread_mutex_unlock(list_mutex);
+    else start_listener(&shards[0]);
 
-    // Wait for previous active handlers to terminate (maybe already done so).
-    pthread_mutex_lock(list_mutex);
-	while (linked_list_size(handler_fds) > 0) {
-		pthread_cond_wait(list_size_cond, list_mutex);
-	}
-	pthread_mutex_unlock(list_mutex);
+    // Upgrader and finisher are done too, either handing off, or being
+    // done with the old instance, or seeing wake_fd.
+    if (upgrade_fd >= 0) {
+        pthread_join(upgrader, NULL);
+        if (channel >= 0) pthread_join(finisher, NULL);
+        handoff_close(upgrade_fd, upgrade_path);
+    }
+
+    if (atomic_load(&handed_off)) {
+        printf("\nServer handed over, serving remaining connections...\n");
+    }
+    else printf("\nServer terminating...\n");
+
+    // Let workers drain any connection still queued and then exit. Closing
+    // listeners handed over leaves them open in the new instance.
+    for (int s = 0; s < shards_num; s++) {
+        destroy_listener(shards[s].listener_fd);
+        if (shards[s].work_queue) work_queue_close(shards[s].work_queue);
+    }
+    if (!atomic_load(&handed_off)) release_listener(&endpoint);
+
+    // After a handoff, parked connections get admitted as handlers finish.
+    if (!atomic_load(&handed_off)) shed_parked();
+    wait_handlers();
+    shed_parked();
+
+    // Workers exit once the queue has been drained.
+    for (int s = 0; s < shards_num; s++) {
+        shard_t *shard = &shards[s];
+        if (!shard->work_queue) continue;
+        for (int i = 0; i < shard->workers_num; i++) {
+            pthread_join(shard->workers[i], NULL);
+        }
+        work_queue_destroy(shard->work_queue);
+        free(shard->workers);
+    }
+
+    // Coroutines are done with broadcasts and the log by now.
+    if (coroutines) coro_runtime_destroy(coroutines);
+    unsigned long args_fresh = atomic_load(&args_pool->stats->fresh);
+    unsigned long bufs_fresh = atomic_load(&buffer_pool->stats.fresh);
+    printf("Reused %lu of %lu handler states and %lu of %lu receive "
+           "buffers.\n", atomic_load(&args_pool->stats->reused),
+           atomic_load(&args_pool->stats->reused) + args_fresh,
+           atomic_load(&buffer_pool->stats.reused),
+           atomic_load(&buffer_pool->stats.reused) + bufs_fresh);
+    fflush(stdout);
+    if (reaper) {
+        printf("Timed out %lu idle, %lu read and %lu lifetime "
+               "connections.\n",
+               atomic_load(&reaper->timed_out[TIMEOUT_IDLE]),
+               atomic_load(&reaper->timed_out[TIMEOUT_READ]),
+               atomic_load(&reaper->timed_out[TIMEOUT_LIFETIME]));
+        fflush(stdout);
+        reaper_destroy(reaper);
+    }
+    if (limiter) rate_limiter_destroy(limiter);
+    if (broadcast) {
+        printf("Broadcast %lu messages, dropped %lu, disconnected %lu "
+               "subscribers.\n", atomic_load(&broadcast->published),
+               atomic_load(&broadcast->dropped),
+               atomic_load(&broadcast->disconnected));
+        fflush(stdout);
+        broadcast_destroy(broadcast);
+    }
 
     // Clean up resources.
+    output_destroy(output);  // Write out anything still pending.
+    close(wake_fd);
+    metrics_stop();
+    metrics_destroy(metrics);
+    if (message_log) message_log_close(message_log);
     pthread_mutex_destroy(list_mutex);
     free(list_mutex);
 	pthread_cond_destroy(list_size_cond);
 	free(list_size_cond);
-    linked_list_destroy(handler_fds);
+    conn_table_destroy(handler_fds);
+    free(shards);
+    if (parking) work_queue_destroy(parking);
+    if (admission) admission_destroy(admission);
 
     return 0;
 }
@@ -119,61 +667,153 @@ void error(const char *msg)
     exit(1);
 }
 
+/**
+ * Prints usage information and terminates process.
+ */
+void usage(const char *exec_name)
+{
+    fprintf(stdout, "Usage: %s [-w workers] [-q queue_size] "
+            "[-o block|reject|grow] [-m max_workers] [-a] [-b backlog] "
+            "[-C max_conns] [-I max_per_addr] [-P park_size] "
+            "[-F flush_bytes] [-L flush_usec] [-R recv_max] "
+            "[-M admin_path] [-S log_dir] [-G segment_size] "
+            "[-Y none|async|sync] [-U upgrade_path] [-T] "
+            "[-E none|echo|ack] [-N] [-B queue_depth] [-D drop|disconnect] "
+            "[-g schedulers] [-k stack_size] [-t timeouts] [-r limits] "
+            "[-O options] <address>\n",
+            exec_name);
+    exit(1);
+}
+
+/**
+ * Returns the overflow policy matching given name, or -1 if there is none.
+ */
+int parse_policy(const char *name)
+{
+    if (strcmp(name, "block") == 0) return POLICY_BLOCK;
+    if (strcmp(name, "reject") == 0) return POLICY_REJECT;
+    if (strcmp(name, "grow") == 0) return POLICY_GROW;
+    return -1;
+}
+
 /**
  * Ask server to terminate normally completing any critical unhandled task.
  *
  * This is a signal handler, that should be connected to a terminating signal.
+ * Signaling wake_fd wakes up any thread waiting to accept, no matter which
+ * thread the signal got delivered to. Listeners are not shut down, since they
+ * may have been handed over to a new instance.
  */
 void terminate_server(int signum)
 {
-    if (signum == TERM_SIGNAL) destroy_listener(listener_fd);
+    if (signum == TERM_SIGNAL) {
+        term_requested = 1;
+        uint64_t val = 1;
+        ssize_t rc = write(wake_fd, &val, sizeof(val));
+        (void) rc;
+    }
 }
 
 /**
- * Initialize a listener on the given port.
+ * Creates the shards of the server, each one with a listener on endpoint.
+ *
+ * In per-CPU mode, there is a shard for every CPU the process may run on,
+ * with all of them sharing the port through SO_REUSEPORT.
+ *
+ * Listeners inherited from a previous instance get used first, in order.
+ * Those left without a shard, when running on fewer CPUs than the previous
+ * instance, get closed, resetting any connection waiting on them.
  */
-int init_listener(int port)
+void init_shards(int per_cpu, const int *inherited, int inherited_num)
 {
-    int socket_fd;                 // Listener's file descriptor.
-    struct sockaddr_in serv_addr;  // Server's local address.
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (per_cpu && sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+        error("ERROR: Failed to get available CPUs");
+    }
 
-    socket_fd = socket(AF_INET, SOCK_STREAM, 0);  // IPv4 TCP socket.
-    if (socket_fd < 0) error("ERROR: Opening of socket failed");
+    shards_num = per_cpu ? CPU_COUNT(&cpus) : 1;
+    shards = (shard_t *) calloc(shards_num, sizeof(shard_t));
 
-    // Create a sockaddr object with local IP and listening port.
-    memset((void *) &serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
+    int cpu = 0;
+    for (int s = 0; s < shards_num; s++) {
+        shard_t *shard = &shards[s];
+        shard->cpu = -1;
+        pthread_mutex_init(&shard->spawn_lock, NULL);
+        if (per_cpu) {
+            while (!CPU_ISSET(cpu, &cpus)) cpu++;
+            shard->cpu = cpu++;
+        }
+        if (s < inherited_num) shard->listener_fd = inherited[s];
+        else if (per_cpu) {
+            shard->listener_fd = init_reuseport_listener(&endpoint,
+                                                         &sock_opts);
+        }
+        else shard->listener_fd = init_listener(&endpoint, &sock_opts);
 
-    // Bind to the listening port at localhost.
-    if (bind(socket_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        error("ERROR: Binding failed");
+        // Mark socket as listener, or just update backlog of inherited ones.
+        if (listen(shard->listener_fd, backlog) < 0) {
+            error("ERROR: Failed to listen on given socket");
+        }
+        if (set_nonblocking(shard->listener_fd) < 0) {
+            error("ERROR: Failed to make listener non-blocking");
+        }
     }
 
-    return socket_fd;
+    for (int s = shards_num; s < inherited_num; s++) {
+        destroy_listener(inherited[s]);
+    }
+    if (inherited_num > 0) adopt_listener(&endpoint);
 }
 
 /**
- * Converts current thread into a listener on given socket.
+ * Converts current thread into the acceptor of given shard.
+ *
+ * Accepts until termination gets requested or listeners get handed over,
+ * waiting for new connections on both the listener and wake_fd.
  */
-void start_listener(int socket_fd)
+void start_listener(shard_t *shard)
 {
-    int rc = listen(socket_fd, 8);  // Mark socket as listener.
-    if (rc < 0) error("ERROR: Failed to listen on given socket");
+    work_item_t item;  // Incoming connection.
+    struct sockaddr_storage addr;  // Address of the client.
+    if (!metrics_slot) metrics_slot = metrics_claim(metrics);
 
-    int in_fd;  // File descriptor for incoming connection.
-    struct sockaddr_in client_addr;  // Address object of the client.
-    socklen_t sock_size = sizeof(client_addr);
+    struct pollfd fds[2];
+    fds[0].fd = shard->listener_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fd;
+    fds[1].events = POLLIN;
 
-    while ((in_fd = accept(socket_fd,
-                           (struct sockaddr *) &client_addr,
-                           &sock_size)) > -1)
-    {
-        handle_client(in_fd, client_addr);
+    while (!term_requested && !atomic_load(&handed_off)) {
+        // Handlers read in blocking mode, so only close on exec.
+        socklen_t addr_size = sizeof(addr);
+        item.fd = accept4(shard->listener_fd, (struct sockaddr *) &addr,
+                          &addr_size, SOCK_CLOEXEC);
+        if (item.fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+            }
+            else if (errno != EINTR && errno != ECONNABORTED) break;
+            continue;
+        }
+
+        item.source = admission_source((struct sockaddr *) &addr);
+        item.accepted_at = metrics_now();
+        socket_options_accepted(item.fd, &sock_opts);
+        metrics_accepted(metrics_slot);
+        admit_client(shard, item);
     }
 }
 
+/**
+ * Entry point for acceptor threads of per-CPU shards.
+ */
+void *start_acceptor(void *args)
+{
+    start_listener((shard_t *) args);
+    return NULL;
+}
+
 /**
  * Properly terminates a listener on the given socket.
  */
@@ -183,39 +823,295 @@ void destroy_listener(int socket_fd)
 }
 
 /**
- * Create a handler on a new thread for the given client connection.
+ * Asks the instance serving on upgrade_path, if any, to hand its listeners
+ * over, storing them into listeners, and the descriptor of its message log,
+ * if it has one, into log_fd.
+ *
+ * Returns the channel to the old instance, or -1 if there is none to take
+ * over from.
  */
-void handle_client(int client_fd, struct sockaddr_in client_addr)
+int request_handoff(int take_conns, int *listeners, int *listeners_num,
+                    int *log_fd)
 {
-    handler_args_t *args = (handler_args_t *) malloc(sizeof(handler_args_t));
-    args->socket_fd = client_fd;
-    args->addr = client_addr;
+    int channel = handoff_connect(upgrade_path,
+                                  take_conns ? HANDOFF_CONNECTIONS : 0);
+    if (channel < 0) return -1;
 
-    // New thread should be detached, since it's not gonna be joined.
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    handoff_msg_t msg;
+    int fd;
+    while (handoff_recv(channel, &msg, &fd, -1) == 0) {
+        if (msg.type == HANDOFF_END) return channel;
+        if (msg.type == HANDOFF_LISTENER && fd >= 0 &&
+            *listeners_num < HANDOFF_MAX_LISTENERS) {
+            listeners[(*listeners_num)++] = fd;
+        }
+        else if (msg.type == HANDOFF_LOG && fd >= 0 && *log_fd < 0) {
+            *log_fd = fd;
+        }
+        else if (fd >= 0) close(fd);
+    }
 
-	pthread_mutex_lock(list_mutex);
+    // Old instance is going away, so start afresh.
+    perror("WARNING: Handoff failed");
+    for (int i = 0; i < *listeners_num; i++) close(listeners[i]);
+    *listeners_num = 0;
+    if (*log_fd >= 0) close(*log_fd);
+    *log_fd = -1;
+    close(channel);
+    return -1;
+}
 
-	// Add new handler to the list of active handlers just to get a
-	// node reference.
-    handler_t *handler = malloc(sizeof(handler_t));
-	node_t *node = linked_list_append(handler_fds, (void *) handler);
+/**
+ * Entry point of the thread completing a handoff over given channel, while
+ * acceptors already accept on the listeners taken over.
+ */
+void *start_finisher(void *args)
+{
+    complete_handoff((int) (intptr_t) args);
+    return NULL;
+}
 
-	args->list_entry = node;  // Pass node reference to new thread.
+/**
+ * Tells the old instance that listeners have been taken over, admitting any
+ * connection it passes back, until it closes the channel or acceptors get
+ * stopped.
+ */
+void complete_handoff(int channel)
+{
+    metrics_slot = metrics_claim(metrics);
 
-	// Create new handler thread.
-    pthread_t tid;
-    pthread_create(&tid, &attr, start_handler, (void *) args);
+    handoff_msg_t msg;
+    if (handoff_send(channel, HANDOFF_READY, NULL, -1) < 0) {
+        perror("WARNING: Handoff failed");
+        close(channel);
+        return;
+    }
+
+    // Connections are spread over shards, as their accepting CPU is gone.
+    work_item_t item;
+    int shard = 0;
+    while (handoff_recv(channel, &msg, &item.fd, wake_fd) == 0) {
+        if (msg.type != HANDOFF_CONNECTION || item.fd < 0) {
+            if (item.fd >= 0) close(item.fd);
+            continue;
+        }
+        item.source = msg.source;
+        item.accepted_at = msg.accepted_at;
+        metrics_accepted(metrics_slot);
+        admit_client(&shards[shard], item);
+        shard = (shard + 1) % shards_num;
+    }
+
+    close(channel);
+}
+
+/**
+ * Entry point of the thread serving handoff requests, until one of them
+ * succeeds or acceptors get stopped.
+ */
+void *start_upgrader(void *args)
+{
+    (void) args;
 
-	// Actually fill the handler object with tid value.
-    handler->tid = tid;
-    handler->fd = client_fd;
+    struct pollfd fds[2];
+    fds[0].fd = upgrade_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_fd;
+    fds[1].events = POLLIN;
 
-	pthread_mutex_unlock(list_mutex);
+    while (poll(fds, 2, -1) > 0 && !fds[1].revents) {
+        int channel = accept4(upgrade_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (channel < 0) continue;
 
+        int rc = hand_off(channel);
+        close(channel);
+        if (rc == 0) break;
+    }
+
+    return NULL;
+}
+
+/**
+ * Hands listeners over to the new instance on the other end of channel, and
+ * stops acceptors once it is ready to accept on them.
+ *
+ * Returns 0 on success, or -1 if the new instance failed, when current one
+ * keeps serving as if nothing happened.
+ */
+int hand_off(int channel)
+{
+    handoff_msg_t request, msg;
+    if (handoff_expect(channel, HANDOFF_REQUEST, &request, wake_fd) < 0) {
+        return -1;
+    }
+
+    for (int s = 0; s < shards_num; s++) {
+        if (handoff_send(channel, HANDOFF_LISTENER, NULL,
+                         shards[s].listener_fd) < 0) return -1;
+    }
+    if (message_log &&
+        handoff_send(channel, HANDOFF_LOG, NULL, message_log_fd()) < 0) {
+        return -1;
+    }
+    if (handoff_send(channel, HANDOFF_END, NULL, -1) < 0 ||
+        handoff_expect(channel, HANDOFF_READY, &msg, wake_fd) < 0) {
+        return -1;
+    }
+
+    // From now on, new connections get accepted by the new instance only.
+    atomic_store(&handed_off, 1);
+    uint64_t val = 1;
+    ssize_t rc = write(wake_fd, &val, sizeof(val));
+    (void) rc;
+
+    if (request.flags & HANDOFF_CONNECTIONS) hand_off_clients(channel);
+    return 0;
+}
+
+/**
+ * Passes connections still waiting in the queues of the workers, or parked,
+ * to the new instance, in this order. Those that fail to be passed are left
+ * to be served here.
+ */
+void hand_off_clients(int channel)
+{
+    work_item_t item;
+    for (int s = 0; s <= shards_num; s++) {
+        work_queue_t *queue = s < shards_num ? shards[s].work_queue : parking;
+        if (!queue) continue;
+
+        while (work_queue_try_pop(queue, &item) == 0) {
+            if (hand_off_client(channel, &item) < 0) {
+                if (work_queue_try_push(queue, item) != 0) {
+                    if (admission && queue != parking) {
+                        admission_release(admission, item.source);
+                    }
+                    admission_shed(item.fd);
+                }
+                return;
+            }
+            // Only queued connections have been admitted.
+            if (admission && queue != parking) {
+                admission_release(admission, item.source);
+            }
+        }
+    }
+}
+
+/**
+ * Passes a waiting connection to the new instance, closing it here.
+ *
+ * Returns 0 on success, -1 on failure, leaving connection untouched.
+ */
+int hand_off_client(int channel, work_item_t *item)
+{
+    handoff_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.source = item->source;
+    msg.accepted_at = item->accepted_at;
+    if (handoff_send(channel, HANDOFF_CONNECTION, &msg, item->fd) < 0) {
+        return -1;
+    }
+
+    close(item->fd);
+    return 0;
+}
+
+/**
+ * Applies admission limits to a new client connection, dispatching it only
+ * if admitted.
+ *
+ * Connections above max connections get parked if there is room, all the
+ * others get reset at once.
+ */
+void admit_client(shard_t *shard, work_item_t item)
+{
+    if (!admission) {
+        handle_client(shard, item);
+        return;
+    }
+
+    // Queue up behind connections already parked, to keep them in order.
+    admission_result_t rc = ADMISSION_FULL;
+    if (!parking || work_queue_size(parking) == 0) {
+        rc = admission_acquire(admission, item.source);
+    }
+
+    if (rc == ADMISSION_OK) handle_client(shard, item);
+    else if (rc == ADMISSION_FULL && parking &&
+             work_queue_try_push(parking, item) == 0) {
+        // Connections may have closed meanwhile, releasing their slot with
+        // nothing parked to be admitted in their place.
+        while (unpark_client(&item) == 0) handle_client(shard, item);
+    }
+    else admission_shed(item.fd);
+}
+
+/**
+ * Pops the oldest parked connection, if it may now be admitted.
+ *
+ * Returns 0 if item holds a newly admitted connection, or 1 otherwise.
+ */
+int unpark_client(work_item_t *item)
+{
+    if (!parking || work_queue_try_pop(parking, item) != 0) return 1;
+
+    admission_result_t rc = admission_acquire(admission, item->source);
+    if (rc == ADMISSION_OK) return 0;
+
+    // Slot got taken by someone else, so wait for the next one.
+    if (rc == ADMISSION_FULL && work_queue_try_push(parking, *item) == 0) {
+        return 1;
+    }
+    admission_shed(item->fd);
+    return 1;
+}
+
+/**
+ * Dispatches a new client connection either to the worker pool of its shard,
+ * to a handler on a new thread, running on shard's CPU, or to a handler
+ * coroutine.
+ */
+void handle_client(shard_t *shard, work_item_t item)
+{
+    if (shard->work_queue) {
+        enqueue_client(shard, item);
+        return;
+    }
+
+    handler_args_t *args = (handler_args_t *) obj_pool_get(args_pool);
+    if (!args) {
+        perror("ERROR: Failed to allocate handler");
+        if (admission) admission_release(admission, item.source);
+        admission_shed(item.fd);
+        return;
+    }
+    args->items[0] = item;
+
+    // Add new handler to the table of active handlers.
+    register_handler(&args->items[0]);
+
+    if (coroutines) {
+        if (coro_spawn(coroutines, start_coroutine, args) == 0) return;
+        abandon_client(&item, "ERROR: Failed to spawn handler");
+        obj_pool_put(args_pool, args);
+        return;
+    }
+
+    // New thread should be detached, since it's not gonna be joined.
+    pthread_attr_t attr;
+    init_thread_attr(&attr, shard);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	// Create new handler thread.
+    pthread_t tid;
+    int rc = pthread_create(&tid, &attr, start_handler, (void *) args);
     pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        errno = rc;
+        abandon_client(&item, "ERROR: Failed to spawn handler");
+        obj_pool_put(args_pool, args);
+    }
 }
 
 /**
@@ -224,33 +1120,502 @@ void handle_client(int client_fd, struct sockaddr_in client_addr)
 void *start_handler(void *args)
 {
     handler_args_t *h_args = (handler_args_t *) args;
-    // printf("New connection accepted. FD: %d\n", h_args->socket_fd);
+    metrics_slot = metrics_claim(metrics);
 
     // Initialize incoming message buffer.
-    char *buffer = (char *) malloc(sizeof(char) * 256);
-    memset(buffer, 0, 256);
-    int n;
+    recv_buffer_t buffer;
+    int rc = recv_buffer_init_pooled(&buffer, buffer_pool);
+    if (message_log) log_writer_init(&log_writer, message_log);
+    reply_batch_init(&replies, reply_mode);
+    broadcast_batch_init(&broadcasts);
+    if (rc < 0) {
+        abandon_client(&h_args->items[0], "ERROR: Failed to allocate buffer");
+    }
+    else serve_clients(&h_args->items[0], &h_args->items[1], &buffer);
+
+    // Free local resources.
+    recv_buffer_free(&buffer);
+    if (message_log) log_writer_free(&log_writer);
+    reply_batch_free(&replies);
+    broadcast_batch_free(&broadcasts);
+    obj_pool_put(args_pool, args);
+    pool_thread_flush();  // Leave pooled state to the next handlers.
+
+    pthread_exit(0);
+}
+
+/**
+ * Entry point for handler coroutines.
+ */
+void start_coroutine(void *args)
+{
+    handler_args_t *h_args = (handler_args_t *) args;
+
+    recv_buffer_t buffer;
+    if (recv_buffer_init_pooled(&buffer, buffer_pool) < 0) {
+        abandon_client(&h_args->items[0], "ERROR: Failed to allocate buffer");
+    }
+    else serve_clients(&h_args->items[0], &h_args->items[1], &buffer);
+
+    recv_buffer_free(&buffer);
+    obj_pool_put(args_pool, args);
+}
+
+/**
+ * Sets up the thread locals of a scheduler thread, shared by all coroutines
+ * it runs.
+ */
+void start_scheduler(void)
+{
+    metrics_slot = metrics_claim(metrics);
+    if (message_log) log_writer_init(&log_writer, message_log);
+    reply_batch_init(&replies, reply_mode);
+    broadcast_batch_init(&broadcasts);
+}
+
+void stop_scheduler(void)
+{
+    if (message_log) log_writer_free(&log_writer);
+    reply_batch_free(&replies);
+    broadcast_batch_free(&broadcasts);
+    pool_thread_flush();
+}
+
+/**
+ * Pushes a new client connection to the queue of shard's worker pool,
+ * applying the overflow policy when the queue is full.
+ */
+void enqueue_client(shard_t *shard, work_item_t item)
+{
+    int rc = work_queue_try_push(shard->work_queue, item);
+
+    if (rc == 1 && policy == POLICY_REJECT) {
+        if (admission) admission_release(admission, item.source);
+        admission_shed(item.fd);
+        return;
+    }
+    if (rc == 1 && policy == POLICY_GROW) {
+        pthread_mutex_lock(&shard->spawn_lock);
+        if (shard->workers_num < max_workers) spawn_worker(shard);
+        pthread_mutex_unlock(&shard->spawn_lock);
+    }
+    if (rc == 1) {
+        // Block accepting, but keep an eye on termination requests, since
+        // the listener may have been shut down while waiting.
+        while ((rc = work_queue_push(shard->work_queue, item, 100)) == 1 &&
+               !term_requested);
+    }
+
+    if (rc != 0) {
+        // Server is terminating.
+        if (admission) admission_release(admission, item.source);
+        close(item.fd);
+    }
+}
+
+/**
+ * Adds a connection to the table of active handlers.
+ *
+ * Connections registered after server started terminating have missed the
+ * broadcast, so they get shut down here, leaving only their already
+ * received data to be read.
+ */
+void register_handler(work_item_t *item)
+{
+    if (conn_table_insert(handler_fds, item->fd, (void *) &item->source) < 0) {
+        error("ERROR: Failed to register handler");
+    }
+    atomic_fetch_add(&active_handlers, 1);
+    metrics_started(metrics_slot);
+    if (atomic_load(&terminating)) shutdown(item->fd, SHUT_RDWR);
+}
 
-    // Keep reading till an error or shutdown (n == 0).
-    while((n = read(h_args->socket_fd, buffer, 255)) > 0) {
-        printf("%s", buffer);
-        memset(buffer, 0, 256);  // Clear the buffer for next incoming.
+/**
+ * Removes a connection from the table of active handlers, waking up the
+ * main thread if it waits for the last one.
+ *
+ * Both the count of handlers and draining flag are sequentially consistent,
+ * so either the handler sees the flag, or the main thread sees the handler
+ * gone.
+ */
+void unregister_handler(int client_fd)
+{
+    conn_table_remove(handler_fds, client_fd);
+    atomic_fetch_sub(&active_handlers, 1);
+    if (atomic_load(&draining)) {
+        pthread_mutex_lock(list_mutex);
+        pthread_cond_signal(list_size_cond);
+        pthread_mutex_unlock(list_mutex);
+    }
+}
+
+/**
+ * Gives up on a registered connection no handler is going to serve,
+ * printing given message about currently set errno, and resets it.
+ */
+void abandon_client(work_item_t *item, const char *msg)
+{
+    perror(msg);
+    if (admission) admission_release(admission, item->source);
+
+    // Remove handler from table before closing, as fd may then get reused.
+    unregister_handler(item->fd);
+    admission_shed(item->fd);
+    metrics_closed(metrics_slot);
+}
+
+/**
+ * Resets parked connections, which were never admitted, and stops parking.
+ */
+void shed_parked(void)
+{
+    if (!parking) return;
+
+    work_item_t item;
+    work_queue_close(parking);
+    while (work_queue_try_pop(parking, &item) == 0) {
+        admission_shed(item.fd);
     }
+}
+
+/**
+ * Waits for all active handlers to finish.
+ *
+ * After a handoff, handlers get to serve their connections to the end, until
+ * termination gets requested. Then, they get asked to terminate.
+ */
+void wait_handlers(void)
+{
+    atomic_store(&draining, 1);
 
-    // Remove handler from list before terminating.
     pthread_mutex_lock(list_mutex);
-    handler_t *handler = linked_list_remove(handler_fds, h_args->list_entry);
-    free(handler);  // Also keep in mutex, to properly handle server termination.
-	pthread_cond_signal(list_size_cond);
-	pthread_mutex_unlock(list_mutex);
+    while (atomic_load(&active_handlers) > 0) {
+        if (atomic_load(&terminating)) {
+            pthread_cond_wait(list_size_cond, list_mutex);
+            continue;
+        }
+        if (term_requested) {
+            pthread_mutex_unlock(list_mutex);
+            stop_handlers();
+            pthread_mutex_lock(list_mutex);
+            continue;
+        }
 
-    // Finally, close the connection to the client.
-    close(h_args->socket_fd);
+        // Keep an eye on termination requests, as signals do not wake us.
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(list_size_cond, list_mutex, &deadline);
+    }
+    pthread_mutex_unlock(list_mutex);
+}
 
-    // Free local resources.
-    free(buffer);
-    free(args);
+/**
+ * Asks active handlers to terminate. Handlers registering from now on see
+ * the flag and shut down their connection by themselves.
+ */
+void stop_handlers(void)
+{
+    atomic_store(&terminating, 1);
+    int fd = conn_table_next(handler_fds, 0);
+    for (; fd >= 0; fd = conn_table_next(handler_fds, fd + 1)) {
+        shutdown(fd, SHUT_RDWR);
+    }
+}
 
-    // printf("Connection closed.\n");
-    pthread_exit(0);
+/**
+ * Serves given registered connection, followed by any parked connection that
+ * gets admitted in its place, once it is done.
+ */
+void serve_clients(work_item_t *item, work_item_t *next,
+                   recv_buffer_t *buffer)
+{
+    while (1) {
+        serve_client(item, buffer);
+        recv_buffer_reset(buffer);  // Do not hold memory while waiting.
+
+        if (finish_client(item, next) != 0) return;
+        work_item_t *served = item;
+        item = next;
+        next = served;
+    }
 }
+
+/**
+ * Closes a served connection, releasing its admission slot.
+ *
+ * Returns 0 if a parked connection got admitted in its place, registered in
+ * next, or 1 otherwise. Handler stays registered until then, so the count
+ * of active handlers never drops to zero while it is still going to serve.
+ */
+int finish_client(work_item_t *done, work_item_t *next)
+{
+    int rc = 1;
+    if (admission) {
+        admission_release(admission, done->source);
+        rc = unpark_client(next);
+        if (rc == 0) register_handler(next);
+    }
+
+    // Remove handler from table before closing, as fd may then get reused.
+    unregister_handler(done->fd);
+    close(done->fd);
+    metrics_closed(metrics_slot);
+
+    return rc;
+}
+
+/**
+ * Adds a new worker thread to the pool of given shard.
+ */
+void spawn_worker(shard_t *shard)
+{
+    pthread_attr_t attr;
+    init_thread_attr(&attr, shard);
+    if (pthread_create(&shard->workers[shard->workers_num], &attr,
+                       start_worker, shard) != 0) {
+        error("ERROR: Failed to launch worker");
+    }
+    pthread_attr_destroy(&attr);
+    shard->workers_num++;
+}
+
+/**
+ * Initializes attributes of a new thread of given shard, pinning it to
+ * shard's CPU, if any.
+ */
+void init_thread_attr(pthread_attr_t *attr, shard_t *shard)
+{
+    pthread_attr_init(attr);
+    if (shard->cpu < 0) return;
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(shard->cpu, &cpus);
+    pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+}
+
+/**
+ * Entry point for worker threads of a pool.
+ *
+ * Each worker serves connections from the queue of its shard one after the
+ * other, until the queue gets closed and drained.
+ */
+void *start_worker(void *args)
+{
+    work_queue_t *work_queue = ((shard_t *) args)->work_queue;
+    metrics_slot = metrics_claim(metrics);
+
+    recv_buffer_t buffer;
+    recv_buffer_init_pooled(&buffer, buffer_pool);
+    if (message_log) log_writer_init(&log_writer, message_log);
+    reply_batch_init(&replies, reply_mode);
+    broadcast_batch_init(&broadcasts);
+
+    work_item_t items[2];
+    while (work_queue_pop(work_queue, &items[0]) == 0) {
+        register_handler(&items[0]);  // Register as an active handler.
+
+        // Buffer may have failed to be allocated so far.
+        if (!buffer.data && recv_buffer_init_pooled(&buffer, buffer_pool) < 0) {
+            abandon_client(&items[0], "ERROR: Failed to allocate buffer");
+            continue;
+        }
+        serve_clients(&items[0], &items[1], &buffer);
+    }
+
+    recv_buffer_free(&buffer);
+    if (message_log) log_writer_free(&log_writer);
+    reply_batch_free(&replies);
+    broadcast_batch_free(&broadcasts);
+    pool_thread_flush();
+    return NULL;
+}
+
+/**
+ * Reads frames from a client connection until it gets closed, using given
+ * buffer. Received messages go to the message log, if any, or else to the
+ * output pipeline. Frames get replied to after every read, if requested, or
+ * else broadcast to other connections, if requested. Connections timing
+ * out get shut down by the reaper, ending reads, while connections
+ * exceeding their rate limits stop being read for a while.
+ */
+void serve_client(work_item_t *item, recv_buffer_t *buffer)
+{
+    connection_t conn;
+    conn.item = item;
+    output_stream_init(&conn.stream, output);
+    frame_reader_init(&conn.reader, frame_format);
+    reply_backlog_init(&conn.backlog);
+    conn.log_conn_id = message_log ?
+            message_log_connection_id(message_log) : 0;
+    conn.subscriber = NULL;
+    if (broadcast) {
+        conn.subscriber = broadcast_subscribe(broadcast, item->fd);
+        if (!conn.subscriber) {
+            perror("ERROR: Failed to subscribe to broadcasts");
+        }
+    }
+
+    if (reaper) {
+        reaper_watch(reaper, &conn.watch, item->fd,
+                     item->accepted_at / 1000000);
+    }
+    if (limiter) rate_conn_init(limiter, &conn.rate, item->source);
+
+    // Coroutines wait for their connection instead of blocking on it.
+    if (coroutines) {
+        int flags = fcntl(item->fd, F_GETFL, 0);
+        fcntl(item->fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    ssize_t n;
+    int first = 1;  // Whether no data has been received yet.
+
+    // Keep reading till an error, shutdown (n == 0) or an invalid frame.
+    while ((n = read_client(item->fd, buffer)) > 0) {
+        uint64_t messages = conn.reader.messages;
+        if (serve_read(&conn, buffer->data, (size_t) n, first) < 0) break;
+        first = 0;
+        if (drain_replies(&conn) < 0) break;
+        if (limiter && throttle(&conn, (size_t) n,
+                                conn.reader.messages - messages) < 0) break;
+    }
+    if (limiter) rate_conn_free(limiter, &conn.rate);
+
+    // Stop being watched before the connection gets closed.
+    if (reaper) reaper_unwatch(reaper, &conn.watch);
+
+    // Connection gets closed once unsubscribed.
+    if (conn.subscriber) broadcast_unsubscribe(broadcast, conn.subscriber);
+    reply_backlog_free(&conn.backlog);
+    output_stream_close(&conn.stream);
+    frame_reader_free(&conn.reader);
+}
+
+/**
+ * Reads from a client connection into buffer, the same way
+ * recv_buffer_read() does. On coroutines, waits for data to arrive instead
+ * of failing.
+ */
+ssize_t read_client(int fd, recv_buffer_t *buffer)
+{
+    ssize_t n;
+    while ((n = recv_buffer_read(buffer, fd)) < 0 && coroutines &&
+           coro_would_block()) {
+        if (coro_wait_fd(fd, EPOLLIN) < 0) return -1;
+    }
+    return n;
+}
+
+/**
+ * Hands the frames of a single read over to the message log or the output
+ * pipeline, replying to them or broadcasting them, if requested.
+ *
+ * Thread locals get looked up here, on every read. Being inlined into a loop
+ * that waits, the lookup could be hoisted out of it, while coroutines may
+ * resume on another thread.
+ *
+ * Returns 0 on success, or -1 if the connection should be closed.
+ */
+__attribute__((noinline))
+int serve_read(connection_t *conn, const char *data, size_t len, int first)
+{
+    work_item_t *item = conn->item;
+    if (first) metrics_first_byte(metrics_slot, item->accepted_at);
+    metrics_read(metrics_slot, len);
+
+    frame_handler_t handler = output_stream_write_frame;
+    void *handler_arg = &conn->stream;
+    log_stream_t log_stream;
+    if (message_log) {
+        log_stream.writer = &log_writer;
+        log_stream.conn_id = conn->log_conn_id;
+        handler = log_stream_write_frame;
+        handler_arg = &log_stream;
+    }
+    if (broadcast) {
+        broadcast_batch_start(&broadcasts, handler, handler_arg);
+        handler = broadcast_frame;
+        handler_arg = &broadcasts;
+    }
+
+    int rc;
+    if (reply_mode != REPLY_NONE) {
+        // Coroutines keep what their connection cannot take at once.
+        reply_batch_start(&replies, item->fd,
+                          coroutines ? &conn->backlog : NULL, handler,
+                          handler_arg);
+        rc = reply_batch_feed(&replies, &conn->reader, data, len);
+    }
+    else {
+        rc = frame_reader_feed(&conn->reader, data, len, handler,
+                               handler_arg);
+    }
+    if (broadcast) {
+        broadcast_batch_publish(&broadcasts, broadcast, conn->subscriber);
+    }
+    if (reaper) {
+        reaper_touch(reaper, &conn->watch,
+                     frame_reader_pending(&conn->reader));
+    }
+
+    output_stream_flush(&conn->stream);
+    if (message_log) log_writer_flush(&log_writer);
+    return rc < 0 ? -1 : 0;
+}
+
+/**
+ * Waits till all replies a coroutine could not write at once get written,
+ * so that it reads no more from a client not reading its replies.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int drain_replies(connection_t *conn)
+{
+    int fd = conn->item->fd;
+    while (reply_backlog_size(&conn->backlog) > 0) {
+        if (coro_wait_fd(fd, EPOLLOUT) < 0 ||
+            reply_backlog_flush(&conn->backlog, fd) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Charges a connection for a read of given bytes and messages, pausing
+ * reading from it for as long as it exceeds its rate limits. Pauses get
+ * slept in slices, so that termination is not held back by them.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+int throttle(connection_t *conn, size_t bytes, uint64_t msgs)
+{
+    uint64_t pause = rate_conn_charge(limiter, &conn->rate, bytes,
+                                      (size_t) msgs);
+    if (pause == 0) return 0;
+    metrics_throttled(metrics_slot, pause);  // Before resuming elsewhere.
+    if (reaper) reaper_pause(reaper, &conn->watch, pause / 1000000);
+
+    uint64_t until = rate_now_ns() + pause;
+    uint64_t now;
+    while (!atomic_load(&terminating) && (now = rate_now_ns()) < until) {
+        uint64_t slice = until - now;
+        if (slice > RATE_PAUSE_SLICE_NS) slice = RATE_PAUSE_SLICE_NS;
+        if (coroutines) {
+            if (coro_sleep(slice) < 0) return -1;
+            continue;
+        }
+        struct timespec ts;
+        ts.tv_sec = (time_t) (slice / 1000000000);
+        ts.tv_nsec = (long) (slice % 1000000000);
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
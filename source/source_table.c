@@ -0,0 +1,215 @@
+/**
+ * source_table.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in source_table.h.
+ *
+ * The table is split into stripes, each one with its own spinlock, so
+ * concurrent acceptors and handlers rarely wait for each other. Critical
+ * sections neither allocate nor block, so a stripe may also be updated from
+ * a signal handler, as long as the signal is blocked while the rest of the
+ * process updates it.
+ *
+ * Entries no longer referenced are only marked deleted, keeping their
+ * source and data, since moving a live entry back into their place would
+ * pull it from under its users. A source coming back while its entry is
+ * still there finds its data as it left it. Deleted entries at the end of a
+ * probe run get freed at once, so runs do not grow forever.
+ *
+ * The table lives in a single shared anonymous mapping, holding no pointer
+ * out of it, so processes forked after its creation all share it.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "source_table.h"
+
+
+#define NO_ENTRY ((size_t) -1)
+
+
+static source_stripe_t *stripe_of(source_table_t *table, uint64_t source,
+                                  size_t *slot);
+static size_t find_entry(source_table_t *table, source_stripe_t *stripe,
+                         uint64_t source, size_t slot, size_t *free_slot);
+static void free_entries(source_table_t *table, source_stripe_t *stripe,
+                         size_t slot);
+static source_entry_t *entry_at(source_table_t *table,
+                                source_stripe_t *stripe, size_t slot);
+static void lock(source_stripe_t *stripe);
+static void unlock(source_stripe_t *stripe);
+
+
+/**
+ * Creates a table with room for given number of sources, each one with
+ * data_size bytes of data, shared with processes forked afterwards.
+ *
+ * Returns NULL on failure with errno set.
+ */
+source_table_t *source_table_create(size_t sources, size_t data_size)
+{
+    // Keep each stripe at most half full on average, for short probes.
+    size_t size = 16;
+    while (size * SOURCE_TABLE_STRIPES < 2 * sources) size <<= 1;
+    size_t entry_size = (sizeof(source_entry_t) + data_size + 15) &
+                        ~(size_t) 15;
+    size_t bytes = sizeof(source_table_t) +
+                   size * SOURCE_TABLE_STRIPES * entry_size;
+
+    // Anonymous mappings are zero filled, which is how locks and free
+    // entries start too.
+    source_table_t *table = (source_table_t *) mmap(
+            NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+            -1, 0);
+    if (table == MAP_FAILED) return NULL;
+
+    table->size = bytes;
+    table->mask = size - 1;
+    table->entry_size = entry_size;
+    table->data_size = data_size;
+
+    char *entries = (char *) (table + 1);
+    for (int i = 0; i < SOURCE_TABLE_STRIPES; i++) {
+        atomic_flag_clear(&table->stripes[i].lock);
+        table->stripes[i].entries = entries + i * size * entry_size;
+    }
+
+    return table;
+}
+
+void source_table_destroy(source_table_t *table)
+{
+    munmap(table, table->size);
+}
+
+/**
+ * Takes a reference to the entry of given source, adding it if it is not
+ * in the table. Data of new entries starts zero filled. Sources may not be
+ * 0.
+ *
+ * Returns the data of the entry, or NULL with errno set to ENOSPC if there
+ * is no room for source, or to EBUSY if it already holds max_refs
+ * references, unless max_refs is 0.
+ */
+void *source_table_acquire(source_table_t *table, uint64_t source,
+                           int max_refs)
+{
+    size_t slot, free_slot;
+    source_stripe_t *stripe = stripe_of(table, source, &slot);
+    source_entry_t *entry = NULL;
+    int err = 0;
+
+    lock(stripe);
+    slot = find_entry(table, stripe, source, slot, &free_slot);
+    if (slot != NO_ENTRY) {
+        entry = entry_at(table, stripe, slot);
+        if (max_refs > 0 && entry->refs >= max_refs) {
+            entry = NULL;
+            err = EBUSY;
+        }
+    }
+    else if (free_slot != NO_ENTRY) {
+        entry = entry_at(table, stripe, free_slot);
+        entry->source = source;
+        memset(entry + 1, 0, table->data_size);
+    }
+    else err = ENOSPC;
+    if (entry) entry->refs++;
+    unlock(stripe);
+
+    if (!entry) {
+        errno = err;
+        return NULL;
+    }
+    return entry + 1;
+}
+
+/**
+ * Drops a reference to the entry of given source.
+ */
+void source_table_release(source_table_t *table, uint64_t source)
+{
+    size_t slot, free_slot;
+    source_stripe_t *stripe = stripe_of(table, source, &slot);
+
+    lock(stripe);
+    slot = find_entry(table, stripe, source, slot, &free_slot);
+    if (slot != NO_ENTRY) {
+        source_entry_t *entry = entry_at(table, stripe, slot);
+        if (entry->refs > 0 && --entry->refs == 0) {
+            free_entries(table, stripe, slot);
+        }
+    }
+    unlock(stripe);
+}
+
+static source_stripe_t *stripe_of(source_table_t *table, uint64_t source,
+                                  size_t *slot)
+{
+    uint64_t h = source * 0x9E3779B97F4A7C15ULL;
+    *slot = (size_t) (h >> 16) & table->mask;
+    return &table->stripes[h >> 58];  // Top 6 bits, for 64 stripes.
+}
+
+/**
+ * Returns the entry of source, deleted or not, by probing linearly from
+ * given slot, or NO_ENTRY if source is not in the table. In the latter case,
+ * free_slot gets the first entry, free or deleted, source could be placed
+ * in, or NO_ENTRY if stripe is full.
+ */
+static size_t find_entry(source_table_t *table, source_stripe_t *stripe,
+                         uint64_t source, size_t slot, size_t *free_slot)
+{
+    *free_slot = NO_ENTRY;
+    size_t start = slot;
+    do {
+        source_entry_t *entry = entry_at(table, stripe, slot);
+        if (entry->source == source) return slot;
+        if (entry->refs == 0 && *free_slot == NO_ENTRY) *free_slot = slot;
+        if (entry->source == 0) return NO_ENTRY;  // End of probe run.
+        slot = (slot + 1) & table->mask;
+    } while (slot != start);
+    return NO_ENTRY;
+}
+
+/**
+ * Frees the deleted entry at given slot, along with the deleted entries
+ * right before it, if it ends its probe run. No lookup needs to go past
+ * it then.
+ */
+static void free_entries(source_table_t *table, source_stripe_t *stripe,
+                         size_t slot)
+{
+    size_t next = (slot + 1) & table->mask;
+    if (entry_at(table, stripe, next)->source != 0) return;
+
+    for (size_t n = 0; n <= table->mask; n++) {
+        source_entry_t *entry = entry_at(table, stripe, slot);
+        if (entry->source == 0 || entry->refs > 0) break;
+        entry->source = 0;
+        slot = (slot - 1) & table->mask;
+    }
+}
+
+static source_entry_t *entry_at(source_table_t *table,
+                                source_stripe_t *stripe, size_t slot)
+{
+    return (source_entry_t *) (stripe->entries + slot * table->entry_size);
+}
+
+static void lock(source_stripe_t *stripe)
+{
+    while (atomic_flag_test_and_set_explicit(&stripe->lock,
+                                             memory_order_acquire));
+}
+
+static void unlock(source_stripe_t *stripe)
+{
+    atomic_flag_clear_explicit(&stripe->lock, memory_order_release);
+}
@@ -0,0 +1,54 @@
+/**
+ * source_table.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to keep an entry for every
+ * client source in use, along with a fixed size of data, shared by all
+ * threads and all processes forked after creating the table.
+ *
+ * Entries get counted references, and stay where they are while referenced,
+ * so their data may be updated with atomics, with no lock held.
+ *
+ */
+
+#ifndef SOURCE_TABLE_H
+#define SOURCE_TABLE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SOURCE_TABLE_STRIPES 64
+
+// Followed by the data of the entry.
+typedef struct {
+    uint64_t source;  // 0 for free entries.
+    int refs;         // Users of entry, 0 for deleted ones.
+    int pad;
+} source_entry_t;
+
+// Open addressing table of sources, guarded by a spinlock.
+typedef struct {
+    _Alignas(64) atomic_flag lock;
+    char *entries;
+} source_stripe_t;
+
+typedef struct {
+    size_t mask;        // Entries of each stripe minus one.
+    size_t entry_size;  // Bytes of every entry, along with its data.
+    size_t data_size;
+    size_t size;        // Bytes mapped, along with the entries that follow.
+    source_stripe_t stripes[SOURCE_TABLE_STRIPES];
+} source_table_t;
+
+
+source_table_t *source_table_create(size_t sources, size_t data_size);
+void source_table_destroy(source_table_t *table);
+void *source_table_acquire(source_table_t *table, uint64_t source,
+                           int max_refs);
+void source_table_release(source_table_t *table, uint64_t source);
+
+#endif
@@ -0,0 +1,363 @@
+/**
+ * timeouts.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in timeouts.h.
+ *
+ * The reaper is a single thread owning a timing wheel of every watched
+ * connection. Handlers only publish new deadlines, with a relaxed store,
+ * leaving the wheel to the reaper, which wakes up once per tick while there
+ * is anything to watch. Expired connections get shut down, not closed, so
+ * their handler wakes up and closes them itself, the way it does on
+ * termination. Handlers stop being watched before closing their connection,
+ * so the reaper never touches a descriptor that may have been reused.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "timeouts.h"
+
+
+#define NEVER (UINT64_MAX >> 2)  // Deadline of connections that never expire.
+
+
+static void *run_reaper(void *args);
+static void expire_watch(wheel_timer_t *timer, void *arg);
+static uint64_t publish(reaper_t *reaper, reaper_watch_t *watch);
+
+
+/**
+ * Parses a comma separated list of timeouts, each one given in seconds as
+ * "idle=seconds", "read=seconds" or "lifetime=seconds", into timeouts.
+ *
+ * Returns 0 on success, -1 with errno set to EINVAL on invalid list.
+ */
+int conn_timeouts_parse(char *spec, conn_timeouts_t *timeouts)
+{
+    enum { IDLE, READ, LIFETIME };
+    char *const names[] = { "idle", "read", "lifetime", NULL };
+
+    while (*spec != '\0') {
+        char *value, *end;
+        int opt = getsubopt(&spec, names, &value);
+        if (opt < 0 || !value) {
+            errno = EINVAL;
+            return -1;
+        }
+        double seconds = strtod(value, &end);
+        if (end == value || *end != '\0' || !(seconds > 0)) {
+            errno = EINVAL;
+            return -1;
+        }
+        uint64_t ms = (uint64_t) (seconds * 1000);
+        if (ms == 0) ms = 1;
+
+        switch (opt) {
+            case IDLE: timeouts->idle_ms = ms; break;
+            case READ: timeouts->read_ms = ms; break;
+            case LIFETIME: timeouts->lifetime_ms = ms; break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Returns non-zero if connections may time out at all.
+ */
+int conn_timeouts_enabled(const conn_timeouts_t *timeouts)
+{
+    return timeouts->idle_ms > 0 || timeouts->read_ms > 0 ||
+           timeouts->lifetime_ms > 0;
+}
+
+const char *conn_timeouts_name(timeout_kind_t kind)
+{
+    switch (kind) {
+        case TIMEOUT_IDLE: return "idle";
+        case TIMEOUT_READ: return "read";
+        case TIMEOUT_LIFETIME: return "lifetime";
+        default: return "none";
+    }
+}
+
+/**
+ * Starts tracking the activity of a connection accepted at given time of
+ * timer_wheel_now_ms(). It counts as idle from now on, not from the time it
+ * may have waited to be served.
+ */
+void conn_activity_init(conn_activity_t *activity, uint64_t accepted_ms)
+{
+    activity->accepted_ms = accepted_ms;
+    activity->active_ms = timer_wheel_now_ms();
+    activity->partial_ms = 0;
+}
+
+/**
+ * Records that data has been received, leaving a message incomplete if
+ * pending is set.
+ */
+void conn_activity_read(conn_activity_t *activity, uint64_t now_ms,
+                        int pending)
+{
+    activity->active_ms = now_ms;
+    if (!pending) activity->partial_ms = 0;
+    else if (activity->partial_ms == 0) activity->partial_ms = now_ms;
+}
+
+/**
+ * Records that a connection stops being read for given time, as it exceeds
+ * its rate limits. Time spent paused does not count against the connection,
+ * except for its lifetime.
+ */
+void conn_activity_pause(conn_activity_t *activity, uint64_t now_ms,
+                         uint64_t pause_ms)
+{
+    activity->active_ms = now_ms + pause_ms;
+    if (activity->partial_ms > 0) activity->partial_ms += pause_ms;
+}
+
+/**
+ * Returns the time a connection with given activity expires at, storing the
+ * timeout expiring into kind, or UINT64_MAX if it may never expire as it is.
+ */
+uint64_t conn_timeouts_deadline(const conn_timeouts_t *timeouts,
+                                const conn_activity_t *activity,
+                                timeout_kind_t *kind)
+{
+    uint64_t deadline = UINT64_MAX;
+    *kind = TIMEOUT_KINDS;
+
+    if (timeouts->idle_ms > 0) {
+        deadline = activity->active_ms + timeouts->idle_ms;
+        *kind = TIMEOUT_IDLE;
+    }
+    if (timeouts->read_ms > 0 && activity->partial_ms > 0 &&
+        activity->partial_ms + timeouts->read_ms < deadline) {
+        deadline = activity->partial_ms + timeouts->read_ms;
+        *kind = TIMEOUT_READ;
+    }
+    if (timeouts->lifetime_ms > 0 &&
+        activity->accepted_ms + timeouts->lifetime_ms < deadline) {
+        deadline = activity->accepted_ms + timeouts->lifetime_ms;
+        *kind = TIMEOUT_LIFETIME;
+    }
+
+    return deadline;
+}
+
+/**
+ * Returns when a connection found with given deadline at now should be
+ * looked at again. Deadlines only move later, except when a message starts
+ * being received, which may bring them down to now plus the read timeout.
+ */
+uint64_t conn_timeouts_recheck(const conn_timeouts_t *timeouts,
+                               uint64_t deadline_ms, uint64_t now_ms)
+{
+    if (timeouts->read_ms > 0 && now_ms + timeouts->read_ms < deadline_ms) {
+        return now_ms + timeouts->read_ms;
+    }
+    return deadline_ms;
+}
+
+/**
+ * Starts a reaper of connections exceeding given timeouts, recording them
+ * into metrics, if not NULL. Reaper runs with all signals blocked.
+ *
+ * Returns the reaper, or NULL on failure with errno set.
+ */
+reaper_t *reaper_create(const conn_timeouts_t *timeouts,
+                        metrics_slot_t *metrics)
+{
+    reaper_t *reaper = (reaper_t *) malloc(sizeof(reaper_t));
+    if (!reaper) return NULL;
+
+    reaper->timeouts = *timeouts;
+    timer_wheel_init(&reaper->wheel, TIMEOUT_TICK_MS, timer_wheel_now_ms());
+    pthread_mutex_init(&reaper->mutex, NULL);
+    atomic_init(&reaper->stopping, 0);
+    reaper->metrics = metrics;
+    for (int k = 0; k < TIMEOUT_KINDS; k++) {
+        atomic_init(&reaper->timed_out[k], 0);
+    }
+
+    reaper->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reaper->wake_fd < 0) {
+        pthread_mutex_destroy(&reaper->mutex);
+        free(reaper);
+        return NULL;
+    }
+
+    sigset_t all, orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &orig);
+    int rc = pthread_create(&reaper->thread, NULL, run_reaper, reaper);
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+    if (rc != 0) {
+        close(reaper->wake_fd);
+        pthread_mutex_destroy(&reaper->mutex);
+        free(reaper);
+        errno = rc;
+        return NULL;
+    }
+
+    return reaper;
+}
+
+/**
+ * Stops the reaper. Connections still watched are left alone.
+ */
+void reaper_destroy(reaper_t *reaper)
+{
+    atomic_store(&reaper->stopping, 1);
+    uint64_t val = 1;
+    ssize_t rc = write(reaper->wake_fd, &val, sizeof(val));
+    (void) rc;
+    pthread_join(reaper->thread, NULL);
+
+    close(reaper->wake_fd);
+    pthread_mutex_destroy(&reaper->mutex);
+    free(reaper);
+}
+
+/**
+ * Starts watching a connection accepted at given time of
+ * timer_wheel_now_ms().
+ */
+void reaper_watch(reaper_t *reaper, reaper_watch_t *watch, int fd,
+                  uint64_t accepted_ms)
+{
+    watch->fd = fd;
+    timer_init(&watch->timer);
+    conn_activity_init(&watch->activity, accepted_ms);
+    uint64_t deadline = publish(reaper, watch);
+    uint64_t check = conn_timeouts_recheck(&reaper->timeouts, deadline,
+                                           watch->activity.active_ms);
+
+    pthread_mutex_lock(&reaper->mutex);
+    int was_empty = reaper->wheel.size == 0;
+    timer_wheel_add(&reaper->wheel, &watch->timer, check);
+    pthread_mutex_unlock(&reaper->mutex);
+
+    // Reaper sleeps for good while there is nothing to watch.
+    if (was_empty) {
+        uint64_t val = 1;
+        ssize_t rc = write(reaper->wake_fd, &val, sizeof(val));
+        (void) rc;
+    }
+}
+
+/**
+ * Records that data has been received on a watched connection, leaving a
+ * message incomplete if pending is set. Takes no lock.
+ */
+void reaper_touch(reaper_t *reaper, reaper_watch_t *watch, int pending)
+{
+    conn_activity_read(&watch->activity, timer_wheel_now_ms(), pending);
+    publish(reaper, watch);
+}
+
+/**
+ * Records that a watched connection stops being read for given time, the
+ * way conn_activity_pause() does. Takes no lock.
+ */
+void reaper_pause(reaper_t *reaper, reaper_watch_t *watch, uint64_t pause_ms)
+{
+    conn_activity_pause(&watch->activity, timer_wheel_now_ms(), pause_ms);
+    publish(reaper, watch);
+}
+
+/**
+ * Stops watching a connection. Should be called before closing it.
+ */
+void reaper_unwatch(reaper_t *reaper, reaper_watch_t *watch)
+{
+    pthread_mutex_lock(&reaper->mutex);
+    timer_wheel_remove(&reaper->wheel, &watch->timer);
+    pthread_mutex_unlock(&reaper->mutex);
+}
+
+/**
+ * Entry point of the reaper thread.
+ */
+static void *run_reaper(void *args)
+{
+    reaper_t *reaper = (reaper_t *) args;
+
+    struct pollfd pfd;
+    pfd.fd = reaper->wake_fd;
+    pfd.events = POLLIN;
+
+    while (!atomic_load(&reaper->stopping)) {
+        pthread_mutex_lock(&reaper->mutex);
+        int timeout = timer_wheel_timeout(&reaper->wheel,
+                                          timer_wheel_now_ms());
+        pthread_mutex_unlock(&reaper->mutex);
+
+        if (poll(&pfd, 1, timeout) > 0) {
+            uint64_t val;
+            ssize_t rc = read(reaper->wake_fd, &val, sizeof(val));
+            (void) rc;
+        }
+
+        pthread_mutex_lock(&reaper->mutex);
+        timer_wheel_advance(&reaper->wheel, timer_wheel_now_ms(),
+                            expire_watch, reaper);
+        pthread_mutex_unlock(&reaper->mutex);
+    }
+
+    return NULL;
+}
+
+/**
+ * Shuts a watched connection down if it is past its deadline, or else
+ * moves its timer on. Called under the mutex of the reaper given as arg.
+ */
+static void expire_watch(wheel_timer_t *timer, void *arg)
+{
+    reaper_t *reaper = (reaper_t *) arg;
+    reaper_watch_t *watch = (reaper_watch_t *) timer;  // Timer comes first.
+
+    uint64_t packed = atomic_load_explicit(&watch->deadline,
+                                           memory_order_relaxed);
+    uint64_t deadline = packed >> 2;
+    uint64_t now = timer_wheel_now_ms();
+    if (deadline > now) {
+        timer_wheel_add(&reaper->wheel, timer,
+                        conn_timeouts_recheck(&reaper->timeouts, deadline,
+                                              now));
+        return;
+    }
+
+    shutdown(watch->fd, SHUT_RDWR);
+    timeout_kind_t kind = (timeout_kind_t) (packed & 3);
+    atomic_fetch_add_explicit(&reaper->timed_out[kind], 1,
+                              memory_order_relaxed);
+    if (reaper->metrics) metrics_timed_out(reaper->metrics, kind);
+}
+
+/**
+ * Publishes the current deadline of a watched connection to the reaper.
+ *
+ * Returns the deadline.
+ */
+static uint64_t publish(reaper_t *reaper, reaper_watch_t *watch)
+{
+    timeout_kind_t kind;
+    uint64_t deadline = conn_timeouts_deadline(&reaper->timeouts,
+                                               &watch->activity, &kind);
+    if (deadline > NEVER) deadline = NEVER;
+    atomic_store_explicit(&watch->deadline, deadline << 2 | (kind & 3),
+                          memory_order_relaxed);
+    return deadline;
+}
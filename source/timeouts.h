@@ -0,0 +1,93 @@
+/**
+ * timeouts.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to time out connections
+ * that stay idle, send messages too slowly, or live for too long, and a
+ * reaper that shuts such connections down under handlers blocked on them.
+ *
+ * Connections are not rescheduled on every read. Their timer expires at
+ * the deadline they had when it was set, or earlier, and only then it gets
+ * moved to the deadline they have by now, if that is later.
+ *
+ */
+
+#ifndef TIMEOUTS_H
+#define TIMEOUTS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "timer_wheel.h"
+#include "metrics.h"
+
+#define TIMEOUT_TICK_MS 100  // Granularity of timeouts.
+
+typedef enum {
+    TIMEOUT_IDLE,      // Nothing received for too long.
+    TIMEOUT_READ,      // A message took too long to be completed.
+    TIMEOUT_LIFETIME,  // Connection lived for too long.
+    TIMEOUT_KINDS
+} timeout_kind_t;
+
+// Limits of connections in ms, 0 for none.
+typedef struct {
+    uint64_t idle_ms;      // Since the last data received.
+    uint64_t read_ms;      // Since the start of a message still incomplete.
+    uint64_t lifetime_ms;  // Since accepted.
+} conn_timeouts_t;
+
+typedef struct {
+    uint64_t accepted_ms;
+    uint64_t active_ms;   // Last time data was received.
+    uint64_t partial_ms;  // Since when a message is incomplete, 0 if none.
+} conn_activity_t;
+
+// A connection watched by a reaper. Activity is only touched by the
+// handler, while the deadline gets published to the reaper.
+typedef struct {
+    wheel_timer_t timer;  // Owned by the reaper.
+    int fd;
+    conn_activity_t activity;
+    atomic_uint_least64_t deadline;  // In ms, shifted left by 2, with the
+                                     // timeout it belongs to in low bits.
+} reaper_watch_t;
+
+typedef struct {
+    conn_timeouts_t timeouts;
+    timer_wheel_t wheel;  // Watched connections, under mutex.
+    pthread_mutex_t mutex;
+    pthread_t thread;
+    int wake_fd;          // Wakes up reaper, when started or stopped.
+    atomic_int stopping;
+    metrics_slot_t *metrics;  // Where timeouts get recorded, NULL if none.
+    atomic_ulong timed_out[TIMEOUT_KINDS];
+} reaper_t;
+
+
+int conn_timeouts_parse(char *spec, conn_timeouts_t *timeouts);
+int conn_timeouts_enabled(const conn_timeouts_t *timeouts);
+const char *conn_timeouts_name(timeout_kind_t kind);
+void conn_activity_init(conn_activity_t *activity, uint64_t accepted_ms);
+void conn_activity_read(conn_activity_t *activity, uint64_t now_ms,
+                        int pending);
+void conn_activity_pause(conn_activity_t *activity, uint64_t now_ms,
+                         uint64_t pause_ms);
+uint64_t conn_timeouts_deadline(const conn_timeouts_t *timeouts,
+                                const conn_activity_t *activity,
+                                timeout_kind_t *kind);
+uint64_t conn_timeouts_recheck(const conn_timeouts_t *timeouts,
+                               uint64_t deadline_ms, uint64_t now_ms);
+reaper_t *reaper_create(const conn_timeouts_t *timeouts,
+                        metrics_slot_t *metrics);
+void reaper_destroy(reaper_t *reaper);
+void reaper_watch(reaper_t *reaper, reaper_watch_t *watch, int fd,
+                  uint64_t accepted_ms);
+void reaper_touch(reaper_t *reaper, reaper_watch_t *watch, int pending);
+void reaper_pause(reaper_t *reaper, reaper_watch_t *watch, uint64_t pause_ms);
+void reaper_unwatch(reaper_t *reaper, reaper_watch_t *watch);
+
+#endif
@@ -0,0 +1,226 @@
+/**
+ * timer_wheel.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in timer_wheel.h.
+ *
+ * Timers expiring within TIMER_WHEEL_SLOTS ticks sit in the slot of their
+ * tick on the first level, which gets expired as a whole once its tick
+ * comes. Timers further away sit in coarser levels, each slot of level l
+ * covering 2^(BITS * l) ticks. Once the first level completes a round, the
+ * next slot of the second one gets cascaded, its timers spread over the
+ * first level, and so on up the levels (G. Varghese and T. Lauck, "Hashed
+ * and Hierarchical Timing Wheels", 1987). Timers further away than all
+ * levels cover wait on the last one, to be placed again once cascaded.
+ *
+ * Timers never expire early, and at most a tick late.
+ *
+ */
+
+#include <time.h>
+#include "timer_wheel.h"
+
+
+#define LEVEL_SHIFT(level) (TIMER_WHEEL_BITS * (level))
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define MAX_DELTA ((1ULL << LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)
+
+
+static void place(timer_wheel_t *wheel, wheel_timer_t *timer,
+                  uint64_t first);
+static void cascade(timer_wheel_t *wheel, int level);
+static void link_timer(wheel_timer_t *head, wheel_timer_t *timer);
+static void unlink_timer(wheel_timer_t *timer);
+
+
+void timer_wheel_init(timer_wheel_t *wheel, unsigned tick_ms,
+                      uint64_t now_ms)
+{
+    wheel->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    wheel->tick = now_ms / wheel->tick_ms;
+    wheel->size = 0;
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+        for (int s = 0; s < TIMER_WHEEL_SLOTS; s++) {
+            wheel->slots[l][s].next = &wheel->slots[l][s];
+            wheel->slots[l][s].prev = &wheel->slots[l][s];
+        }
+    }
+}
+
+void timer_init(wheel_timer_t *timer)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+}
+
+/**
+ * Returns non-zero if timer is in a wheel, waiting to expire.
+ */
+int timer_pending(const wheel_timer_t *timer)
+{
+    return timer->prev != NULL;
+}
+
+/**
+ * Adds a timer expiring at given time of timer_wheel_now_ms(), moving it if
+ * it is already in the wheel. Times already past expire on the next tick.
+ */
+void timer_wheel_add(timer_wheel_t *wheel, wheel_timer_t *timer,
+                     uint64_t expires_ms)
+{
+    if (timer_pending(timer)) timer_wheel_remove(wheel, timer);
+
+    // Round up, so that timers never expire early.
+    timer->expires = expires_ms / wheel->tick_ms +
+                     (expires_ms % wheel->tick_ms != 0);
+    place(wheel, timer, wheel->tick + 1);
+    wheel->size++;
+}
+
+/**
+ * Removes a timer from the wheel, if it is in there.
+ */
+void timer_wheel_remove(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (!timer_pending(timer)) return;
+    unlink_timer(timer);
+    wheel->size--;
+}
+
+/**
+ * Expires every timer due by given time of timer_wheel_now_ms(), calling
+ * expire for each one of them, after taking it out of the wheel. Expire may
+ * add and remove any timer, including the expired one.
+ *
+ * Returns the number of timers expired.
+ */
+size_t timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms,
+                           timer_expire_t expire, void *arg)
+{
+    uint64_t target = now_ms / wheel->tick_ms;
+    size_t expired = 0;
+
+    while (wheel->tick < target) {
+        // Nothing to cascade or expire on the ticks left.
+        if (wheel->size == 0) {
+            wheel->tick = target;
+            break;
+        }
+        uint64_t tick = ++wheel->tick;
+
+        // Cascade from coarser levels first, as they may fill finer ones
+        // due to be cascaded on this tick too.
+        int level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1 &&
+               (tick & ((1ULL << LEVEL_SHIFT(level + 1)) - 1)) == 0) {
+            level++;
+        }
+        for (; level > 0; level--) cascade(wheel, level);
+
+        // Detach the slot, so that timers added by expire wait for their
+        // turn, even if it is the same slot.
+        wheel_timer_t due;
+        wheel_timer_t *head = &wheel->slots[0][tick & SLOT_MASK];
+        due.next = due.prev = &due;
+        if (head->next != head) {
+            due.next = head->next;
+            due.prev = head->prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            head->next = head->prev = head;
+        }
+
+        while (due.next != &due) {
+            wheel_timer_t *timer = due.next;
+            unlink_timer(timer);
+            wheel->size--;
+            expired++;
+            expire(timer, arg);
+        }
+    }
+
+    return expired;
+}
+
+/**
+ * Returns the time in ms until the next tick that may expire a timer, fit
+ * for epoll_wait(), or -1 if the wheel is empty.
+ */
+int timer_wheel_timeout(const timer_wheel_t *wheel, uint64_t now_ms)
+{
+    if (wheel->size == 0) return -1;
+
+    uint64_t next_ms = (wheel->tick + 1) * wheel->tick_ms;
+    return next_ms > now_ms ? (int) (next_ms - now_ms) : 0;
+}
+
+/**
+ * Returns a monotonic timestamp in ms.
+ */
+uint64_t timer_wheel_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/**
+ * Links a timer into the slot covering its expiration tick, or the first
+ * tick that has not been expired yet, if that is later.
+ */
+static void place(timer_wheel_t *wheel, wheel_timer_t *timer,
+                  uint64_t first)
+{
+    uint64_t expires = timer->expires;
+    if (expires < first) expires = first;
+    uint64_t delta = expires - wheel->tick;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expires = wheel->tick + MAX_DELTA;
+    }
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 &&
+           delta >= 1ULL << LEVEL_SHIFT(level + 1)) {
+        level++;
+    }
+    int slot = (int) ((expires >> LEVEL_SHIFT(level)) & SLOT_MASK);
+    link_timer(&wheel->slots[level][slot], timer);
+}
+
+/**
+ * Spreads the timers of the current slot of given level over finer levels.
+ */
+static void cascade(timer_wheel_t *wheel, int level)
+{
+    int slot = (int) ((wheel->tick >> LEVEL_SHIFT(level)) & SLOT_MASK);
+    wheel_timer_t *head = &wheel->slots[level][slot];
+
+    wheel_timer_t *timer = head->next;
+    head->next = head->prev = head;
+    while (timer != head) {
+        wheel_timer_t *next = timer->next;
+        place(wheel, timer, wheel->tick);  // Current tick is yet to expire.
+        timer = next;
+    }
+}
+
+static void link_timer(wheel_timer_t *head, wheel_timer_t *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void unlink_timer(wheel_timer_t *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
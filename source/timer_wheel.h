@@ -0,0 +1,58 @@
+/**
+ * timer_wheel.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to keep many timers in a
+ * hierarchical timing wheel, adding, removing and expiring each one of them
+ * in constant time.
+ *
+ * Wheels are not thread safe. Timers are embedded into what they time, so
+ * the wheel never allocates.
+ *
+ */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS 6  // Slots of every level, as a power of 2.
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer *prev;  // NULL when not in a wheel.
+    uint64_t expires;          // Tick timer expires on.
+} wheel_timer_t;
+
+typedef struct {
+    unsigned tick_ms;  // Length of a tick.
+    uint64_t tick;     // Last tick expired.
+    size_t size;       // Timers in the wheel.
+    // Level l holds timers expiring within 2^(BITS * (l + 1)) ticks, each
+    // slot being the head of a circular list.
+    wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+// Called for every expired timer, already out of the wheel.
+typedef void (*timer_expire_t)(wheel_timer_t *timer, void *arg);
+
+
+void timer_wheel_init(timer_wheel_t *wheel, unsigned tick_ms,
+                      uint64_t now_ms);
+void timer_init(wheel_timer_t *timer);
+int timer_pending(const wheel_timer_t *timer);
+void timer_wheel_add(timer_wheel_t *wheel, wheel_timer_t *timer,
+                     uint64_t expires_ms);
+void timer_wheel_remove(timer_wheel_t *wheel, wheel_timer_t *timer);
+size_t timer_wheel_advance(timer_wheel_t *wheel, uint64_t now_ms,
+                           timer_expire_t expire, void *arg);
+int timer_wheel_timeout(const timer_wheel_t *wheel, uint64_t now_ms);
+uint64_t timer_wheel_now_ms(void);
+
+#endif
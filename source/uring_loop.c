@@ -0,0 +1,628 @@
+/**
+ * uring_loop.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in uring_loop.h.
+ *
+ * Each loop arms a single multishot accept on the listener and a single
+ * multishot receive on every connection, so the kernel keeps producing
+ * completions without any further submission. Received data lands in a ring
+ * of buffers provided to the kernel, which are handed back once consumed.
+ * All new submissions of a batch of completions go to the kernel together
+ * with the wait for the next batch, in a single io_uring_enter().
+ *
+ * Replies get sent right away, without blocking, the way epoll loops send
+ * them. Whatever a socket does not take waits in the backlog of its
+ * connection, for a poll of the socket becoming writable to complete. Once
+ * too much of it waits, the receive of the connection gets cancelled, until
+ * the peer reads its replies. A connection gets closed only once no
+ * operation is armed on it any more.
+ *
+ * No liburing is required. Rings are set up directly through the system
+ * calls, needing a kernel of version 6.0 or newer.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring_loop.h"
+#include "event_loop.h"
+
+
+#define RING_ENTRIES 256  // Entries of submission queue.
+#define BUF_COUNT 512     // Buffers provided for receiving (power of 2).
+#define BUF_SIZE 4096     // Size of each provided buffer.
+#define BUF_GROUP 0       // Group id of provided buffers.
+
+// Kinds of operations, encoded into the low bits of user_data.
+#define TAG_RECV 0UL
+#define TAG_ACCEPT 1UL
+#define TAG_TERM 2UL
+#define TAG_IGNORE 3UL
+#define TAG_WRITE 4UL
+#define TAG_MASK 7UL
+
+
+static int setup_rings(uring_loop_t *loop);
+static int setup_buffers(uring_loop_t *loop);
+static int probe_multishot_recv(uring_loop_t *loop);
+static struct io_uring_sqe *get_sqe(uring_loop_t *loop);
+static int enter(uring_loop_t *loop, unsigned min_complete);
+static void arm_accept(uring_loop_t *loop);
+static void arm_recv(uring_loop_t *loop, connection_t *conn, int fd);
+static void arm_term_poll(uring_loop_t *loop);
+static void arm_write_poll(uring_loop_t *loop, connection_t *conn);
+static void cancel_recv(uring_loop_t *loop, connection_t *conn);
+static void recycle_buffer(uring_loop_t *loop, unsigned short bid);
+static void publish_buffers(uring_loop_t *loop);
+static void handle_completion(uring_loop_t *loop, struct io_uring_cqe *cqe);
+static void register_connection(uring_loop_t *loop, int fd);
+static void receive(uring_loop_t *loop, connection_t *conn,
+                    struct io_uring_cqe *cqe);
+static void receive_done(uring_loop_t *loop, connection_t *conn, int res);
+static void write_replies(uring_loop_t *loop, connection_t *conn);
+static void finish_connection(uring_loop_t *loop, connection_t *conn);
+static void close_connection(uring_loop_t *loop, connection_t *conn);
+static void begin_termination(uring_loop_t *loop);
+
+
+/**
+ * Creates a new loop.
+ *
+ * Returns NULL, with errno set, when the running kernel lacks any of the
+ * io_uring features required.
+ */
+uring_loop_t *uring_loop_create(int listener_fd, int term_fd,
+                                output_t *output)
+{
+    uring_loop_t *loop = (uring_loop_t *) calloc(1, sizeof(uring_loop_t));
+    loop->ring_fd = -1;
+    loop->listener_fd = listener_fd;
+    loop->term_fd = term_fd;
+    loop->conns = linked_list_create();
+    loop->output = output;
+    reply_batch_init(&loop->replies, REPLY_NONE);
+
+    if (setup_rings(loop) < 0 || setup_buffers(loop) < 0 ||
+        probe_multishot_recv(loop) < 0) {
+        int err = errno;
+        uring_loop_destroy(loop);
+        errno = err;
+        return NULL;
+    }
+
+    return loop;
+}
+
+void uring_loop_destroy(uring_loop_t *loop)
+{
+    // Close any connection still owned by the loop.
+    while (linked_list_size(loop->conns) > 0) {
+        close_connection(loop, (connection_t *) loop->conns->root->next->data);
+    }
+    linked_list_destroy(loop->conns);
+    reply_batch_free(&loop->replies);
+
+    // Closing the ring also unregisters the buffers.
+    if (loop->ring_fd >= 0) close(loop->ring_fd);
+    if (loop->buf_ring) {
+        munmap(loop->buf_ring, BUF_COUNT * sizeof(struct io_uring_buf));
+    }
+    free(loop->buffers);
+    if (loop->sqes) munmap(loop->sqes, loop->sqes_size);
+    if (loop->cq_ptr && loop->cq_ptr != loop->sq_ptr) {
+        munmap(loop->cq_ptr, loop->cq_size);
+    }
+    if (loop->sq_ptr) munmap(loop->sq_ptr, loop->sq_size);
+    free(loop);
+}
+
+/**
+ * Runs the loop on current thread until termination has been requested and
+ * every owned connection has been closed.
+ */
+void uring_loop_run(uring_loop_t *loop)
+{
+    arm_term_poll(loop);
+    arm_accept(loop);
+
+    while (!loop->terminating || linked_list_size(loop->conns) > 0) {
+        publish_buffers(loop);
+        if (enter(loop, 1) < 0) {
+            if (errno == EINTR) continue;
+            perror("ERROR: Waiting for completions failed");
+            break;
+        }
+
+        unsigned head = *loop->cq_head;
+        unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handle_completion(loop, &loop->cqes[head & *loop->cq_mask]);
+            head++;
+        }
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Creates the ring and maps its queues into memory.
+ */
+static int setup_rings(uring_loop_t *loop)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // Completion queue gets larger, since multishot operations flood it.
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = RING_ENTRIES * 8;
+
+    loop->ring_fd = (int) syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (loop->ring_fd < 0) return -1;
+
+    loop->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    loop->cq_size = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (loop->cq_size > loop->sq_size) loop->sq_size = loop->cq_size;
+        loop->cq_size = loop->sq_size;
+    }
+
+    loop->sq_ptr = mmap(NULL, loop->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+                        IORING_OFF_SQ_RING);
+    if (loop->sq_ptr == MAP_FAILED) {
+        loop->sq_ptr = NULL;
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) loop->cq_ptr = loop->sq_ptr;
+    else {
+        loop->cq_ptr = mmap(NULL, loop->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+                            IORING_OFF_CQ_RING);
+        if (loop->cq_ptr == MAP_FAILED) {
+            loop->cq_ptr = NULL;
+            return -1;
+        }
+    }
+
+    loop->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    loop->sqes = mmap(NULL, loop->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, loop->ring_fd,
+                      IORING_OFF_SQES);
+    if (loop->sqes == MAP_FAILED) {
+        loop->sqes = NULL;
+        return -1;
+    }
+
+    char *sq = (char *) loop->sq_ptr;
+    loop->sq_head = (unsigned *) (sq + params.sq_off.head);
+    loop->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    loop->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    loop->sq_array = (unsigned *) (sq + params.sq_off.array);
+
+    char *cq = (char *) loop->cq_ptr;
+    loop->cq_head = (unsigned *) (cq + params.cq_off.head);
+    loop->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    loop->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    loop->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Registers a ring of buffers, that the kernel picks from when receiving.
+ */
+static int setup_buffers(uring_loop_t *loop)
+{
+    size_t ring_size = BUF_COUNT * sizeof(struct io_uring_buf);
+    loop->buf_ring = (struct io_uring_buf_ring *) mmap(
+            NULL, ring_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buf_ring == MAP_FAILED) {
+        loop->buf_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) loop->buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if (syscall(__NR_io_uring_register, loop->ring_fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+
+    loop->buffers = (char *) malloc((size_t) BUF_COUNT * BUF_SIZE);
+    loop->buf_tail = 0;
+    for (unsigned i = 0; i < BUF_COUNT; i++) {
+        recycle_buffer(loop, (unsigned short) i);
+    }
+    publish_buffers(loop);
+
+    return 0;
+}
+
+/**
+ * Verifies that multishot receive works, by receiving over a local pair of
+ * sockets. Kernels before 6.0 reject it, although they support the rest.
+ */
+static int probe_multishot_recv(uring_loop_t *loop)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) return -1;
+
+    // A single byte followed by EOF, completes the receive in two steps.
+    if (write(sv[1], "x", 1) != 1) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    shutdown(sv[1], SHUT_WR);
+    arm_recv(loop, NULL, sv[0]);
+
+    int received = 0;
+    int done = 0;
+    int rc = 0;
+    while (!done && rc == 0) {
+        if ((rc = enter(loop, 1)) < 0) break;
+
+        unsigned head = *loop->cq_head;
+        unsigned tail = __atomic_load_n(loop->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &loop->cqes[head & *loop->cq_mask];
+            if (cqe->res > 0) received = 1;
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                recycle_buffer(loop, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                done = 1;
+                if (cqe->res < 0) {
+                    errno = -cqe->res;
+                    rc = -1;
+                }
+            }
+            head++;
+        }
+        __atomic_store_n(loop->cq_head, head, __ATOMIC_RELEASE);
+    }
+    publish_buffers(loop);
+
+    close(sv[0]);
+    close(sv[1]);
+
+    if (rc == 0 && !received) {
+        errno = EINVAL;
+        rc = -1;
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+/**
+ * Returns the next free submission entry, cleared.
+ */
+static struct io_uring_sqe *get_sqe(uring_loop_t *loop)
+{
+    unsigned tail = *loop->sq_tail;
+    unsigned head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+
+    // Submission queue is full, so flush it without waiting.
+    while (tail - head >= *loop->sq_mask + 1) {
+        if (enter(loop, 0) < 0 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY) {
+            return NULL;
+        }
+        head = __atomic_load_n(loop->sq_head, __ATOMIC_ACQUIRE);
+    }
+
+    unsigned index = tail & *loop->sq_mask;
+    struct io_uring_sqe *sqe = &loop->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    loop->sq_array[index] = index;
+    __atomic_store_n(loop->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    loop->to_submit++;
+
+    return sqe;
+}
+
+/**
+ * Submits all queued entries and waits for at least min_complete
+ * completions, in a single system call.
+ */
+static int enter(uring_loop_t *loop, unsigned min_complete)
+{
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int rc = (int) syscall(__NR_io_uring_enter, loop->ring_fd,
+                           loop->to_submit, min_complete, flags, NULL, 0);
+    if (rc < 0) return -1;
+    loop->to_submit -= (unsigned) rc;
+    return 0;
+}
+
+static void arm_accept(uring_loop_t *loop)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listener_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = TAG_ACCEPT;
+}
+
+/**
+ * Arms a multishot receive on fd. Completions get reported for conn, or are
+ * ignored when conn is NULL.
+ */
+static void arm_recv(uring_loop_t *loop, connection_t *conn, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = conn ? (uint64_t) (uintptr_t) conn | TAG_RECV : TAG_IGNORE;
+    if (conn) conn->receiving = 1;
+}
+
+static void arm_term_poll(uring_loop_t *loop)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->term_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = TAG_TERM;
+}
+
+/**
+ * Arms a poll for the socket of a connection becoming writable.
+ */
+static void arm_write_poll(uring_loop_t *loop, connection_t *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uint64_t) (uintptr_t) conn | TAG_WRITE;
+    conn->writing = 1;
+}
+
+/**
+ * Asks the kernel to stop the multishot receive of a connection. It still
+ * completes, with ECANCELED, unless it had been about to complete anyway.
+ */
+static void cancel_recv(uring_loop_t *loop, connection_t *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t) (uintptr_t) conn | TAG_RECV;
+    sqe->user_data = TAG_IGNORE;
+}
+
+/**
+ * Hands a consumed buffer back to the kernel. It becomes visible only after
+ * the next call to publish_buffers().
+ */
+static void recycle_buffer(uring_loop_t *loop, unsigned short bid)
+{
+    struct io_uring_buf *buf =
+            &loop->buf_ring->bufs[loop->buf_tail & (BUF_COUNT - 1)];
+    char *addr = loop->buffers + (size_t) bid * BUF_SIZE;
+    buf->addr = (uint64_t) (uintptr_t) addr;
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    loop->buf_tail++;
+}
+
+static void publish_buffers(uring_loop_t *loop)
+{
+    __atomic_store_n(&loop->buf_ring->tail, loop->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void handle_completion(uring_loop_t *loop, struct io_uring_cqe *cqe)
+{
+    uint64_t tag = cqe->user_data & TAG_MASK;
+    int more = cqe->flags & IORING_CQE_F_MORE;
+    connection_t *conn =
+            (connection_t *) (uintptr_t) (cqe->user_data & ~TAG_MASK);
+
+    if (tag == TAG_ACCEPT) {
+        if (cqe->res >= 0 && loop->terminating) close(cqe->res);
+        else if (cqe->res >= 0) register_connection(loop, cqe->res);
+        if (!more && !loop->terminating) arm_accept(loop);
+    }
+    else if (tag == TAG_TERM) begin_termination(loop);
+    else if (tag == TAG_RECV) {
+        if (cqe->res > 0) receive(loop, conn, cqe);
+        if (!more) receive_done(loop, conn, cqe->res);
+    }
+    else if (tag == TAG_WRITE) {
+        conn->writing = 0;
+        write_replies(loop, conn);
+    }
+}
+
+/**
+ * Makes the loop the owner of an accepted connection and starts receiving
+ * from it, unless it does not get admitted.
+ */
+static void register_connection(uring_loop_t *loop, int fd)
+{
+    uint64_t source = 0;
+    if (loop->admission) {
+        source = admission_peer_source(fd);
+        if (admission_acquire(loop->admission, source) != ADMISSION_OK) {
+            admission_shed(fd);
+            return;
+        }
+    }
+
+    connection_t *conn = (connection_t *) malloc(sizeof(connection_t));
+    conn->fd = fd;
+    conn->source = source;
+    socket_options_accepted(fd, loop->sock_opts);
+    conn->list_entry = linked_list_append(loop->conns, (void *) conn);
+    output_stream_init(&conn->stream, loop->output);
+    frame_reader_init(&conn->reader, loop->format);
+    reply_backlog_init(&conn->replies);
+    conn->writing = 0;
+    conn->read_paused = 0;
+    conn->read_done = 0;
+    arm_recv(loop, conn, fd);
+}
+
+/**
+ * Consumes data received on a connection, replying to its frames if the
+ * loop does so.
+ */
+static void receive(uring_loop_t *loop, connection_t *conn,
+                    struct io_uring_cqe *cqe)
+{
+    // Frames are parsed in place, before the buffer gets recycled.
+    // Connections not speaking our protocol get shut down, so their receive
+    // completes with EOF.
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *data = loop->buffers + (size_t) bid * BUF_SIZE;
+    int rc;
+    if (loop->replies.mode != REPLY_NONE && !conn->read_done) {
+        reply_batch_start(&loop->replies, conn->fd, &conn->replies,
+                          output_stream_write_frame, &conn->stream);
+        rc = reply_batch_feed(&loop->replies, &conn->reader, data, cqe->res);
+    }
+    else {
+        rc = frame_reader_feed(&conn->reader, data, cqe->res,
+                               output_stream_write_frame, &conn->stream);
+    }
+    if (rc < 0) {
+        conn->read_done = 1;  // Nothing more gets replied to.
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    output_stream_flush(&conn->stream);
+    recycle_buffer(loop, bid);
+
+    size_t waiting = reply_backlog_size(&conn->replies);
+    if (waiting > 0 && !conn->writing) arm_write_poll(loop, conn);
+    if (waiting > REPLY_BACKLOG_MAX && !conn->read_paused) {
+        conn->read_paused = 1;
+        cancel_recv(loop, conn);
+    }
+}
+
+/**
+ * Handles the final completion of the receive of a connection, given its
+ * result, arming it again unless the connection is done with.
+ */
+static void receive_done(uring_loop_t *loop, connection_t *conn, int res)
+{
+    conn->receiving = 0;
+
+    // Receive stopped without EOF, e.g. when running out of buffers, or
+    // when cancelled, in which case it gets armed once replies drain.
+    if (res > 0 || res == -ENOBUFS || res == -ECANCELED) {
+        if (!conn->read_paused) arm_recv(loop, conn, conn->fd);
+        return;
+    }
+
+    // Replies still waiting get sent first, on EOF.
+    conn->read_done = 1;
+    if (res < 0 || reply_backlog_size(&conn->replies) == 0) {
+        finish_connection(loop, conn);
+    }
+}
+
+/**
+ * Writes as many waiting replies as the socket of a connection takes, once
+ * it has become writable, resuming receiving from it once all of them are
+ * gone.
+ */
+static void write_replies(uring_loop_t *loop, connection_t *conn)
+{
+    int rc = reply_backlog_flush(&conn->replies, conn->fd);
+    if (rc < 0 || (rc == 0 && conn->read_done)) {
+        finish_connection(loop, conn);
+        return;
+    }
+    if (rc > 0) {
+        arm_write_poll(loop, conn);  // Wait till socket takes more.
+        return;
+    }
+
+    if (conn->read_paused) {
+        conn->read_paused = 0;
+        if (!conn->receiving) arm_recv(loop, conn, conn->fd);
+    }
+}
+
+/**
+ * Closes a connection once no operation is armed on it any more. Until
+ * then, it gets shut down, so that any armed operation completes.
+ */
+static void finish_connection(uring_loop_t *loop, connection_t *conn)
+{
+    if (conn->receiving || conn->writing) {
+        conn->read_done = 1;
+        reply_backlog_free(&conn->replies);
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    close_connection(loop, conn);
+}
+
+/**
+ * Unregisters a connection from the loop and closes it. There should be no
+ * operation armed on it.
+ */
+static void close_connection(uring_loop_t *loop, connection_t *conn)
+{
+    linked_list_remove(loop->conns, conn->list_entry);
+    output_stream_close(&conn->stream);
+    frame_reader_free(&conn->reader);
+    reply_backlog_free(&conn->replies);
+    if (loop->admission) admission_release(loop->admission, conn->source);
+    close(conn->fd);
+    free(conn);
+}
+
+/**
+ * Stops accepting new connections and asks owned ones to terminate.
+ *
+ * Connections are only shut down here, so any data still queued on them
+ * gets consumed before their receive completes with EOF.
+ */
+static void begin_termination(uring_loop_t *loop)
+{
+    if (loop->terminating) return;
+    loop->terminating = 1;
+
+    struct io_uring_sqe *sqe = get_sqe(loop);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = TAG_ACCEPT;
+        sqe->user_data = TAG_IGNORE;
+    }
+
+    iterator_t *iter = linked_list_iterator(loop->conns);
+    while (iterator_has_next(iter)) {
+        connection_t *conn = (connection_t *) iterator_next(iter);
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    iterator_destroy(iter);
+}
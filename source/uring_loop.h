@@ -0,0 +1,75 @@
+/**
+ * uring_loop.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to create and run an
+ * io_uring based loop, able to multiplex many client connections on a single
+ * thread with multishot accept and multishot receive operations, replying
+ * to the frames received if asked to.
+ *
+ */
+
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+#include "linked_list.h"
+#include "output.h"
+#include "frame.h"
+#include "endpoint.h"
+#include "reply.h"
+#include "admission.h"
+
+typedef struct {
+    int ring_fd;
+
+    // Submission queue.
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned to_submit;  // Entries queued since last io_uring_enter().
+
+    // Completion queue.
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_size;
+    size_t cq_size;
+    size_t sqes_size;
+
+    // Ring of buffers provided to the kernel for receiving.
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    unsigned short buf_tail;  // Local tail, published once per batch.
+
+    int listener_fd;       // Listener shared among loops.
+    int term_fd;           // Descriptor that becomes readable on termination.
+    int terminating;       // Set once termination has been requested.
+    linked_list_t *conns;  // Connections owned by this loop.
+    output_t *output;      // Pipeline received data is written to.
+    frame_format_t format; // Of data received, frames by default.
+    reply_batch_t replies; // Replies to frames received. Set up by servers
+                           // through reply_batch_init(), none by default.
+    const socket_options_t *sock_opts;  // Of accepted connections, NULL if
+                                        // none.
+    admission_t *admission; // Limits of connections, possibly shared with
+                            // other loops, none by default.
+} uring_loop_t;
+
+
+uring_loop_t *uring_loop_create(int listener_fd, int term_fd,
+                                output_t *output);
+void uring_loop_destroy(uring_loop_t *loop);
+void uring_loop_run(uring_loop_t *loop);
+
+#endif
@@ -0,0 +1,175 @@
+/**
+ * work_queue.c
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * This file implements routines defined in work_queue.h.
+ *
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "work_queue.h"
+
+
+static void enqueue(work_queue_t *queue, work_item_t item);
+
+
+work_queue_t *work_queue_create(int capacity)
+{
+    work_queue_t *queue = (work_queue_t *) malloc(sizeof(work_queue_t));
+
+    queue->items = (work_item_t *) malloc(sizeof(work_item_t) * capacity);
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->size = 0;
+    queue->closed = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+
+    return queue;
+}
+
+void work_queue_destroy(work_queue_t *queue)
+{
+    pthread_mutex_destroy(&queue->mutex);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+    free(queue->items);
+    free(queue);
+}
+
+/**
+ * Pushes an item, waiting up to timeout_ms for a free slot.
+ *
+ * Returns 0 on success, 1 if no slot got free in time and -1 if the queue
+ * has been closed.
+ */
+int work_queue_push(work_queue_t *queue, work_item_t item, int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int rc = 0;
+    pthread_mutex_lock(&queue->mutex);
+    while (!queue->closed && queue->size == queue->capacity) {
+        if (pthread_cond_timedwait(&queue->not_full, &queue->mutex,
+                                   &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (queue->closed) rc = -1;
+    else if (queue->size == queue->capacity) rc = 1;
+    else enqueue(queue, item);
+    pthread_mutex_unlock(&queue->mutex);
+
+    return rc;
+}
+
+/**
+ * Pushes an item only if there is a free slot.
+ *
+ * Returns 0 on success, 1 if the queue is full and -1 if it has been closed.
+ */
+int work_queue_try_push(work_queue_t *queue, work_item_t item)
+{
+    int rc = 0;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->closed) rc = -1;
+    else if (queue->size == queue->capacity) rc = 1;
+    else enqueue(queue, item);
+    pthread_mutex_unlock(&queue->mutex);
+
+    return rc;
+}
+
+/**
+ * Pops the oldest item, blocking while the queue is empty.
+ *
+ * Returns 0 on success, or -1 when the queue has been closed and there are
+ * no more items left in it.
+ */
+int work_queue_pop(work_queue_t *queue, work_item_t *item)
+{
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->size == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    if (queue->size == 0) {
+        pthread_mutex_unlock(&queue->mutex);
+        return -1;
+    }
+
+    *item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->size--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+
+    return 0;
+}
+
+/**
+ * Pops the oldest item, if any, without blocking.
+ *
+ * Returns 0 on success, or 1 if the queue is empty.
+ */
+int work_queue_try_pop(work_queue_t *queue, work_item_t *item)
+{
+    int rc = 1;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->size > 0) {
+        *item = queue->items[queue->head];
+        queue->head = (queue->head + 1) % queue->capacity;
+        queue->size--;
+        pthread_cond_signal(&queue->not_full);
+        rc = 0;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+
+    return rc;
+}
+
+/**
+ * Rejects any further push and wakes up everyone waiting on the queue.
+ *
+ * Items already queued can still be popped.
+ */
+void work_queue_close(work_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_cond_broadcast(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+int work_queue_size(work_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    int size = queue->size;
+    pthread_mutex_unlock(&queue->mutex);
+    return size;
+}
+
+/**
+ * Appends an item at the tail. Caller should hold the mutex and have checked
+ * that there is a free slot.
+ */
+static void enqueue(work_queue_t *queue, work_item_t item)
+{
+    int tail = (queue->head + queue->size) % queue->capacity;
+    queue->items[tail] = item;
+    queue->size++;
+    pthread_cond_signal(&queue->not_empty);
+}
@@ -0,0 +1,46 @@
+/**
+ * work_queue.h
+ *
+ * Created by Dimitrios Karageorgiou,
+ *  for course "Embedded And Realtime Systems".
+ *  Electrical and Computers Engineering Department, AuTh, GR - 2017-2018
+ *
+ * A header file that declares routines in order to create and manage a
+ * bounded multi-producer multi-consumer queue of accepted connections.
+ *
+ */
+
+#ifndef WORK_QUEUE_H
+#define WORK_QUEUE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+typedef struct {
+    int fd;                // Descriptor of accepted connection.
+    uint64_t source;       // Source of the client, as of admission_source().
+    uint64_t accepted_at;  // Accept time, as of metrics_now().
+} work_item_t;
+
+typedef struct {
+    work_item_t *items;  // Circular buffer of queued items.
+    int capacity;
+    int head;            // Index of the next item to be popped.
+    int size;
+    int closed;          // Set when no more items are going to be pushed.
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} work_queue_t;
+
+
+work_queue_t *work_queue_create(int capacity);
+void work_queue_destroy(work_queue_t *queue);
+int work_queue_push(work_queue_t *queue, work_item_t item, int timeout_ms);
+int work_queue_try_push(work_queue_t *queue, work_item_t item);
+int work_queue_pop(work_queue_t *queue, work_item_t *item);
+int work_queue_try_pop(work_queue_t *queue, work_item_t *item);
+void work_queue_close(work_queue_t *queue);
+int work_queue_size(work_queue_t *queue);
+
+#endif